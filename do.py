@@ -34,7 +34,13 @@ WARN=[
     "-Wno-unused-function", "-Wno-unused-variable", "-Wshadow",
     "-Wpointer-arith", "-Wstrict-prototypes", "-Wmissing-prototypes",
 ]
-DEFS=["-fno-exceptions", "-mfma", "-std=c2x"]
+DEFS=["-fno-exceptions", "-std=c2x"]
+# add "-DALLOC_COUNTING" to count heap allocations per thread and print the audio callback's on exit, see src/allocs.c
+# add "-DNO_MMAP_IO" to read local files with read() instead of mapping them, see src/fileio.c
+# add "-DCPU_COUNTING" to print the CPU time of the audio callback on exit, a syscall per callback, see src/mos.c
+# add "-DSYSCALL_COUNTING" to print the syscalls each played track took to read, see src/fileio.h
+# add "-DLOAD_TIMING" to print how long each track took from the key press to the first audio, see src/mos.c
+# add "-DSEEK_COUNTING" to print how many seeks each drag over the progress bar asked for and made, see src/mos.c
 # TODO dbg and rel
 OPT_DBG = ["-g"]
 
@@ -135,10 +141,17 @@ async def do_mos(target: str) -> Tuple[str, int]:
     # would be that changing a single character in this script would mean
     # everything is now out of date.
 
-    objs = [ "def", "mos" ]
+    objs = [ "def", "library", "watch", "jobpool", "probe", "sort", "search", "trigram", "fuzzy", "filter", "decoder", "loader", "params", "cache", "fileio", "readahead", "seekindex", "pcm", "resample", "floatfile", "loudness", "waveform", "playclock", "allocs", "mos" ]
     dbg_objs = ["bld/" + x + ".dbg.o" for x in objs]
     # TODO: dbg and rel
-    return await do_exe(target, dbg_objs, OPT_DBG, ["-L/usr/local/lib", "-lSDL3", "-lSDL3_ttf", "-lavcodec", "-lavformat", "-lavutil"])
+    return await do_exe(target, dbg_objs, OPT_DBG, ["-L/usr/local/lib", "-lSDL3", "-lSDL3_ttf", "-lavcodec", "-lavformat", "-lavutil", "-lm"])
+
+
+async def do_pcmbench(target: str) -> Tuple[str, int]:
+    assert target == "pcmbench"
+    objs = [ "def", "pcm", "resample", "pcmbench" ]
+    dbg_objs = ["bld/" + x + ".dbg.o" for x in objs]
+    return await do_exe(target, dbg_objs, OPT_DBG, ["-L/usr/local/lib", "-lSDL3", "-lavutil", "-lm"])
 
 
 async def default(target: str) -> Tuple[str, int]:
@@ -153,8 +166,9 @@ async def default(target: str) -> Tuple[str, int]:
 RULES: Dict[str, Callable[[str], Coroutine[Any, Any, Tuple[str, int]]]] = {
     "default.o": default_o,
     "mos": do_mos,
+    "pcmbench": do_pcmbench,
 }
-ALL_TARGETS: List[str] = ["mos"]
+ALL_TARGETS: List[str] = ["mos", "pcmbench"]
 
 
 def get_rule(target: str) -> Callable[[str], Coroutine[Any, Any, Tuple[str,int]]]:
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "def.h"
+
+// Heap allocations the calling thread made so far. Only counted in builds
+// with -DALLOC_COUNTING, otherwise always 0.
+u64 thread_allocs(void);
@@ -0,0 +1,226 @@
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+	char magic[8];
+	u32 version;
+	u32 record_size;
+	u32 record_count;
+	u32 strings_size;
+} CacheHeader;
+
+static CacheKey *key_at(const RecordCache *c, i32 i){
+	return (CacheKey*)(c->records + (size_t)i * c->format->record_size);
+}
+
+static Sub *sub_at(const CacheFormat *f, void *record, i32 i){
+	return (Sub*)((u8*)record + f->subs[i]);
+}
+
+static Sub push_bytes(CharList *l, const void *s, i32 len){
+	Sub res = {l->count, len};
+	if(len > 0)
+		push_string(l, s, len);
+	return res;
+}
+
+static i32 *cache_slot(RecordCache *c, const char *path, i32 len){
+	const u32 mask = (u32)c->slot_cap - 1;
+	for(u32 i = hash_path(path, len) & mask;; i = (i + 1) & mask){
+		i32 *slot = &c->slots[i];
+		if(*slot < 0)
+			return slot;
+		const Sub k = key_at(c, *slot)->path;
+		if(k.len == len && memeq(c->strings.data + k.start, path, len))
+			return slot;
+	}
+}
+
+// Makes room for count records, with the table at most half full.
+static void cache_grow(RecordCache *c, i32 count){
+	i32 cap = MAX(c->slot_cap, 256);
+	while(count * 2 > cap)
+		cap *= 2;
+	free(c->slots);
+	c->slots = malloc(cap * sizeof(c->slots[0]));
+	for(i32 i = 0; i < cap; ++i)
+		c->slots[i] = -1;
+	c->slot_cap = cap;
+	for(i32 i = 0; i < c->record_count; ++i){
+		const Sub k = key_at(c, i)->path;
+		*cache_slot(c, c->strings.data + k.start, k.len) = i;
+	}
+}
+
+static bool sub_in_range(Sub s, u32 size){
+	return s.start >= 0 && s.len >= 0 && (u64)s.start + (u64)s.len <= size;
+}
+
+void record_cache_load(RecordCache *c, const CacheFormat *format){
+	zerostruct(c);
+	c->format = format;
+	c->strings = make_charlist();
+	CharList path = make_charlist();
+	FILE *f = cache_file_path(format->name, &path) ? fopen(path.data, "rb") : NULL;
+	free(path.data);
+	if(f == NULL)
+		return;
+	const u32 size = format->record_size;
+	CacheHeader h;
+	bool ok = fread(&h, sizeof(h), 1, f) == 1
+		&& memeq(h.magic, format->magic, sizeof(h.magic))
+		&& h.version == format->version
+		&& h.record_size == size
+		&& h.record_count <= (format->max > 0 ? format->max : (1u << 28))
+		&& h.strings_size < (1u << 31);
+	u8 *records = NULL;
+	char *strings = NULL;
+	if(ok){
+		records = malloc(MAX(h.record_count, 1u) * size);
+		strings = malloc(MAX(h.strings_size, 1u));
+		ok = fread(records, size, h.record_count, f) == h.record_count
+			&& fread(strings, 1, h.strings_size, f) == h.strings_size;
+	}
+	fclose(f);
+	u64 clock = 0;
+	for(u32 i = 0; ok && i < h.record_count; ++i){
+		void *r = records + (size_t)i * size;
+		const CacheKey *k = r;
+		ok = sub_in_range(k->path, h.strings_size);
+		for(i32 j = 0; ok && j < format->sub_count; ++j)
+			ok = sub_in_range(*sub_at(format, r, j), h.strings_size);
+		ok = ok && (format->valid == NULL || format->valid(r));
+		clock = MAX(clock, k->used);
+	}
+	if(ok){
+		push_string(&c->strings, strings, h.strings_size);
+		c->records = records;
+		c->record_count = h.record_count;
+		c->record_cap = h.record_count;
+		c->clock = clock;
+		records = NULL;
+		cache_grow(c, c->record_count);
+	}
+	free(records);
+	free(strings);
+}
+
+typedef struct {
+	u64 used;
+	i32 index;
+} UsedIndex;
+
+static int compare_used(const void *pa, const void *pb){
+	const UsedIndex *a = pa;
+	const UsedIndex *b = pb;
+	return a->used < b->used ? 1 : a->used > b->used ? -1 : 0;
+}
+
+void record_cache_save(const RecordCache *c, const void *const *keep, i32 keep_count){
+	const CacheFormat *format = c->format;
+	const u32 size = format->record_size;
+	u32 count;
+	UsedIndex *order = NULL;
+	if(keep){
+		count = (u32)keep_count;
+	} else {
+		order = malloc(MAX(c->record_count, 1) * sizeof(order[0]));
+		for(i32 i = 0; i < c->record_count; ++i)
+			order[i] = (UsedIndex){key_at(c, i)->used, i};
+		qsort(order, c->record_count, sizeof(order[0]), compare_used);
+		count = (u32)c->record_count;
+		if(format->max > 0)
+			count = MIN(count, format->max);
+	}
+	// what's in the strings but not pointed at anymore drops out here.
+	u8 *records = malloc(MAX(count, 1u) * size);
+	CharList strings = make_charlist();
+	for(u32 i = 0; i < count; ++i){
+		void *r = records + (size_t)i * size;
+		memcpy(r, keep ? keep[i] : (const void*)key_at(c, order[i].index), size);
+		CacheKey *k = r;
+		k->path = push_bytes(&strings, c->strings.data + k->path.start, k->path.len);
+		for(i32 j = 0; j < format->sub_count; ++j){
+			Sub *s = sub_at(format, r, j);
+			*s = push_bytes(&strings, c->strings.data + s->start, s->len);
+		}
+	}
+	CharList path = make_charlist();
+	CharList tmp = make_charlist();
+	bool ok = cache_file_path(format->name, &path);
+	if(ok){
+		push_string(&tmp, path.data, path.count - 1);
+		push_string(&tmp, ".tmp", 5);
+	}
+	FILE *f = ok ? fopen(tmp.data, "wb") : NULL;
+	if(f){
+		CacheHeader h = {};
+		memcpy(h.magic, format->magic, sizeof(h.magic));
+		h.version = format->version;
+		h.record_size = size;
+		h.record_count = count;
+		h.strings_size = strings.count;
+		ok = fwrite(&h, sizeof(h), 1, f) == 1
+			&& fwrite(records, size, count, f) == count
+			&& fwrite(strings.data, 1, strings.count, f) == (size_t)strings.count;
+		ok = (fclose(f) == 0) && ok;
+		ok = ok && rename(tmp.data, path.data) == 0;
+		if(!ok)
+			unlink(tmp.data);
+	} else {
+		ok = 0;
+	}
+	if(!ok)
+		eprintln("failed to write ", format->name);
+	free(path.data);
+	free(tmp.data);
+	free(strings.data);
+	free(records);
+	free(order);
+}
+
+void record_cache_free(RecordCache *c){
+	free(c->strings.data);
+	free(c->records);
+	free(c->slots);
+	zerostruct(c);
+}
+
+void *record_cache_find(RecordCache *c, const char *path, i32 len){
+	if(c->slot_cap == 0)
+		return NULL;
+	const i32 *slot = cache_slot(c, path, len);
+	return *slot >= 0 ? key_at(c, *slot) : NULL;
+}
+
+void *record_cache_put(RecordCache *c, const char *path, i32 len){
+	if((c->record_count + 1) * 2 > c->slot_cap)
+		cache_grow(c, c->record_count + 1);
+	i32 *slot = cache_slot(c, path, len);
+	if(*slot < 0){
+		if(c->record_count >= c->record_cap){
+			c->record_cap = MAX(c->record_cap * 2, 256);
+			c->records = realloc(c->records, (size_t)c->record_cap * c->format->record_size);
+		}
+		// push_bytes may move strings, but the slot doesn't point into it.
+		*slot = c->record_count++;
+		CacheKey *k = key_at(c, *slot);
+		memset(k, 0, c->format->record_size);
+		k->path = push_bytes(&c->strings, path, len);
+	}
+	CacheKey *k = key_at(c, *slot);
+	k->used = ++c->clock;
+	return k;
+}
+
+void record_cache_use(RecordCache *c, void *record){
+	((CacheKey*)record)->used = ++c->clock;
+}
+
+Sub record_cache_push(RecordCache *c, const void *bytes, i32 len){
+	return push_bytes(&c->strings, bytes, len);
+}
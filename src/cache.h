@@ -0,0 +1,64 @@
+#pragma once
+
+#include "library.h"
+
+// A cache file of fixed size records keyed by path: a header, the records,
+// and behind them a blob with the paths and anything else of a record that
+// doesn't have a fixed size, as Subs into it. The records are loaded into
+// memory whole, looked up through an open addressing table, and saved to a
+// temporary file that's renamed over the old one, so a crash never leaves
+// half a cache behind.
+//
+// Not thread safe, whoever shares one has to lock around it.
+
+// Every record starts with this.
+typedef struct {
+	Sub path; // with the NUL
+	u64 used; // the cache's clock when the record was last used
+} CacheKey;
+
+typedef struct {
+	const char *name; // of the file in the cache directory
+	char magic[8];
+	u32 version;
+	u32 record_size;
+	// Where in a record its other Subs into the strings are, offsetof. A
+	// load checks they're in range, a save keeps what they point at.
+	u16 subs[4];
+	i32 sub_count;
+	// Most records a save keeps, the ones used last. 0 if there's no limit.
+	u32 max;
+	// Checks the rest of a record that was just loaded. NULL if the Subs
+	// being in range is all it takes.
+	bool (*valid)(const void *record);
+} CacheFormat;
+
+typedef struct {
+	const CacheFormat *format;
+	CharList strings;
+	u8 *records;
+	i32 record_count;
+	i32 record_cap;
+	i32 *slots; // index into records, -1 if empty
+	i32 slot_cap;
+	u64 clock;
+} RecordCache;
+
+// Starts out empty if there's no file, or it's for another version or
+// broken in any way.
+void record_cache_load(RecordCache *c, const CacheFormat *format);
+// Saves the records in keep, in that order, or all of them if keep is NULL,
+// the most recently used first and no more than format->max. The records
+// and strings stay as they were.
+void record_cache_save(const RecordCache *c, const void *const *keep, i32 keep_count);
+void record_cache_free(RecordCache *c);
+
+// NULL if path isn't in there. Lookups don't count as a use.
+void *record_cache_find(RecordCache *c, const char *path, i32 len);
+// The record of path, a new one that's zero but for its key if there was
+// none. Either way it's used now. The pointer is good until the next put.
+void *record_cache_put(RecordCache *c, const char *path, i32 len);
+void record_cache_use(RecordCache *c, void *record);
+// Copies bytes into the strings. What an old Sub pointed at stays there
+// until the next save, which only keeps what's still pointed at.
+Sub record_cache_push(RecordCache *c, const void *bytes, i32 len);
@@ -0,0 +1,568 @@
+#include "decoder.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL3/SDL_mutex.h>
+#include <SDL3/SDL_thread.h>
+
+// The decoder thread is the only one writing to the ring and the audio
+// callback the only one reading from it. Both positions only ever go up and
+// count bytes since the start, the ring index is the position modulo cap.
+// The writer publishes new bytes by moving write with release, the reader
+// frees them by moving read, so neither side ever waits for the other.
+//
+// A seek can't take back what's in the ring already, the reader owns that.
+// Instead, once the first frame from the new position is decoded, skip_to
+// gets set to where it's going to be written and the reader jumps over
+// everything before it. Until then, the old audio keeps playing.
+//
+// Seeks land on the exact sample: the decoder starts a bit before the
+// target and drops what comes before it. With a seek index, a bit before is
+// the closest point that's SEEK_PREROLL_SAMPLES or more ahead of the target,
+// found by byte offset, and the samples get counted from there. Otherwise
+// it's wherever libav lands, and the frames say where that is. Playing from
+// the start without a seek adds points to the index as it goes.
+//
+// Seeks are latest wins: decoder_seek only leaves the newest target, and the
+// thread picks up whatever is there once it's done with the last one. Each
+// gets a serial, so the main thread can tell when the last one it sent has
+// landed, and hold back the next until then.
+//
+// With a resampler the last few samples of the track only come out once
+// it's told there's nothing after them. end_track does that before it
+// marks the end, so the ring still holds exactly the track.
+//
+// The decoder doesn't know when the reader made room, it checks every now
+// and then. A quarter of the ring is plenty of time. Except after a seek:
+// the reader jumps over the whole ring at once and has nothing left to
+// play, so until it did the decoder looks again every millisecond.
+
+// mp3 frames lean on the bytes of the ones before, starting a few frames
+// early gets the first one after the target right.
+#define SEEK_PREROLL_SAMPLES 4096
+
+struct Decoder {
+	SDL_Thread *thread;
+	SDL_Mutex *mutex;
+	SDL_Condition *wake;
+	// guarded by mutex
+	bool stop;
+	bool seek_pending;
+	f32 seek_to;
+	u32 seek_serial; // of seek_to, only the main thread changes it
+
+	// only used by the decoder thread
+	AVFormatContext *format;
+	AVCodecContext *codec;
+	AVStream *stream;
+	AVPacket *packet;
+	AVFrame *frame;
+	bool frame_ready;
+	i32 frame_offset; // samples of frame that are in the ring already
+	bool draining;    // sent the decoder the end of the stream
+	bool at_end;
+	bool mark_pending; // the next frame is where playback jumps to
+	i64 seek_sample;   // where the last seek is for, frames before it get dropped
+	i64 next_sample;   // of the next frame out of the codec, -1 if the frame has to say
+	i64 frame_at;      // sample of the track frame starts with
+	i64 trim_end;      // the track ends before this sample, 0 if it doesn't
+	u32 serving;       // serial of the seek that's being done
+	SeekIndex *index;  // NULL if the file doesn't get one
+	bool indexing;     // playing from the start, points go into the index
+	i64 index_step;    // samples between points
+	i64 seek_preroll;
+	// What goes into the ring, what comes out of pcm_mix and out of the
+	// resampler, when they aren't that already. Bytes.
+	u8 *scratch;
+	i32 scratch_cap;
+	u8 *mixed;
+	i32 mixed_cap;
+	u8 *resampled;
+	i32 resampled_cap;
+	i32 wait_ms;
+
+	// what comes out of the codec
+	enum AVSampleFormat in_format;
+	bool planar;
+	i32 in_channels;
+	i32 sample_size;
+	// what's in the ring
+	DecoderOutput out;
+	bool convert; // mixed by matrix with the gain in it, resampled, and narrowed if out is S16
+	f32 matrix[PCM_MAX_CHANNELS * PCM_MAX_CHANNELS];
+	Resampler *resampler; // NULL if the rate stays
+	PcmDither dither;
+	i32 frame_bytes;
+	f64 ring_to_track; // input samples per frame in the ring
+	bool ending; // the codec is done, the resampler may not be
+	i32 sample_rate;
+	f64 time_base;
+	i64 start_time;
+	f64 total_samples;
+
+	u8 *ring;
+	u64 cap; // bytes, whole sample frames
+	_Atomic u64 write;
+	_Atomic u64 read;
+	_Atomic u64 skip_to;
+	// The sample of the track that's at mark_pos in the ring. Two seeks
+	// can land while the callback reads them, so they're a seqlock like
+	// PlaybackClock: mark_seq is odd while they change.
+	_Atomic u32 mark_seq;
+	_Atomic u64 mark_pos;
+	_Atomic i64 mark_sample;
+	// where the track ends in the ring, UINT64_MAX until it's decoded
+	_Atomic u64 end;
+	// Serial of the last seek that's over: its first frame is in the ring,
+	// the track ended, or it failed. And how many got to libav.
+	_Atomic u32 seek_landed;
+	_Atomic u32 seeks_done;
+};
+
+//# decoder thread
+
+static void feed_packet(Decoder *d){
+	for(;;){
+		const int rc = av_read_frame(d->format, d->packet);
+		if(rc < 0){
+			// The end, or an error there's nothing to do about. Either way,
+			// get the last frames out of the codec.
+			avcodec_send_packet(d->codec, NULL);
+			d->draining = 1;
+			return;
+		}
+		if(d->packet->stream_index == d->stream->index)
+			break;
+		av_packet_unref(d->packet);
+	}
+	// Everything before this packet is out of the codec, so it starts at
+	// next_sample.
+	if(d->indexing && d->next_sample >= 0 && d->packet->pos >= 0
+	&& d->next_sample >= MAX(seek_index_last(d->index), 0) + d->index_step)
+		seek_index_add(d->index, d->next_sample, d->packet->pos);
+	const int rc = avcodec_send_packet(d->codec, d->packet);
+	av_packet_unref(d->packet);
+	if(rc < 0)
+		eprintln("failed to decode packet: ", (i32)rc);
+}
+
+static void *reserve(u8 **buf, i32 *cap, i32 bytes){
+	if(bytes > *cap){
+		*cap = bytes;
+		*buf = realloc(*buf, bytes);
+	}
+	return *buf;
+}
+
+static void write_ring(Decoder *d, const u8 *src, i32 bytes){
+	const u64 write = atomic_load_explicit(&d->write, memory_order_relaxed);
+	const u64 at = write % d->cap;
+	const i32 first = (i32)MIN((u64)bytes, d->cap - at);
+	memcpy(d->ring + at, src, first);
+	memcpy(d->ring, src + first, bytes - first);
+	atomic_store_explicit(&d->write, write + bytes, memory_order_release);
+}
+
+// Narrows frames of float to S16 if that's what the ring holds, into
+// scratch. The ring's bytes of them either way.
+static const u8 *finish_samples(Decoder *d, const f32 *samples, i32 frames){
+	if(d->out.format != AV_SAMPLE_FMT_S16)
+		return (const u8*)samples;
+	pcm_narrow((i16*)d->scratch, samples, frames * d->out.channels, &d->dither);
+	return d->scratch;
+}
+
+// Puts count samples of the frame in the ring, which may be more or fewer
+// after resampling.
+static void put_samples(Decoder *d, i32 count){
+	const u8 *src;
+	i32 frames = count;
+	if(d->convert){
+		const i32 floats = d->out.channels * (i32)sizeof(f32);
+		const i32 out_frames = d->resampler ? resampler_out_max(d->resampler, count) : count;
+		reserve(&d->scratch, &d->scratch_cap, out_frames * d->frame_bytes);
+		// each step goes straight into scratch if it's the last one
+		const bool narrow = d->out.format == AV_SAMPLE_FMT_S16;
+		f32 *mixed = d->resampler || narrow ? reserve(&d->mixed, &d->mixed_cap, count * floats) : (f32*)d->scratch;
+		pcm_mix(mixed, d->out.channels, d->frame->extended_data, d->in_format, d->in_channels, d->matrix, d->frame_offset, count);
+		if(d->resampler){
+			f32 *resampled = narrow ? reserve(&d->resampled, &d->resampled_cap, out_frames * floats) : (f32*)d->scratch;
+			frames = resampler_process(d->resampler, mixed, count, resampled);
+			mixed = resampled;
+		}
+		src = finish_samples(d, mixed, frames);
+	} else if(d->planar){
+		reserve(&d->scratch, &d->scratch_cap, count * d->frame_bytes);
+		pcm_interleave(d->scratch, d->frame->extended_data, d->in_channels, d->sample_size, d->frame_offset, count);
+		src = d->scratch;
+	} else {
+		src = d->frame->data[0] + d->frame_offset * d->frame_bytes;
+	}
+	write_ring(d, src, frames * d->frame_bytes);
+}
+
+// Frames there's room for in the ring.
+static i32 ring_room(const Decoder *d){
+	const u64 used = atomic_load_explicit(&d->write, memory_order_relaxed) - atomic_load_explicit(&d->read, memory_order_acquire);
+	return (i32)((d->cap - used) / d->frame_bytes);
+}
+
+// The codec is done. Puts what the resampler still has in the ring and marks
+// the end there. Returns 0 if that doesn't fit yet.
+static bool end_track(Decoder *d){
+	if(d->resampler){
+		const i32 tail = resampler_tail(d->resampler);
+		if(tail > ring_room(d))
+			return 0;
+		const i32 floats = d->out.channels * (i32)sizeof(f32);
+		reserve(&d->scratch, &d->scratch_cap, tail * d->frame_bytes);
+		const bool narrow = d->out.format == AV_SAMPLE_FMT_S16;
+		f32 *resampled = narrow ? reserve(&d->resampled, &d->resampled_cap, tail * floats) : (f32*)d->scratch;
+		const i32 frames = resampler_flush(d->resampler, resampled);
+		write_ring(d, finish_samples(d, resampled, frames), frames * d->frame_bytes);
+	}
+	d->at_end = 1;
+	const u64 write = atomic_load_explicit(&d->write, memory_order_relaxed);
+	atomic_store_explicit(&d->end, write, memory_order_release);
+	atomic_store_explicit(&d->seek_landed, d->serving, memory_order_release);
+	return 1;
+}
+
+// The sample of the track the frame that was just decoded starts with.
+static i64 frame_sample(Decoder *d){
+	if(d->next_sample >= 0)
+		return d->next_sample;
+	i64 ts = d->frame->best_effort_timestamp;
+	if(ts == AV_NOPTS_VALUE)
+		ts = d->frame->pts;
+	if(ts == AV_NOPTS_VALUE)
+		return d->seek_sample;
+	if(d->start_time != AV_NOPTS_VALUE)
+		ts -= d->start_time;
+	return (i64)((f64)ts * d->time_base * d->sample_rate);
+}
+
+// Playback continues with what of the frame isn't in the ring yet, which is
+// sample of the track.
+static void mark_frame(Decoder *d, i64 sample){
+	const u64 write = atomic_load_explicit(&d->write, memory_order_relaxed);
+	const u32 seq = atomic_load_explicit(&d->mark_seq, memory_order_relaxed);
+	atomic_store_explicit(&d->mark_seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&d->mark_sample, sample, memory_order_relaxed);
+	atomic_store_explicit(&d->mark_pos, write, memory_order_relaxed);
+	atomic_store_explicit(&d->mark_seq, seq + 2, memory_order_release);
+	atomic_store_explicit(&d->skip_to, write, memory_order_release);
+	atomic_store_explicit(&d->seek_landed, d->serving, memory_order_release);
+	d->mark_pending = 0;
+}
+
+// Moves a bit of the track into the ring. Returns 0 if there was nothing to
+// do, because the ring is full or the track is over.
+static bool decode_some(Decoder *d){
+	if(d->at_end)
+		return 0;
+	if(d->ending){
+		end_track(d);
+		return 0;
+	}
+	if(!d->frame_ready){
+		const int rc = avcodec_receive_frame(d->codec, d->frame);
+		if(rc == AVERROR(EAGAIN)){
+			feed_packet(d);
+			return 1;
+		}
+		if(rc < 0){
+			if(rc != AVERROR_EOF)
+				eprintln("failed to decode frame: ", (i32)rc);
+			d->ending = 1;
+			end_track(d);
+			return 0;
+		}
+		d->frame_ready = 1;
+		d->frame_offset = 0;
+		const i64 at = frame_sample(d);
+		d->frame_at = at;
+		d->next_sample = at + d->frame->nb_samples;
+		if(d->mark_pending){
+			// decode and drop what's before the target
+			const i64 skip = d->seek_sample - at;
+			if(skip >= d->frame->nb_samples){
+				av_frame_unref(d->frame);
+				d->frame_ready = 0;
+				return 1;
+			}
+			d->frame_offset = (i32)MAX(skip, 0);
+			mark_frame(d, at + d->frame_offset);
+		}
+	}
+	i32 left = d->frame->nb_samples - d->frame_offset;
+	if(d->trim_end > 0){
+		// what's after the end is as good as not there
+		const i64 before_end = d->trim_end - (d->frame_at + d->frame_offset);
+		if(before_end <= 0){
+			av_frame_unref(d->frame);
+			d->frame_ready = 0;
+			d->ending = 1;
+			end_track(d);
+			return 0;
+		}
+		left = (i32)MIN((i64)left, before_end);
+	}
+	i32 room = ring_room(d);
+	if(d->resampler)
+		room = resampler_in_max(d->resampler, room);
+	const i32 n = MIN(room, left);
+	if(n <= 0)
+		return 0;
+	put_samples(d, n);
+	d->frame_offset += n;
+	if(d->frame_offset == d->frame->nb_samples){
+		av_frame_unref(d->frame);
+		d->frame_ready = 0;
+	}
+	return 1;
+}
+
+static void seek(Decoder *d, f32 relative){
+	const i64 target = (i64)(d->total_samples * relative);
+	SeekPoint point;
+	const bool indexed = d->index != NULL
+		&& seek_index_find(d->index, target - d->seek_preroll, &point)
+		&& av_seek_frame(d->format, d->stream->index, point.pos, AVSEEK_FLAG_BYTE) >= 0;
+	int rc = 0;
+	if(!indexed){
+		i64 ts;
+		int stream = d->stream->index;
+		if(d->stream->duration != AV_NOPTS_VALUE){
+			ts = (i64)((f64)d->stream->duration * relative);
+			if(d->start_time != AV_NOPTS_VALUE)
+				ts += d->start_time;
+		} else {
+			ts = (i64)((f64)d->format->duration * relative);
+			stream = -1;
+		}
+		rc = av_seek_frame(d->format, stream, ts, AVSEEK_FLAG_BACKWARD);
+	}
+	atomic_fetch_add_explicit(&d->seeks_done, 1, memory_order_relaxed);
+	if(rc < 0){
+		eprintln("failed to seek: ", (i32)rc);
+		atomic_store_explicit(&d->seek_landed, d->serving, memory_order_release);
+		return;
+	}
+	avcodec_flush_buffers(d->codec);
+	av_frame_unref(d->frame);
+	d->frame_ready = 0;
+	d->draining = 0;
+	d->at_end = 0;
+	d->ending = 0;
+	if(d->resampler)
+		resampler_reset(d->resampler);
+	d->mark_pending = 1;
+	d->seek_sample = target;
+	d->next_sample = indexed ? point.sample : -1;
+	// the counting starts over somewhere in the middle
+	d->indexing = 0;
+	atomic_store_explicit(&d->end, UINT64_MAX, memory_order_release);
+}
+
+static int decoder_main(void *arg){
+	Decoder *d = arg;
+	SDL_SetCurrentThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+	SDL_LockMutex(d->mutex);
+	while(!d->stop){
+		if(d->seek_pending){
+			const f32 relative = d->seek_to;
+			d->serving = d->seek_serial;
+			d->seek_pending = 0;
+			SDL_UnlockMutex(d->mutex);
+			seek(d, relative);
+			SDL_LockMutex(d->mutex);
+			continue;
+		}
+		SDL_UnlockMutex(d->mutex);
+		const bool busy = decode_some(d);
+		SDL_LockMutex(d->mutex);
+		if(!busy && !d->stop && !d->seek_pending){
+			// the reader is about to throw the whole ring away
+			const bool jumping = atomic_load_explicit(&d->read, memory_order_acquire) < atomic_load_explicit(&d->skip_to, memory_order_relaxed);
+			SDL_WaitConditionTimeout(d->wake, d->mutex, jumping ? 1 : d->wait_ms);
+		}
+	}
+	SDL_UnlockMutex(d->mutex);
+	return 0;
+}
+
+//# main thread
+
+Decoder *decoder_start(AVFormatContext *format, AVCodecContext *codec, i32 stream, SeekIndex *index, DecoderOutput out, DecoderTrim trim, i32 ring_ms){
+	Decoder *d = calloc(1, sizeof(*d));
+	d->format = format;
+	d->codec = codec;
+	d->stream = format->streams[stream];
+	d->packet = av_packet_alloc();
+	d->frame = av_frame_alloc();
+	d->mark_pending = 1;
+	d->seek_sample = trim.start;
+	d->trim_end = trim.end;
+	d->next_sample = -1;
+	d->index = index;
+	d->indexing = index != NULL;
+
+	d->in_format = codec->sample_fmt;
+	d->planar = av_sample_fmt_is_planar(codec->sample_fmt);
+	d->in_channels = codec->ch_layout.nb_channels;
+	d->sample_size = av_get_bytes_per_sample(codec->sample_fmt);
+	d->out = out;
+	d->convert = out.format != av_get_packed_sample_fmt(codec->sample_fmt) || out.channels != d->in_channels || out.rate != codec->sample_rate || out.gain != 1;
+	if(d->convert){
+		if(out.channels == d->in_channels)
+			pcm_identity_matrix(d->matrix, out.channels);
+		else
+			pcm_downmix_matrix(d->matrix, &codec->ch_layout, out.channels);
+		for(i32 i = 0; i < out.channels * d->in_channels; ++i)
+			d->matrix[i] *= out.gain;
+		pcm_dither_init(&d->dither, (u32)(uintptr_t)d);
+	}
+	if(out.rate != codec->sample_rate)
+		d->resampler = resampler_create(codec->sample_rate, out.rate, out.channels, out.quality);
+	d->frame_bytes = MAX(out.channels * av_get_bytes_per_sample(out.format), 1);
+	d->ring_to_track = (f64)codec->sample_rate / out.rate;
+	d->sample_rate = codec->sample_rate;
+	d->time_base = av_q2d(d->stream->time_base);
+	d->start_time = d->stream->start_time;
+	if(d->stream->duration != AV_NOPTS_VALUE)
+		d->total_samples = (f64)d->stream->duration * d->time_base * d->sample_rate;
+	else if(format->duration != AV_NOPTS_VALUE)
+		d->total_samples = (f64)format->duration / AV_TIME_BASE * d->sample_rate;
+
+	d->index_step = (i64)d->sample_rate * SEEK_INDEX_SECONDS;
+	d->seek_preroll = MAX(d->stream->codecpar->seek_preroll, SEEK_PREROLL_SAMPLES);
+
+	i64 frames = (i64)out.rate * ring_ms / 1000;
+	frames = MAX(frames, 4096);
+	d->cap = (u64)frames * d->frame_bytes;
+	d->ring = malloc(d->cap);
+	// Most codecs say how big their frames are, so the scratch space doesn't
+	// have to grow while playing.
+	if((d->planar || d->convert) && codec->frame_size > 0){
+		const i32 frames_out = d->resampler ? resampler_out_max(d->resampler, codec->frame_size) : codec->frame_size;
+		const i32 floats = out.channels * (i32)sizeof(f32);
+		reserve(&d->scratch, &d->scratch_cap, frames_out * d->frame_bytes);
+		if(d->convert && (d->resampler || out.format == AV_SAMPLE_FMT_S16))
+			reserve(&d->mixed, &d->mixed_cap, codec->frame_size * floats);
+		if(d->resampler && out.format == AV_SAMPLE_FMT_S16)
+			reserve(&d->resampled, &d->resampled_cap, frames_out * floats);
+	}
+	d->wait_ms = MAX(ring_ms / 4, 1);
+	atomic_store_explicit(&d->end, UINT64_MAX, memory_order_relaxed);
+
+	d->mutex = SDL_CreateMutex();
+	d->wake = SDL_CreateCondition();
+	d->thread = SDL_CreateThread(decoder_main, "decoder", d);
+	return d;
+}
+
+void decoder_stop(Decoder **dd){
+	Decoder *d = *dd;
+	if(d == NULL)
+		return;
+	SDL_LockMutex(d->mutex);
+	d->stop = 1;
+	SDL_SignalCondition(d->wake);
+	SDL_UnlockMutex(d->mutex);
+	SDL_WaitThread(d->thread, NULL);
+	SDL_DestroyCondition(d->wake);
+	SDL_DestroyMutex(d->mutex);
+	av_packet_free(&d->packet);
+	av_frame_free(&d->frame);
+	avcodec_free_context(&d->codec);
+	avformat_close_input(&d->format);
+	seek_index_close(&d->index);
+	free(d->scratch);
+	free(d->mixed);
+	free(d->resampled);
+	resampler_free(&d->resampler);
+	free(d->ring);
+	free(d);
+	*dd = NULL;
+}
+
+f64 decoder_duration(const Decoder *d){
+	return d->sample_rate > 0 ? d->total_samples / d->sample_rate : 0;
+}
+
+i32 decoder_rate(const Decoder *d){
+	return d->sample_rate;
+}
+
+i64 decoder_samples(const Decoder *d){
+	return d->total_samples > 0 ? (i64)d->total_samples : 0;
+}
+
+void decoder_seek(Decoder *d, f32 relative){
+	SDL_LockMutex(d->mutex);
+	d->seek_pending = 1;
+	d->seek_to = relative;
+	d->seek_serial += 1;
+	SDL_SignalCondition(d->wake);
+	SDL_UnlockMutex(d->mutex);
+}
+
+bool decoder_seeking(const Decoder *d){
+	return atomic_load_explicit(&d->seek_landed, memory_order_acquire) != d->seek_serial;
+}
+
+u32 decoder_seeks_done(const Decoder *d){
+	return atomic_load_explicit(&d->seeks_done, memory_order_relaxed);
+}
+
+//# audio callback
+
+i32 decoder_peek(Decoder *d, const u8 **data, i32 max){
+	u64 read = atomic_load_explicit(&d->read, memory_order_relaxed);
+	const u64 skip = atomic_load_explicit(&d->skip_to, memory_order_acquire);
+	if(skip > read){
+		read = skip;
+		atomic_store_explicit(&d->read, read, memory_order_release);
+	}
+	const u64 write = atomic_load_explicit(&d->write, memory_order_acquire);
+	const u64 at = read % d->cap;
+	u64 n = MIN(write - read, d->cap - at);
+	n = MIN(n, (u64)max);
+	n -= n % d->frame_bytes;
+	*data = d->ring + at;
+	return (i32)n;
+}
+
+void decoder_consume(Decoder *d, i32 bytes){
+	const u64 read = atomic_load_explicit(&d->read, memory_order_relaxed);
+	atomic_store_explicit(&d->read, read + bytes, memory_order_release);
+}
+
+bool decoder_drained(const Decoder *d){
+	const u64 end = atomic_load_explicit(&d->end, memory_order_acquire);
+	return atomic_load_explicit(&d->read, memory_order_relaxed) >= end;
+}
+
+i64 decoder_position(const Decoder *d){
+	u64 pos;
+	i64 sample;
+	for(;;){
+		const u32 seq = atomic_load_explicit(&d->mark_seq, memory_order_acquire);
+		if(seq & 1)
+			continue;
+		pos = atomic_load_explicit(&d->mark_pos, memory_order_relaxed);
+		sample = atomic_load_explicit(&d->mark_sample, memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);
+		if(atomic_load_explicit(&d->mark_seq, memory_order_relaxed) == seq)
+			break;
+	}
+	const u64 read = atomic_load_explicit(&d->read, memory_order_relaxed);
+	i64 at = sample;
+	if(read > pos)
+		at += (i64)((f64)((read - pos) / d->frame_bytes) * d->ring_to_track);
+	return MAX(at, (i64)0);
+}
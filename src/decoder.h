@@ -0,0 +1,73 @@
+#pragma once
+
+#include "pcm.h"
+#include "resample.h"
+#include "seekindex.h"
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+// Demuxes and decodes a track on its own thread, ahead of playback, into a
+// ring of interleaved PCM. The decoder_* calls the audio callback makes only
+// copy out of the ring and read atomics: no locks, no syscalls and no libav.
+// That's about these calls only, what the callback does with SDL's stream
+// around them takes the stream's lock, which SDL holds during the callback
+// anyway.
+typedef struct Decoder Decoder;
+
+// What goes into the ring. Usually the codec's own sample format, channels
+// and rate. Anything else gets mixed down and narrowed with pcm.h, which
+// takes any packed or planar format but only makes S16 and FLT, and resampled
+// with resample.h in between. A gain other than 1 goes into the mix, so it
+// needs a format pcm.h makes too.
+typedef struct {
+	enum AVSampleFormat format; // packed
+	i32 channels;
+	i32 rate;
+	ResampleQuality quality;
+	f32 gain; // linear
+} DecoderOutput;
+
+// The part of the track to play, in samples of the track. Seeks can still
+// go before start, but not past end.
+typedef struct {
+	i64 start;
+	i64 end; // 0 plays to the end
+} DecoderTrim;
+
+// Takes over the contexts, which are open and ready to decode stream, and
+// index, which may be NULL. Plays trim of the track. Keeps about ring_ms of
+// audio decoded ahead.
+Decoder *decoder_start(AVFormatContext *format, AVCodecContext *codec, i32 stream, SeekIndex *index, DecoderOutput out, DecoderTrim trim, i32 ring_ms);
+// Stops the thread and frees everything. The audio callback must not be
+// reading from it anymore.
+void decoder_stop(Decoder **d);
+// Length of the track in seconds, 0 if nobody knows.
+f64 decoder_duration(const Decoder *d);
+// Jumps to relative (0..1) of the track, to the sample. What's decoded
+// already keeps playing until the new position is ready.
+void decoder_seek(Decoder *d, f32 relative);
+// The last seek isn't over yet, its new position isn't decoded.
+bool decoder_seeking(const Decoder *d);
+// Seeks that got to libav, fewer than decoder_seek calls if they came in
+// faster than they could be done.
+u32 decoder_seeks_done(const Decoder *d);
+
+// Encoder delay and padding (LAME/Xing for mp3, pre-skip for opus, edit
+// lists for m4a) are left to libav, which drops those samples from the
+// frames it hands out. So the ring holds exactly the track, and one track
+// can follow another without a gap.
+
+// Audio callback only. Points *data at the next PCM bytes in the ring and
+// returns how many of them are there in one piece, up to max, in whole
+// sample frames.
+i32 decoder_peek(Decoder *d, const u8 **data, i32 max);
+void decoder_consume(Decoder *d, i32 bytes);
+// Got to the end of the track and everything's been read.
+bool decoder_drained(const Decoder *d);
+// The sample of the track the next read starts at. Samples are the track's
+// own, at decoder_rate, whatever the ring holds.
+i64 decoder_position(const Decoder *d);
+i32 decoder_rate(const Decoder *d);
+// Samples in the track, 0 if nobody knows.
+i64 decoder_samples(const Decoder *d);
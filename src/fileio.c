@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include "fileio.h"
+#include "library.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Given a path, libav reads through its file protocol: a read() for every
+// 32 KiB, an lseek() for every jump, and the kernel copying into libav's
+// buffer each time. Mapped, a read is a memcpy out of the page cache, and the
+// kernel is only asked for hints. It gets told the file is read front to
+// back, and where the next bit is going to come from after a seek.
+//
+// libav still copies out of its buffer into packets, there's no way around
+// that with AVIOContext.
+//
+// A file that gets shorter while it's mapped, like a tag editor rewriting
+// it in place, turns reads past its new end into SIGBUS. The copy out of
+// the mapping is guarded: the handler jumps back out of it, and the read
+// fails like a read() error would. SA_NODEFER leaves SIGBUS unblocked after
+// the jump, so there's no sigprocmask per read. Faults outside a guarded
+// copy get the default action, as if there was no handler.
+
+#define FILE_IO_BUFFER (32 * 1024)
+// how much to ask the kernel to read ahead, at the start and after a seek
+#define FILE_IO_WILLNEED (1024 * 1024)
+
+struct FileIO {
+	AVIOContext *avio;
+	AVIOInterruptCB interrupt;
+	int fd; // -1 once mapped
+	const u8 *map;
+	// map is its data then, not a mapping
+	ReadAhead *ra;
+	ReadAheadFile *cached;
+	i64 size;
+	i64 pos;
+	u32 syscalls;
+	bool truncated; // a read faulted, the file got shorter
+};
+
+static _Thread_local sigjmp_buf *bus_guard;
+
+static void on_sigbus(int sig){
+	if(bus_guard != NULL)
+		siglongjmp(*bus_guard, 1);
+	signal(sig, SIG_DFL);
+}
+
+static void guard_sigbus(void){
+	static _Atomic bool installed;
+	if(atomic_exchange(&installed, 1))
+		return;
+	struct sigaction sa = {};
+	sa.sa_handler = on_sigbus;
+	sa.sa_flags = SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGBUS, &sa, NULL);
+}
+
+// memcpy that returns 0 instead of dying if the file shrank under src.
+static bool copy_mapped(u8 *dst, const u8 *src, i32 n){
+	sigjmp_buf env;
+	if(sigsetjmp(env, 0)){
+		bus_guard = NULL;
+		return 0;
+	}
+	bus_guard = &env;
+	memcpy(dst, src, n);
+	bus_guard = NULL;
+	return 1;
+}
+
+static bool interrupted(FileIO *f){
+	return f->interrupt.callback != NULL && f->interrupt.callback(f->interrupt.opaque);
+}
+
+static void will_need(FileIO *f, i64 pos){
+	if(f->cached)
+		return;
+	// madvise wants a page aligned start.
+	const i64 page = 4096;
+	const i64 start = pos & ~(page - 1);
+	i64 len = f->size - start;
+	len = MIN(len, FILE_IO_WILLNEED);
+	if(len <= 0)
+		return;
+	madvise((void*)(f->map + start), len, MADV_WILLNEED);
+	f->syscalls += 1;
+}
+
+static int read_mapped(void *opaque, u8 *buf, int n){
+	FileIO *f = opaque;
+	if(interrupted(f))
+		return AVERROR_EXIT;
+	if(f->truncated)
+		return AVERROR(EIO);
+	const i64 left = f->size - f->pos;
+	if(left <= 0)
+		return AVERROR_EOF;
+	n = (int)MIN((i64)n, left);
+	// the read ahead cache has its own copy, that can't change
+	if(f->cached){
+		memcpy(buf, f->map + f->pos, n);
+	} else if(!copy_mapped(buf, f->map + f->pos, n)){
+		f->truncated = 1;
+		return AVERROR(EIO);
+	}
+	f->pos += n;
+	return n;
+}
+
+static int read_fd(void *opaque, u8 *buf, int n){
+	FileIO *f = opaque;
+	if(interrupted(f))
+		return AVERROR_EXIT;
+	const ssize_t got = read(f->fd, buf, n);
+	f->syscalls += 1;
+	if(got < 0)
+		return AVERROR(errno);
+	if(got == 0)
+		return AVERROR_EOF;
+	f->pos += got;
+	return (int)got;
+}
+
+static i64 seek_io(void *opaque, i64 offset, int whence){
+	FileIO *f = opaque;
+	whence &= ~AVSEEK_FORCE;
+	if(whence == AVSEEK_SIZE)
+		return f->size;
+	i64 pos;
+	switch(whence){
+	case SEEK_SET: pos = offset; break;
+	case SEEK_CUR: pos = f->pos + offset; break;
+	case SEEK_END: pos = f->size + offset; break;
+	default: return AVERROR(EINVAL);
+	}
+	if(pos < 0)
+		return AVERROR(EINVAL);
+	if(pos == f->pos)
+		return pos;
+	if(f->map != NULL){
+		will_need(f, pos);
+	} else {
+		f->syscalls += 1;
+		if(lseek(f->fd, pos, SEEK_SET) < 0)
+			return AVERROR(errno);
+	}
+	f->pos = pos;
+	return pos;
+}
+
+FileIO *file_io_open(const char *path, AVIOInterruptCB interrupt, ReadAhead *ra){
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		return NULL;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)){
+		close(fd);
+		return NULL;
+	}
+	FileIO *f = calloc(1, sizeof(*f));
+	f->interrupt = interrupt;
+	f->fd = fd;
+	f->size = st.st_size;
+	f->syscalls = 2;
+	const i64 mtime = file_mtime_us(&st);
+	if(ra)
+		f->cached = read_ahead_get(ra, path, f->size, mtime, &f->map);
+	if(f->cached){
+		f->ra = ra;
+		close(fd);
+		f->fd = -1;
+		f->syscalls += 1;
+	}
+#ifndef NO_MMAP_IO
+	void *map = f->cached == NULL && f->size > 0 ? mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	f->syscalls += f->cached == NULL;
+	if(map != MAP_FAILED){
+		guard_sigbus();
+		// the mapping keeps the file open.
+		close(fd);
+		f->fd = -1;
+		f->map = map;
+		madvise(map, f->size, MADV_SEQUENTIAL);
+		f->syscalls += 2;
+		will_need(f, 0);
+	}
+#endif
+	u8 *buffer = av_malloc(FILE_IO_BUFFER);
+	f->avio = avio_alloc_context(buffer, FILE_IO_BUFFER, 0, f, f->map ? read_mapped : read_fd, NULL, seek_io);
+	return f;
+}
+
+AVIOContext *file_io_context(FileIO *f){
+	return f->avio;
+}
+
+void file_io_close(FileIO **ff){
+	FileIO *f = *ff;
+	if(f == NULL)
+		return;
+	if(f->avio)
+		av_freep(&f->avio->buffer);
+	avio_context_free(&f->avio);
+	if(f->cached)
+		read_ahead_release(f->ra, f->cached);
+	else if(f->map)
+		munmap((void*)f->map, f->size);
+	if(f->fd >= 0)
+		close(f->fd);
+	free(f);
+	*ff = NULL;
+}
+
+bool file_io_mapped(const FileIO *f){
+	return f->map != NULL && f->cached == NULL;
+}
+
+bool file_io_cached(const FileIO *f){
+	return f->cached != NULL;
+}
+
+u32 file_io_syscalls(const FileIO *f){
+	return f->syscalls;
+}
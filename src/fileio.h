@@ -0,0 +1,28 @@
+#pragma once
+
+#include "readahead.h"
+
+#include <libavformat/avformat.h>
+
+// Where libav reads a local file from. Regular files get mapped and libav's
+// reads are copies out of the mapping, without a syscall each. If the file
+// is in the read ahead cache, it's read from there the same way. If the file
+// can't be mapped, or with -DNO_MMAP_IO, it's read() and lseek() as usual.
+// Either way, the syscalls made for the file get counted, and printed for
+// each track that played with -DSYSCALL_COUNTING.
+typedef struct FileIO FileIO;
+
+// NULL if path can't be opened or isn't a regular file, then libav opens it
+// by itself. Reads fail once interrupt says so, like libav's own would. ra
+// may be NULL.
+FileIO *file_io_open(const char *path, AVIOInterruptCB interrupt, ReadAhead *ra);
+// Goes into AVFormatContext.pb, with AVFMT_FLAG_CUSTOM_IO. Stays with f.
+AVIOContext *file_io_context(FileIO *f);
+// libav has to be done with the context.
+void file_io_close(FileIO **f);
+
+bool file_io_mapped(const FileIO *f);
+// read from the read ahead cache
+bool file_io_cached(const FileIO *f);
+// Syscalls so far, including opening and mapping the file.
+u32 file_io_syscalls(const FileIO *f);
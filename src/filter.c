@@ -0,0 +1,391 @@
+#include "filter.h"
+#include "fuzzy.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL3/SDL_mutex.h>
+#include <SDL3/SDL_thread.h>
+
+// The worker keeps the matches for every prefix of the query. Typing another
+// character only has to look at what matched so far, and backspace goes back
+// a level without looking at anything.
+//
+// Queries go in and matches come out through a few fields under the mutex.
+// Every query gets a generation, and between chunks of names the worker
+// checks whether a newer one came in. If so, it drops the level it was
+// working on and starts on the new query, keeping all the levels it
+// finished. Matches of the last level go out a chunk at a time, so the first
+// screenful is there long before a big library has been looked at.
+
+// names to look at before checking for a newer query and handing out matches
+#define FILTER_CHUNK 8192
+// entries to put into the lowercase copy of the names before checking for a
+// query, see search.c
+#define FILTER_INDEX_CHUNK 65536
+
+typedef struct {
+	I32List order;  // level 0, the whole playlist in the order it's on screen
+	CharList query; // the prompt the levels were made for
+	I32List ids;    // level k, the matches for query[0..k+1), ends at ends[k]
+	I32List ends;
+	bool fuzzy;
+} FilterLevels;
+
+struct FilterWorker {
+	SDL_Thread *thread;
+	SDL_Mutex *mutex;
+	SDL_Condition *wake;    // a query came in, or stop
+	SDL_Condition *changed; // matches came out, or the worker is done
+	// The newest query, anything older is cancelled. Only goes up under the
+	// mutex, but the worker looks at it without.
+	_Atomic u32 generation;
+
+	// guarded by mutex
+	bool stop;
+	bool pending;
+	bool busy;
+	// The search has names to catch up on, and the worker may. It's busy
+	// with those, not a query, while indexing.
+	bool index_names;
+	bool indexing;
+	CharList query;
+	bool fuzzy;
+	i32 selected_id;
+	i32 top;
+	I32List order;
+	bool order_changed;
+	// matches of published_generation the main thread hasn't taken yet
+	u32 published_generation;
+	I32List published;
+	bool published_reset; // rows of older queries have to go
+	i32 published_selected; // -1 if not known yet
+
+	// only used by the worker
+	NameSearch *search;
+	const Playlist *pl;
+	FilterLevels levels;
+	I32List ranked;
+	FuzzyRanker *ranker;
+
+	// only used by the main thread
+	bool has_order;
+	SortKind sort;
+	u32 sort_version;
+	bool submitted; // since the last filter_poll
+};
+
+static void append_ids(I32List *l, const i32 *ids, i32 count){
+	if(l->count + count > l->cap){
+		l->cap = MAX(l->count + count, l->cap * 2);
+		l->data = realloc(l->data, l->cap * sizeof(l->data[0]));
+	}
+	memcpy(l->data + l->count, ids, count * sizeof(ids[0]));
+	l->count += count;
+}
+
+static i32 find_id(const i32 *ids, i32 count, i32 id){
+	for(i32 i = 0; i < count; ++i){
+		if(ids[i] == id)
+			return i;
+	}
+	return -1;
+}
+
+//# worker
+
+static bool cancelled(FilterWorker *w, u32 generation){
+	return atomic_load_explicit(&w->generation, memory_order_relaxed) != generation;
+}
+
+// The first batch of a query replaces whatever the main thread hasn't taken
+// from older ones. So does a batch with reset.
+static void publish(FilterWorker *w, u32 generation, const i32 *ids, i32 count, i32 selected, bool reset){
+	SDL_LockMutex(w->mutex);
+	if(!cancelled(w, generation)){
+		if(w->published_generation != generation || reset){
+			w->published_generation = generation;
+			w->published.count = 0;
+			w->published_reset = 1;
+			w->published_selected = -1;
+		}
+		append_ids(&w->published, ids, count);
+		if(selected >= 0)
+			w->published_selected = selected;
+		SDL_BroadcastCondition(w->changed);
+	}
+	SDL_UnlockMutex(w->mutex);
+}
+
+static void run_query(FilterWorker *w, u32 generation, const CharList *q, bool fuzzy, i32 selected_id, i32 top){
+	FilterLevels *f = &w->levels;
+	NameSearch *search = w->search;
+	if(f->fuzzy != fuzzy){
+		f->ends.count = 0;
+		f->fuzzy = fuzzy;
+	}
+	// everything up to the first character that changed is still good.
+	i32 keep = 0;
+	while(keep < f->ends.count && keep < q->count && f->query.data[keep] == q->data[keep])
+		++keep;
+	f->ends.count = keep;
+	f->ids.count = keep > 0 ? f->ends.data[keep-1] : 0;
+	f->query.count = 0;
+	push_string(&f->query, q->data, keep);
+
+	// level 0 is the whole playlist, level k holds the matches for q[0..k).
+	i32 start = keep > 1 ? f->ends.data[keep-2] : 0;
+	i32 count = keep > 0 ? f->ends.data[keep-1] - start : f->order.count;
+	i32 selected = find_id(keep > 0 ? f->ids.data + start : f->order.data, count, selected_id);
+	selected = MAX(selected, 0);
+	for(i32 k = keep; k < q->count; ++k){
+		const bool last = k == q->count - 1;
+		const i32 level_start = f->ids.count;
+		i32 published = level_start;
+		i32 next_selected = 0;
+		bool selected_known = 0;
+		// With a lot of names to look at, it's quicker to search all of them
+		// front to back than one by one in sorted order. The first chunk
+		// still goes one by one, so it's on screen before that's done.
+		name_search_set_query(search, q->data, k + 1);
+		const bool all = !fuzzy && count > search->span_count / 8 && name_search_complete(search, w->pl);
+		for(i32 chunk = 0; chunk < count; chunk += FILTER_CHUNK){
+			if(cancelled(w, generation)){
+				f->ids.count = level_start;
+				return;
+			}
+			if(all && chunk == FILTER_CHUNK)
+				name_search_all(search);
+			const i32 chunk_end = MIN(chunk + FILTER_CHUNK, count);
+			for(i32 i = chunk; i < chunk_end; ++i){
+				// f->ids may move while we push to it, so go by index.
+				const i32 id = k > 0 ? f->ids.data[start + i] : f->order.data[i];
+				bool match;
+				if(fuzzy)
+					match = fuzzy_matches(search, w->pl, id);
+				else if(all && chunk > 0)
+					match = name_search_found(search, id);
+				else
+					match = name_search_matches(search, w->pl, id);
+				if(match){
+					push_i32(&f->ids, id);
+					if(i < selected)
+						next_selected += 1;
+				}
+			}
+			if(last){
+				// Fuzzy matches get ranked once they're all in, until then
+				// they're in playlist order like the rest.
+				i32 sel = -1;
+				if(!fuzzy && !selected_known && chunk_end > selected){
+					sel = next_selected;
+					selected_known = 1;
+				}
+				publish(w, generation, f->ids.data + published, f->ids.count - published, sel, 0);
+				published = f->ids.count;
+			}
+		}
+		if(last && count == 0)
+			publish(w, generation, f->ids.data, 0, 0, 0);
+		push_i32(&f->ends, f->ids.count);
+		push_string(&f->query, q->data + k, 1);
+		selected = next_selected;
+		start = level_start;
+		count = f->ids.count - level_start;
+	}
+	if(cancelled(w, generation))
+		return;
+
+	const i32 *top_ids = q->count > 0 ? f->ids.data + start : f->order.data;
+	if(fuzzy && q->count > 0){
+		// The best match is what we're looking for, whatever was selected.
+		name_search_set_query(search, q->data, q->count);
+		if(!fuzzy_rank(w->ranker, search, w->pl, top_ids, count, top, &w->generation, generation, &w->ranked))
+			return;
+		publish(w, generation, w->ranked.data, w->ranked.count, 0, 1);
+	} else if(keep == q->count){
+		// nothing new to look at, the level we went back to is it.
+		publish(w, generation, top_ids, count, selected, 0);
+	}
+}
+
+static int filter_worker_main(void *arg){
+	FilterWorker *w = arg;
+	CharList query = make_charlist();
+	SDL_LockMutex(w->mutex);
+	while(!w->stop){
+		if(!w->pending && w->index_names){
+			// Queries come first, the names get copied in between.
+			w->busy = 1;
+			w->indexing = 1;
+			SDL_UnlockMutex(w->mutex);
+			const bool done = name_search_update(w->search, w->pl, FILTER_INDEX_CHUNK);
+			SDL_LockMutex(w->mutex);
+			w->busy = 0;
+			w->indexing = 0;
+			// unless filter_pause said to stop meanwhile
+			w->index_names = w->index_names && !done;
+			SDL_BroadcastCondition(w->changed);
+			continue;
+		}
+		if(!w->pending){
+			SDL_WaitCondition(w->wake, w->mutex);
+			continue;
+		}
+		w->pending = 0;
+		w->busy = 1;
+		const u32 generation = atomic_load_explicit(&w->generation, memory_order_relaxed);
+		query.count = 0;
+		push_string(&query, w->query.data, w->query.count);
+		const bool fuzzy = w->fuzzy;
+		const i32 selected_id = w->selected_id;
+		const i32 top = w->top;
+		if(w->order_changed){
+			// the levels are in the order of the playlist, they start over.
+			I32List order = w->levels.order;
+			w->levels.order = w->order;
+			w->order = order;
+			w->order_changed = 0;
+			w->levels.ends.count = 0;
+		}
+		SDL_UnlockMutex(w->mutex);
+
+		run_query(w, generation, &query, fuzzy, selected_id, top);
+
+		SDL_LockMutex(w->mutex);
+		w->busy = 0;
+		SDL_BroadcastCondition(w->changed);
+	}
+	SDL_UnlockMutex(w->mutex);
+	free(query.data);
+	return 0;
+}
+
+//# main thread
+
+FilterWorker *filter_worker_start(NameSearch *s, const Playlist *pl){
+	FilterWorker *w = calloc(1, sizeof(*w));
+	w->mutex = SDL_CreateMutex();
+	w->wake = SDL_CreateCondition();
+	w->changed = SDL_CreateCondition();
+	w->query = make_charlist();
+	w->order = make_i32list();
+	w->published = make_i32list();
+	w->published_selected = -1;
+	w->search = s;
+	w->pl = pl;
+	w->levels.order = make_i32list();
+	w->levels.query = make_charlist();
+	w->levels.ids = make_i32list();
+	w->levels.ends = make_i32list();
+	w->ranked = make_i32list();
+	w->ranker = fuzzy_ranker_start();
+	w->index_names = 1;
+	w->thread = SDL_CreateThread(filter_worker_main, "filter", w);
+	return w;
+}
+
+void filter_worker_stop(FilterWorker **ww){
+	FilterWorker *w = *ww;
+	if(w == NULL)
+		return;
+	SDL_LockMutex(w->mutex);
+	atomic_fetch_add_explicit(&w->generation, 1, memory_order_relaxed);
+	w->stop = 1;
+	SDL_SignalCondition(w->wake);
+	SDL_UnlockMutex(w->mutex);
+	SDL_WaitThread(w->thread, NULL);
+	fuzzy_ranker_stop(&w->ranker);
+	SDL_DestroyCondition(w->changed);
+	SDL_DestroyCondition(w->wake);
+	SDL_DestroyMutex(w->mutex);
+	free(w->query.data);
+	free(w->order.data);
+	free(w->published.data);
+	free(w->levels.order.data);
+	free(w->levels.query.data);
+	free(w->levels.ids.data);
+	free(w->levels.ends.data);
+	free(w->ranked.data);
+	free(w);
+	*ww = NULL;
+}
+
+void filter_submit(FilterWorker *w, const FilterQuery *q){
+	SDL_LockMutex(w->mutex);
+	atomic_fetch_add_explicit(&w->generation, 1, memory_order_relaxed);
+	w->query.count = 0;
+	push_string(&w->query, q->query, q->len);
+	w->fuzzy = q->fuzzy;
+	w->selected_id = q->selected_id;
+	w->top = q->top;
+	if(!w->has_order || w->sort != q->sort || w->sort_version != q->sort_version){
+		w->order.count = 0;
+		append_ids(&w->order, q->order->data, q->order->count);
+		w->order_changed = 1;
+		w->has_order = 1;
+		w->sort = q->sort;
+		w->sort_version = q->sort_version;
+	}
+	w->pending = 1;
+	SDL_SignalCondition(w->wake);
+	SDL_UnlockMutex(w->mutex);
+	w->submitted = 1;
+}
+
+bool filter_poll(FilterWorker *w, I32List *rows, i32 *selected, i32 wait_ms){
+	bool changed = 0;
+	SDL_LockMutex(w->mutex);
+	const u32 generation = atomic_load_explicit(&w->generation, memory_order_relaxed);
+	// Only right after a query came in. A slow one would hold up every
+	// frame until it shows something otherwise.
+	if(w->submitted && w->published_generation != generation && (w->pending || w->busy) && wait_ms > 0)
+		SDL_WaitConditionTimeout(w->changed, w->mutex, wait_ms);
+	w->submitted = 0;
+	if(w->published_generation == generation){
+		if(w->published_reset){
+			rows->count = 0;
+			w->published_reset = 0;
+			changed = 1;
+		}
+		if(w->published.count > 0){
+			append_ids(rows, w->published.data, w->published.count);
+			w->published.count = 0;
+			changed = 1;
+		}
+		if(w->published_selected >= 0){
+			*selected = w->published_selected;
+			w->published_selected = -1;
+			changed = 1;
+		}
+	}
+	SDL_UnlockMutex(w->mutex);
+	return changed;
+}
+
+bool filter_pause(FilterWorker *w){
+	SDL_LockMutex(w->mutex);
+	const bool running = w->pending || (w->busy && !w->indexing);
+	atomic_fetch_add_explicit(&w->generation, 1, memory_order_relaxed);
+	w->pending = 0;
+	w->index_names = 0;
+	while(w->busy)
+		SDL_WaitCondition(w->changed, w->mutex);
+	SDL_UnlockMutex(w->mutex);
+	return running;
+}
+
+void filter_index_names(FilterWorker *w){
+	SDL_LockMutex(w->mutex);
+	w->index_names = 1;
+	SDL_SignalCondition(w->wake);
+	SDL_UnlockMutex(w->mutex);
+}
+
+bool filter_idle(FilterWorker *w){
+	SDL_LockMutex(w->mutex);
+	const bool idle = !w->pending && !w->busy && !w->index_names;
+	SDL_UnlockMutex(w->mutex);
+	return idle;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "search.h"
+#include "sort.h"
+
+// Runs the filter prompt against the playlist on a background thread, so a
+// slow query never holds up input or drawing. A newer query cancels the one
+// that's running, and matches show up a chunk at a time, in the order
+// they'll be on screen.
+typedef struct FilterWorker FilterWorker;
+
+typedef struct {
+	const char *query;
+	i32 len;
+	bool fuzzy;
+	// the playlist in the order it's on screen, copied when sort or
+	// sort_version change
+	const I32List *order;
+	SortKind sort;
+	u32 sort_version;
+	// stays selected if it still matches, otherwise the next match after it
+	i32 selected_id;
+	// rows on screen, how many fuzzy matches get ranked
+	i32 top;
+} FilterQuery;
+
+// The worker reads s and pl while a query runs, see filter_pause. It also
+// keeps s up to date with pl, starting with all of it, see filter_index_names.
+FilterWorker *filter_worker_start(NameSearch *s, const Playlist *pl);
+void filter_worker_stop(FilterWorker **w);
+void filter_submit(FilterWorker *w, const FilterQuery *q);
+// Main thread, once a frame. Moves whatever matched since the last call into
+// rows, replacing the rows of an older query. Once it's known which row the
+// selected id ended up in, *selected gets set to it, once per query. On the
+// first call after filter_submit, waits up to wait_ms for the query to show
+// something, if it hasn't yet.
+// Returns 1 if anything changed.
+bool filter_poll(FilterWorker *w, I32List *rows, i32 *selected, i32 wait_ms);
+// Cancels the running query and waits for the worker to let go of the
+// search and the playlist, so they can be changed. Returns 1 if a query got
+// cancelled, which has to be submitted again. The search doesn't catch up
+// with the playlist until filter_index_names.
+bool filter_pause(FilterWorker *w);
+// The playlist changed, has the worker bring the search up to date with it
+// in between queries.
+void filter_index_names(FilterWorker *w);
+// Nothing running or waiting to run, and the search is up to date.
+bool filter_idle(FilterWorker *w);
@@ -0,0 +1,92 @@
+#include "floatfile.h"
+
+#include <stdlib.h>
+
+bool float_file_open(FloatFile *f, const char *path){
+	if(avformat_open_input(&f->format, path, NULL, NULL) < 0)
+		return 0;
+	const AVCodec *decoder = NULL;
+	f->stream = -1;
+	if(avformat_find_stream_info(f->format, NULL) >= 0)
+		f->stream = av_find_best_stream(f->format, AVMEDIA_TYPE_AUDIO, -1, -1, &decoder, 0);
+	f->codec = f->stream >= 0 && decoder ? avcodec_alloc_context3(decoder) : NULL;
+	bool ok = 0;
+	if(f->codec && avcodec_parameters_to_context(f->codec, f->format->streams[f->stream]->codecpar) >= 0){
+		// One core is plenty, the workers that use this run next to each
+		// other and to the decoder of what's playing.
+		f->codec->thread_count = 1;
+		ok = avcodec_open2(f->codec, decoder, NULL) >= 0;
+	}
+	const enum AVSampleFormat packed = ok ? av_get_packed_sample_fmt(f->codec->sample_fmt) : AV_SAMPLE_FMT_NONE;
+	ok = (packed == AV_SAMPLE_FMT_S16 || packed == AV_SAMPLE_FMT_S32 || packed == AV_SAMPLE_FMT_FLT)
+		&& f->codec->ch_layout.nb_channels > 0 && f->codec->ch_layout.nb_channels <= PCM_MAX_CHANNELS
+		&& f->codec->sample_rate > 0;
+	if(!ok){
+		float_file_close(f);
+		return 0;
+	}
+	f->channels = f->codec->ch_layout.nb_channels;
+	f->rate = f->codec->sample_rate;
+	const AVStream *st = f->format->streams[f->stream];
+	f->guess = 0;
+	if(st->duration != AV_NOPTS_VALUE)
+		f->guess = (f64)st->duration * av_q2d(st->time_base) * f->rate;
+	else if(f->format->duration != AV_NOPTS_VALUE)
+		f->guess = (f64)f->format->duration / AV_TIME_BASE * f->rate;
+	pcm_identity_matrix(f->matrix, f->channels);
+	f->packet = av_packet_alloc();
+	f->frame = av_frame_alloc();
+	return 1;
+}
+
+i32 float_file_next(FloatFile *f){
+	for(;;){
+		const int rc = avcodec_receive_frame(f->codec, f->frame);
+		if(rc == AVERROR(EAGAIN)){
+			const int read = av_read_frame(f->format, f->packet);
+			// A truncated file or a read error isn't the end, what came
+			// out so far isn't the whole track.
+			if(read < 0 && read != AVERROR_EOF)
+				return -1;
+			if(read < 0){
+				avcodec_send_packet(f->codec, NULL);
+				continue;
+			}
+			if(f->packet->stream_index == f->stream)
+				avcodec_send_packet(f->codec, f->packet);
+			av_packet_unref(f->packet);
+			continue;
+		}
+		if(rc < 0)
+			return rc == AVERROR_EOF ? 0 : -1;
+		const AVFrame *frame = f->frame;
+		const i32 n = frame->nb_samples;
+		const bool same = frame->format == f->codec->sample_fmt && frame->ch_layout.nb_channels == f->channels;
+		if(same && n > 0){
+			if(n * f->channels > f->samples_cap){
+				f->samples_cap = MAX(n * f->channels, f->samples_cap * 2);
+				f->samples = realloc(f->samples, f->samples_cap * sizeof(f32));
+			}
+			pcm_mix(f->samples, f->channels, frame->extended_data, frame->format, f->channels, f->matrix, 0, n);
+		}
+		av_frame_unref(f->frame);
+		if(!same)
+			return -1;
+		if(n > 0)
+			return n;
+	}
+}
+
+void float_file_close(FloatFile *f){
+	av_frame_free(&f->frame);
+	av_packet_free(&f->packet);
+	avcodec_free_context(&f->codec);
+	avformat_close_input(&f->format);
+}
+
+void float_file_free(FloatFile *f){
+	float_file_close(f);
+	free(f->samples);
+	f->samples = NULL;
+	f->samples_cap = 0;
+}
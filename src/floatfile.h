@@ -0,0 +1,38 @@
+#pragma once
+
+#include "pcm.h"
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+// A whole file decoded to interleaved float, one frame after the other, for
+// the workers that look at every sample of a track: loudness.c and
+// waveform.c. What plays goes through decoder.c, which seeks, trims and
+// converts to what the device wants.
+typedef struct {
+	AVFormatContext *format;
+	AVCodecContext *codec;
+	AVPacket *packet;
+	AVFrame *frame;
+	i32 stream;
+	i32 channels;
+	i32 rate;
+	// Sample frames in the stream, as the container tells it, 0 if it
+	// doesn't. Only a guess, how many there are shows at the end.
+	f64 guess;
+	f32 matrix[PCM_MAX_CHANNELS * PCM_MAX_CHANNELS];
+	// the last frame, kept from one file to the next
+	f32 *samples;
+	i32 samples_cap;
+} FloatFile;
+
+// f starts out zero, and can be opened again after a close. Returns 0, with
+// f closed, if the file has no audio stream, or none pcm_mix takes.
+bool float_file_open(FloatFile *f, const char *path);
+// Decodes the next frame into f->samples. Returns its sample frames, 0 at
+// the end of the stream, -1 if reading or decoding failed or the format
+// changed on the way.
+i32 float_file_next(FloatFile *f);
+void float_file_close(FloatFile *f);
+// Closes it and frees the samples too.
+void float_file_free(FloatFile *f);
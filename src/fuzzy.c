@@ -0,0 +1,397 @@
+#include "fuzzy.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL3/SDL_cpuinfo.h>
+#include <SDL3/SDL_mutex.h>
+#include <SDL3/SDL_thread.h>
+
+// Scoring works like fzf's v1 algorithm. Find the first place the query
+// shows up in order, then walk back from its end to make it as short as
+// possible, and score that part of the name. Every matched character is
+// worth something, gaps cost something, and characters at the start of a
+// word, right after another match, or in the file name rather than the
+// directories get a bonus on top.
+//
+// Ranking scores every name, which takes a while for big libraries, so the
+// names are split up into ranges, and the thread that ranks takes them
+// along with a few helpers. Those are started once, with the filter worker,
+// and wait for the next query in between. Each range keeps only the best
+// few, and only those get sorted. Nobody looks past the first screen of a
+// ranked list anyway.
+
+#define FUZZY_MAX_THREADS 8
+// Names per range. Fewer aren't worth waking a helper for, and a newer query
+// only gets noticed in between ranges.
+#define FUZZY_RANGE 8192
+
+enum {
+	ScoreMatch = 16,
+	ScoreGapStart = -3,
+	ScoreGapExtension = -1,
+	BonusBoundary = ScoreMatch / 2,
+	BonusNonWord = ScoreMatch / 2,
+	BonusCamel123 = BonusBoundary + ScoreGapExtension,
+	BonusConsecutive = -(ScoreGapStart + ScoreGapExtension),
+	BonusFirstCharMultiplier = 2,
+	BonusBoundaryWhite = BonusBoundary + 2,
+	BonusBoundaryDelimiter = BonusBoundary + 1,
+	// per character matched in the file name
+	BonusBasename = 2,
+};
+
+typedef enum {
+	CharWhite,
+	CharNonWord,
+	CharDelimiter,
+	CharLower,
+	CharUpper,
+	CharNumber,
+} CharClass;
+
+static CharClass char_class(char c){
+	if(c >= 'a' && c <= 'z')
+		return CharLower;
+	if(c >= 'A' && c <= 'Z')
+		return CharUpper;
+	if(c >= '0' && c <= '9')
+		return CharNumber;
+	switch(c){
+		case ' ': case '\t':
+			return CharWhite;
+		case '/': case ',': case ':': case ';': case '|':
+			return CharDelimiter;
+		case '_': case '-': case '.': case '(': case ')': case '[': case ']': case '\'': case '&':
+			return CharNonWord;
+	}
+	// anything outside of ASCII is probably a letter
+	return (u8)c >= 128 ? CharLower : CharNonWord;
+}
+
+static i32 bonus_for(CharClass prev, CharClass class){
+	if(class > CharNonWord){
+		if(prev == CharWhite)
+			return BonusBoundaryWhite;
+		if(prev == CharDelimiter)
+			return BonusBoundaryDelimiter;
+		if(prev == CharNonWord)
+			return BonusBoundary;
+	}
+	if((prev == CharLower && class == CharUpper) || (prev != CharNumber && class == CharNumber))
+		return BonusCamel123;
+	if(class == CharNonWord || class == CharDelimiter)
+		return BonusNonWord;
+	if(class == CharWhite)
+		return BonusBoundaryWhite;
+	return 0;
+}
+
+bool fuzzy_matches(const NameSearch *s, const Playlist *pl, i32 id){
+	const MusicEntry *e = &pl->entries.data[id];
+	const i32 len = e->path.len - e->name_offset - 1;
+	const char *lower = name_search_lower(s, id);
+	if(lower == NULL){
+		// not in the lowercase copy yet
+		const char *name = pl->names.data + e->path.start + e->name_offset;
+		i32 k = 0;
+		for(i32 i = 0; i < len && k < s->query.count; ++i)
+			k += lower_char(name[i]) == s->query.data[k];
+		return k == s->query.count;
+	}
+	const char *p = lower;
+	const char *end = lower + len;
+	for(i32 k = 0; k < s->query.count; ++k){
+		p = memchr(p, s->query.data[k], end - p);
+		if(p == NULL)
+			return 0;
+		p += 1;
+	}
+	return 1;
+}
+
+i32 fuzzy_score(const NameSearch *s, const Playlist *pl, i32 id){
+	const MusicEntry *e = &pl->entries.data[id];
+	const char *name = pl->names.data + e->path.start + e->name_offset;
+	const i32 len = e->path.len - e->name_offset - 1;
+	const char *q = s->query.data;
+	const i32 m = s->query.count;
+	if(m == 0)
+		return 0;
+
+	i32 k = 0;
+	i32 end = -1;
+	for(i32 i = 0; i < len; ++i){
+		if(lower_char(name[i]) == q[k] && ++k == m){
+			end = i + 1;
+			break;
+		}
+	}
+	if(end < 0)
+		return -1;
+	i32 start = end - 1;
+	k = m - 1;
+	for(i32 i = end - 1; i >= 0; --i){
+		if(lower_char(name[i]) == q[k] && --k < 0){
+			start = i;
+			break;
+		}
+	}
+	i32 basename = len;
+	while(basename > 0 && name[basename-1] != '/')
+		basename -= 1;
+
+	i32 score = 0;
+	i32 consecutive = 0;
+	i32 first_bonus = 0;
+	bool in_gap = 0;
+	CharClass prev = start > 0 ? char_class(name[start-1]) : CharDelimiter;
+	k = 0;
+	for(i32 i = start; i < end; ++i){
+		const CharClass class = char_class(name[i]);
+		if(k < m && lower_char(name[i]) == q[k]){
+			i32 bonus = bonus_for(prev, class);
+			if(consecutive == 0){
+				first_bonus = bonus;
+			} else {
+				// a run keeps the bonus of where it started
+				if(bonus >= BonusBoundary && bonus > first_bonus)
+					first_bonus = bonus;
+				bonus = MAX(bonus, first_bonus);
+				bonus = MAX(bonus, (i32)BonusConsecutive);
+			}
+			score += ScoreMatch + (k == 0 ? bonus * BonusFirstCharMultiplier : bonus);
+			if(i >= basename)
+				score += BonusBasename;
+			consecutive += 1;
+			in_gap = 0;
+			k += 1;
+		} else {
+			score += in_gap ? ScoreGapExtension : ScoreGapStart;
+			in_gap = 1;
+			consecutive = 0;
+			first_bonus = 0;
+		}
+		prev = class;
+	}
+	return MAX(score, 0);
+}
+
+//# ranking
+
+typedef struct {
+	i32 score;
+	i32 index; // into the ids being ranked
+} Ranked;
+
+static bool ranked_worse(Ranked a, Ranked b){
+	return a.score < b.score || (a.score == b.score && a.index > b.index);
+}
+
+// A min-heap of the best cap so far, the worst one on top.
+static void heap_offer(Ranked *heap, i32 *count, i32 cap, Ranked r){
+	if(*count < cap){
+		i32 i = (*count)++;
+		while(i > 0 && ranked_worse(r, heap[(i - 1) / 2])){
+			heap[i] = heap[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+		heap[i] = r;
+		return;
+	}
+	if(cap == 0 || !ranked_worse(heap[0], r))
+		return;
+	i32 i = 0;
+	for(;;){
+		i32 c = 2 * i + 1;
+		if(c >= *count)
+			break;
+		if(c + 1 < *count && ranked_worse(heap[c+1], heap[c]))
+			c += 1;
+		if(!ranked_worse(heap[c], r))
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = r;
+}
+
+static int compare_ranked(const void *pa, const void *pb){
+	const Ranked *a = pa;
+	const Ranked *b = pb;
+	return ranked_worse(*b, *a) ? -1 : ranked_worse(*a, *b) ? 1 : 0;
+}
+
+typedef struct {
+	const NameSearch *s;
+	const Playlist *pl;
+	const i32 *ids;
+	i32 *scores;
+	i32 begin;
+	i32 end;
+	Ranked *heap;
+	i32 heap_count;
+	i32 top;
+	const _Atomic u32 *generation;
+	u32 want;
+} RankRange;
+
+struct FuzzyRanker {
+	SDL_Thread *threads[FUZZY_MAX_THREADS - 1];
+	i32 thread_count;
+	SDL_Mutex *mutex;
+	SDL_Condition *wake; // there are ranges to take, or stop
+	SDL_Condition *done; // the last range of a ranking is done
+	// guarded by mutex
+	bool stop;
+	RankRange *ranges;
+	i32 range_count;
+	i32 next_range;
+	i32 unfinished;
+};
+
+static bool rank_cancelled(const RankRange *r){
+	return r->generation && atomic_load_explicit(r->generation, memory_order_relaxed) != r->want;
+}
+
+// Whatever's left once it's cancelled is only skipped, so it still counts as
+// done and nobody waits for it.
+static void rank_range(RankRange *r){
+	if(rank_cancelled(r))
+		return;
+	for(i32 i = r->begin; i < r->end; ++i){
+		const i32 score = fuzzy_score(r->s, r->pl, r->ids[i]);
+		r->scores[i] = score;
+		if(score >= 0)
+			heap_offer(r->heap, &r->heap_count, r->top, (Ranked){score, i});
+	}
+}
+
+// Takes ranges until there are none left. With the mutex held.
+static void take_ranges(FuzzyRanker *f){
+	while(f->next_range < f->range_count){
+		RankRange *r = &f->ranges[f->next_range++];
+		SDL_UnlockMutex(f->mutex);
+		rank_range(r);
+		SDL_LockMutex(f->mutex);
+		if(--f->unfinished == 0)
+			SDL_SignalCondition(f->done);
+	}
+}
+
+static int ranker_main(void *arg){
+	FuzzyRanker *f = arg;
+	SDL_LockMutex(f->mutex);
+	while(!f->stop){
+		if(f->next_range == f->range_count){
+			SDL_WaitCondition(f->wake, f->mutex);
+			continue;
+		}
+		take_ranges(f);
+	}
+	SDL_UnlockMutex(f->mutex);
+	return 0;
+}
+
+FuzzyRanker *fuzzy_ranker_start(void){
+	FuzzyRanker *f = calloc(1, sizeof(*f));
+	f->mutex = SDL_CreateMutex();
+	f->wake = SDL_CreateCondition();
+	f->done = SDL_CreateCondition();
+	// the thread that ranks is one of them
+	const i32 n = MIN(SDL_GetNumLogicalCPUCores(), FUZZY_MAX_THREADS) - 1;
+	for(i32 i = 0; i < n; ++i){
+		SDL_Thread *t = SDL_CreateThread(ranker_main, "fuzzy rank", f);
+		if(t)
+			f->threads[f->thread_count++] = t;
+	}
+	return f;
+}
+
+void fuzzy_ranker_stop(FuzzyRanker **ff){
+	FuzzyRanker *f = *ff;
+	if(f == NULL)
+		return;
+	SDL_LockMutex(f->mutex);
+	f->stop = 1;
+	SDL_BroadcastCondition(f->wake);
+	SDL_UnlockMutex(f->mutex);
+	for(i32 i = 0; i < f->thread_count; ++i)
+		SDL_WaitThread(f->threads[i], NULL);
+	SDL_DestroyCondition(f->done);
+	SDL_DestroyCondition(f->wake);
+	SDL_DestroyMutex(f->mutex);
+	free(f);
+	*ff = NULL;
+}
+
+bool fuzzy_rank(FuzzyRanker *f, const NameSearch *s, const Playlist *pl, const i32 *ids, i32 count, i32 top, const _Atomic u32 *generation, u32 want, I32List *out){
+	out->count = 0;
+	top = MIN(top, count);
+	top = MAX(top, 0);
+	const i32 n = MAX((count + FUZZY_RANGE - 1) / FUZZY_RANGE, 1);
+	i32 *scores = malloc(MAX(count, 1) * sizeof(scores[0]));
+	Ranked *heaps = malloc(MAX((size_t)n * top, 1) * sizeof(heaps[0]));
+	RankRange *ranges = malloc(n * sizeof(ranges[0]));
+	for(i32 i = 0; i < n; ++i){
+		ranges[i] = (RankRange){
+			.s = s,
+			.pl = pl,
+			.ids = ids,
+			.scores = scores,
+			.begin = i * FUZZY_RANGE,
+			.end = MIN((i + 1) * FUZZY_RANGE, count),
+			.heap = heaps + (size_t)i * top,
+			.top = top,
+			.generation = generation,
+			.want = want,
+		};
+	}
+	if(n == 1 || f == NULL || f->thread_count == 0){
+		for(i32 i = 0; i < n; ++i)
+			rank_range(&ranges[i]);
+	} else {
+		SDL_LockMutex(f->mutex);
+		f->ranges = ranges;
+		f->range_count = n;
+		f->next_range = 0;
+		f->unfinished = n;
+		SDL_BroadcastCondition(f->wake);
+		// whatever the helpers haven't taken yet by then is done right here
+		take_ranges(f);
+		while(f->unfinished > 0)
+			SDL_WaitCondition(f->done, f->mutex);
+		f->ranges = NULL;
+		f->range_count = 0;
+		f->next_range = 0;
+		SDL_UnlockMutex(f->mutex);
+	}
+	if(generation && atomic_load_explicit(generation, memory_order_relaxed) != want){
+		free(ranges);
+		free(heaps);
+		free(scores);
+		return 0;
+	}
+	Ranked *best = malloc(MAX(top, 1) * sizeof(best[0]));
+	i32 best_count = 0;
+	for(i32 i = 0; i < n; ++i){
+		const RankRange *r = &ranges[i];
+		for(i32 j = 0; j < r->heap_count; ++j)
+			heap_offer(best, &best_count, top, r->heap[j]);
+	}
+	qsort(best, best_count, sizeof(best[0]), compare_ranked);
+	for(i32 i = 0; i < best_count; ++i){
+		push_i32(out, ids[best[i].index]);
+		scores[best[i].index] = -1;
+	}
+	for(i32 i = 0; i < count; ++i){
+		if(scores[i] >= 0)
+			push_i32(out, ids[i]);
+	}
+	free(best);
+	free(ranges);
+	free(heaps);
+	free(scores);
+	return 1;
+}
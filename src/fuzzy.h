@@ -0,0 +1,27 @@
+#pragma once
+
+#include "search.h"
+
+#include <stdatomic.h>
+
+// fzf style fuzzy matching: the query has to show up in the name in order,
+// but not necessarily in one piece. These use the query of the NameSearch,
+// set with name_search_set_query.
+
+bool fuzzy_matches(const NameSearch *s, const Playlist *pl, i32 id);
+// Higher is better, -1 if it doesn't match.
+i32 fuzzy_score(const NameSearch *s, const Playlist *pl, i32 id);
+// Threads that help with fuzzy_rank, one fewer than there are cores. They
+// sleep until there's something to rank.
+typedef struct FuzzyRanker FuzzyRanker;
+
+FuzzyRanker *fuzzy_ranker_start(void);
+void fuzzy_ranker_stop(FuzzyRanker **f);
+
+// Replaces out with the ids that match, best match first. Only the first top
+// of them are ranked, the rest follow in the order they're in ids. Ties go
+// to whichever comes first in ids. With f, big lists are split up with its
+// threads, one thread ranks with it at a time. NULL ranks on this one alone.
+// Once *generation isn't want anymore, it stops early and returns 0 with out
+// empty. A NULL generation never stops.
+bool fuzzy_rank(FuzzyRanker *f, const NameSearch *s, const Playlist *pl, const i32 *ids, i32 count, i32 top, const _Atomic u32 *generation, u32 want, I32List *out);
@@ -0,0 +1,225 @@
+#include "jobpool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static u8 *info_at(const JobPool *p, i32 id){
+	return p->infos + (size_t)id * p->format->info_size;
+}
+
+static bool info_is_current(const JobPoolFormat *f, const u8 *info, const MusicEntry *e){
+	i64 mtime, size;
+	memcpy(&mtime, info + f->mtime, sizeof(mtime));
+	memcpy(&size, info + f->size, sizeof(size));
+	return mtime == e->mtime && size == e->size;
+}
+
+static void push_job(PoolJobList *l, const PoolJob *job){
+	if(l->count >= l->cap){
+		l->cap = MAX(l->cap * 2, 64);
+		l->data = realloc(l->data, l->cap * sizeof(l->data[0]));
+	}
+	l->data[l->count++] = *job;
+}
+
+static void clear_jobs(PoolJobList *l){
+	for(i32 i = l->head; i < l->count; ++i)
+		free(l->data[i].path);
+	l->head = 0;
+	l->count = 0;
+}
+
+static void make_job(const Playlist *pl, i32 id, u32 generation, PoolJob *job){
+	const MusicEntry *e = &pl->entries.data[id];
+	job->id = id;
+	job->generation = generation;
+	job->mtime = e->mtime;
+	job->size = e->size;
+	job->path = malloc(e->path.len);
+	memcpy(job->path, pl->names.data + e->path.start, e->path.len);
+}
+
+static bool take_job(JobPool *p, PoolJob *job){
+	if(p->urgent.count > 0){
+		// newest first, that's what's needed right now.
+		*job = p->urgent.data[--p->urgent.count];
+		return 1;
+	}
+	if(p->background.head < p->background.count){
+		*job = p->background.data[p->background.head++];
+		if(p->background.head == p->background.count){
+			p->background.head = 0;
+			p->background.count = 0;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+//# workers
+
+bool job_pool_wait(JobPool *p, PoolJob *job){
+	while(!p->stop){
+		if(take_job(p, job))
+			return 1;
+		SDL_WaitCondition(p->wake, p->mutex);
+	}
+	return 0;
+}
+
+//# main thread
+
+void job_pool_start(JobPool *p, const JobPoolFormat *format, i32 thread_count, SDL_ThreadFunction worker, const char *name, void *arg){
+	p->format = format;
+	p->mutex = SDL_CreateMutex();
+	p->wake = SDL_CreateCondition();
+	record_cache_load(&p->cache, format->cache);
+	thread_count = MIN(thread_count, JOB_POOL_MAX_THREADS);
+	for(i32 i = 0; i < thread_count; ++i){
+		SDL_Thread *t = SDL_CreateThread(worker, name, arg);
+		if(t)
+			p->threads[p->thread_count++] = t;
+	}
+}
+
+void job_pool_stop_workers(JobPool *p){
+	SDL_LockMutex(p->mutex);
+	p->stop = 1;
+	SDL_BroadcastCondition(p->wake);
+	SDL_UnlockMutex(p->mutex);
+	for(i32 i = 0; i < p->thread_count; ++i)
+		SDL_WaitThread(p->threads[i], NULL);
+	p->thread_count = 0;
+}
+
+// Only what belongs to entries of pl gets saved, so files that are gone
+// drop out of the cache and its strings don't pile up over time.
+static void cache_save(JobPool *p, const Playlist *pl){
+	const void **keep = malloc(MAX(p->info_count, 1) * sizeof(keep[0]));
+	i32 count = 0;
+	for(i32 id = 0; id < p->info_count; ++id){
+		if(job_pool_info(p, pl, id) == NULL || (pl->entries.data[id].flags & EntryRemoved))
+			continue;
+		const Sub path = pl->entries.data[id].path;
+		const void *r = record_cache_find(&p->cache, pl->names.data + path.start, path.len);
+		if(r != NULL)
+			keep[count++] = r;
+	}
+	record_cache_save(&p->cache, keep, count);
+	free(keep);
+}
+
+void job_pool_free(JobPool *p, const Playlist *pl){
+	cache_save(p, pl);
+	clear_jobs(&p->urgent);
+	clear_jobs(&p->background);
+	free(p->urgent.data);
+	free(p->background.data);
+	free(p->infos);
+	record_cache_free(&p->cache);
+	SDL_DestroyCondition(p->wake);
+	SDL_DestroyMutex(p->mutex);
+	zerostruct(p);
+}
+
+void job_pool_reset(JobPool *p){
+	SDL_LockMutex(p->mutex);
+	p->generation += 1;
+	clear_jobs(&p->urgent);
+	clear_jobs(&p->background);
+	SDL_UnlockMutex(p->mutex);
+	// The cache has everything, the table gets filled again from there.
+	p->info_count = 0;
+	p->next_background = 0;
+}
+
+void job_pool_update(JobPool *p, const Playlist *pl, bool background){
+	const JobPoolFormat *f = p->format;
+	if(p->info_count < pl->entries.count){
+		if(pl->entries.count > p->info_cap){
+			p->info_cap = MAX(pl->entries.count + pl->entries.count / 8, 1024);
+			p->infos = realloc(p->infos, (size_t)p->info_cap * f->info_size);
+		}
+		for(i32 id = p->info_count; id < pl->entries.count; ++id){
+			const MusicEntry *e = &pl->entries.data[id];
+			const u8 *r = record_cache_find(&p->cache, pl->names.data + e->path.start, e->path.len);
+			u8 *info = info_at(p, id);
+			if(r && info_is_current(f, r + f->info_offset, e))
+				memcpy(info, r + f->info_offset, f->info_size);
+			else
+				memset(info, 0, f->info_size);
+		}
+		p->info_count = pl->entries.count;
+	}
+	if(!background)
+		return;
+
+	SDL_LockMutex(p->mutex);
+	if(p->background.count - p->background.head < f->batch / 2){
+		i32 pushed = 0;
+		while(pushed < f->batch && p->next_background < p->info_count){
+			const i32 id = p->next_background++;
+			u8 *state = info_at(p, id);
+			if(*state != JobNone || (pl->entries.data[id].flags & EntryRemoved))
+				continue;
+			PoolJob job;
+			make_job(pl, id, p->generation, &job);
+			push_job(&p->background, &job);
+			*state = JobQueued;
+			pushed += 1;
+		}
+		if(pushed)
+			SDL_BroadcastCondition(p->wake);
+	}
+	SDL_UnlockMutex(p->mutex);
+}
+
+bool job_pool_current(const JobPool *p, i32 id, u32 generation){
+	// only the main thread changes the generation
+	return generation == p->generation && id >= 0 && id < p->info_count;
+}
+
+void job_pool_put(JobPool *p, const Playlist *pl, i32 id, const void *info, bool cache){
+	if(id < 0 || id >= pl->entries.count)
+		return;
+	if(id < p->info_count)
+		memcpy(info_at(p, id), info, p->format->info_size);
+	if(!cache)
+		return;
+	const Sub path = pl->entries.data[id].path;
+	u8 *record = record_cache_put(&p->cache, pl->names.data + path.start, path.len);
+	memcpy(record + p->format->info_offset, info, p->format->info_size);
+}
+
+void job_pool_prioritize(JobPool *p, const Playlist *pl, const i32 *ids, i32 count){
+	bool any = 0;
+	SDL_LockMutex(p->mutex);
+	for(i32 i = count - 1; i >= 0; --i){
+		// pushed back to front, so the first one gets picked up first.
+		const i32 id = ids[i];
+		if(id < 0 || id >= p->info_count)
+			continue;
+		u8 *info = info_at(p, id);
+		if(*info == JobQueued)
+			continue;
+		if(*info != JobNone && info_is_current(p->format, info, &pl->entries.data[id]))
+			continue;
+		PoolJob job;
+		make_job(pl, id, p->generation, &job);
+		push_job(&p->urgent, &job);
+		*info = JobQueued;
+		any = 1;
+	}
+	if(any)
+		SDL_BroadcastCondition(p->wake);
+	SDL_UnlockMutex(p->mutex);
+}
+
+const void *job_pool_info(const JobPool *p, const Playlist *pl, i32 id){
+	if(id < 0 || id >= p->info_count)
+		return NULL;
+	const u8 *info = info_at(p, id);
+	if(*info != JobDone && *info != JobFailed)
+		return NULL;
+	return info_is_current(p->format, info, &pl->entries.data[id]) ? info : NULL;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "cache.h"
+#include "library.h"
+
+#include <stdatomic.h>
+
+#include <SDL3/SDL_mutex.h>
+#include <SDL3/SDL_thread.h>
+
+// What probe.c and loudness.c have in common: workers that look at one file
+// after the other, a table with what's known about every entry of the
+// playlist, and a cache file behind it.
+//
+// Workers never touch the playlist or the table. Jobs carry a copy of the
+// path, and the main thread moves results into the table. Entries that are
+// asked for go first, newest first, then the rest of the library in the
+// background, a batch at a time. Jobs and results carry the generation they
+// were made in, a reset makes everything older stale.
+//
+// An info is the same for both: a u8 state first, one of JobState, and an
+// i64 mtime and size of the file it's about. The table and the records of
+// the cache hold them as is, the pool only looks at those three.
+
+#define JOB_POOL_MAX_THREADS 4
+
+typedef enum {
+	JobNone,
+	JobQueued,
+	JobDone,
+	JobFailed,
+} JobState;
+
+typedef struct {
+	i32 id;
+	u32 generation;
+	i64 mtime;
+	i64 size;
+	char *path;
+} PoolJob;
+
+typedef struct {
+	PoolJob *data;
+	i32 head; // background jobs are taken from the front
+	i32 count;
+	i32 cap;
+} PoolJobList;
+
+typedef struct {
+	const CacheFormat *cache;
+	// Where in a record of the cache its info is, offsetof, and how big an
+	// info is. Where in an info its mtime and size are.
+	u32 info_offset;
+	u32 info_size;
+	u16 mtime;
+	u16 size;
+	// how many background jobs to keep queued up
+	i32 batch;
+} JobPoolFormat;
+
+typedef struct {
+	const JobPoolFormat *format;
+	SDL_Thread *threads[JOB_POOL_MAX_THREADS];
+	i32 thread_count;
+
+	// Whoever uses the pool keeps its results under this mutex too.
+	SDL_Mutex *mutex;
+	SDL_Condition *wake;
+	// Set under the mutex, but workers may also look at it without while
+	// they work, so stopping doesn't wait for a whole file.
+	_Atomic bool stop;
+	// guarded by mutex
+	u32 generation;
+	PoolJobList urgent;
+	PoolJobList background;
+
+	// only used by the main thread
+	u8 *infos;
+	i32 info_count;
+	i32 info_cap;
+	i32 next_background;
+	RecordCache cache;
+} JobPool;
+
+// Loads the cache and starts thread_count workers, at most
+// JOB_POOL_MAX_THREADS, that run worker with arg.
+void job_pool_start(JobPool *p, const JobPoolFormat *format, i32 thread_count, SDL_ThreadFunction worker, const char *name, void *arg);
+// Stops the workers and waits for them. The table and the cache stay.
+void job_pool_stop_workers(JobPool *p);
+// Saves what's known about the entries of pl and frees everything.
+void job_pool_free(JobPool *p, const Playlist *pl);
+
+// Workers only, with the mutex held, which is let go of while waiting.
+// Returns 1 with the next job, its path is the worker's to free, or 0 once
+// the pool stops.
+bool job_pool_wait(JobPool *p, PoolJob *job);
+
+// The rest is for the main thread only.
+// The playlist got replaced and all the ids changed.
+void job_pool_reset(JobPool *p);
+// Once a frame. New entries start out with what the cache knows about
+// them, and with background, the workers get more of the library to do.
+void job_pool_update(JobPool *p, const Playlist *pl, bool background);
+// Whether a result of the job for id made in generation still counts.
+bool job_pool_current(const JobPool *p, i32 id, u32 generation);
+// Puts info in the table, for entry id of pl, and into the cache if cache.
+// Entries the table doesn't have yet get it from the cache.
+void job_pool_put(JobPool *p, const Playlist *pl, i32 id, const void *info, bool cache);
+// Does these entries before anything else.
+void job_pool_prioritize(JobPool *p, const Playlist *pl, const i32 *ids, i32 count);
+// NULL if the entry isn't done yet, or the file changed since.
+const void *job_pool_info(const JobPool *p, const Playlist *pl, i32 id);
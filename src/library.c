@@ -0,0 +1,1341 @@
+#define _GNU_SOURCE
+#include "library.h"
+#include "sort.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <SDL3/SDL_stdinc.h>
+#include <SDL3/SDL_cpuinfo.h>
+#include <SDL3/SDL_mutex.h>
+#include <SDL3/SDL_thread.h>
+#include <SDL3/SDL_timer.h>
+
+static const Slice accepted_extensions[] = {
+#define X(A) S(#A),
+	extensions_def
+#undef X
+};
+
+void push_string(CharList *l, const char *str, i32 len){
+	if(l->count + len > l->cap){
+		do {
+			l->cap *= 2;
+		} while(l->count + len > l->cap);
+		l->data = realloc(l->data, l->cap * sizeof(l->data[0]));
+	}
+	memcpy(l->data + l->count, str, len);
+	l->count += len;
+}
+
+void delete_chars(CharList *l, i32 at, i32 n){
+	assert(at + n <= l->count);
+	i32 r = l->count - at - n;
+	memmove(l->data + at, l->data + at + n, r);
+	l->count -= n;
+}
+
+void insert_string(CharList *l, i32 at, const char *str, i32 len){
+	if(l->count + len > l->cap){
+		do {
+			l->cap *= 2;
+		} while(l->count + len > l->cap);
+		l->data = realloc(l->data, sizeof(l->data[0]) * l->cap);
+	}
+	memmove(l->data + at + len, l->data + at, l->count - at);
+	memcpy(l->data + at, str, len);
+	l->count += len;
+}
+
+void push_entry(MusicEntryList *l, const MusicEntry *entry){
+	if(l->count >= l->cap){
+		l->cap *= 2;
+		l->data = realloc(l->data, sizeof(l->data[0]) * l->cap);
+	}
+	l->data[l->count] = *entry;
+	l->count += 1;
+}
+
+CharList make_charlist(void){
+	i32 cap = 64;
+	CharList l;
+	l.data = malloc(cap * sizeof(l.data[0]));
+	l.count = 0;
+	l.cap = cap;
+	return l;
+}
+
+I32List make_i32list(void){
+	i32 cap = 64;
+	I32List l;
+	l.data = malloc(cap * sizeof(l.data[0]));
+	l.count = 0;
+	l.cap = cap;
+	return l;
+}
+
+void push_i32(I32List *l, i32 x){
+	if(l->count >= l->cap){
+		l->cap *= 2;
+		l->data = realloc(l->data, sizeof(l->data[0]) * l->cap);
+	}
+	l->data[l->count] = x;
+	l->count += 1;
+}
+
+void push_dir(DirEntryList *l, const DirEntry *dir){
+	if(l->count >= l->cap){
+		l->cap *= 2;
+		l->data = realloc(l->data, sizeof(l->data[0]) * l->cap);
+	}
+	l->data[l->count] = *dir;
+	l->count += 1;
+}
+
+DirEntryList make_dirlist(void){
+	i32 cap = 64;
+	DirEntryList l;
+	l.data = malloc(cap * sizeof(l.data[0]));
+	l.count = 0;
+	l.cap = cap;
+	return l;
+}
+
+MusicEntryList make_entrylist(void){
+	i32 cap = 64;
+	MusicEntryList l;
+	l.data = malloc(cap * sizeof(l.data[0]));
+	l.count = 0;
+	l.cap = cap;
+	return l;
+}
+
+// funny that the order of parameters in SDL_qsort_r is different from the C stdlib qsort_r
+int compare_sub(void *arg, const void *pa, const void *pb){
+	const CharList *strdata = arg;
+	const Sub *a = pa;
+	const Sub *b = pb;
+	i32 minlen = MIN(a->len, b->len);
+	i32 d = memcmp(strdata->data + a->start, strdata->data + b->start, minlen);
+	if(d != 0)
+		return d;
+	if(a->len < b->len)
+		return -1;
+	if(a->len > b->len)
+		return 1;
+	return 0;
+}
+
+static Sub get_extension(const CharList *l){
+	i32 i = l->count - 1;
+	while(i >= 0){
+		if(l->data[i] == '.'){
+			++i;
+			break;
+		}
+		--i;
+	}
+	if(i < 0){
+		return (Sub){-1,-1};
+	} else {
+		return (Sub){i, l->count - 1 - i};
+	}
+}
+
+static i32 get_extension_id(const CharList *base, Sub s, const Slice cands[], i32 cand_count){
+	for(i32 i = 0; i < cand_count; ++i){
+		if(cands[i].len == s.len && 0 == memcmp(cands[i].str, base->data + s.start, s.len)){
+			return i;
+		}
+	}
+	return -1;
+}
+
+i32 path_extension_id(const CharList *fullpath){
+	Sub ext = get_extension(fullpath);
+	if(ext.start < 0)
+		return -1;
+	return get_extension_id(fullpath, ext, accepted_extensions, countof(accepted_extensions));
+}
+
+//# parallel directory scanner
+//
+// Every worker owns a deque of directories.  The owner pushes and pops at the
+// tail, so it walks its part of the tree depth first and stays in the same
+// subtree.  Idle workers steal from the head, which holds the directories
+// closest to the root, i.e. the biggest chunks of remaining work.  A directory
+// is the unit of work, so a plain mutex per deque is cheap compared to the
+// readdir and stat calls we do for it.
+
+typedef struct {
+	char *path; // NUL-terminated, always ends with a '/'
+	i32 len;    // without the NUL
+} ScanJob;
+
+typedef struct {
+	SDL_Mutex *mutex;
+	ScanJob *jobs;
+	i32 head;
+	i32 tail;
+	i32 cap;
+} ScanDeque;
+
+typedef struct Scanner Scanner;
+
+typedef struct {
+	Scanner *scanner;
+	i32 idx;
+	SDL_Thread *thread;
+	ScanDeque deque;
+	CharList fullpath;
+	// Per-thread results. path.start is relative to this worker's names and is
+	// fixed up when merging.
+	CharList names;
+	MusicEntryList entries;
+	DirEntryList dirs;
+	i64 directories;
+	i64 skipped_loops;
+} ScanWorker;
+
+struct Scanner {
+	ScanWorker *workers;
+	i32 worker_count;
+	i32 name_offset;
+	// Number of directories that are queued or being scanned.  Zero means
+	// that the whole tree has been walked.
+	_Atomic i32 pending;
+	SDL_Mutex *visited_mutex;
+	InodeSet visited;
+};
+
+static u64 hash_u64x2(u64 a, u64 b){
+	u64 h = a * 0x9e3779b97f4a7c15ull ^ b;
+	h ^= h >> 32;
+	h *= 0xd6e8feb86659fd93ull;
+	h ^= h >> 32;
+	return h;
+}
+
+bool inode_set_insert(InodeSet *set, u64 dev, u64 ino){
+	if((set->count + 1) * 2 > set->cap){
+		InodeSet grown = {
+			.keys = calloc((size_t)MAX(set->cap * 2, 256) * 2, sizeof(u64)),
+			.count = 0,
+			.cap = MAX(set->cap * 2, 256),
+		};
+		for(i32 i = 0; i < set->cap; ++i){
+			u64 d = set->keys[2*i];
+			u64 n = set->keys[2*i+1];
+			if(d != 0 || n != 0)
+				inode_set_insert(&grown, d, n);
+		}
+		free(set->keys);
+		*set = grown;
+	}
+	// dev 0 ino 0 is our empty marker. that combination doesn't happen for a
+	// real directory, but make sure anyway.
+	if(dev == 0 && ino == 0)
+		ino = ~0ull;
+	u32 mask = (u32)set->cap - 1;
+	u32 i = (u32)hash_u64x2(dev, ino) & mask;
+	while(1){
+		u64 d = set->keys[2*i];
+		u64 n = set->keys[2*i+1];
+		if(d == 0 && n == 0){
+			set->keys[2*i] = dev;
+			set->keys[2*i+1] = ino;
+			set->count += 1;
+			return 1;
+		}
+		if(d == dev && n == ino)
+			return 0;
+		i = (i + 1) & mask;
+	}
+}
+
+static void deque_push(ScanDeque *q, ScanJob job){
+	SDL_LockMutex(q->mutex);
+	if(q->tail >= q->cap){
+		if(q->head > 0){
+			memmove(q->jobs, q->jobs + q->head, (q->tail - q->head) * sizeof(q->jobs[0]));
+			q->tail -= q->head;
+			q->head = 0;
+		}
+		if(q->tail >= q->cap){
+			q->cap = MAX(q->cap * 2, 64);
+			q->jobs = realloc(q->jobs, q->cap * sizeof(q->jobs[0]));
+		}
+	}
+	q->jobs[q->tail++] = job;
+	SDL_UnlockMutex(q->mutex);
+}
+
+static bool deque_pop_tail(ScanDeque *q, ScanJob *job){
+	bool ok = 0;
+	SDL_LockMutex(q->mutex);
+	if(q->tail > q->head){
+		*job = q->jobs[--q->tail];
+		ok = 1;
+	}
+	if(q->tail == q->head){
+		q->tail = 0;
+		q->head = 0;
+	}
+	SDL_UnlockMutex(q->mutex);
+	return ok;
+}
+
+static bool deque_steal_head(ScanDeque *q, ScanJob *job){
+	bool ok = 0;
+	// Don't wait behind the owner or another thief, just try the next victim.
+	if(!SDL_TryLockMutex(q->mutex))
+		return 0;
+	if(q->tail > q->head){
+		*job = q->jobs[q->head++];
+		ok = 1;
+	}
+	if(q->tail == q->head){
+		q->tail = 0;
+		q->head = 0;
+	}
+	SDL_UnlockMutex(q->mutex);
+	return ok;
+}
+
+static void scan_push_directory(ScanWorker *w, const char *dir, i32 dirlen, const char *name, i32 namelen){
+	ScanJob job;
+	job.len = dirlen + namelen + 1;
+	job.path = malloc(job.len + 1);
+	memcpy(job.path, dir, dirlen);
+	memcpy(job.path + dirlen, name, namelen);
+	job.path[job.len - 1] = '/';
+	job.path[job.len] = 0;
+	atomic_fetch_add_explicit(&w->scanner->pending, 1, memory_order_relaxed);
+	deque_push(&w->deque, job);
+}
+
+i64 file_mtime_us(const struct stat *st){
+	return (i64)st->st_mtim.tv_sec * 1000000 + st->st_mtim.tv_nsec / 1000;
+}
+
+bool stat_file(const char *path, i64 *mtime, i64 *size){
+	struct stat st;
+	if(stat(path, &st) != 0)
+		return 0;
+	*mtime = file_mtime_us(&st);
+	*size = (i64)st.st_size;
+	return 1;
+}
+
+static void scan_add_file(ScanWorker *w, i32 dir, const struct stat *st){
+	CharList *fullpath = &w->fullpath;
+	Sub ext = get_extension(fullpath);
+	if(ext.start < 0)
+		return;
+	i32 ext_id = get_extension_id(fullpath, ext, accepted_extensions, countof(accepted_extensions));
+	if(ext_id < 0)
+		return;
+	assert(ext_id < ExtIdCount);
+	MusicEntry music_entry;
+	music_entry.path.start = w->names.count;
+	music_entry.name_offset = w->scanner->name_offset;
+	music_entry.path.len = fullpath->count;
+	music_entry.ext = ext_id;
+	music_entry.mtime = file_mtime_us(st);
+	music_entry.size = st->st_size;
+	music_entry.dir = dir;
+	music_entry.flags = 0;
+	push_string(&w->names, fullpath->data, fullpath->count);
+	push_entry(&w->entries, &music_entry);
+}
+
+static void scan_directory(ScanWorker *w, ScanJob job){
+	Scanner *s = w->scanner;
+	int fd = open(job.path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd < 0)
+		return;
+	struct stat st;
+	if(fstat(fd, &st) != 0){
+		close(fd);
+		return;
+	}
+	// We follow symlinks to directories, so the same directory can show up
+	// more than once, or we could even walk in circles.
+	SDL_LockMutex(s->visited_mutex);
+	bool fresh = inode_set_insert(&s->visited, (u64)st.st_dev, (u64)st.st_ino);
+	SDL_UnlockMutex(s->visited_mutex);
+	if(!fresh){
+		w->skipped_loops += 1;
+		close(fd);
+		return;
+	}
+	DIR *dirp = fdopendir(fd);
+	if(dirp == NULL){
+		close(fd);
+		return;
+	}
+	w->directories += 1;
+	const i32 dir = w->dirs.count;
+	DirEntry dir_entry = {
+		.path = {w->names.count, job.len + 1},
+		.mtime = file_mtime_us(&st),
+		.dev = (u64)st.st_dev,
+		.ino = (u64)st.st_ino,
+	};
+	push_string(&w->names, job.path, job.len + 1);
+	push_dir(&w->dirs, &dir_entry);
+	CharList *fullpath = &w->fullpath;
+	fullpath->count = 0;
+	push_string(fullpath, job.path, job.len);
+	while(1){
+		struct dirent *de = readdir(dirp);
+		if(de == NULL)
+			break;
+		const char *name = de->d_name;
+		if(name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+			continue;
+		i32 namelen = strlen(name);
+		u8 type = de->d_type;
+		if(type == DT_DIR){
+			scan_push_directory(w, job.path, job.len, name, namelen);
+			continue;
+		}
+		if(type != DT_REG && type != DT_LNK && type != DT_UNKNOWN)
+			continue;
+		fullpath->count = job.len;
+		push_string(fullpath, name, namelen);
+		push_string(fullpath, "\0", 1);
+		// check the extension before we stat, most of the time that's enough
+		// to throw out non-music regular files.
+		if(type == DT_REG){
+			Sub ext = get_extension(fullpath);
+			if(ext.start < 0 || get_extension_id(fullpath, ext, accepted_extensions, countof(accepted_extensions)) < 0)
+				continue;
+		}
+		// follows symlinks
+		if(fstatat(dirfd(dirp), name, &st, 0) != 0)
+			continue;
+		if(S_ISDIR(st.st_mode)){
+			scan_push_directory(w, job.path, job.len, name, namelen);
+		} else if(S_ISREG(st.st_mode)){
+			scan_add_file(w, dir, &st);
+		}
+	}
+	closedir(dirp);
+}
+
+static int scan_worker_main(void *arg){
+	ScanWorker *w = arg;
+	Scanner *s = w->scanner;
+	i32 idle_rounds = 0;
+	while(1){
+		ScanJob job;
+		bool got = deque_pop_tail(&w->deque, &job);
+		for(i32 k = 1; !got && k < s->worker_count; ++k){
+			got = deque_steal_head(&s->workers[(w->idx + k) % s->worker_count].deque, &job);
+		}
+		if(got){
+			idle_rounds = 0;
+			scan_directory(w, job);
+			free(job.path);
+			atomic_fetch_sub_explicit(&s->pending, 1, memory_order_acq_rel);
+			continue;
+		}
+		if(atomic_load_explicit(&s->pending, memory_order_acquire) == 0)
+			break;
+		// Somebody is still reading a directory and might push more work.
+		idle_rounds += 1;
+		SDL_DelayNS(idle_rounds < 8 ? 0 : 50 * 1000);
+	}
+	return 0;
+}
+
+static void scanner_init(Scanner *s, i32 name_offset){
+	zerostruct(s);
+	s->worker_count = MIN(SDL_GetNumLogicalCPUCores(), 64);
+	if(s->worker_count < 1)
+		s->worker_count = 1;
+	s->name_offset = name_offset;
+	s->visited_mutex = SDL_CreateMutex();
+	s->workers = calloc(s->worker_count, sizeof(s->workers[0]));
+	for(i32 i = 0; i < s->worker_count; ++i){
+		ScanWorker *w = &s->workers[i];
+		w->scanner = s;
+		w->idx = i;
+		w->deque.mutex = SDL_CreateMutex();
+		w->fullpath = make_charlist();
+		w->names = make_charlist();
+		w->entries = make_entrylist();
+		w->dirs = make_dirlist();
+	}
+}
+
+// Walks everything that was pushed so far. Worker 0 runs on the calling thread.
+static void scanner_run(Scanner *s){
+	for(i32 i = 1; i < s->worker_count; ++i){
+		s->workers[i].thread = SDL_CreateThread(scan_worker_main, "scan", &s->workers[i]);
+	}
+	scan_worker_main(&s->workers[0]);
+	for(i32 i = 1; i < s->worker_count; ++i){
+		if(s->workers[i].thread)
+			SDL_WaitThread(s->workers[i].thread, NULL);
+		s->workers[i].thread = NULL;
+	}
+}
+
+// Appends the per-thread results to pl and frees the scanner.
+static void scanner_collect(Scanner *s, Playlist *pl, ScanStats *st){
+	st->thread_count = s->worker_count;
+	for(i32 i = 0; i < s->worker_count; ++i){
+		ScanWorker *w = &s->workers[i];
+		const i32 offset = pl->names.count;
+		const i32 dir_offset = pl->dirs.count;
+		push_string(&pl->names, w->names.data, w->names.count);
+		for(i32 j = 0; j < w->entries.count; ++j){
+			MusicEntry e = w->entries.data[j];
+			e.path.start += offset;
+			e.dir += dir_offset;
+			push_entry(&pl->entries, &e);
+		}
+		for(i32 j = 0; j < w->dirs.count; ++j){
+			DirEntry d = w->dirs.data[j];
+			d.path.start += offset;
+			push_dir(&pl->dirs, &d);
+		}
+		st->directories += w->directories;
+		st->skipped_loops += w->skipped_loops;
+		free(w->fullpath.data);
+		free(w->names.data);
+		free(w->entries.data);
+		free(w->dirs.data);
+		free(w->deque.jobs);
+		SDL_DestroyMutex(w->deque.mutex);
+	}
+	free(s->workers);
+	free(s->visited.keys);
+	SDL_DestroyMutex(s->visited_mutex);
+	zerostruct(s);
+}
+
+// Entries are sorted by path right after a scan, so the order is just 0..n-1.
+static void playlist_reset_order(Playlist *pl){
+	pl->order.count = 0;
+	for(i32 i = 0; i < pl->entries.count; ++i)
+		push_i32(&pl->order, i);
+}
+
+// Sorts the entries of a fresh scan by path, so that the order is 0..n-1.
+// Every path starts with the root, the sort can skip that part.
+static void playlist_sort_entries(Playlist *pl){
+	const i32 n = pl->entries.count;
+	playlist_reset_order(pl);
+	radix_sort_strings(pl->names.data, pl->entries.data, sizeof(MusicEntry), pl->order.data, n, pl->base_name.len);
+	MusicEntry *sorted = malloc(MAX(n, 1) * sizeof(MusicEntry));
+	for(i32 i = 0; i < n; ++i)
+		sorted[i] = pl->entries.data[pl->order.data[i]];
+	memcpy(pl->entries.data, sorted, n * sizeof(MusicEntry));
+	free(sorted);
+	playlist_reset_order(pl);
+}
+
+static Playlist make_empty_playlist(Slice directory){
+	Playlist pl = {};
+	pl.names = make_charlist();
+	pl.entries = make_entrylist();
+	pl.dirs = make_dirlist();
+	pl.order = make_i32list();
+	push_string(&pl.names, directory.str, directory.len);
+	assert(pl.names.count > 0);
+	if(pl.names.data[pl.names.count-1] != '/'){
+		push_string(&pl.names, "/", 1);
+	}
+	pl.base_name.start = 0;
+	pl.base_name.len = pl.names.count;
+	return pl;
+}
+
+Playlist make_playlist_from_directory(Slice directory, ScanStats *stats){
+	const u64 t0 = SDL_GetTicksNS();
+	Playlist pl = make_empty_playlist(directory);
+	const i32 baselen = pl.base_name.len;
+
+	Scanner s;
+	scanner_init(&s, baselen);
+	// scan_push_directory appends the '/' itself.
+	scan_push_directory(&s.workers[0], pl.names.data, baselen - 1, "", 0);
+	scanner_run(&s);
+	ScanStats st = {};
+	scanner_collect(&s, &pl, &st);
+
+	playlist_sort_entries(&pl);
+
+	st.files = pl.entries.count;
+	st.elapsed_ns = SDL_GetTicksNS() - t0;
+	if(stats)
+		*stats = st;
+	return pl;
+}
+
+// Rescans only the directories in old whose mtime changed or that went away.
+// Adding, removing or renaming something in a directory bumps its mtime, so
+// every other directory still has exactly the entries we know about.  Returns
+// 0 if nothing changed.  out is sorted from scratch, so its ids don't match
+// the ones in old.
+static bool rescan_changed_directories(const Playlist *old, Playlist *out, ScanStats *stats, _Atomic bool *cancel){
+	const u64 t0 = SDL_GetTicksNS();
+	u8 *changed = calloc(MAX(old->dirs.count, 1), 1);
+	i32 changed_count = 0;
+	for(i32 i = 0; i < old->dirs.count; ++i){
+		if(atomic_load_explicit(cancel, memory_order_relaxed)){
+			free(changed);
+			return 0;
+		}
+		const DirEntry *d = &old->dirs.data[i];
+		struct stat st;
+		if(stat(old->names.data + d->path.start, &st) != 0 || !S_ISDIR(st.st_mode)){
+			// gone. its parent changed as well and takes care of anything new.
+			changed[i] = 2;
+			changed_count += 1;
+		} else if(file_mtime_us(&st) != d->mtime || (u64)st.st_dev != d->dev || (u64)st.st_ino != d->ino){
+			changed[i] = 1;
+			changed_count += 1;
+		}
+	}
+	if(changed_count == 0){
+		free(changed);
+		return 0;
+	}
+
+	Slice root = {old->names.data + old->base_name.start, old->base_name.len};
+	Playlist pl = make_empty_playlist(root);
+	// keep everything we know from unchanged directories.
+	i32 *dir_remap = malloc(MAX(old->dirs.count, 1) * sizeof(i32));
+	for(i32 i = 0; i < old->dirs.count; ++i){
+		dir_remap[i] = -1;
+		if(changed[i])
+			continue;
+		DirEntry d = old->dirs.data[i];
+		dir_remap[i] = pl.dirs.count;
+		i32 start = pl.names.count;
+		push_string(&pl.names, old->names.data + d.path.start, d.path.len);
+		d.path.start = start;
+		push_dir(&pl.dirs, &d);
+	}
+	for(i32 i = 0; i < old->entries.count; ++i){
+		MusicEntry e = old->entries.data[i];
+		// entries the watcher added to a directory it didn't know have no
+		// dir, but their parent changed and gets rescanned anyway.
+		if((e.flags & EntryRemoved) || e.dir < 0 || dir_remap[e.dir] < 0)
+			continue;
+		i32 start = pl.names.count;
+		push_string(&pl.names, old->names.data + e.path.start, e.path.len);
+		e.path.start = start;
+		e.dir = dir_remap[e.dir];
+		push_entry(&pl.entries, &e);
+	}
+
+	Scanner s;
+	scanner_init(&s, pl.base_name.len);
+	// Unchanged directories are done. Marking them as visited also stops the
+	// walk from descending into them again from a changed parent.
+	for(i32 i = 0; i < old->dirs.count; ++i){
+		if(!changed[i])
+			inode_set_insert(&s.visited, old->dirs.data[i].dev, old->dirs.data[i].ino);
+	}
+	i32 next_worker = 0;
+	for(i32 i = 0; i < old->dirs.count; ++i){
+		if(changed[i] != 1)
+			continue;
+		const DirEntry *d = &old->dirs.data[i];
+		scan_push_directory(&s.workers[next_worker], old->names.data + d->path.start, d->path.len - 2, "", 0);
+		next_worker = (next_worker + 1) % s.worker_count;
+	}
+	scanner_run(&s);
+	ScanStats st = {};
+	scanner_collect(&s, &pl, &st);
+	free(dir_remap);
+	free(changed);
+
+	playlist_sort_entries(&pl);
+	st.files = pl.entries.count;
+	st.elapsed_ns = SDL_GetTicksNS() - t0;
+	if(stats)
+		*stats = st;
+	*out = pl;
+	return 1;
+}
+
+// Returns the first row in pl->order whose path is not less than path.
+static i32 playlist_lower_bound(const Playlist *pl, const char *path, i32 len){
+	i32 lo = 0;
+	i32 hi = pl->order.count;
+	while(lo < hi){
+		i32 mid = lo + (hi - lo) / 2;
+		const Sub *p = &pl->entries.data[pl->order.data[mid]].path;
+		i32 d = memcmp(pl->names.data + p->start, path, MIN(p->len, len));
+		if(d == 0)
+			d = p->len < len ? -1 : (p->len > len ? 1 : 0);
+		if(d < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+i32 playlist_row_of(const Playlist *pl, i32 id, bool *exact){
+	const Sub p = pl->entries.data[id].path;
+	i32 row = playlist_lower_bound(pl, pl->names.data + p.start, p.len);
+	// paths are unique among the entries in order, so there is no need to
+	// walk over equal neighbours.
+	if(exact)
+		*exact = row < pl->order.count && pl->order.data[row] == id;
+	return row;
+}
+
+//# path index
+//
+// Open addressing with linear probing from a path to an entry or directory
+// index.  Keys aren't stored in the table, only the hash and the index.  The
+// path itself lives in the names blob, so comparing a key means a second
+// lookup, but that's only needed when the hashes match.  Indexed paths end in
+// a NUL, which is not part of the key.
+
+enum { PathSlotEmpty = -1, PathSlotDeleted = -2 };
+
+u32 hash_path(const char *s, i32 len){
+	u64 h = 0xcbf29ce484222325ull;
+	for(i32 i = 0; i < len; ++i){
+		h ^= (u8)s[i];
+		h *= 0x100000001b3ull;
+	}
+	return (u32)(h ^ (h >> 32));
+}
+
+static const Sub *path_index_key(const void *items, size_t stride, i32 id){
+	// MusicEntry and DirEntry both start with their path.
+	return (const Sub*)((const u8*)items + stride * (size_t)id);
+}
+
+static i32 path_index_find(const PathIndex *idx, const char *names, const void *items, size_t stride, const char *path, i32 len){
+	if(idx->cap == 0)
+		return -1;
+	const u32 h = hash_path(path, len);
+	const u32 mask = (u32)idx->cap - 1;
+	for(u32 i = h & mask;; i = (i + 1) & mask){
+		const PathSlot *slot = &idx->slots[i];
+		if(slot->id == PathSlotEmpty)
+			return -1;
+		if(slot->id >= 0 && slot->hash == h){
+			const Sub *k = path_index_key(items, stride, slot->id);
+			if(k->len - 1 == len && memeq(names + k->start, path, len))
+				return slot->id;
+		}
+	}
+}
+
+static void path_index_insert_hashed(PathIndex *idx, u32 h, i32 id){
+	const u32 mask = (u32)idx->cap - 1;
+	u32 i = h & mask;
+	while(idx->slots[i].id >= 0)
+		i = (i + 1) & mask;
+	if(idx->slots[i].id == PathSlotEmpty)
+		idx->used += 1;
+	idx->slots[i] = (PathSlot){h, id};
+	idx->count += 1;
+}
+
+static void path_index_rebuild(PathIndex *idx, i32 cap){
+	PathSlot *old = idx->slots;
+	i32 old_cap = idx->cap;
+	idx->slots = malloc(cap * sizeof(idx->slots[0]));
+	for(i32 i = 0; i < cap; ++i)
+		idx->slots[i] = (PathSlot){0, PathSlotEmpty};
+	idx->cap = cap;
+	idx->count = 0;
+	idx->used = 0;
+	for(i32 i = 0; i < old_cap; ++i){
+		if(old[i].id >= 0)
+			path_index_insert_hashed(idx, old[i].hash, old[i].id);
+	}
+	free(old);
+}
+
+static void path_index_insert(PathIndex *idx, const char *names, const void *items, size_t stride, i32 id){
+	// keep the load, including tombstones, below 1/2.
+	if((idx->used + 1) * 2 > idx->cap){
+		i32 cap = MAX(idx->cap, 1024);
+		while((idx->count + 1) * 4 > cap)
+			cap *= 2;
+		path_index_rebuild(idx, cap);
+	}
+	const Sub *k = path_index_key(items, stride, id);
+	path_index_insert_hashed(idx, hash_path(names + k->start, k->len - 1), id);
+}
+
+static void path_index_remove(PathIndex *idx, const char *names, const void *items, size_t stride, i32 id){
+	if(idx->cap == 0)
+		return;
+	const Sub *k = path_index_key(items, stride, id);
+	const u32 h = hash_path(names + k->start, k->len - 1);
+	const u32 mask = (u32)idx->cap - 1;
+	for(u32 i = h & mask;; i = (i + 1) & mask){
+		PathSlot *slot = &idx->slots[i];
+		if(slot->id == PathSlotEmpty)
+			return;
+		if(slot->id == id){
+			slot->id = PathSlotDeleted;
+			idx->count -= 1;
+			return;
+		}
+	}
+}
+
+i32 playlist_find_path(const Playlist *pl, const char *path, i32 len){
+	if(pl->entry_index.cap > 0)
+		return path_index_find(&pl->entry_index, pl->names.data, pl->entries.data, sizeof(MusicEntry), path, len - 1);
+	i32 row = playlist_lower_bound(pl, path, len);
+	if(row >= pl->order.count)
+		return -1;
+	i32 id = pl->order.data[row];
+	const Sub p = pl->entries.data[id].path;
+	return (p.len == len && memeq(pl->names.data + p.start, path, len)) ? id : -1;
+}
+
+static void *copy_array(const void *data, i32 count, i32 *cap, size_t size){
+	*cap = MAX(count + count / 8, 64);
+	void *res = malloc(*cap * size);
+	memcpy(res, data, count * size);
+	return res;
+}
+
+void playlist_make_owned(Playlist *pl){
+	if(pl->mapping){
+		pl->names.data = copy_array(pl->names.data, pl->names.count, &pl->names.cap, sizeof(char));
+		pl->entries.data = copy_array(pl->entries.data, pl->entries.count, &pl->entries.cap, sizeof(MusicEntry));
+		pl->dirs.data = copy_array(pl->dirs.data, pl->dirs.count, &pl->dirs.cap, sizeof(DirEntry));
+		pl->order.data = copy_array(pl->order.data, pl->order.count, &pl->order.cap, sizeof(i32));
+		munmap(pl->mapping, pl->mapping_size);
+		pl->mapping = NULL;
+		pl->mapping_size = 0;
+	}
+	if(pl->entry_index.cap == 0){
+		path_index_rebuild(&pl->entry_index, 1024);
+		for(i32 i = 0; i < pl->entries.count; ++i){
+			if(!(pl->entries.data[i].flags & EntryRemoved))
+				path_index_insert(&pl->entry_index, pl->names.data, pl->entries.data, sizeof(MusicEntry), i);
+		}
+	}
+	if(pl->dir_index.cap == 0){
+		path_index_rebuild(&pl->dir_index, 1024);
+		for(i32 i = 0; i < pl->dirs.count; ++i)
+			path_index_insert(&pl->dir_index, pl->names.data, pl->dirs.data, sizeof(DirEntry), i);
+	}
+}
+
+//# applying watcher deltas
+
+static void insert_i32(I32List *l, i32 at, i32 x){
+	push_i32(l, x);
+	memmove(l->data + at + 1, l->data + at, (l->count - 1 - at) * sizeof(l->data[0]));
+	l->data[at] = x;
+}
+
+static void remove_i32(I32List *l, i32 at){
+	memmove(l->data + at, l->data + at + 1, (l->count - 1 - at) * sizeof(l->data[0]));
+	l->count -= 1;
+}
+
+static void push_change(PlaylistChanges *c, PlaylistChangeKind kind, i32 id, i32 row){
+	if(c->count >= c->cap){
+		c->cap = MAX(c->cap * 2, 64);
+		c->data = realloc(c->data, c->cap * sizeof(c->data[0]));
+	}
+	c->data[c->count++] = (PlaylistChange){kind, id, row};
+}
+
+static void playlist_unlink_entry(Playlist *pl, i32 id, PlaylistChanges *changes){
+	bool exact;
+	i32 row = playlist_row_of(pl, id, &exact);
+	assert(exact);
+	remove_i32(&pl->order, row);
+	path_index_remove(&pl->entry_index, pl->names.data, pl->entries.data, sizeof(MusicEntry), id);
+	push_change(changes, ChangeRemove, id, row);
+}
+
+static void playlist_link_entry(Playlist *pl, i32 id, PlaylistChanges *changes){
+	const Sub p = pl->entries.data[id].path;
+	i32 row = playlist_lower_bound(pl, pl->names.data + p.start, p.len);
+	insert_i32(&pl->order, row, id);
+	path_index_insert(&pl->entry_index, pl->names.data, pl->entries.data, sizeof(MusicEntry), id);
+	push_change(changes, ChangeInsert, id, row);
+}
+
+static i32 parent_dir_of(const Playlist *pl, const char *path, i32 len){
+	i32 slash = len - 1;
+	while(slash >= 0 && path[slash] != '/')
+		--slash;
+	if(slash < 0)
+		return -1;
+	return path_index_find(&pl->dir_index, pl->names.data, pl->dirs.data, sizeof(DirEntry), path, slash + 1);
+}
+
+static void playlist_add_file(Playlist *pl, const LibraryDelta *d, const char *path, i32 len, PlaylistChanges *changes){
+	i32 id = playlist_find_path(pl, path, len);
+	if(id >= 0){
+		pl->entries.data[id].mtime = d->mtime;
+		pl->entries.data[id].size = d->size;
+		return;
+	}
+	MusicEntry e = {
+		.path = {pl->names.count, len},
+		.name_offset = pl->base_name.len,
+		.ext = d->ext,
+		.mtime = d->mtime,
+		.size = d->size,
+		.dir = parent_dir_of(pl, path, len - 1),
+	};
+	push_string(&pl->names, path, len);
+	push_entry(&pl->entries, &e);
+	playlist_link_entry(pl, pl->entries.count - 1, changes);
+}
+
+static void playlist_remove_file(Playlist *pl, i32 id, PlaylistChanges *changes){
+	playlist_unlink_entry(pl, id, changes);
+	pl->entries.data[id].flags |= EntryRemoved;
+}
+
+bool playlist_apply_deltas(Playlist *pl, const LibraryDeltas *deltas, PlaylistChanges *changes){
+	bool overflow = 0;
+	changes->count = 0;
+	if(deltas->count == 0)
+		return 0;
+	playlist_make_owned(pl);
+	pl->dirty = 1;
+	for(i32 k = 0; k < deltas->count; ++k){
+		const LibraryDelta *d = &deltas->data[k];
+		const char *path = deltas->names.data + d->path.start;
+		const i32 len = d->path.len;
+		switch(d->kind){
+		case DeltaAddFile:
+			playlist_add_file(pl, d, path, len, changes);
+			break;
+		case DeltaRemoveFile: {
+			i32 id = playlist_find_path(pl, path, len);
+			if(id >= 0)
+				playlist_remove_file(pl, id, changes);
+		} break;
+		case DeltaRename: {
+			const char *to = deltas->names.data + d->new_path.start;
+			const i32 to_len = d->new_path.len;
+			i32 id = playlist_find_path(pl, path, len);
+			if(id < 0){
+				playlist_add_file(pl, d, to, to_len, changes);
+				break;
+			}
+			// renaming over an existing file replaces it.
+			i32 replaced = playlist_find_path(pl, to, to_len);
+			if(replaced >= 0)
+				playlist_remove_file(pl, replaced, changes);
+			// Same entry, new path, so anything that refers to the entry
+			// (history, the playing track) stays valid.
+			playlist_unlink_entry(pl, id, changes);
+			MusicEntry *e = &pl->entries.data[id];
+			e->path = (Sub){pl->names.count, to_len};
+			e->mtime = d->mtime;
+			e->size = d->size;
+			e->ext = d->ext;
+			e->dir = parent_dir_of(pl, to, to_len - 1);
+			push_string(&pl->names, to, to_len);
+			playlist_link_entry(pl, id, changes);
+		} break;
+		case DeltaAddDir: {
+			i32 dir = path_index_find(&pl->dir_index, pl->names.data, pl->dirs.data, sizeof(DirEntry), path, len - 1);
+			if(dir >= 0){
+				pl->dirs.data[dir].mtime = d->mtime;
+				pl->dirs.data[dir].dev = d->dev;
+				pl->dirs.data[dir].ino = d->ino;
+			} else {
+				DirEntry de = {.path = {pl->names.count, len}, .mtime = d->mtime, .dev = d->dev, .ino = d->ino};
+				push_string(&pl->names, path, len);
+				push_dir(&pl->dirs, &de);
+				path_index_insert(&pl->dir_index, pl->names.data, pl->dirs.data, sizeof(DirEntry), pl->dirs.count - 1);
+			}
+		} break;
+		case DeltaRemoveDir: {
+			// everything below a directory is one contiguous run of rows.
+			const i32 prefix = len - 1;
+			while(1){
+				i32 row = playlist_lower_bound(pl, path, prefix);
+				if(row >= pl->order.count)
+					break;
+				i32 id = pl->order.data[row];
+				const Sub p = pl->entries.data[id].path;
+				if(p.len < prefix || !memeq(pl->names.data + p.start, path, prefix))
+					break;
+				playlist_remove_file(pl, id, changes);
+			}
+			for(i32 i = 0; i < pl->dirs.count; ++i){
+				const Sub p = pl->dirs.data[i].path;
+				if(p.len >= prefix && memeq(pl->names.data + p.start, path, prefix))
+					path_index_remove(&pl->dir_index, pl->names.data, pl->dirs.data, sizeof(DirEntry), i);
+			}
+		} break;
+		case DeltaOverflow:
+			overflow = 1;
+			break;
+		}
+	}
+	return overflow;
+}
+
+void print_scan_stats(const ScanStats *st){
+	f32 secs = (f32)st->elapsed_ns / 1e9f;
+	f32 rate = secs > 0.0f ? (f32)(st->files + st->directories) / secs : 0.0f;
+	eprintln("scanned ", st->files, " files in ", st->directories, " directories with ", st->thread_count, " threads in ", (u64)(st->elapsed_ns / 1000000), " ms (", rate, " entries/s, ", st->skipped_loops, " directories skipped as already visited)");
+}
+
+void print_playlist(const Playlist *pl){
+	for(i32 i = 0; i < pl->entries.count; ++i){
+		Slice tmp = {pl->names.data + pl->entries.data[i].path.start, pl->entries.data[i].path.len};
+		println(tmp);
+	}
+}
+
+void free_playlist(Playlist *pl){
+	if(pl->mapping){
+		munmap(pl->mapping, pl->mapping_size);
+	} else {
+		free(pl->entries.data);
+		free(pl->names.data);
+		free(pl->dirs.data);
+		free(pl->order.data);
+	}
+	free(pl->entry_index.slots);
+	free(pl->dir_index.slots);
+	zerostruct(pl);
+}
+
+//# library index
+//
+// A snapshot of a Playlist as it is laid out in memory: the names blob, the
+// sorted entries and the scanned directories.  At startup we map it and point
+// the playlist straight at the mapping, so loading costs the same no matter
+// how big the library is.  Entries keep their ids, removed ones included, and
+// the order is stored as well, so indices in a saved index mean the same as
+// they did in the playlist that was saved.  Bump the version whenever the
+// layout of the header, MusicEntry or DirEntry changes.
+//
+// Loading only checks the header, looking at every entry would cost as much
+// as the library is big. The rest gets checked on the refresh thread, against
+// a checksum from when the index was saved. If it's off, the refresh scans
+// everything again.
+
+#define LIBRARY_INDEX_VERSION 3
+
+typedef struct {
+	char magic[8];
+	u32 version;
+	u32 entry_size;
+	u32 dir_size;
+	i32 base_name_len;
+	i32 names_count;
+	i32 entry_count;
+	i32 dir_count;
+	i32 order_count;
+	u64 names_offset;
+	u64 entries_offset;
+	u64 dirs_offset;
+	u64 order_offset;
+	u64 file_size;
+	u64 checksum; // of the names, entries, dirs and order, see index_checksum
+} LibraryIndexHeader;
+
+static const char library_index_magic[8] = "mosidx\0";
+
+bool cache_file_path(const char *name, CharList *out){
+	out->count = 0;
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	if(xdg && xdg[0]){
+		push_string(out, xdg, strlen(xdg));
+	} else if(home && home[0]){
+		push_string(out, home, strlen(home));
+		push_string(out, "/.cache", 7);
+	} else {
+		return 0;
+	}
+	push_string(out, "\0", 1);
+	mkdir(out->data, 0755);
+	out->count -= 1;
+	push_string(out, "/mos", 4);
+	push_string(out, "\0", 1);
+	mkdir(out->data, 0755);
+	out->count -= 1;
+	push_string(out, "/", 1);
+	push_string(out, name, strlen(name));
+	push_string(out, "\0", 1);
+	return 1;
+}
+
+static bool write_padded(FILE *f, const void *data, size_t n, u64 *offset){
+	static const u8 zeros[64] = {};
+	u64 pad = alignpower2(*offset, 64) - *offset;
+	if(pad && fwrite(zeros, 1, pad, f) != pad)
+		return 0;
+	*offset += pad;
+	if(n && fwrite(data, 1, n, f) != n)
+		return 0;
+	*offset += n;
+	return 1;
+}
+
+// Not much of a hash, only there to notice a garbled file.
+static u64 checksum_bytes(u64 h, const void *data, u64 n){
+	const u8 *p = data;
+	for(; n >= 8; p += 8, n -= 8){
+		u64 w;
+		memcpy(&w, p, 8);
+		h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+		h ^= h >> 29;
+	}
+	u64 w = 0;
+	memcpy(&w, p, n);
+	return hash_u64x2(h ^ w, n);
+}
+
+static u64 index_checksum(const char *names, i32 names_count, const MusicEntry *entries, i32 entry_count, const DirEntry *dirs, i32 dir_count, const i32 *order, i32 order_count){
+	u64 h = checksum_bytes(0, names, (u64)names_count);
+	h = checksum_bytes(h, entries, (u64)entry_count * sizeof(MusicEntry));
+	h = checksum_bytes(h, dirs, (u64)dir_count * sizeof(DirEntry));
+	return checksum_bytes(h, order, (u64)order_count * sizeof(i32));
+}
+
+bool library_index_save(const Playlist *pl){
+	CharList path = make_charlist();
+	CharList tmp = make_charlist();
+	bool ok = cache_file_path("library.idx", &path);
+	if(ok){
+		push_string(&tmp, path.data, path.count - 1);
+		push_string(&tmp, ".tmp", 5);
+	}
+	FILE *f = ok ? fopen(tmp.data, "wb") : NULL;
+	if(f){
+		LibraryIndexHeader h = {};
+		memcpy(h.magic, library_index_magic, sizeof(h.magic));
+		h.version = LIBRARY_INDEX_VERSION;
+		h.entry_size = sizeof(MusicEntry);
+		h.dir_size = sizeof(DirEntry);
+		h.base_name_len = pl->base_name.len;
+		h.names_count = pl->names.count;
+		h.entry_count = pl->entries.count;
+		h.dir_count = pl->dirs.count;
+		h.order_count = pl->order.count;
+		h.names_offset = alignpower2(sizeof(h), 64);
+		h.entries_offset = alignpower2(h.names_offset + (u64)h.names_count, 64);
+		h.dirs_offset = alignpower2(h.entries_offset + (u64)h.entry_count * sizeof(MusicEntry), 64);
+		h.order_offset = alignpower2(h.dirs_offset + (u64)h.dir_count * sizeof(DirEntry), 64);
+		h.file_size = h.order_offset + (u64)h.order_count * sizeof(i32);
+		h.checksum = index_checksum(pl->names.data, pl->names.count, pl->entries.data, pl->entries.count, pl->dirs.data, pl->dirs.count, pl->order.data, pl->order.count);
+		assert(pl->base_name.start == 0);
+		u64 offset = 0;
+		ok = write_padded(f, &h, sizeof(h), &offset)
+			&& write_padded(f, pl->names.data, pl->names.count, &offset)
+			&& write_padded(f, pl->entries.data, pl->entries.count * sizeof(MusicEntry), &offset)
+			&& write_padded(f, pl->dirs.data, pl->dirs.count * sizeof(DirEntry), &offset)
+			&& write_padded(f, pl->order.data, pl->order.count * sizeof(i32), &offset);
+		assert(!ok || offset == h.file_size);
+		ok = (fclose(f) == 0) && ok;
+		// rename is atomic, so a reader either sees the old index or the new
+		// one. a mapping of the old one stays valid.
+		ok = ok && rename(tmp.data, path.data) == 0;
+		if(!ok)
+			unlink(tmp.data);
+	} else {
+		ok = 0;
+	}
+	if(!ok)
+		eprintln("failed to write library index");
+	free(path.data);
+	free(tmp.data);
+	return ok;
+}
+
+static bool sub_in_range(Sub s, i32 size){
+	return s.start >= 0 && s.len >= 0 && (i64)s.start + s.len <= size;
+}
+
+// The header only says where things are. Everything that points somewhere
+// else gets followed without checks later, so a file that's garbled has to be
+// caught before the playlist is handed out. Only the checksum waits for the
+// refresh thread, this is a quick look at every entry.
+static bool library_index_valid(const LibraryIndexHeader *h, const u8 *base){
+	const char *names = (const char*)(base + h->names_offset);
+	const MusicEntry *entries = (const MusicEntry*)(base + h->entries_offset);
+	const DirEntry *dirs = (const DirEntry*)(base + h->dirs_offset);
+	const i32 *order = (const i32*)(base + h->order_offset);
+	for(i32 i = 0; i < h->entry_count; ++i){
+		const MusicEntry *e = &entries[i];
+		if(!sub_in_range(e->path, h->names_count) || e->path.len < 1 || names[e->path.start + e->path.len - 1] != 0)
+			return 0;
+		if(e->name_offset < 0 || e->name_offset >= e->path.len || (u32)e->ext >= ExtIdCount || e->dir < -1 || e->dir >= h->dir_count)
+			return 0;
+	}
+	for(i32 i = 0; i < h->dir_count; ++i){
+		const DirEntry *d = &dirs[i];
+		if(!sub_in_range(d->path, h->names_count) || d->path.len < 1 || names[d->path.start + d->path.len - 1] != 0)
+			return 0;
+	}
+	for(i32 i = 0; i < h->order_count; ++i){
+		if(order[i] < 0 || order[i] >= h->entry_count)
+			return 0;
+	}
+	return 1;
+}
+
+// For a playlist that points into a loaded index, which library_index_valid
+// already looked at. The mapping is private and nothing writes to it until
+// playlist_make_owned, which doesn't happen while a refresh runs.
+static bool library_index_intact(const Playlist *pl){
+	const LibraryIndexHeader *h = pl->mapping;
+	const u8 *base = pl->mapping;
+	const u64 sum = index_checksum((const char*)(base + h->names_offset), h->names_count,
+		(const MusicEntry*)(base + h->entries_offset), h->entry_count,
+		(const DirEntry*)(base + h->dirs_offset), h->dir_count,
+		(const i32*)(base + h->order_offset), h->order_count);
+	return sum == h->checksum;
+}
+
+bool library_index_load(Slice directory, Playlist *out){
+	CharList path = make_charlist();
+	bool ok = cache_file_path("library.idx", &path);
+	int fd = ok ? open(path.data, O_RDONLY | O_CLOEXEC) : -1;
+	free(path.data);
+	if(fd < 0)
+		return 0;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(LibraryIndexHeader)){
+		close(fd);
+		return 0;
+	}
+	// private and writable, so that the playlist can be treated like any other
+	// while the file itself never changes under somebody else's mapping.
+	size_t size = (size_t)st.st_size;
+	u8 *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED)
+		return 0;
+	const LibraryIndexHeader *h = (const LibraryIndexHeader*)base;
+	ok = memeq(h->magic, library_index_magic, sizeof(h->magic))
+		&& h->version == LIBRARY_INDEX_VERSION
+		&& h->entry_size == sizeof(MusicEntry)
+		&& h->dir_size == sizeof(DirEntry)
+		&& h->file_size == size
+		&& h->base_name_len >= 0 && h->names_count >= 0 && h->entry_count >= 0 && h->dir_count >= 0 && h->order_count >= 0
+		&& h->entries_offset % _Alignof(MusicEntry) == 0
+		&& h->dirs_offset % _Alignof(DirEntry) == 0
+		&& h->order_offset % _Alignof(i32) == 0
+		&& h->names_offset <= size && h->names_offset + (u64)h->names_count <= size
+		&& h->entries_offset <= size && h->entries_offset + (u64)h->entry_count * sizeof(MusicEntry) <= size
+		&& h->dirs_offset <= size && h->dirs_offset + (u64)h->dir_count * sizeof(DirEntry) <= size
+		&& h->order_offset <= size && h->order_offset + (u64)h->order_count * sizeof(i32) <= size
+		&& h->order_count <= h->entry_count
+		&& h->base_name_len <= h->names_count;
+	// the index is only good for the directory it was made from.
+	if(ok){
+		i32 len = directory.len;
+		const char *names = (const char*)(base + h->names_offset);
+		bool slash = len > 0 && directory.str[len-1] == '/';
+		ok = h->base_name_len == len + !slash
+			&& memeq(names, directory.str, len)
+			&& names[h->base_name_len-1] == '/';
+	}
+	ok = ok && library_index_valid(h, base);
+	if(!ok){
+		munmap(base, size);
+		return 0;
+	}
+	Playlist pl = {};
+	pl.base_name = (Sub){0, h->base_name_len};
+	pl.names = (CharList){(char*)(base + h->names_offset), h->names_count, h->names_count};
+	pl.entries = (MusicEntryList){(MusicEntry*)(base + h->entries_offset), h->entry_count, h->entry_count};
+	pl.dirs = (DirEntryList){(DirEntry*)(base + h->dirs_offset), h->dir_count, h->dir_count};
+	pl.order = (I32List){(i32*)(base + h->order_offset), h->order_count, h->order_count};
+	pl.mapping = base;
+	pl.mapping_size = size;
+	*out = pl;
+	return 1;
+}
+
+//# background refresh of a loaded index
+
+struct LibraryRefresh {
+	SDL_Thread *thread;
+	const Playlist *old;
+	Playlist result;
+	bool changed;
+	_Atomic bool done;
+	_Atomic bool cancel;
+	ScanStats stats;
+};
+
+static int library_refresh_main(void *arg){
+	LibraryRefresh *r = arg;
+	const Playlist *old = r->old;
+	if(old->mapping && !library_index_intact(old)){
+		eprintln("library index is damaged, scanning the whole library");
+		const Slice root = {old->names.data + old->base_name.start, old->base_name.len};
+		r->result = make_playlist_from_directory(root, &r->stats);
+		r->changed = 1;
+	} else {
+		r->changed = rescan_changed_directories(old, &r->result, &r->stats, &r->cancel);
+	}
+	if(r->changed)
+		library_index_save(&r->result);
+	atomic_store_explicit(&r->done, 1, memory_order_release);
+	return 0;
+}
+
+LibraryRefresh *library_refresh_start(const Playlist *pl){
+	LibraryRefresh *r = calloc(1, sizeof(*r));
+	r->old = pl;
+	r->thread = SDL_CreateThread(library_refresh_main, "library refresh", r);
+	if(r->thread == NULL){
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+bool library_refresh_poll(LibraryRefresh **pr, Playlist *out){
+	LibraryRefresh *r = *pr;
+	if(r == NULL || !atomic_load_explicit(&r->done, memory_order_acquire))
+		return 0;
+	SDL_WaitThread(r->thread, NULL);
+	bool changed = r->changed;
+	if(changed){
+		print_scan_stats(&r->stats);
+		*out = r->result;
+	}
+	free(r);
+	*pr = NULL;
+	return changed;
+}
+
+void library_refresh_cancel(LibraryRefresh **pr){
+	LibraryRefresh *r = *pr;
+	if(r == NULL)
+		return;
+	atomic_store_explicit(&r->cancel, 1, memory_order_relaxed);
+	SDL_WaitThread(r->thread, NULL);
+	if(r->changed)
+		free_playlist(&r->result);
+	free(r);
+	*pr = NULL;
+}
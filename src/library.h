@@ -0,0 +1,237 @@
+#pragma once
+
+#include "def.h"
+
+typedef struct {
+	i32 start;
+	i32 len;
+} Sub;
+
+#define extensions_def\
+	X(wav)\
+	X(mp3)\
+	X(opus)\
+	X(ogg)\
+	X(m4a)\
+
+#if 0
+	X(xm)\
+	X(mod)\
+	X(it)
+#endif
+
+typedef enum ExtensionId {
+#define X(A) ext_##A,
+	extensions_def
+#undef X
+	ExtIdCount,
+} ExtensionId;
+
+typedef struct {
+	Sub path;
+	i32 name_offset;
+	ExtensionId ext;
+	i64 mtime; // see file_mtime_us
+	i64 size;
+	i32 dir; // index into Playlist.dirs, -1 if unknown
+	u32 flags;
+} MusicEntry;
+
+struct stat;
+
+// An mtime in microseconds, the unit MusicEntry, DirEntry and every cache
+// that checks whether a file changed keep it in. The same as
+// AVIODirEntry.modification_timestamp, which the scanner used before.
+i64 file_mtime_us(const struct stat *st);
+// The mtime and size of the file at path, following symlinks. 0 if there's
+// no such file.
+bool stat_file(const char *path, i64 *mtime, i64 *size);
+
+enum {
+	// The file is gone. The entry stays around with its path, so that its id
+	// and name stay valid for whoever still refers to it.
+	EntryRemoved = 1,
+};
+
+typedef struct {
+	Sub path; // ends with '/' and a NUL
+	i64 mtime;
+	u64 dev;
+	u64 ino;
+} DirEntry;
+
+typedef struct {
+	char *data;
+	i32 count;
+	i32 cap;
+} CharList;
+
+typedef struct {
+	i32 *data;
+	i32 count;
+	i32 cap;
+} I32List;
+
+typedef struct {
+	MusicEntry *data;
+	i32 count;
+	i32 cap;
+} MusicEntryList;
+
+typedef struct {
+	DirEntry *data;
+	i32 count;
+	i32 cap;
+} DirEntryList;
+
+typedef struct {
+	u32 hash;
+	i32 id;
+} PathSlot;
+
+typedef struct {
+	PathSlot *slots;
+	i32 count;
+	i32 used;
+	i32 cap;
+} PathIndex;
+
+// Entry ids are indices into entries.  Deltas don't change them, removed
+// entries keep theirs and get EntryRemoved.  A refresh builds a whole new
+// playlist with ids of its own, so anything that holds ids has to look them
+// up again by path when it gets swapped in.  order holds the ids of the
+// entries that exist right now, sorted by path.
+typedef struct {
+	Sub base_name;
+	MusicEntryList entries;
+	CharList names;
+	DirEntryList dirs;
+	I32List order;
+	// path -> index into entries and dirs. only built by playlist_make_owned.
+	PathIndex entry_index;
+	PathIndex dir_index;
+	bool dirty;
+	// Set if entries, names and dirs point into a mapped library index
+	// instead of separate heap allocations. Such a playlist must not grow.
+	void *mapping;
+	size_t mapping_size;
+} Playlist;
+
+typedef struct LibraryRefresh LibraryRefresh;
+typedef struct LibraryWatch LibraryWatch;
+
+typedef enum {
+	DeltaAddFile,
+	DeltaRemoveFile,
+	DeltaRename,
+	DeltaAddDir,
+	DeltaRemoveDir,
+	// the kernel dropped events. everything could have changed.
+	DeltaOverflow,
+} LibraryDeltaKind;
+
+typedef struct {
+	LibraryDeltaKind kind;
+	ExtensionId ext;
+	Sub path;     // into LibraryDeltas.names, NUL-terminated. directories end with '/'
+	Sub new_path; // renames only
+	i64 mtime;
+	i64 size;
+	u64 dev;
+	u64 ino;
+} LibraryDelta;
+
+typedef struct {
+	LibraryDelta *data;
+	i32 count;
+	i32 cap;
+	CharList names;
+} LibraryDeltas;
+
+typedef enum {
+	ChangeInsert,
+	ChangeRemove,
+} PlaylistChangeKind;
+
+// What happened to pl->order, in the order it happened.
+typedef struct {
+	PlaylistChangeKind kind;
+	i32 id;
+	i32 row;
+} PlaylistChange;
+
+typedef struct {
+	PlaylistChange *data;
+	i32 count;
+	i32 cap;
+} PlaylistChanges;
+
+// Directories by dev and ino, to not walk one twice when symlinks lead to
+// it again.
+typedef struct {
+	u64 *keys; // dev and ino, two u64 per slot. zero dev and ino means empty.
+	i32 count;
+	i32 cap;
+} InodeSet;
+
+typedef struct {
+	i32 thread_count;
+	i64 files;
+	i64 directories;
+	i64 skipped_loops;
+	u64 elapsed_ns;
+} ScanStats;
+
+void push_string(CharList *l, const char *str, i32 len);
+void delete_chars(CharList *l, i32 at, i32 n);
+void insert_string(CharList *l, i32 at, const char *str, i32 len);
+void push_entry(MusicEntryList *l, const MusicEntry *entry);
+void push_i32(I32List *l, i32 x);
+void push_dir(DirEntryList *l, const DirEntry *dir);
+CharList make_charlist(void);
+I32List make_i32list(void);
+MusicEntryList make_entrylist(void);
+DirEntryList make_dirlist(void);
+
+int compare_sub(void *arg, const void *pa, const void *pb);
+
+Playlist make_playlist_from_directory(Slice directory, ScanStats *stats);
+void print_scan_stats(const ScanStats *stats);
+void print_playlist(const Playlist *pl);
+void free_playlist(Playlist *pl);
+// FNV-1a, the hash the path indices use.
+u32 hash_path(const char *s, i32 len);
+// path and len include the NUL, like MusicEntry.path. returns an entry id or -1.
+i32 playlist_find_path(const Playlist *pl, const char *path, i32 len);
+// Row of the entry in pl->order. If it isn't in there, this is the row it
+// would go to, i.e. the row of the entry that follows it.
+i32 playlist_row_of(const Playlist *pl, i32 id, bool *exact);
+i32 path_extension_id(const CharList *fullpath);
+// Returns 1 if the inode was not in the set yet. Starts out zero, free keys.
+bool inode_set_insert(InodeSet *set, u64 dev, u64 ino);
+// Copies a mapped playlist to the heap and builds the path indices.
+void playlist_make_owned(Playlist *pl);
+// Returns 1 if the deltas are incomplete and the library needs a rescan.
+bool playlist_apply_deltas(Playlist *pl, const LibraryDeltas *deltas, PlaylistChanges *changes);
+
+bool cache_file_path(const char *name, CharList *out);
+bool library_index_save(const Playlist *pl);
+bool library_index_load(Slice directory, Playlist *out);
+
+// Checks the directories of a loaded index on a background thread and
+// rescans the ones that changed. pl has to stay alive and unchanged until
+// poll returned 1 or the refresh got cancelled.
+LibraryRefresh *library_refresh_start(const Playlist *pl);
+// Returns 1 with the rescanned playlist in *out if anything changed. Its ids
+// have nothing to do with the ones in pl.
+bool library_refresh_poll(LibraryRefresh **r, Playlist *out);
+void library_refresh_cancel(LibraryRefresh **r);
+
+// Watches the directories of a playlist with inotify on a background thread.
+LibraryWatch *library_watch_start(const Playlist *pl);
+// Watches any directories of pl that aren't watched yet.
+void library_watch_add_dirs(LibraryWatch *w, const Playlist *pl);
+// Hands over everything that happened since the last poll, in order, however
+// long ago that was. out is cleared first.
+bool library_watch_poll(LibraryWatch *w, LibraryDeltas *out);
+void library_watch_stop(LibraryWatch **w);
@@ -0,0 +1,444 @@
+#include "loader.h"
+#include "library.h"
+#include "params.h"
+
+#include <stdlib.h>
+
+#include <SDL3/SDL_mutex.h>
+#include <SDL3/SDL_thread.h>
+#include <SDL3/SDL_timer.h>
+
+// Opening a file means libav reading and guessing at its first few hundred
+// kilobytes. Usually that's quick, but on a network mount or a disk that has
+// to spin up it can take seconds, and holding N to skip through tracks asks
+// for a new one every frame.
+//
+// Requests go in under the mutex, each with a generation. libav checks an
+// interrupt callback while it waits for the disk, and that gives up as soon
+// as a newer request came in. So only the last track someone asked for gets
+// opened all the way, and what's left of the others is closed right away.
+//
+// Files that were played before skip avformat_find_stream_info, see params.h.
+// Local files are read from a mapping, or from memory if they were read
+// ahead, see fileio.h.
+//
+// Unless the device gets opened in each track's own format, the decoder
+// mixes down what has more channels than the device, see pcm.h, and
+// resamples to the device's rate, see resample.h. SDL can do both too, but
+// slower, it clips, and its resampler is what it is. When the device takes
+// 16 bit, the decoder narrows to that as well, with dither. That's the last
+// step there is, SDL would just round.
+//
+// The gain for loudness normalization goes into the decoder's mix too, see
+// loudness.h. Tracks that get one are converted even when nothing else
+// would change. SDL could do it too, but only by going to float and back,
+// which is what the mix does anyway.
+
+typedef enum {
+	Ok,
+	ErrNoAudioStream,
+	ErrNoCodecFound,
+	ErrAllocFailed,
+	ErrFfmpeg,
+	ErrUnsupportedFormat,
+} ResultTag;
+
+typedef struct {
+	ResultTag tag;
+	int rc;
+} Result;
+
+#define ffmpegerr(rc) (Result){.tag=ErrFfmpeg, .rc = rc}
+#define R(x) (Result){.tag=x}
+#define okp(r) (r.tag == Ok)
+
+struct Loader {
+	SDL_Thread *thread;
+	SDL_Mutex *mutex;
+	SDL_Condition *wake;
+	// The newest request, anything older is cancelled. Only goes up under
+	// the mutex, but the loader looks at it without while libav waits.
+	_Atomic u32 generation;
+	i32 ring_ms;
+	ParamCache *params; // only used by the loader
+	ReadAhead *read_ahead;
+	SeekIndexCache *seeks;
+
+	// guarded by mutex
+	bool stop;
+	bool pending;
+	CharList path;
+	i32 id;
+	f32 gain;
+	DecoderTrim trim;
+	SDL_AudioSpec device;
+	bool native;
+	ResampleQuality quality;
+	u64 requested_ns;
+	bool done;
+	Track *loaded;
+	// Tracks nobody wants anymore. Freeing one joins its decoder, which may
+	// sit in a read from a slow disk, so the loader does that, and never
+	// with the mutex held.
+	Track **discarded;
+	i32 discarded_count;
+	i32 discarded_cap;
+};
+
+// With the mutex held.
+static void discard_track(Loader *l, Track *track){
+	if(track == NULL)
+		return;
+	if(l->discarded_count >= l->discarded_cap){
+		l->discarded_cap = MAX(l->discarded_cap * 2, 4);
+		l->discarded = realloc(l->discarded, l->discarded_cap * sizeof(l->discarded[0]));
+	}
+	l->discarded[l->discarded_count++] = track;
+	SDL_SignalCondition(l->wake);
+}
+
+void free_track(Track *track){
+	if(track == NULL)
+		return;
+	decoder_stop(&track->decoder);
+#ifdef SYSCALL_COUNTING
+	// what reading the file took, for the tracks that got played
+	if(track->io && atomic_load_explicit(&track->first_audio_ns, memory_order_relaxed) != 0)
+		println("read the file with ", file_io_syscalls(track->io), " syscalls",
+			file_io_cached(track->io) ? ", from memory" : file_io_mapped(track->io) ? ", mapped" : "");
+#endif
+	file_io_close(&track->io);
+	free(track);
+}
+
+//# loader
+
+static void log_err(Result r){
+	switch(r.tag){
+		case ErrFfmpeg:
+			const char tmp[4] = { (char)(-r.rc), (char)(-r.rc >> 8), (char)(-r.rc >> 16), (char)(-r.rc >> 24), };
+			bool printable_tag = 1;
+			for(int i = 0; i < 4; ++i){
+				printable_tag &= (tmp[i] >= 32 && tmp[i] <= 126);
+			}
+			eprint("err: ", r.tag, " (ffmpeg), return code: ", r.rc);
+			if(printable_tag){
+				Slice tmp2 = {tmp, sizeof(tmp)};
+				eprintln(", tag: ", tmp2);
+			} else {
+				eprint("\n");
+			}
+			break;
+		default:
+			eprintln("err: ", r.tag, " ", r.rc);
+			break;
+	}
+}
+
+static bool cancelled(Loader *l, u32 generation){
+	return atomic_load_explicit(&l->generation, memory_order_relaxed) != generation;
+}
+
+// libav calls this while it's blocked on I/O, nonzero makes it give up. It
+// keeps a copy for as long as the file is open, so once the decoder has the
+// file this has to stay 0.
+static int interrupted(void *arg){
+	const Track *track = arg;
+	return track->loader != NULL && cancelled(track->loader, track->generation);
+}
+
+static SDL_AudioFormat sdl_format(enum AVSampleFormat format){
+	switch(av_get_packed_sample_fmt(format)){
+		case AV_SAMPLE_FMT_U8:
+			return SDL_AUDIO_U8;
+		case AV_SAMPLE_FMT_S16:
+			return SDL_AUDIO_S16;
+		case AV_SAMPLE_FMT_S32:
+			return SDL_AUDIO_S32;
+		case AV_SAMPLE_FMT_FLT:
+			return SDL_AUDIO_F32;
+		default:
+			return SDL_AUDIO_UNKNOWN;
+	}
+}
+
+static DecoderOutput choose_output(const AVCodecContext *codec, const SDL_AudioSpec *device, bool native, ResampleQuality quality, f32 gain){
+	const enum AVSampleFormat packed = av_get_packed_sample_fmt(codec->sample_fmt);
+	const i32 channels = codec->ch_layout.nb_channels;
+	DecoderOutput out = {packed, channels, codec->sample_rate, quality, 1};
+	if(channels > PCM_MAX_CHANNELS)
+		return out;
+	out.gain = gain;
+	// What SDL doesn't take (DBL, S64) becomes float, and so do U8 and S32
+	// with a gain. A native device gets opened in that.
+	if(sdl_format(packed) == SDL_AUDIO_UNKNOWN || (gain != 1 && packed != AV_SAMPLE_FMT_S16))
+		out.format = AV_SAMPLE_FMT_FLT;
+	if(native || device->channels == 0)
+		return out;
+	if(channels > device->channels && device->channels <= 2){
+		out.format = AV_SAMPLE_FMT_FLT;
+		out.channels = device->channels;
+	}
+	if(device->freq != codec->sample_rate && device->freq > 0){
+		out.format = AV_SAMPLE_FMT_FLT;
+		out.rate = device->freq;
+	}
+	if(device->format == SDL_AUDIO_S16)
+		out.format = AV_SAMPLE_FMT_S16;
+	return out;
+}
+
+// Opens path and starts decoding it into track, which goes on in the
+// background.
+static Result open_track(Loader *l, Track *track, const CharList *path, const SDL_AudioSpec *device, bool native, ResampleQuality quality, f32 gain, DecoderTrim trim)
+{
+	AVFormatContext *format_ctx = avformat_alloc_context();
+	if(format_ctx == NULL){
+		return R(ErrAllocFailed);
+	}
+	format_ctx->interrupt_callback = (AVIOInterruptCB){ .callback = interrupted, .opaque = track };
+	// libav doesn't free the context on errors when it's ours, the caller
+	// closes track->io.
+	track->io = file_io_open(path->data, format_ctx->interrupt_callback, l->read_ahead);
+	if(track->io){
+		format_ctx->pb = file_io_context(track->io);
+		format_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+	}
+
+	int rc = avformat_open_input(&format_ctx, path->data, NULL, NULL);
+	if(rc < 0){
+		return ffmpegerr(rc);
+	}
+	i32 audio_stream_idx = param_cache_apply(l->params, path->data, path->count, format_ctx);
+	if(audio_stream_idx < 0){
+		rc = avformat_find_stream_info(format_ctx, NULL);
+		if(rc < 0){
+			avformat_close_input(&format_ctx);
+			return ffmpegerr(rc);
+		}
+		audio_stream_idx = 0;
+		for(; audio_stream_idx < (i32)format_ctx->nb_streams; audio_stream_idx += 1){
+			if(format_ctx->streams[audio_stream_idx]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO){
+				break;
+			}
+		}
+		if(audio_stream_idx == (i32)format_ctx->nb_streams){
+			avformat_close_input(&format_ctx);
+			return R(ErrNoAudioStream);
+		}
+		param_cache_put(l->params, path->data, path->count, format_ctx, audio_stream_idx);
+	}
+	AVStream *stream = format_ctx->streams[audio_stream_idx];
+	const AVCodec *codec = avcodec_find_decoder(stream->codecpar->codec_id);
+	if(codec == NULL){
+		avformat_close_input(&format_ctx);
+		return R(ErrNoCodecFound);
+	}
+	AVCodecContext *codec_context = avcodec_alloc_context3(codec);
+	if(codec_context == NULL){
+		avformat_close_input(&format_ctx);
+		return R(ErrAllocFailed);
+	}
+	avcodec_parameters_to_context(codec_context, stream->codecpar);
+	AVDictionary **codec_options = NULL;
+	rc = avcodec_open2(codec_context, codec, codec_options);
+	if(rc < 0){
+		avcodec_free_context(&codec_context);
+		avformat_close_input(&format_ctx);
+		return ffmpegerr(rc);
+	}
+
+	const DecoderOutput out = choose_output(codec_context, device, native, quality, gain);
+	SDL_AudioSpec src_spec;
+	src_spec.channels = out.channels;
+	src_spec.freq = out.rate;
+	src_spec.format = sdl_format(out.format);
+	// more channels than pcm_mix takes, in a format SDL doesn't know
+	if(src_spec.format == SDL_AUDIO_UNKNOWN){
+		avcodec_free_context(&codec_context);
+		avformat_close_input(&format_ctx);
+		return R(ErrUnsupportedFormat);
+	}
+	// println("src spec ", src_spec.format,  ", ", src_spec.channels, ", ", src_spec.freq);
+
+	// Only for demuxers that would have to guess where to seek to, and
+	// codecs that put out a packet's samples right away, see seekindex.h.
+	const int format_flags = format_ctx->iformat->flags;
+	SeekIndex *index = NULL;
+	if((format_flags & AVFMT_GENERIC_INDEX) && !(format_flags & AVFMT_NO_BYTE_SEEK) && !(codec->capabilities & AV_CODEC_CAP_DELAY))
+		index = seek_index_open(l->seeks, path->data, path->count);
+
+	// From here on the decoder reads the file, and that doesn't get cancelled.
+	track->loader = NULL;
+	track->spec = src_spec;
+	track->decoder = decoder_start(format_ctx, codec_context, audio_stream_idx, index, out, trim, l->ring_ms);
+	return R(Ok);
+}
+
+static int loader_main(void *arg){
+	Loader *l = arg;
+	CharList path = make_charlist();
+	l->params = param_cache_load();
+	Track **discarded = NULL;
+	i32 discarded_cap = 0;
+	SDL_LockMutex(l->mutex);
+	while(!l->stop){
+		// a track that's asked for comes first
+		if(!l->pending && l->discarded_count > 0){
+			// swap the lists, so they don't get allocated each time
+			Track **tmp = discarded;
+			const i32 tmp_cap = discarded_cap;
+			const i32 count = l->discarded_count;
+			discarded = l->discarded;
+			discarded_cap = l->discarded_cap;
+			l->discarded = tmp;
+			l->discarded_cap = tmp_cap;
+			l->discarded_count = 0;
+			SDL_UnlockMutex(l->mutex);
+			for(i32 i = 0; i < count; ++i)
+				free_track(discarded[i]);
+			SDL_LockMutex(l->mutex);
+			continue;
+		}
+		if(!l->pending){
+			SDL_WaitCondition(l->wake, l->mutex);
+			continue;
+		}
+		l->pending = 0;
+		const u32 generation = atomic_load_explicit(&l->generation, memory_order_relaxed);
+		path.count = 0;
+		push_string(&path, l->path.data, l->path.count);
+		Track *track = calloc(1, sizeof(*track));
+		track->id = l->id;
+		track->requested_ns = l->requested_ns;
+		track->loader = l;
+		track->generation = generation;
+		track->skips_lead = l->trim.start > 0;
+		const SDL_AudioSpec device = l->device;
+		const bool native = l->native;
+		const ResampleQuality quality = l->quality;
+		const f32 gain = l->gain;
+		const DecoderTrim trim = l->trim;
+		SDL_UnlockMutex(l->mutex);
+
+		Result rc = open_track(l, track, &path, &device, native, quality, gain, trim);
+		if(okp(rc)){
+			track->opened_ns = SDL_GetTicksNS();
+		} else {
+			if(!cancelled(l, generation)){
+				log_err(rc);
+				const Slice name = {path.data, path.count - 1};
+				eprintln("failed to open ", name);
+			}
+			free_track(track);
+			track = NULL;
+		}
+
+		SDL_LockMutex(l->mutex);
+		if(cancelled(l, generation)){
+			SDL_UnlockMutex(l->mutex);
+			free_track(track);
+			SDL_LockMutex(l->mutex);
+		} else {
+			l->done = 1;
+			l->loaded = track;
+		}
+	}
+	SDL_UnlockMutex(l->mutex);
+	free(discarded);
+	param_cache_stop(&l->params);
+	free(path.data);
+	return 0;
+}
+
+//# main thread
+
+Loader *loader_start(i32 ring_ms, ReadAhead *ra, SeekIndexCache *seeks){
+	Loader *l = calloc(1, sizeof(*l));
+	l->ring_ms = ring_ms;
+	l->read_ahead = ra;
+	l->seeks = seeks;
+	l->mutex = SDL_CreateMutex();
+	l->wake = SDL_CreateCondition();
+	l->path = make_charlist();
+	l->thread = SDL_CreateThread(loader_main, "loader", l);
+	return l;
+}
+
+void loader_stop(Loader **ll){
+	Loader *l = *ll;
+	if(l == NULL)
+		return;
+	SDL_LockMutex(l->mutex);
+	atomic_fetch_add_explicit(&l->generation, 1, memory_order_relaxed);
+	l->stop = 1;
+	SDL_SignalCondition(l->wake);
+	SDL_UnlockMutex(l->mutex);
+	SDL_WaitThread(l->thread, NULL);
+	SDL_DestroyCondition(l->wake);
+	SDL_DestroyMutex(l->mutex);
+	free_track(l->loaded);
+	for(i32 i = 0; i < l->discarded_count; ++i)
+		free_track(l->discarded[i]);
+	free(l->discarded);
+	free(l->path.data);
+	free(l);
+	*ll = NULL;
+}
+
+void loader_open(Loader *l, Slice path, i32 id, f32 gain, DecoderTrim trim){
+	SDL_LockMutex(l->mutex);
+	atomic_fetch_add_explicit(&l->generation, 1, memory_order_relaxed);
+	l->path.count = 0;
+	push_string(&l->path, path.str, path.len);
+	if(path.len == 0 || path.str[path.len - 1] != 0)
+		push_string(&l->path, "", 1);
+	l->id = id;
+	l->gain = gain;
+	l->trim = trim;
+	l->requested_ns = SDL_GetTicksNS();
+	l->pending = 1;
+	discard_track(l, l->loaded);
+	l->loaded = NULL;
+	l->done = 0;
+	SDL_SignalCondition(l->wake);
+	SDL_UnlockMutex(l->mutex);
+}
+
+void loader_set_output(Loader *l, const SDL_AudioSpec *device, bool native, ResampleQuality quality){
+	SDL_LockMutex(l->mutex);
+	l->device = *device;
+	l->native = native;
+	l->quality = quality;
+	SDL_UnlockMutex(l->mutex);
+}
+
+void loader_cancel(Loader *l){
+	SDL_LockMutex(l->mutex);
+	atomic_fetch_add_explicit(&l->generation, 1, memory_order_relaxed);
+	l->pending = 0;
+	discard_track(l, l->loaded);
+	l->loaded = NULL;
+	l->done = 0;
+	SDL_UnlockMutex(l->mutex);
+}
+
+void loader_discard(Loader *l, Track *track){
+	if(track == NULL)
+		return;
+	SDL_LockMutex(l->mutex);
+	discard_track(l, track);
+	SDL_UnlockMutex(l->mutex);
+}
+
+bool loader_poll(Loader *l, Track **track){
+	SDL_LockMutex(l->mutex);
+	const bool done = l->done;
+	if(done){
+		*track = l->loaded;
+		l->loaded = NULL;
+		l->done = 0;
+	}
+	SDL_UnlockMutex(l->mutex);
+	return done;
+}
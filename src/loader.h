@@ -0,0 +1,56 @@
+#pragma once
+
+#include "decoder.h"
+#include "fileio.h"
+
+#include <stdatomic.h>
+
+#include <SDL3/SDL_audio.h>
+
+// Opens tracks on a thread of its own, so the UI never waits for the disk.
+// Only the newest request counts: asking for another track cancels the one
+// that's being opened, even halfway through libav looking at the file.
+typedef struct Loader Loader;
+
+// A track that's open and decoding, and what its samples look like to SDL.
+typedef struct {
+	Decoder *decoder;
+	FileIO *io; // NULL if libav reads the file by itself
+	SDL_AudioSpec spec;
+	i32 id;
+	// When it was asked for and when it was open, SDL_GetTicksNS. The audio
+	// callback fills in when its first samples went out.
+	u64 requested_ns;
+	u64 opened_ns;
+	_Atomic u64 first_audio_ns;
+	bool report; // print how long it took once it's heard
+	bool skips_lead; // opened with a trim.start, the way auto next plays it
+	// Set while the loader opens it, libav gives up once generation is old.
+	Loader *loader;
+	u32 generation;
+} Track;
+
+// Waits for the track's decoder to stop, the main thread gives tracks to
+// loader_discard instead.
+void free_track(Track *track);
+
+// Opened tracks keep ring_ms of audio decoded ahead, see decoder_start.
+// Files in ra are read from memory, and tracks get their seek index from
+// seeks. Both have to outlive the loader and the tracks.
+Loader *loader_start(i32 ring_ms, ReadAhead *ra, SeekIndexCache *seeks);
+void loader_stop(Loader **l);
+// Starts opening path for id, instead of whatever was being opened. Its
+// samples get multiplied by gain, if they can be, see choose_output in
+// loader.c, and only trim of it plays.
+void loader_open(Loader *l, Slice path, i32 id, f32 gain, DecoderTrim trim);
+void loader_cancel(Loader *l);
+// Frees track on the loader thread. Its decoder may be stuck in a read from
+// a slow disk, and free_track waits for it.
+void loader_discard(Loader *l, Track *track);
+// What the device takes, whether it gets opened in each track's format, and
+// how to resample when it doesn't, for tracks opened from now on. See
+// choose_output in loader.c.
+void loader_set_output(Loader *l, const SDL_AudioSpec *device, bool native, ResampleQuality quality);
+// Main thread, once a frame. Returns 1 once the newest request is done, with
+// *track NULL if it couldn't be opened.
+bool loader_poll(Loader *l, Track **track);
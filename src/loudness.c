@@ -0,0 +1,584 @@
+#define _GNU_SOURCE
+#include "loudness.h"
+#include "floatfile.h"
+#include "jobpool.h"
+#include "resample.h"
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LOUDNESS_X86 1
+#include <immintrin.h>
+#endif
+
+#include <SDL3/SDL_cpuinfo.h>
+#include <SDL3/SDL_mutex.h>
+#include <SDL3/SDL_thread.h>
+
+// How loud a file is takes decoding all of it. That's a few hundred times
+// faster than it plays, but still seconds for an album, so it's done in the
+// background like probing, see jobpool.h, with the tracks that play next
+// first. There are at most two workers and they run at low priority, the
+// decoder of what's playing always comes first. The waveform worker decodes
+// what plays next anyway, so it measures that with a LoudnessMeter of its
+// own and hands the results in, see loudness_pool_put.
+//
+// BS.1770: each channel goes through the K-weighting filter, a high shelf
+// and then a high pass, and the squares of what comes out are summed up,
+// surrounds a bit louder and LFE not at all. 100 ms of those make a step,
+// four steps in a row a 400 ms block. Blocks under -70 LUFS don't count,
+// and then neither do the ones 10 LU under the mean of the rest. A filter
+// can't be vectorized along the samples, it needs the last output for the
+// next one, so it runs on all channels of a frame at once in one 8 wide
+// vector, if the CPU has AVX and FMA, and one channel after the other if
+// not.
+//
+// True peak is the sample peak of the track at 4 times its rate, or 2 times
+// from 96 kHz on, resampled with resample.h. With its high quality, whose
+// passband goes up to about 95 % of the input's Nyquist: the medium one's
+// ends early enough to take the edge off intersample peaks of bright
+// material, and the peak would come out low.
+//
+// An album's loudness is made out of its tracks', weighted by how many
+// blocks each has. Gating the blocks of all tracks together would be the
+// real thing, this is a fraction of a LU off for anything that sounds like
+// an album, and doesn't need to keep the blocks around.
+//
+// Results are kept in a cache file keyed by path, mtime and size, see
+// cache.h, like the probe cache.
+
+#define LOUDNESS_MAX_THREADS 2
+// the gates: LUFS, and LU under the mean of what got past the first
+#define GATE_ABSOLUTE -70.0
+#define GATE_RELATIVE -10.0
+
+static_assert(LoudnessNone == JobNone && LoudnessQueued == JobQueued && LoudnessDone == JobDone && LoudnessFailed == JobFailed, "the pool looks at the state");
+
+typedef struct {
+	i32 id;
+	u32 generation;
+	Loudness info;
+} LoudnessResult;
+
+typedef struct {
+	LoudnessResult *data;
+	i32 count;
+	i32 cap;
+} LoudnessResults;
+
+typedef struct {
+	CacheKey key;
+	Loudness info;
+} LoudnessRecord;
+
+static bool loudness_record_valid(const void *record){
+	const LoudnessRecord *r = record;
+	return r->info.state == LoudnessDone || r->info.state == LoudnessFailed;
+}
+
+static const CacheFormat loudness_cache_format = {
+	.name = "loudness.cache",
+	.magic = "moslud",
+	.version = 2,
+	.record_size = sizeof(LoudnessRecord),
+	.valid = loudness_record_valid,
+};
+
+// Fewer jobs than probing, each one takes much longer.
+static const JobPoolFormat loudness_pool_format = {
+	.cache = &loudness_cache_format,
+	.info_offset = offsetof(LoudnessRecord, info),
+	.info_size = sizeof(Loudness),
+	.mtime = offsetof(Loudness, mtime),
+	.size = offsetof(Loudness, size),
+	.batch = 16,
+};
+
+// One stage of the K-weighting filter, transposed direct form II.
+typedef struct {
+	f32 b0, b1, b2, a1, a2;
+} Biquad;
+
+// What measuring a file takes, kept from one to the next.
+struct LoudnessMeter {
+	i32 channels;
+	// square root of each channel's weight, so it can go on the samples
+	f32 weight[8];
+	Biquad shelf;
+	Biquad pass;
+	f32 state[4][8]; // shelf, then high pass, two per lane each
+	i32 step_len;    // frames in 100 ms
+	i32 step_at;
+	f64 step_sum;
+	f64 steps[4];    // mean squares of the last four steps
+	i64 step_count;
+	f64 *blocks;     // mean square of every 400 ms block
+	i32 block_count;
+	i32 block_cap;
+	f32 peak;
+	Resampler *oversampler; // NULL from 192 kHz on
+	f64 (*k_weight)(LoudnessMeter *a, const f32 *x, i32 n);
+	// a frame of the file, oversampled
+	f32 *over;
+	i32 over_cap;
+};
+
+struct LoudnessPool {
+	JobPool jobs;
+	// guarded by jobs.mutex
+	LoudnessResults results;
+
+	// only used by the main thread
+	LoudnessResults taken;
+};
+
+static const char *const normalize_mode_names[NormalizeModeCount] = {
+	[NormalizeOff] = "off",
+	[NormalizeTrack] = "track",
+	[NormalizeAlbum] = "album",
+};
+
+const char *normalize_mode_name(NormalizeMode mode){
+	return mode < NormalizeModeCount ? normalize_mode_names[mode] : "?";
+}
+
+static f64 lufs(f64 energy){
+	return -0.691 + 10 * log10(energy);
+}
+
+static f64 mean_square(f64 loudness){
+	return pow(10, (loudness + 0.691) / 10);
+}
+
+//# workers
+
+static void *reserve(void *buf, i32 *cap, i32 count, size_t size){
+	if(count > *cap){
+		*cap = MAX(count, *cap * 2);
+		buf = realloc(buf, *cap * size);
+	}
+	return buf;
+}
+
+static f32 channel_weight(const AVChannelLayout *layout, i32 ch){
+	switch(av_channel_layout_channel_from_index(layout, ch)){
+		case AV_CHAN_LOW_FREQUENCY:
+		case AV_CHAN_LOW_FREQUENCY_2:
+			return 0;
+		case AV_CHAN_SIDE_LEFT:
+		case AV_CHAN_SIDE_RIGHT:
+		case AV_CHAN_BACK_LEFT:
+		case AV_CHAN_BACK_RIGHT:
+			return 1.41f;
+		default:
+			return 1;
+	}
+}
+
+// The coefficients from BS.1770 are for 48 kHz, these are the analog
+// prototypes they come from, for any rate.
+static void k_weight_init(LoudnessMeter *a, const AVChannelLayout *layout, i32 channels, i32 rate){
+	const f64 shelf_k = tan(M_PI * 1681.974450955533 / rate);
+	const f64 shelf_q = 0.7071752369554196;
+	const f64 vh = pow(10, 3.999843853973347 / 20);
+	const f64 vb = pow(vh, 0.4996667741545416);
+	f64 a0 = 1 + shelf_k / shelf_q + shelf_k * shelf_k;
+	a->shelf = (Biquad){
+		.b0 = (f32)((vh + vb * shelf_k / shelf_q + shelf_k * shelf_k) / a0),
+		.b1 = (f32)(2 * (shelf_k * shelf_k - vh) / a0),
+		.b2 = (f32)((vh - vb * shelf_k / shelf_q + shelf_k * shelf_k) / a0),
+		.a1 = (f32)(2 * (shelf_k * shelf_k - 1) / a0),
+		.a2 = (f32)((1 - shelf_k / shelf_q + shelf_k * shelf_k) / a0),
+	};
+	const f64 pass_k = tan(M_PI * 38.13547087602444 / rate);
+	const f64 pass_q = 0.5003270373238773;
+	a0 = 1 + pass_k / pass_q + pass_k * pass_k;
+	a->pass = (Biquad){
+		.b0 = 1,
+		.b1 = -2,
+		.b2 = 1,
+		.a1 = (f32)(2 * (pass_k * pass_k - 1) / a0),
+		.a2 = (f32)((1 - pass_k / pass_q + pass_k * pass_k) / a0),
+	};
+	a->channels = channels;
+	for(i32 ch = 0; ch < 8; ++ch)
+		a->weight[ch] = ch < channels ? sqrtf(channel_weight(layout, ch)) : 0;
+	memset(a->state, 0, sizeof(a->state));
+	a->step_len = MAX(rate / 10, 1);
+	a->step_at = 0;
+	a->step_sum = 0;
+	a->step_count = 0;
+	a->block_count = 0;
+	a->peak = 0;
+}
+
+// Runs n frames of x through the filters and returns the sum of the squares
+// of what comes out, over all channels.
+static f64 k_weight(LoudnessMeter *a, const f32 *x, i32 n){
+	const i32 channels = a->channels;
+	const Biquad s = a->shelf;
+	const Biquad p = a->pass;
+	f64 sum = 0;
+	for(i32 ch = 0; ch < channels; ++ch){
+		f32 s1 = a->state[0][ch], s2 = a->state[1][ch];
+		f32 p1 = a->state[2][ch], p2 = a->state[3][ch];
+		const f32 w = a->weight[ch];
+		f32 acc = 0;
+		for(i32 i = 0; i < n; ++i){
+			const f32 in = x[i * channels + ch] * w;
+			const f32 y = s.b0 * in + s1;
+			s1 = s.b1 * in - s.a1 * y + s2;
+			s2 = s.b2 * in - s.a2 * y;
+			const f32 z = y + p1;
+			p1 = p.b1 * y - p.a1 * z + p2;
+			p2 = y - p.a2 * z;
+			acc += z * z;
+		}
+		a->state[0][ch] = s1;
+		a->state[1][ch] = s2;
+		a->state[2][ch] = p1;
+		a->state[3][ch] = p2;
+		sum += acc;
+	}
+	return sum;
+}
+
+#ifdef LOUDNESS_X86
+// The same, with all channels in one vector.
+__attribute__((target("avx,fma"))) static f64 k_weight_fma(LoudnessMeter *a, const f32 *x, i32 n){
+	const i32 channels = a->channels;
+	// maskload only reads the lanes that are on, so the last frame doesn't
+	// read past the end.
+	static const i32 lanes[16] = {-1, -1, -1, -1, -1, -1, -1, -1};
+	const __m256i mask = _mm256_loadu_si256((const __m256i*)(lanes + 8 - channels));
+	const __m256 w = _mm256_loadu_ps(a->weight);
+	const __m256 sb0 = _mm256_set1_ps(a->shelf.b0);
+	const __m256 sb1 = _mm256_set1_ps(a->shelf.b1);
+	const __m256 sb2 = _mm256_set1_ps(a->shelf.b2);
+	const __m256 sa1 = _mm256_set1_ps(a->shelf.a1);
+	const __m256 sa2 = _mm256_set1_ps(a->shelf.a2);
+	const __m256 pb1 = _mm256_set1_ps(a->pass.b1);
+	const __m256 pa1 = _mm256_set1_ps(a->pass.a1);
+	const __m256 pa2 = _mm256_set1_ps(a->pass.a2);
+	__m256 s1 = _mm256_loadu_ps(a->state[0]);
+	__m256 s2 = _mm256_loadu_ps(a->state[1]);
+	__m256 p1 = _mm256_loadu_ps(a->state[2]);
+	__m256 p2 = _mm256_loadu_ps(a->state[3]);
+	__m256 acc = _mm256_setzero_ps();
+	for(i32 i = 0; i < n; ++i){
+		const __m256 in = _mm256_mul_ps(_mm256_maskload_ps(x + i * channels, mask), w);
+		const __m256 y = _mm256_fmadd_ps(sb0, in, s1);
+		s1 = _mm256_fmadd_ps(sb1, in, _mm256_fnmadd_ps(sa1, y, s2));
+		s2 = _mm256_fnmadd_ps(sa2, y, _mm256_mul_ps(sb2, in));
+		// the high pass has 1, -2, 1 on top
+		const __m256 z = _mm256_add_ps(y, p1);
+		p1 = _mm256_fmadd_ps(pb1, y, _mm256_fnmadd_ps(pa1, z, p2));
+		p2 = _mm256_fnmadd_ps(pa2, z, y);
+		acc = _mm256_fmadd_ps(z, z, acc);
+	}
+	_mm256_storeu_ps(a->state[0], s1);
+	_mm256_storeu_ps(a->state[1], s2);
+	_mm256_storeu_ps(a->state[2], p1);
+	_mm256_storeu_ps(a->state[3], p2);
+	f32 sums[8];
+	_mm256_storeu_ps(sums, acc);
+	f64 sum = 0;
+	for(i32 ch = 0; ch < channels; ++ch)
+		sum += sums[ch];
+	return sum;
+}
+
+static bool has_fma(void){
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx") && __builtin_cpu_supports("fma");
+}
+#endif
+
+// Cuts x into steps, and the steps into blocks.
+static void measure(LoudnessMeter *a, const f32 *x, i32 n){
+	while(n > 0){
+		const i32 run = MIN(n, a->step_len - a->step_at);
+		a->step_sum += a->k_weight(a, x, run);
+		x += run * a->channels;
+		n -= run;
+		a->step_at += run;
+		if(a->step_at < a->step_len)
+			break;
+		a->steps[a->step_count++ % 4] = a->step_sum / a->step_len;
+		a->step_sum = 0;
+		a->step_at = 0;
+		if(a->step_count < 4)
+			continue;
+		a->blocks = reserve(a->blocks, &a->block_cap, a->block_count + 1, sizeof(f64));
+		a->blocks[a->block_count++] = (a->steps[0] + a->steps[1] + a->steps[2] + a->steps[3]) / 4;
+	}
+}
+
+static void find_peak(LoudnessMeter *a, const f32 *x, i32 n){
+	f32 peak = a->peak;
+	for(i32 i = 0; i < n; ++i)
+		peak = fmaxf(peak, fabsf(x[i]));
+	a->peak = peak;
+}
+
+static void integrate(const LoudnessMeter *a, Loudness *out){
+	const f64 absolute = mean_square(GATE_ABSOLUTE);
+	f64 sum = 0;
+	i32 count = 0;
+	for(i32 i = 0; i < a->block_count; ++i){
+		if(a->blocks[i] > absolute){
+			sum += a->blocks[i];
+			count += 1;
+		}
+	}
+	out->peak = a->peak;
+	out->blocks = 0;
+	out->loudness = GATE_ABSOLUTE;
+	if(count == 0)
+		return;
+	const f64 relative = sum / count * pow(10, GATE_RELATIVE / 10);
+	sum = 0;
+	count = 0;
+	for(i32 i = 0; i < a->block_count; ++i){
+		if(a->blocks[i] > absolute && a->blocks[i] > relative){
+			sum += a->blocks[i];
+			count += 1;
+		}
+	}
+	out->blocks = (u32)count;
+	out->loudness = (f32)lufs(sum / count);
+}
+
+LoudnessMeter *loudness_meter_create(void){
+	LoudnessMeter *m = calloc(1, sizeof(*m));
+	m->k_weight = k_weight;
+#ifdef LOUDNESS_X86
+	if(has_fma())
+		m->k_weight = k_weight_fma;
+#endif
+	return m;
+}
+
+void loudness_meter_free(LoudnessMeter **m){
+	if(*m == NULL)
+		return;
+	resampler_free(&(*m)->oversampler);
+	free((*m)->blocks);
+	free((*m)->over);
+	free(*m);
+	*m = NULL;
+}
+
+void loudness_meter_start(LoudnessMeter *m, const FloatFile *f){
+#ifdef LOUDNESS_X86
+	// The filters decay into denormals after a track goes silent, and those
+	// are slow. They're far below anything that counts. It's per thread, and
+	// whoever measures does little else.
+	_mm_setcsr(_mm_getcsr() | _MM_FLUSH_ZERO_ON | _MM_DENORMALS_ZERO_ON);
+#endif
+	k_weight_init(m, &f->codec->ch_layout, f->channels, f->rate);
+	resampler_free(&m->oversampler);
+	const i32 factor = f->rate < 96000 ? 4 : f->rate < 192000 ? 2 : 1;
+	if(factor > 1)
+		m->oversampler = resampler_create(f->rate, f->rate * factor, f->channels, ResampleHigh);
+}
+
+void loudness_meter_take(LoudnessMeter *m, const f32 *x, i32 n){
+	const i32 channels = m->channels;
+	find_peak(m, x, n * channels);
+	if(m->oversampler){
+		m->over = reserve(m->over, &m->over_cap, resampler_out_max(m->oversampler, n) * channels, sizeof(f32));
+		const i32 k = resampler_process(m->oversampler, x, n, m->over);
+		find_peak(m, m->over, k * channels);
+	}
+	measure(m, x, n);
+}
+
+void loudness_meter_finish(LoudnessMeter *m, Loudness *out){
+	if(m->oversampler){
+		m->over = reserve(m->over, &m->over_cap, resampler_tail(m->oversampler) * m->channels, sizeof(f32));
+		const i32 k = resampler_flush(m->oversampler, m->over);
+		find_peak(m, m->over, k * m->channels);
+		resampler_free(&m->oversampler);
+	}
+	integrate(m, out);
+}
+
+// Returns 0 if the file couldn't be decoded to the end, or the pool is
+// stopping.
+static bool analyze_file(LoudnessPool *p, LoudnessMeter *m, FloatFile *f, const char *path, Loudness *out){
+	if(!float_file_open(f, path))
+		return 0;
+	loudness_meter_start(m, f);
+	i32 n;
+	do {
+		n = float_file_next(f);
+		if(n > 0)
+			loudness_meter_take(m, f->samples, n);
+	} while(n > 0 && !atomic_load_explicit(&p->jobs.stop, memory_order_relaxed));
+	float_file_close(f);
+	if(n != 0)
+		return 0;
+	loudness_meter_finish(m, out);
+	return 1;
+}
+
+static int loudness_worker_main(void *arg){
+	LoudnessPool *p = arg;
+	SDL_SetCurrentThreadPriority(SDL_THREAD_PRIORITY_LOW);
+	LoudnessMeter *m = loudness_meter_create();
+	FloatFile f = {};
+	SDL_LockMutex(p->jobs.mutex);
+	PoolJob job;
+	while(job_pool_wait(&p->jobs, &job)){
+		SDL_UnlockMutex(p->jobs.mutex);
+
+		LoudnessResult r = {.id = job.id, .generation = job.generation};
+		r.info.mtime = job.mtime;
+		r.info.size = job.size;
+		r.info.state = analyze_file(p, m, &f, job.path, &r.info) ? LoudnessDone : LoudnessFailed;
+		free(job.path);
+
+		SDL_LockMutex(p->jobs.mutex);
+		// half a file isn't worth anything
+		if(p->jobs.stop)
+			break;
+		LoudnessResults *out = &p->results;
+		if(out->count >= out->cap){
+			out->cap = MAX(out->cap * 2, 64);
+			out->data = realloc(out->data, out->cap * sizeof(out->data[0]));
+		}
+		out->data[out->count++] = r;
+	}
+	SDL_UnlockMutex(p->jobs.mutex);
+	loudness_meter_free(&m);
+	float_file_free(&f);
+	return 0;
+}
+
+//# main thread
+
+LoudnessPool *loudness_pool_start(void){
+	LoudnessPool *p = calloc(1, sizeof(*p));
+	// Unlike probing this keeps a core busy. A quarter of them is enough to
+	// stay ahead of playback by far.
+	i32 n = SDL_GetNumLogicalCPUCores() / 4;
+	n = MIN(n, LOUDNESS_MAX_THREADS);
+	n = MAX(n, 1);
+	job_pool_start(&p->jobs, &loudness_pool_format, n, loudness_worker_main, "loudness", p);
+	return p;
+}
+
+void loudness_pool_stop(LoudnessPool **pp, const Playlist *pl){
+	LoudnessPool *p = *pp;
+	if(p == NULL)
+		return;
+	job_pool_stop_workers(&p->jobs);
+	loudness_pool_update(p, pl, 0);
+	job_pool_free(&p->jobs, pl);
+	free(p->results.data);
+	free(p->taken.data);
+	free(p);
+	*pp = NULL;
+}
+
+void loudness_pool_reset(LoudnessPool *p){
+	if(p == NULL)
+		return;
+	job_pool_reset(&p->jobs);
+}
+
+void loudness_pool_update(LoudnessPool *p, const Playlist *pl, bool background){
+	if(p == NULL)
+		return;
+	job_pool_update(&p->jobs, pl, background);
+
+	SDL_LockMutex(p->jobs.mutex);
+	LoudnessResults tmp = p->taken;
+	p->taken = p->results;
+	p->results = tmp;
+	p->results.count = 0;
+	SDL_UnlockMutex(p->jobs.mutex);
+
+	for(i32 i = 0; i < p->taken.count; ++i){
+		const LoudnessResult *r = &p->taken.data[i];
+		if(!job_pool_current(&p->jobs, r->id, r->generation))
+			continue;
+		// A failure may be the disk's, the next run tries again.
+		job_pool_put(&p->jobs, pl, r->id, &r->info, r->info.state == LoudnessDone);
+	}
+}
+
+void loudness_pool_put(LoudnessPool *p, const Playlist *pl, i32 id, const Loudness *info){
+	if(p == NULL)
+		return;
+	job_pool_put(&p->jobs, pl, id, info, info->state == LoudnessDone);
+}
+
+void loudness_prioritize(LoudnessPool *p, const Playlist *pl, const i32 *ids, i32 count){
+	if(p == NULL)
+		return;
+	job_pool_prioritize(&p->jobs, pl, ids, count);
+}
+
+const Loudness *loudness_info(const LoudnessPool *p, const Playlist *pl, i32 id){
+	if(p == NULL)
+		return NULL;
+	return job_pool_info(&p->jobs, pl, id);
+}
+
+// Replaces loudness and peak with the album's, if id is on one and all of it
+// is analyzed.
+static void album_loudness(const LoudnessPool *p, const ProbePool *probe, const Playlist *pl, i32 id, f64 *loudness, f64 *peak){
+	const MusicEntry *e = &pl->entries.data[id];
+	const TrackInfo *info = probe_info(probe, pl, id);
+	if(e->dir < 0 || info == NULL || info->state != ProbeDone || info->album.len == 0)
+		return;
+	const Slice album = probe_string(probe, info->album);
+	f64 energy = 0;
+	f64 blocks = 0;
+	f64 album_peak = 0;
+	for(i32 i = 0; i < pl->order.count; ++i){
+		const i32 j = pl->order.data[i];
+		if(pl->entries.data[j].dir != e->dir)
+			continue;
+		// Without its tag there's no telling if it's on the album.
+		const TrackInfo *other = probe_info(probe, pl, j);
+		if(other == NULL)
+			return;
+		if(other->state != ProbeDone || !sliceEq(probe_string(probe, other->album), album))
+			continue;
+		const Loudness *l = loudness_info(p, pl, j);
+		if(l == NULL)
+			return;
+		if(l->state != LoudnessDone || l->blocks == 0)
+			continue;
+		energy += l->blocks * mean_square(l->loudness);
+		blocks += l->blocks;
+		album_peak = MAX(album_peak, (f64)l->peak);
+	}
+	if(blocks > 0){
+		*loudness = lufs(energy / blocks);
+		*peak = album_peak;
+	}
+}
+
+f32 loudness_gain(const LoudnessPool *p, const ProbePool *probe, const Playlist *pl, i32 id, NormalizeMode mode){
+	if(mode == NormalizeOff)
+		return 1;
+	const Loudness *l = loudness_info(p, pl, id);
+	if(l == NULL || l->state != LoudnessDone || l->blocks == 0)
+		return 1;
+	f64 loudness = l->loudness;
+	f64 peak = l->peak;
+	if(mode == NormalizeAlbum)
+		album_loudness(p, probe, pl, id, &loudness, &peak);
+	f64 db = LOUDNESS_TARGET - loudness;
+	// the clipping guard
+	if(peak > 0)
+		db = MIN(db, LOUDNESS_CEILING - 20 * log10(peak));
+	return (f32)pow(10, db / 20);
+}
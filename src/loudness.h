@@ -0,0 +1,75 @@
+#pragma once
+
+#include "floatfile.h"
+#include "library.h"
+#include "probe.h"
+
+typedef enum {
+	LoudnessNone,
+	LoudnessQueued,
+	LoudnessDone,
+	LoudnessFailed,
+} LoudnessState;
+
+// How loud a file is, after decoding all of it. EBU R128: integrated
+// loudness over K-weighted, gated 400 ms blocks, and the true peak, from 4
+// times oversampling.
+typedef struct {
+	u8 state;
+	u32 blocks;   // that got through the gates, 0 if it's all silence
+	f32 loudness; // LUFS
+	f32 peak;     // true peak, 1 is full scale
+	i64 mtime;    // of the file that was analyzed
+	i64 size;
+} Loudness;
+
+typedef enum {
+	NormalizeOff,
+	NormalizeTrack,
+	NormalizeAlbum,
+	NormalizeModeCount,
+} NormalizeMode;
+
+// What normalizing brings tracks to, in LUFS, like ReplayGain 2 does. And
+// how far under full scale the gain keeps the true peak, in dB.
+#define LOUDNESS_TARGET -18.0f
+#define LOUDNESS_CEILING -1.0f
+
+const char *normalize_mode_name(NormalizeMode mode);
+
+typedef struct LoudnessPool LoudnessPool;
+
+// Starts the workers and loads the loudness cache.
+LoudnessPool *loudness_pool_start(void);
+// Saves what we know about the entries of pl and stops the workers.
+void loudness_pool_stop(LoudnessPool **p, const Playlist *pl);
+// The playlist got replaced and all the ids changed.
+void loudness_pool_reset(LoudnessPool *p);
+// Main thread only, once a frame. Picks up results, and keeps the workers
+// busy with the rest of the library if background.
+void loudness_pool_update(LoudnessPool *p, const Playlist *pl, bool background);
+// A result that was measured somewhere else, for entry id of pl.
+void loudness_pool_put(LoudnessPool *p, const Playlist *pl, i32 id, const Loudness *info);
+// Analyzes these entries before anything else, e.g. the ones that play next.
+void loudness_prioritize(LoudnessPool *p, const Playlist *pl, const i32 *ids, i32 count);
+// NULL if the entry hasn't been analyzed yet, or the file changed since.
+const Loudness *loudness_info(const LoudnessPool *p, const Playlist *pl, i32 id);
+
+// Measures a file for someone who decodes all of it anyway, on their thread.
+typedef struct LoudnessMeter LoudnessMeter;
+
+LoudnessMeter *loudness_meter_create(void);
+void loudness_meter_free(LoudnessMeter **m);
+// Starts over, for the file f just opened.
+void loudness_meter_start(LoudnessMeter *m, const FloatFile *f);
+// The next n sample frames of it, as float_file_next has them.
+void loudness_meter_take(LoudnessMeter *m, const f32 *x, i32 n);
+// After the last frame. Fills in out but for its state, mtime and size.
+void loudness_meter_finish(LoudnessMeter *m, Loudness *out);
+
+// The linear gain that brings entry id to LOUDNESS_TARGET, without taking
+// its true peak past LOUDNESS_CEILING. In album mode it's the same for the
+// whole album, the entries in the same directory with the same album tag,
+// once all of them are analyzed, and the track's own until then. 1 if not
+// even that is known.
+f32 loudness_gain(const LoudnessPool *p, const ProbePool *probe, const Playlist *pl, i32 id, NormalizeMode mode);
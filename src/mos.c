@@ -2,14 +2,26 @@
 // move directories. show directories in view
 // volume control
 // quick jump to predefined directories
-// toggle to sort all entries by name or mtime
 // mouse wheel up and down to scroll the list
 // mouse click to play track
-// show length of files in list. maybe lazily.
 // load playlist from files
+#define _GNU_SOURCE
 #include "def.h"
+#include "library.h"
+#include "probe.h"
+#include "loudness.h"
+#include "waveform.h"
+#include "sort.h"
+#include "search.h"
+#include "filter.h"
+#include "decoder.h"
+#include "loader.h"
+#include "pcm.h"
+#include "playclock.h"
+#include "allocs.h"
 
 #include <SDL3/SDL_keycode.h>
+#include <stdatomic.h>
 #include <time.h>
 
 #include <SDL3/SDL_audio.h>
@@ -31,32 +43,26 @@
 #include <libavutil/file.h>
 #include <libavutil/mem.h>
 
-typedef enum {
-	Ok,
-	ErrNoAudioStream,
-	ErrNoCodecFound,
-	ErrAllocFailed,
-	ErrFfmpeg,
-} ResultTag;
-
 typedef enum {
 	InputDefault,
 	InputFilter,
 } InputMode;
 
-typedef struct {
-	ResultTag tag;
-	int rc;
-} Result;
-
-#define ffmpegerr(rc) (Result){.tag=ErrFfmpeg, .rc = rc}
-#define R(x) (Result){.tag=x}
-#define okp(r) (r.tag == Ok)
-
-typedef struct {
-	i32 start;
-	i32 len;
-} Sub;
+// How much audio the decoder keeps ready ahead of playback. A slow disk or a
+// seek has this long before anyone hears it.
+#define DECODE_AHEAD_MS 500
+// SDL's stream sets itself up in the first few callbacks of a track, after
+// that the callback shouldn't touch the heap anymore.
+#define AUDIO_WARMUP_CALLBACKS 16
+// With auto next on, the next track gets opened this long before the current
+// one ends, so its first samples are decoded by the time they're needed.
+#define PREROLL_SECONDS 5.0
+// With auto next or shuffle on, this many of the tracks that come next are
+// read into memory ahead of time, keeping at most READ_AHEAD_MB of files.
+#define READ_AHEAD_TRACKS 3
+#define READ_AHEAD_MB 256
+// Auto next skips the silence before and after tracks, all but this much.
+#define DEAD_AIR_KEEP_MS 500
 
 typedef struct {
 	SDL_Texture *texture;
@@ -71,63 +77,6 @@ typedef struct {
 	const u8 *end;
 } ByteRange;
 
-#define extensions_def\
-	X(wav)\
-	X(mp3)\
-	X(opus)\
-	X(ogg)\
-	X(m4a)\
-
-#if 0
-	X(xm)\
-	X(mod)\
-	X(it)
-#endif
-
-typedef enum ExtensionId {
-#define X(A) ext_##A,
-	extensions_def
-#undef X
-	ExtIdCount,
-} ExtensionId;
-
-static const Slice accepted_extensions[] = {
-#define X(A) S(#A),
-	extensions_def
-#undef X
-};
-
-typedef struct {
-	Sub path;
-	i32 name_offset;
-	ExtensionId ext;
-	i64 mtime;
-} MusicEntry;
-
-typedef struct {
-	char *data;
-	i32 count;
-	i32 cap;
-} CharList;
-
-typedef struct {
-	i32 *data;
-	i32 count;
-	i32 cap;
-} I32List;
-
-typedef struct {
-	MusicEntry *data;
-	i32 count;
-	i32 cap;
-} MusicEntryList;
-
-typedef struct {
-	Sub base_name;
-	MusicEntryList entries;
-	CharList names;
-} Playlist;
-
 typedef struct { u64 state; u64 inc; } Pcg32;
 
 static u32 pcg32_random(Pcg32* rng)
@@ -158,6 +107,23 @@ static u32 pcg32_boundedrand(Pcg32* rng, u32 bound)
 	}
 }
 
+// What the audio callback has been up to. Only the audio thread writes it.
+typedef struct {
+	_Atomic u64 callbacks;
+	// heap allocations on the audio thread during callbacks, see allocs.h
+	_Atomic u64 allocs;
+	_Atomic u32 last_allocs;
+	// the most in one callback, once warmed up
+	_Atomic u32 max_allocs;
+	i32 warmup; // callbacks left until then
+	// CPU time of the audio thread and the audio it put out, [1] while SDL
+	// converts to the device format, [0] while it doesn't have to. CPU time
+	// is a syscall, so it's only taken with -DCPU_COUNTING.
+	_Atomic u64 cpu_ns[2];
+	_Atomic u64 audio_us[2];
+	u64 last_cpu_ns; // 0 after the device was opened
+} AudioStats;
+
 typedef struct {
 	bool want_to_quit;
 
@@ -171,38 +137,100 @@ typedef struct {
 	f32 font_line_skip;
 
 	Playlist playlist;
+	LibraryRefresh *library_refresh;
+	LibraryWatch *library_watch;
+	LibraryDeltas library_deltas;
+	PlaylistChanges playlist_changes;
+	ProbePool *probe;
+	LoudnessPool *loudness;
+	// Tracks get their loudness gain when they're opened, L cycles. Off to
+	// start with: a gain has to go through the mix, even with native output,
+	// and the library only gets analyzed while it's on. The tracks album
+	// mode had the rest of their directory analyzed for.
+	NormalizeMode normalize;
+	i32 album_analyzed[READ_AHEAD_TRACKS + 1];
+	i32 album_analyzed_count;
+	WaveformWorker *waveforms;
+	PlaylistSorts sorts;
+	NameSearch name_search;
+	SortKind sort;
+	// Rows in whatever is on screen: the playlist in the current sort order,
+	// or matching_items while filtering.
 	i32 previous_selected_idx;
 	i32 playlist_selected_idx;
 	i32 playlist_top;
+	// Entry ids, like matching_items and history.
 	i32 playlist_playing_idx;
 
 	SDL_AudioDeviceID audio_device_id;
 	SDL_AudioSpec dst_audio_spec;
+	// With native_output, the device gets opened in the format of each
+	// track, so there's nothing to convert. device_asked is what it was
+	// opened with, device_spec what it actually takes.
+	bool native_output;
+	// how tracks at another rate than the device get resampled, R cycles
+	ResampleQuality resample_quality;
+	SDL_AudioSpec device_asked;
+	SDL_AudioSpec device_spec;
+	i32 device_frames; // in the device's buffer, 0 if SDL didn't say
+	// device_spec when it was opened with dst_audio_spec, what the loader
+	// converts tracks to without native_output
+	SDL_AudioSpec shared_spec;
 	SDL_AudioStream *current_audio_stream;
 
-	SDL_Mutex *avmutex;
-	AVFormatContext *format_context;
-	AVStream *stream;
-	AVCodecContext *codec_context;
-	AVCodec *codec;
-	i32 sample_size;
-	i32 audio_stream_idx;
+	// What the audio callback plays. When it's over and next_track is
+	// there, the callback moves on to it by itself and leaves the old one in
+	// finished_track, for the main thread to free. Otherwise the main thread
+	// only changes these while the device is paused.
+	_Atomic(Track*) track;
+	_Atomic(Track*) next_track;
+	_Atomic(Track*) finished_track;
+	// The callback may go on with next_track without the main thread, it's
+	// in a format the device takes without being opened again. Set before
+	// next_track.
+	_Atomic bool splice_next;
+	Loader *loader;
+	ReadAhead *read_ahead;
+	SeekIndexCache *seeks;
+	// what the loader is opening, if anything
+	bool loading;
+	bool loading_next; // for next_track, not to play right away
+	i32 loading_id;
+	i32 preroll_failed_id; // don't try to open it again every frame
+	i32 shuffle_next; // the random pick for after the current track, -1 if not made yet
+	AudioStats audio_stats;
 	bool eof;
 	bool paused;
 	bool auto_next;
 	bool shuffle;
 	bool seeking;
-
-	AVPacket *current_packet;
-	AVFrame *current_frame;
-	i32 current_frame_sample;
-	f32 last_relative_duration;
+	// Dragging over the progress bar asks for a seek with every mouse
+	// motion. Only the newest target is kept, and it goes to the decoder
+	// once a frame, after the last one there landed. seek_track is the track
+	// it's for, it doesn't carry over to another one.
+	bool seek_pending;
+	f32 seek_target;
+	const Track *seek_track;
+	// for the drag that's going on, printed when it's over with
+	// -DSEEK_COUNTING
+	u32 seeks_asked;
+	u32 seeks_sent;
+	u32 seeks_done_before;
+
+	// Where the device is in the track, see update_clock.
+	PlaybackClock clock;
 
 	Pcg32 rng;
 	InputMode input_mode;
 	CharList filter_prompt;
 	i32 filter_prompt_cursor;
+	// rank fuzzy matches instead of looking for the query as is
+	bool filter_fuzzy;
 	I32List matching_items;
+	FilterWorker *filter;
+	// the filter hasn't said yet where the selected entry ended up, and
+	// nobody moved the selection since
+	bool filter_selection_pending;
 
 	I32List history;
 	i32 history_cursor;
@@ -212,227 +240,17 @@ constexpr u8 font_bytes[] = {
 #embed "golos-ui.ttf"
 };
 
-static void log_err(Result r){
-	switch(r.tag){
-		case ErrFfmpeg:
-			const char tmp[4] = { (char)(-r.rc), (char)(-r.rc >> 8), (char)(-r.rc >> 16), (char)(-r.rc >> 24), };
-			bool printable_tag = 1;
-			for(int i = 0; i < 4; ++i){
-				printable_tag &= (tmp[i] >= 32 && tmp[i] <= 126);
-			}
-			eprint("err: ", r.tag, " (ffmpeg), return code: ", r.rc);
-			if(printable_tag){
-				Slice tmp2 = {tmp, sizeof(tmp)};
-				eprintln(", tag: ", tmp2);
-			} else {
-				eprint("\n");
-			}
-			break;
-		default:
-			eprintln("err: ", r.tag, " ", r.rc);
-			break;
-	}
-}
-
-// funny that the order of parameters in SDL_qsort_r is different from the C stdlib qsort_r
-static int compare_sub(void *arg, const void *pa, const void *pb){
-	const CharList *strdata = arg;
-	const Sub *a = pa;
-	const Sub *b = pb;
-	i32 minlen = MIN(a->len, b->len);
-	i32 d = memcmp(strdata->data + a->start, strdata->data + b->start, minlen);
-	if(d != 0)
-		return d;
-	if(a->len < b->len)
-		return -1;
-	if(a->len > b->len)
-		return 1;
-	return 0;
-}
-
-static void push_string(CharList *l, const char *str, i32 len){
-	if(l->count + len > l->cap){
-		do {
-			l->cap *= 2;
-		} while(l->count + len > l->cap);
-		l->data = realloc(l->data, l->cap * sizeof(l->data[0]));
-	}
-	memcpy(l->data + l->count, str, len);
-	l->count += len;
-}
-
-static void delete_chars(CharList *l, i32 at, i32 n){
-	assert(at + n <= l->count);
-	i32 r = l->count - at + n;
-	memmove(l->data + at, l->data + at + n, r);
-	l->count -= n;
-}
-
-static void insert_string(CharList *l, i32 at, const char *str, i32 len){
-	if(l->count + len > l->cap){
-		do {
-			l->cap *= 2;
-		} while(l->count + len > l->cap);
-		l->data = realloc(l->data, sizeof(l->data[0]) * l->cap);
-	}
-	memmove(l->data + at + len, l->data + at, len);
-	memcpy(l->data + at, str, len);
-	l->count += len;
-}
-
-static void push_entry(MusicEntryList *l, const MusicEntry *entry){
-	if(l->count >= l->cap){
-		l->cap *= 2;
-		l->data = realloc(l->data, sizeof(l->data[0]) * l->cap);
-	}
-	l->data[l->count] = *entry;
-	l->count += 1;
-}
-
-static CharList make_charlist(void){
-	i32 cap = 64;
-	CharList l;
-	l.data = malloc(cap * sizeof(l.data[0]));
-	l.count = 0;
-	l.cap = cap;
-	return l;
-}
-
-static I32List make_i32list(void){
-	i32 cap = 64;
-	I32List l;
-	l.data = malloc(cap * sizeof(l.data[0]));
-	l.count = 0;
-	l.cap = cap;
-	return l;
-}
-
-static void push_i32(I32List *l, i32 x){
-	if(l->count >= l->cap){
-		l->cap *= 2;
-		l->data = realloc(l->data, sizeof(l->data[0]) * l->cap);
-	}
-	l->data[l->count] = x;
-	l->count += 1;
-}
-
-static MusicEntryList make_entrylist(void){
-	i32 cap = 64;
-	MusicEntryList l;
-	l.data = malloc(cap * sizeof(l.data[0]));
-	l.count = 0;
-	l.cap = cap;
-	return l;
-}
-
-static Sub get_extension(const CharList *l){
-	i32 i = l->count - 1;
-	while(i >= 0){
-		if(l->data[i] == '.'){
-			++i;
-			break;
-		}
-		--i;
-	}
-	if(i < 0){
-		return (Sub){-1,-1};
-	} else {
-		return (Sub){i, l->count - 1 - i};
-	}
-}
-
-static i32 get_extension_id(CharList *base, Sub s, const Slice cands[], i32 cand_count){
-	for(i32 i = 0; i < cand_count; ++i){
-		if(cands[i].len == s.len && 0 == memcmp(cands[i].str, base->data + s.start, s.len)){
-			return i;
-		}
-	}
-	return -1;
-}
-
-static Playlist make_playlist_from_directory(Slice directory){
-	AVIODirContext *dirp;
-	int rc = avio_open_dir(&dirp, directory.str, NULL);
-	Playlist pl = {};
-	if(rc < 0){
-		return pl;
-	}
-	CharList fullpath = make_charlist();
-	push_string(&fullpath, directory.str, directory.len);
-	assert(fullpath.count > 0);
-	if(fullpath.data[fullpath.count-1] != '/'){
-		push_string(&fullpath, "/", 1);
-	}
-	i32 baselen = fullpath.count;
-	CharList names = make_charlist();
-	push_string(&names, fullpath.data, fullpath.count);
-	pl.base_name.start = 0;
-	pl.base_name.len = baselen;
-	MusicEntryList entries = make_entrylist();
-
-	while(1){
-		AVIODirEntry *directory_entry;
-		rc = avio_read_dir(dirp, &directory_entry);
-		if(!directory_entry){
-			break;
-		}
-		i64 mtime = directory_entry->modification_timestamp;
-		fullpath.count = baselen;
-		i32 namelen = strlen(directory_entry->name);
-		push_string(&fullpath, directory_entry->name, namelen);
-		push_string(&fullpath, "\0", 1);
-		i64 filemode = directory_entry->type;
-		avio_free_directory_entry(&directory_entry);
-		// TODO: AVIO_ENTRY_SYMBOLIC_LINK
-		// TODO: AVIO_ENTRY_DIRECTORY
-		if(filemode != AVIO_ENTRY_FILE){
-			continue;
-		}
-		Sub ext = get_extension(&fullpath);
-		if(ext.start < 0)
-			continue;
-		i32 ext_id = get_extension_id(&fullpath, ext, accepted_extensions, countof(accepted_extensions));
-		if(ext_id < 0)
-			continue;
-		assert(ext_id < ExtIdCount);
-		MusicEntry music_entry;
-		music_entry.path.start = names.count;
-		music_entry.name_offset = baselen;
-		music_entry.path.len = fullpath.count;
-		music_entry.ext = ext_id;
-		music_entry.mtime = mtime;
-		push_string(&names, fullpath.data, fullpath.count);
-		push_entry(&entries, &music_entry);
-	}
-	free(fullpath.data);
-	avio_close_dir(&dirp);
-	SDL_qsort_r(entries.data, entries.count, sizeof(entries.data[0]), compare_sub, &names);
-	pl.names = names;
-	pl.entries = entries;
-	return pl;
-}
-
-static void print_playlist(const Playlist *pl){
-	for(i32 i = 0; i < pl->entries.count; ++i){
-		Slice tmp = {pl->names.data + pl->entries.data[i].path.start, pl->entries.data[i].path.len};
-		println(tmp);
-	}
-}
-
-static void free_playlist(Playlist *pl){
-	free(pl->entries.data);
-	pl->entries.data = NULL;
-	pl->entries.count =0;
-	pl->entries.cap = 0;
-	free(pl->names.data);
-	pl->names.data = NULL;
-	pl->names.count = 0;
-	pl->names.cap = 0;
-}
-
 static void free_player(Player *player){
 	assert(player != NULL);
+	filter_worker_stop(&player->filter);
+	loader_stop(&player->loader);
 	free_playlist(&player->playlist);
+	free(player->library_deltas.data);
+	free(player->library_deltas.names.data);
+	free(player->playlist_changes.data);
+	free_playlist_sorts(&player->sorts);
+	free_name_search(&player->name_search);
+	free(player->history.data);
 	free(player->matching_items.data);
 	player->matching_items.data = NULL;
 	player->matching_items.count = 0;
@@ -444,6 +262,11 @@ static void free_player(Player *player){
 	if(player->current_audio_stream){
 		SDL_DestroyAudioStream(player->current_audio_stream);
 	}
+	free_track(atomic_exchange(&player->track, NULL));
+	free_track(atomic_exchange(&player->next_track, NULL));
+	free_track(atomic_exchange(&player->finished_track, NULL));
+	read_ahead_stop(&player->read_ahead);
+	seek_index_cache_stop(&player->seeks);
 }
 
 static void fill_silence(SDL_AudioStream *stream, int amount){
@@ -456,155 +279,165 @@ static void fill_silence(SDL_AudioStream *stream, int amount){
 	}
 }
 
-static void audio_stream_callback(void *userdata, SDL_AudioStream *stream, int additional_amount, int total_amount)
-{
-	Player *player = (Player*)userdata;
+static bool same_spec(const SDL_AudioSpec *a, const SDL_AudioSpec *b){
+	return a->format == b->format && a->channels == b->channels && a->freq == b->freq;
+}
+
+// The track is over. If the next one is ready, its first sample goes right
+// after the last one of this track. The stream converts whatever was put in
+// before a format change in the old format, so that's fine too.
+static Track *splice_next_track(Player *player, SDL_AudioStream *stream, Track *track){
+	// the main thread hasn't caught up with the last one yet
+	if(atomic_load_explicit(&player->finished_track, memory_order_acquire) != NULL)
+		return NULL;
+	if(!atomic_load_explicit(&player->splice_next, memory_order_acquire))
+		return NULL;
+	Track *next = atomic_exchange_explicit(&player->next_track, NULL, memory_order_acq_rel);
+	if(next == NULL)
+		return NULL;
+	if(!same_spec(&next->spec, &track->spec)){
+		SDL_SetAudioStreamFormat(stream, &next->spec, NULL);
+		// the stream sets itself up for the new format
+		player->audio_stats.warmup = AUDIO_WARMUP_CALLBACKS;
+	}
+	atomic_store_explicit(&player->track, next, memory_order_release);
+	atomic_store_explicit(&player->finished_track, track, memory_order_release);
+	return next;
+}
 
-	if(player->paused){
+// What the device plays right now is behind what was read from the decoder
+// by what's still queued in the stream, in the track's format, and by the
+// device's buffer. Right after a splice that can reach back into the last
+// track, the new one is at its start until then.
+static void update_clock(Player *player, SDL_AudioStream *stream, const Track *track){
+	const i32 rate = decoder_rate(track->decoder);
+	const i32 queued = SDL_GetAudioStreamQueued(stream);
+	f64 latency = (f64)MAX(queued, 0) / SDL_AUDIO_FRAMESIZE(track->spec) / MAX(track->spec.freq, 1);
+	latency += (f64)player->device_frames / MAX(player->device_spec.freq, 1);
+	const i64 ahead = (i64)(latency * rate);
+	const i64 sample = decoder_position(track->decoder) - ahead;
+	playback_clock_set(&player->clock, &(PlaybackTime){
+		.id = track->id,
+		.sample = MAX(sample, (i64)0),
+		.samples = decoder_samples(track->decoder),
+		.rate = rate,
+		.at_ns = SDL_GetTicksNS(),
+		.ahead = ahead,
+		.running = 1,
+	});
+}
+
+// Runs on SDL's audio thread. Everything that could take a while happens on
+// the decoder thread, this only copies what it decoded already.
+static void fill_audio(Player *player, SDL_AudioStream *stream, int additional_amount){
+	Track *track = atomic_load_explicit(&player->track, memory_order_acquire);
+
+	if(player->paused || track == NULL){
 		fill_silence(stream, additional_amount);
 		return;
 	}
 
-	SDL_LockMutex(player->avmutex);
-
 	while(additional_amount > 0){
-		// get a new packet if we need one
-		if(NULL == player->current_packet){
-			player->current_frame = NULL;
-			player->current_frame_sample = 0;
-			AVPacket *packet = av_packet_alloc();
-			while(1){
-				// get a packet
-				packet->stream_index = player->stream->index;
-				if(0 == player->eof){
-					int rc = av_read_frame(player->format_context, packet);
-					if(rc >= 0){
-						if(packet->stream_index != player->stream->index){
-							continue;
-						} else {
-							break;
-						}
-					} else {
-						// eof
-						if(rc == AVERROR_EOF){
-							player->eof = 1;
-						}
-						// eof
-						if(player->format_context->pb && player->format_context->pb->eof_reached){
-							player->eof = 1;
-						}
-						// actual error
-						if(rc < 0 && 0 == player->eof){
-							av_packet_free(&packet);
-							packet = NULL;
-						}
-					}
-				}
-				if(player->eof){
-					av_packet_free(&packet);
-					packet = NULL;
-					break;
-				}
-				if(NULL == packet){
-					break;
+		const u8 *data;
+		const i32 n = decoder_peek(track->decoder, &data, additional_amount);
+		if(n == 0){
+			// either the track is over, or the decoder fell behind.
+			if(decoder_drained(track->decoder)){
+				Track *next = splice_next_track(player, stream, track);
+				if(next != NULL){
+					track = next;
+					continue;
 				}
+				player->eof = 1;
 			}
-			if(packet != NULL){
-				player->current_packet = packet;
-				int rc = avcodec_send_packet(player->codec_context, packet);
-				if(rc < 0){
-					log_err(ffmpegerr(rc));
-				}
-				assert(rc >= 0);
-			}
-		}
-		if(player->eof){
 			fill_silence(stream, additional_amount);
 			break;
 		}
-		// just for now
-		assert(player->current_packet != NULL);
-		assert(player->current_packet->size > 0);
-
-		// get a new frame if we need one. this may require us to get a new packet.
-		if(NULL == player->current_frame){
-			AVFrame *decoded_frame = av_frame_alloc();
-			int rc = avcodec_receive_frame(player->codec_context, decoded_frame);
-			if(rc == AVERROR(EAGAIN) || rc == AVERROR_EOF){
-				av_frame_free(&decoded_frame);
-				av_packet_free(&player->current_packet);
-				player->current_packet = NULL;
-			} else {
-				assert(rc >= 0);
-				player->current_frame = decoded_frame;
-			}
-		}
-		if(NULL == player->current_frame){
-			assert(player->current_packet == NULL);
-			continue;
-		}
+		SDL_PutAudioStreamData(stream, data, n);
+		decoder_consume(track->decoder, n);
+		const bool converting = !same_spec(&track->spec, &player->device_spec);
+		const u64 bytes_per_second = (u64)SDL_AUDIO_FRAMESIZE(track->spec) * (u64)track->spec.freq;
+		const u64 us = (u64)n * 1000000 / MAX(bytes_per_second, 1u);
+		atomic_fetch_add_explicit(&player->audio_stats.audio_us[converting], us, memory_order_relaxed);
+		if(atomic_load_explicit(&track->first_audio_ns, memory_order_relaxed) == 0)
+			atomic_store_explicit(&track->first_audio_ns, SDL_GetTicksNS(), memory_order_relaxed);
+		additional_amount -= n;
+	}
+	update_clock(player, stream, track);
+}
 
-		const i32 channel_count = player->codec_context->ch_layout.nb_channels;
-
-		const int sample_size = av_get_bytes_per_sample(player->codec_context->sample_fmt);
-		bool is_planar = 0;
-		switch(player->codec_context->sample_fmt){
-		case AV_SAMPLE_FMT_U8:
-		case AV_SAMPLE_FMT_U8P:
-		case AV_SAMPLE_FMT_S16P:
-		case AV_SAMPLE_FMT_S32P:
-		case AV_SAMPLE_FMT_FLTP:
-			is_planar = 1;
-			break;
-		default:
-			is_planar = 0;
-			break;
-		}
+static void count_callback(AudioStats *stats, u64 allocs){
+	atomic_fetch_add_explicit(&stats->callbacks, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&stats->allocs, allocs, memory_order_relaxed);
+	atomic_store_explicit(&stats->last_allocs, (u32)allocs, memory_order_relaxed);
+	if(stats->warmup > 0){
+		stats->warmup -= 1;
+		return;
+	}
+	if(allocs > atomic_load_explicit(&stats->max_allocs, memory_order_relaxed))
+		atomic_store_explicit(&stats->max_allocs, (u32)allocs, memory_order_relaxed);
+	assertm(allocs == 0, "the audio callback allocated ", allocs, " times");
+}
 
-		i32 current_sample = player->current_frame_sample;
-		// TODO: i think i should use linesize here, because for packed audio i don't count the number of samples in each channel, but for all channels.
-		const i32 frame_sample_count = is_planar ? player->current_frame->nb_samples : channel_count * player->current_frame->nb_samples;
-		assert(channel_count < 8);
-		if(is_planar){
-			int how_many_samples = frame_sample_count - current_sample;
-			int how_many_bytes = how_many_samples * (channel_count * sample_size);
-			if(how_many_bytes > additional_amount){
-				how_many_samples = additional_amount / (channel_count * sample_size);
-			}
-			u8 const *ptrs[8];
-			for(int ch = 0; ch < channel_count; ++ch){
-				ptrs[ch] = player->current_frame->data[ch] + current_sample * sample_size;
-			}
-			SDL_PutAudioStreamPlanarData(stream, (const void * const*)ptrs, channel_count, how_many_samples);
-			additional_amount -= how_many_samples * (channel_count * sample_size);
-			current_sample += how_many_samples;
-		} else {
-			int how_many_samples = frame_sample_count - current_sample;
-			int how_many_bytes = how_many_samples * channel_count;
-			if(how_many_bytes > additional_amount){
-				how_many_bytes = additional_amount;
-				how_many_samples = how_many_bytes / channel_count;
-			}
-			SDL_PutAudioStreamData(stream, player->current_frame->data[0] + current_sample * sample_size, how_many_bytes);
-			additional_amount -= how_many_bytes;
-			current_sample += how_many_samples;
-		}
-		// Should have exhausted the current frame or provided enough data to the sdl audio stream (or both).
-		assert(current_sample == frame_sample_count || 0 == additional_amount);
+#ifdef CPU_COUNTING
+static u64 thread_cpu_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (u64)ts.tv_sec * 1000000000 + (u64)ts.tv_nsec;
+}
+#endif
 
-		player->last_relative_duration = (player->current_frame->pts + (player->current_frame_sample / (f32)player->current_frame->nb_samples) * player->current_frame->duration) / player->stream->duration;
+// SDL converts what the callback put in after it returns, on the same
+// thread. So the CPU time from one callback to the next is all it takes to
+// get that audio to the device.
+static void count_cpu(Player *player){
+#ifdef CPU_COUNTING
+	AudioStats *stats = &player->audio_stats;
+	const Track *track = atomic_load_explicit(&player->track, memory_order_acquire);
+	const u64 now = thread_cpu_ns();
+	if(stats->last_cpu_ns != 0 && track != NULL){
+		const bool converting = !same_spec(&track->spec, &player->device_spec);
+		atomic_fetch_add_explicit(&stats->cpu_ns[converting], now - stats->last_cpu_ns, memory_order_relaxed);
+	}
+	stats->last_cpu_ns = now;
+#endif
+}
 
-		player->current_frame_sample = current_sample;
-		if(player->current_frame_sample == frame_sample_count){
-			av_frame_free(&player->current_frame);
-			player->current_frame = NULL;
-			player->current_frame_sample = 0;
-		}
+static void audio_stream_callback(void *userdata, SDL_AudioStream *stream, int additional_amount, int total_amount)
+{
+	Player *player = (Player*)userdata;
+	count_cpu(player);
+	const u64 allocs = thread_allocs();
+	fill_audio(player, stream, additional_amount);
+	count_callback(&player->audio_stats, thread_allocs() - allocs);
+}
 
+#if defined(ALLOC_COUNTING) || defined(CPU_COUNTING)
+static void print_audio_stats(const AudioStats *stats){
+	const u64 callbacks = atomic_load_explicit(&stats->callbacks, memory_order_relaxed);
+	const u64 allocs = atomic_load_explicit(&stats->allocs, memory_order_relaxed);
+	const u32 max_allocs = atomic_load_explicit(&stats->max_allocs, memory_order_relaxed);
+#ifdef ALLOC_COUNTING
+	eprintln(callbacks, " audio callbacks, ", allocs, " allocations in them, at most ", max_allocs, " in one once warmed up");
+#else
+	eprintln(callbacks, " audio callbacks");
+#endif
+	static const char *const paths[2] = {"as is", "converted"};
+	for(i32 i = 0; i < 2; ++i){
+		const u64 audio_us = atomic_load_explicit(&stats->audio_us[i], memory_order_relaxed);
+		const u64 cpu_ns = atomic_load_explicit(&stats->cpu_ns[i], memory_order_relaxed);
+		if(audio_us == 0)
+			continue;
+		const f32 seconds = (f32)audio_us / 1e6f;
+#ifdef CPU_COUNTING
+		const f32 cpu_us = (f32)cpu_ns / 1e3f / seconds;
+		eprintln(seconds, " s of audio ", paths[i], ", ", cpu_us, " us of CPU per second of it");
+#else
+		eprintln(seconds, " s of audio ", paths[i]);
+#endif
 	}
-
-	SDL_UnlockMutex(player->avmutex);
 }
+#endif
 
 // TODO: iterate utf8 codepoints, draw unicode text. don't care about shaping
 // everything correctly, but we should at least be able to draw more than
@@ -678,15 +511,76 @@ static f32 measure_text_advance(Glyph *ascii_glyphs, Slice text){
 	return res;
 }
 
+static i32 row_id(const I32List *rows, i32 row){
+	return row >= 0 && row < rows->count ? rows->data[row] : -1;
+}
+
+// Row of id in the order player_sorted returned last.
+static i32 player_row_of(const Player *player, i32 id){
+	return sorted_row_of(&player->sorts, &player->playlist, player->sort, id);
+}
+
+static const I32List *player_sorted(Player *player){
+	// The duration order gets built again while durations come in. The
+	// selection is a row in it, keep it on the same entry.
+	PlaylistSorts *s = &player->sorts;
+	const u32 version = s->version;
+	i32 *selected = player->input_mode == InputDefault ? &player->playlist_selected_idx : &player->previous_selected_idx;
+	const i32 selected_id = player->sort != Sort_path && s->built[player->sort] ? row_id(&s->perm[player->sort], *selected) : -1;
+	const I32List *rows = playlist_sorted(s, &player->playlist, player->probe, player->sort);
+	if(s->version != version && selected_id >= 0){
+		const i32 row = player_row_of(player, selected_id);
+		if(row >= 0)
+			*selected = row;
+	}
+	return rows;
+}
+
+static const I32List *player_rows(Player *player){
+	return player->input_mode == InputDefault ? player_sorted(player) : &player->matching_items;
+}
+
+// Row of id in the sorted playlist, or keep the old row if it's gone.
+static i32 follow_id(Player *player, i32 id, i32 row){
+	const I32List *rows = player_sorted(player);
+	i32 res = id >= 0 ? player_row_of(player, id) : -1;
+	if(res < 0)
+		res = MIN(row, rows->count - 1);
+	return MAX(res, 0);
+}
+
+static Slice format_duration(char *buf, i32 cap, f32 seconds){
+	i32 s = (i32)seconds;
+	i32 n;
+	if(s >= 3600)
+		n = snprintf(buf, cap, "%d:%02d:%02d", s / 3600, s / 60 % 60, s % 60);
+	else
+		n = snprintf(buf, cap, "%d:%02d", s / 60, s % 60);
+	return (Slice){buf, MIN(n, cap - 1)};
+}
+
+// Rows of the playlist that fit on screen.
+static i32 visible_rows(const Player *player){
+	// because of the header line, we do height - font_line_skip.
+	return (i32)((player->playlist_height - player->font_line_skip)/ player->font_line_skip);
+}
+
 static void draw_playlist(SDL_Renderer *renderer, Player *player, f32 x, f32 y){
-	if(player->playlist.entries.count <= 0){
+	if(player->playlist.order.count <= 0){
 		return;
 	}
 
 	if(player->input_mode == InputDefault){
-		draw_text(renderer, player->ascii_glyphs, (Slice){player->playlist.names.data + player->playlist.base_name.start, player->playlist.base_name.len}, x, y, player->window_width);
+		Slice sort_name = sort_kind_names[player->sort];
+		f32 sort_w = measure_text_advance(player->ascii_glyphs, sort_name);
+		draw_text(renderer, player->ascii_glyphs, sort_name, player->window_width - sort_w, y, sort_w);
+		draw_text(renderer, player->ascii_glyphs, (Slice){player->playlist.names.data + player->playlist.base_name.start, player->playlist.base_name.len}, x, y, player->window_width - sort_w);
 		y += player->font_line_skip;
 	} else if(player->input_mode == InputFilter){
+		if(player->filter_fuzzy){
+			f32 w = measure_text_advance(player->ascii_glyphs, S("fuzzy"));
+			draw_text(renderer, player->ascii_glyphs, S("fuzzy"), player->window_width - w, y, w);
+		}
 		draw_text(renderer, player->ascii_glyphs, S("Search: "), x, y, player->window_width);
 		f32 x2 = measure_text_advance(player->ascii_glyphs, S("Search: "));
 		Slice filter_query_text = {player->filter_prompt.data, player->filter_prompt.count};
@@ -697,8 +591,7 @@ static void draw_playlist(SDL_Renderer *renderer, Player *player, f32 x, f32 y){
 	if(player->playlist_selected_idx < player->playlist_top){
 		player->playlist_top = player->playlist_selected_idx;
 	}
-	// because of the header line, we do height - font_line_skip.
-	const int num_visible_entries = (int)((player->playlist_height - player->font_line_skip)/ player->font_line_skip);
+	const int num_visible_entries = visible_rows(player);
 	int bottom = player->playlist_top + num_visible_entries;
 	if(player->playlist_selected_idx >= bottom){
 		player->playlist_top = player->playlist_selected_idx - num_visible_entries + 1;
@@ -707,16 +600,29 @@ static void draw_playlist(SDL_Renderer *renderer, Player *player, f32 x, f32 y){
 	assertm(relative_playlist_selected_idx >= 0, relative_playlist_selected_idx, " ", player->playlist_top, " ", num_visible_entries);
 	assertm(relative_playlist_selected_idx <= num_visible_entries, relative_playlist_selected_idx, " ", player->playlist_top, " ", num_visible_entries);
 	int i = player->playlist_top;
-	int max_i = player->input_mode == InputDefault ? player->playlist.entries.count : player->matching_items.count;
+	const I32List *rows = player_rows(player);
+	if(player->playlist_top < rows->count){
+		i32 visible = MIN(num_visible_entries, rows->count - player->playlist_top);
+		probe_prioritize(player->probe, &player->playlist, rows->data + player->playlist_top, visible);
+	}
 	while(1){
-		if(i >= max_i)
+		if(i >= rows->count)
 			break;
-		const i32 j = player->input_mode == InputDefault ? i : player->matching_items.data[i];
+		const i32 j = rows->data[i];
 		Slice name = playlist_entry_name(player, j, false);
+		f32 name_w = player->window_width;
+		const TrackInfo *info = probe_info(player->probe, &player->playlist, j);
+		if(info && info->state == ProbeDone){
+			char buf[32];
+			Slice duration = format_duration(buf, sizeof(buf), info->duration);
+			f32 w = measure_text_advance(player->ascii_glyphs, duration);
+			draw_text(renderer, player->ascii_glyphs, duration, player->window_width - w, y, w);
+			name_w -= w + player->ascii_glyphs['0'].advance;
+		}
 		if(i == player->playlist_selected_idx){
-			draw_text_colored(renderer, player->ascii_glyphs, name, x, y, player->window_width, player->font_line_skip, (SDL_Color){.r=0x80, .g=0x80, .b=0x80, .a=0x80});
+			draw_text_colored(renderer, player->ascii_glyphs, name, x, y, name_w, player->font_line_skip, (SDL_Color){.r=0x80, .g=0x80, .b=0x80, .a=0x80});
 		} else {
-			draw_text(renderer, player->ascii_glyphs, name, x, y, player->window_width);
+			draw_text(renderer, player->ascii_glyphs, name, x, y, name_w);
 		}
 		y += player->font_line_skip;
 		if(y >= player->playlist_height){
@@ -727,18 +633,66 @@ static void draw_playlist(SDL_Renderer *renderer, Player *player, f32 x, f32 y){
 }
 
 
+// Where a drag over the progress bar is seeking to, until that's done, and
+// where playback is otherwise.
+static f32 shown_progress(Player *player){
+	if(player->seeks_asked > 0)
+		return player->seek_target;
+	const PlaybackTime t = playback_clock_get(&player->clock);
+	return playback_relative(&t, SDL_GetTicksNS());
+}
+
 static void draw_progress_bar(SDL_Renderer *renderer, Player *player, f32 x, f32 y){
 	if(player->playlist_playing_idx < 0)
 		return;
 
-	// Technically this is a race condition. last_relative_duration is set by
-	// the audio callback thread, but this function is called from the main
-	// thread.  But I don't mind. Worst that can happen is that we read a stale
-	// value for the progress bar.
-	f32 w = player->last_relative_duration * player->max_progress_bar_width;
-	SDL_SetRenderDrawColor(renderer, 0xff, 0xff, 0xff, 0xff);
-	SDL_FRect rect = {.x=0, .y = y, .w = w, .h = player->font_line_skip, };
-	SDL_RenderFillRect(renderer, &rect);
+	f32 w = shown_progress(player) * player->max_progress_bar_width;
+	Waveform wave;
+	if(!waveform_get(player->waveforms, &player->playlist, player->playlist_playing_idx, &wave)){
+		SDL_SetRenderDrawColor(renderer, 0xff, 0xff, 0xff, 0xff);
+		SDL_FRect rect = {.x=0, .y = y, .w = w, .h = player->font_line_skip, };
+		SDL_RenderFillRect(renderer, &rect);
+		return;
+	}
+	// One line a pixel, from the lowest to the highest sample under it.
+	// What's played is white.
+	const i32 width = (i32)player->max_progress_bar_width;
+	i32 count;
+	const WavePeak *peaks = waveform_level(&wave, width, &count);
+	const f32 half = player->font_line_skip / 2;
+	SDL_FRect lines[256];
+	i32 n = 0;
+	for(i32 played = 1; played >= 0; --played){
+		const u8 c = played ? 0xff : 0x60;
+		SDL_SetRenderDrawColor(renderer, c, c, c, 0xff);
+		const i32 from = played ? 0 : (i32)w;
+		const i32 to = played ? (i32)w : width;
+		for(i32 px = from; px < to; ++px){
+			const i32 first = (i32)((i64)px * count / width);
+			const i32 end = MAX(first + 1, (i32)((i64)(px + 1) * count / width));
+			i8 lo = 127;
+			i8 hi = -127;
+			for(i32 i = first; i < end; ++i){
+				lo = MIN(lo, peaks[i].min);
+				hi = MAX(hi, peaks[i].max);
+			}
+			const f32 top = y + half - hi * half / 127;
+			const f32 bottom = y + half - lo * half / 127;
+			lines[n++] = (SDL_FRect){.x = (f32)px, .y = top, .w = 1, .h = MAX(bottom - top, 1.0f)};
+			if(n == countof(lines)){
+				SDL_RenderFillRects(renderer, lines, n);
+				n = 0;
+			}
+		}
+		SDL_RenderFillRects(renderer, lines, n);
+		n = 0;
+	}
+}
+
+// Indicators of something with more than two settings show the first letter
+// of the one it's on.
+static char mode_letter(const char *name){
+	return (char)SDL_toupper((unsigned char)name[0]);
 }
 
 static void draw_ui_indicators(SDL_Renderer *renderer, Player *player, f32 x, f32 y){
@@ -746,129 +700,119 @@ static void draw_ui_indicators(SDL_Renderer *renderer, Player *player, f32 x, f3
 	SDL_RenderFillRect(renderer, &rect);
 	SDL_Color shuffle_bg = player->shuffle ? (SDL_Color){0x60, 0x60, 0x60, 0x60} : (SDL_Color){};
 	SDL_Color auto_next_bg = player->auto_next ? (SDL_Color){0x60, 0x60, 0x60, 0x60} : (SDL_Color){};
+	SDL_Color native_bg = player->native_output ? (SDL_Color){0x60, 0x60, 0x60, 0x60} : (SDL_Color){};
 	draw_text_colored(renderer, player->ascii_glyphs, S("S"), x, y, player->window_width - x, player->font_line_skip, shuffle_bg);
 	x += player->ascii_glyphs['S'].advance;
 	draw_text_colored(renderer, player->ascii_glyphs, S("X"), x, y, player->window_width - x, player->font_line_skip, auto_next_bg);
+	x += player->ascii_glyphs['X'].advance;
+	draw_text_colored(renderer, player->ascii_glyphs, S("P"), x, y, player->window_width - x, player->font_line_skip, native_bg);
+	x += player->ascii_glyphs['P'].advance;
+	const char quality = mode_letter(resample_quality_name(player->resample_quality));
+	draw_text(renderer, player->ascii_glyphs, (Slice){&quality, 1}, x, y, player->window_width - x);
+	x += player->ascii_glyphs[(u8)quality].advance;
+	SDL_Color normalize_bg = player->normalize != NormalizeOff ? (SDL_Color){0x60, 0x60, 0x60, 0x60} : (SDL_Color){};
+	const char normalize = mode_letter(normalize_mode_name(player->normalize));
+	draw_text_colored(renderer, player->ascii_glyphs, (Slice){&normalize, 1}, x, y, player->window_width - x, player->font_line_skip, normalize_bg);
+}
+
+// Room for every letter an indicator can show, so the progress bar doesn't
+// change its width with them.
+static f32 indicators_width(Player *player){
+	f32 w = player->ascii_glyphs['S'].advance + player->ascii_glyphs['X'].advance + player->ascii_glyphs['P'].advance;
+	f32 quality_w = 0;
+	for(i32 q = 0; q < ResampleQualityCount; ++q){
+		const char c = mode_letter(resample_quality_name(q));
+		quality_w = MAX(quality_w, measure_text_advance(player->ascii_glyphs, (Slice){&c, 1}));
+	}
+	f32 normalize_w = 0;
+	for(i32 m = 0; m < NormalizeModeCount; ++m){
+		const char c = mode_letter(normalize_mode_name(m));
+		normalize_w = MAX(normalize_w, measure_text_advance(player->ascii_glyphs, (Slice){&c, 1}));
+	}
+	return w + quality_w + normalize_w;
 }
 
 static void draw_currently_playing(SDL_Renderer *renderer, Player *player, f32 x, f32 y){
 	if(player->playlist_playing_idx < 0)
 		return;
 	Slice name = playlist_entry_name(player, player->playlist_playing_idx, false);
-	draw_text(renderer, player->ascii_glyphs, name, x, y, player->window_width);
+	// elapsed and remaining on the right
+	const PlaybackTime t = playback_clock_get(&player->clock);
+	f32 time_w = 0;
+	if(t.id >= 0 && t.rate > 0){
+		const u64 now = SDL_GetTicksNS();
+		char buf[64];
+		const Slice elapsed = format_duration(buf, 32, (f32)playback_seconds(&t, playback_elapsed(&t, now)));
+		i32 len = elapsed.len;
+		if(t.samples > 0){
+			memcpy(buf + len, " -", 2);
+			len += 2;
+			len += format_duration(buf + len, (i32)sizeof(buf) - len, (f32)playback_seconds(&t, playback_remaining(&t, now))).len;
+		}
+		const Slice text = {buf, len};
+		time_w = measure_text_advance(player->ascii_glyphs, text);
+		draw_text(renderer, player->ascii_glyphs, text, player->window_width - time_w, y, time_w);
+	}
+	draw_text(renderer, player->ascii_glyphs, name, x, y, MAX(player->window_width - time_w - x, 0.0f));
 }
 
 //static void libavcodec_log_callback(void*,int,const char*, va_list){
 //}
 
 
-static Result player_load_audio(Player *player, Slice path)
-{
-	SDL_PauseAudioDevice(player->audio_device_id);
-
-	SDL_LockMutex(player->avmutex);
-
-	// free all existing decoding state.
-	if(player->format_context){
-		avformat_free_context(player->format_context);
-		player->format_context = NULL;
-	}
-	if(player->stream){
-		player->stream = NULL;
-	}
-	if(player->codec_context){
-		avcodec_free_context(&player->codec_context);
-		player->codec_context = NULL;
-	}
-	if(player->codec){
-		player->codec = NULL;
-	}
-	player->sample_size = 0;
-	player->audio_stream_idx = 0;
+// Drops all tracks, the device has to be paused.
+static void stop_tracks(Player *player){
+	loader_discard(player->loader, atomic_exchange(&player->track, NULL));
+	loader_discard(player->loader, atomic_exchange(&player->next_track, NULL));
+	loader_discard(player->loader, atomic_exchange(&player->finished_track, NULL));
 	player->eof = 0;
-	if(player->current_packet){
-		av_packet_free(&player->current_packet);
-		player->current_packet = NULL;
-	}
-	if(player->current_frame){
-		av_frame_free(&player->current_frame);
-		player->current_frame = NULL;
-		player->current_frame_sample = 0;
-	}
-	player->last_relative_duration = 0.0f;
-
-	SDL_UnlockMutex(player->avmutex);
+	playback_clock_set(&player->clock, &(PlaybackTime){.id = -1});
+	player->preroll_failed_id = -1;
+}
 
-	AVFormatContext *format_ctx = avformat_alloc_context();
-	if(format_ctx == NULL){
-		return R(ErrAllocFailed);
-	}
+// Stops the clock where the device stopped, or starts it again from there.
+// The device has to be paused, so the callback doesn't write it too.
+static void hold_clock(Player *player, bool running){
+	PlaybackTime t = playback_clock_get(&player->clock);
+	const u64 now = SDL_GetTicksNS();
+	const i64 at = playback_elapsed(&t, now);
+	t.ahead -= at - t.sample;
+	t.sample = at;
+	t.at_ns = now;
+	t.running = running;
+	playback_clock_set(&player->clock, &t);
+}
 
-	int rc = avformat_open_input(&format_ctx, path.str, NULL, NULL);
-	if(rc < 0){
-		return ffmpegerr(rc);
+// Opens the device in spec, or as close to it as it gets.
+static bool open_audio_device(Player *player, const SDL_AudioSpec *spec){
+	if(player->audio_device_id)
+		SDL_CloseAudioDevice(player->audio_device_id);
+	player->audio_device_id = SDL_OpenAudioDevice(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK, spec);
+	if(player->audio_device_id == 0)
+		return 0;
+	SDL_PauseAudioDevice(player->audio_device_id);
+	player->device_asked = *spec;
+	if(!SDL_GetAudioDeviceFormat(player->audio_device_id, &player->device_spec, &player->device_frames)){
+		player->device_spec = *spec;
+		player->device_frames = 0;
 	}
-	rc = avformat_find_stream_info(format_ctx, NULL);
-	if(rc < 0){
-		return ffmpegerr(rc);
+	if(same_spec(spec, &player->dst_audio_spec) && !same_spec(&player->device_spec, &player->shared_spec)){
+		player->shared_spec = player->device_spec;
+		loader_set_output(player->loader, &player->shared_spec, player->native_output, player->resample_quality);
 	}
+	// a new device, a new thread
+	player->audio_stats.last_cpu_ns = 0;
+	return 1;
+}
 
-	u32 audio_stream_idx = 0;
-	for(; audio_stream_idx < format_ctx->nb_streams; audio_stream_idx += 1){
-		if(format_ctx->streams[audio_stream_idx]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO){
-			break;
-		}
-	}
-	if(audio_stream_idx == format_ctx->nb_streams){
-		return R(ErrNoAudioStream);
-	}
-	AVStream *stream = format_ctx->streams[audio_stream_idx];
-	const AVCodec *codec = avcodec_find_decoder(stream->codecpar->codec_id);
-	if(codec == NULL){
-		return R(ErrNoCodecFound);
-	}
-	AVCodecContext *codec_context = avcodec_alloc_context3(codec);
-	if(codec_context == NULL){
-		return R(ErrAllocFailed);
-	}
-	avcodec_parameters_to_context(codec_context, stream->codecpar);
-	AVDictionary **codec_options = NULL;
-	rc = avcodec_open2(codec_context, codec, codec_options);
-	if(rc < 0){
-		return ffmpegerr(rc);
-	}
+static void play_track(Player *player, Track *track)
+{
+	SDL_PauseAudioDevice(player->audio_device_id);
 
-	SDL_AudioSpec src_spec;
-	src_spec.channels = codec_context->ch_layout.nb_channels;
-	src_spec.freq = codec_context->sample_rate;
-	int sample_size;
-	switch(codec_context->sample_fmt){
-		case AV_SAMPLE_FMT_U8:
-		case AV_SAMPLE_FMT_U8P:
-			src_spec.format = SDL_AUDIO_U8;
-			sample_size = 1;
-			break;
-		case AV_SAMPLE_FMT_S16:
-		case AV_SAMPLE_FMT_S16P:
-			src_spec.format = SDL_AUDIO_S16;
-			sample_size = 2;
-			break;
-		case AV_SAMPLE_FMT_S32:
-		case AV_SAMPLE_FMT_S32P:
-			src_spec.format = SDL_AUDIO_S32;
-			sample_size = 4;
-			break;
-		case AV_SAMPLE_FMT_FLT:
-		case AV_SAMPLE_FMT_FLTP:
-			src_spec.format = SDL_AUDIO_F32;
-			sample_size = 4;
-			break;
-		default:
-			sample_size = 0;
-			break;
-	}
-	// assertm(sample_size == 2, sample_size);
-	// println("src spec ", src_spec.format,  ", ", src_spec.channels, ", ", src_spec.freq);
+	// The callback isn't running while the device is paused, so the
+	// tracks can go.
+	stop_tracks(player);
+	player->audio_stats.warmup = AUDIO_WARMUP_CALLBACKS;
 	// println("dst spec ", player->dst_audio_spec.format,  ", ", player->dst_audio_spec.channels, ", ", player->dst_audio_spec.freq);
 
 	if(player->current_audio_stream){
@@ -876,7 +820,13 @@ static Result player_load_audio(Player *player, Slice path)
 		SDL_DestroyAudioStream(player->current_audio_stream);
 		player->current_audio_stream = NULL;
 	}
-	SDL_AudioStream *audio_stream = SDL_CreateAudioStream(&src_spec, &player->dst_audio_spec);
+	const SDL_AudioSpec *want = player->native_output ? &track->spec : &player->dst_audio_spec;
+	if(!same_spec(want, &player->device_asked) && !open_audio_device(player, want)){
+		eprintln("failed to open audio device in the format of the track");
+		if(!open_audio_device(player, &player->dst_audio_spec))
+			assertm(0, "failed to open audio device");
+	}
+	SDL_AudioStream *audio_stream = SDL_CreateAudioStream(&track->spec, &player->device_spec);
 	void *audio_callback_userdata = player;
 	bool ok;
 	ok = SDL_SetAudioStreamGetCallback(audio_stream, audio_stream_callback, audio_callback_userdata);
@@ -885,83 +835,210 @@ static Result player_load_audio(Player *player, Slice path)
 	assert(ok);
 	player->current_audio_stream = audio_stream;
 
-	player->format_context = format_ctx;
-	player->stream = stream;
-	player->codec_context = codec_context;
-	player->audio_stream_idx = audio_stream_idx;
-	player->sample_size = sample_size;
+	atomic_store(&player->track, track);
 	SDL_ResumeAudioDevice(player->audio_device_id);
-
-	return R(Ok);
 }
 
-
 static void update_window_height(Player *player, f32 w, f32 h){
 	player->window_width = w;
 	player->window_height = h;
 	int row_count = (int)(w / player->font_line_skip);
 	float bottom_pad = player->font_line_skip * 2;
 	player->playlist_height = h - bottom_pad;
-	player->max_progress_bar_width = w - player->ascii_glyphs['S'].advance - player->ascii_glyphs['X'].advance - 2;
+	player->max_progress_bar_width = w - indicators_width(player) - 2;
 }
 
-static bool is_alpha(char c){
-	return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+// Keeps the entry with selected_id selected. If it doesn't match anymore,
+// the closest match after it gets selected. The matches come in over the
+// next few frames, see take_filter_results.
+static void update_playlist_filter(Player *player, i32 selected_id){
+	const FilterQuery q = {
+		.query = player->filter_prompt.data,
+		.len = player->filter_prompt.count,
+		.fuzzy = player->filter_fuzzy,
+		.order = player_sorted(player),
+		.sort = player->sort,
+		.sort_version = player->sorts.version,
+		.selected_id = selected_id,
+		.top = visible_rows(player),
+	};
+	filter_submit(player->filter, &q);
+	player->filter_selection_pending = 1;
 }
 
-static void update_playlist_filter(Player *player){
-	// TODO: be smarter about resetting the selected index. try to keep the same track. otherwise take the closest idx that passes the filter.
-	player->matching_items.count = 0;
-	player->playlist_selected_idx = 0;
-	player->playlist_top = 0;
-	for(i32 i = 0; i < player->playlist.entries.count; ++i){
-		i32 j = 0;
-		i32 k = 0;
-		bool ok = 1;
-		Slice name = playlist_entry_name(player, i, false);
-		// TODO: better fuzzy match with multiple separate words maybe?
-		while(k < player->filter_prompt.count){
-			if(j >= name.len){
-				ok = 0;
-				break;
-			}
-			const char a = name.str[j];
-			const char b = player->filter_prompt.data[k];
-			if(a == b || (is_alpha(a) && is_alpha(b) && (a | 32) == (b | 32))) {
-				j++;
-				k++;
-			} else {
-				j++;
-				k = 0;
-			}
-		}
-		if(ok){
-			push_i32(&player->matching_items, i);
+static void take_filter_results(Player *player){
+	i32 selected = -1;
+	// Waiting a little for a query that was just typed gets its first
+	// screenful into this frame instead of the next one.
+	if(!filter_poll(player->filter, &player->matching_items, &selected, 8))
+		return;
+	if(selected >= 0 && player->filter_selection_pending){
+		player->playlist_selected_idx = selected;
+		player->filter_selection_pending = 0;
+	}
+	player->playlist_selected_idx = MIN(player->playlist_selected_idx, player->matching_items.count - 1);
+	player->playlist_selected_idx = MAX(player->playlist_selected_idx, 0);
+}
+
+static i32 remap_playlist_idx(const Playlist *from, const Playlist *to, i32 idx){
+	if(idx < 0 || idx >= from->entries.count)
+		return -1;
+	Sub p = from->entries.data[idx].path;
+	return playlist_find_path(to, from->names.data + p.start, p.len);
+}
+
+// Swaps in a rescanned playlist. Indices into the old one are looked up by
+// path. The decoder has its own copy of everything it needs, so the track
+// that is playing right now just keeps playing, even if it's gone from the
+// new playlist. The next one gets opened again, by its new id.
+static void replace_playlist(Player *player, Playlist fresh){
+	i32 *selected = player->input_mode == InputDefault ? &player->playlist_selected_idx : &player->previous_selected_idx;
+	const i32 selected_id = row_id(player_sorted(player), *selected);
+	const i32 match_id = row_id(&player->matching_items, player->playlist_selected_idx);
+	filter_pause(player->filter);
+	Playlist old = player->playlist;
+	player->playlist = fresh;
+	playlist_sorts_reset(&player->sorts);
+	name_search_reset(&player->name_search);
+	filter_index_names(player->filter);
+	probe_pool_reset(player->probe);
+	loudness_pool_reset(player->loudness);
+	player->album_analyzed_count = 0;
+	player->playlist_playing_idx = remap_playlist_idx(&old, &fresh, player->playlist_playing_idx);
+	// The callback may have moved on to the next track already, the main
+	// thread just hasn't heard. Its id has to be in the new playlist too, and
+	// so does the one it put on the clock. The callback reads both, so it
+	// can't run meanwhile.
+	SDL_PauseAudioDevice(player->audio_device_id);
+	Track *track = atomic_load(&player->track);
+	if(track != NULL)
+		track->id = remap_playlist_idx(&old, &fresh, track->id);
+	PlaybackTime t = playback_clock_get(&player->clock);
+	t.id = remap_playlist_idx(&old, &fresh, t.id);
+	playback_clock_set(&player->clock, &t);
+	if(!player->paused)
+		SDL_ResumeAudioDevice(player->audio_device_id);
+	loader_discard(player->loader, atomic_exchange(&player->next_track, NULL));
+	player->shuffle_next = remap_playlist_idx(&old, &fresh, player->shuffle_next);
+	player->loading_id = remap_playlist_idx(&old, &fresh, player->loading_id);
+	if(player->loading && player->loading_next){
+		loader_cancel(player->loader);
+		player->loading = 0;
+	}
+	player->preroll_failed_id = -1;
+	i32 count = 0;
+	i32 cursor = player->history_cursor;
+	for(i32 i = 0; i < player->history.count; ++i){
+		i32 j = remap_playlist_idx(&old, &fresh, player->history.data[i]);
+		if(j >= 0){
+			player->history.data[count++] = j;
+		} else if(i < player->history_cursor){
+			cursor -= 1;
 		}
 	}
+	player->history.count = count;
+	player->history_cursor = cursor;
+	*selected = follow_id(player, remap_playlist_idx(&old, &fresh, selected_id), *selected);
+	if(player->input_mode == InputFilter){
+		update_playlist_filter(player, remap_playlist_idx(&old, &fresh, match_id));
+	}
+	free_playlist(&old);
+	library_watch_add_dirs(player->library_watch, &player->playlist);
 }
 
+// Applies what the watcher saw since the last frame. Ids stay valid, so only
+// the selected row needs to follow its entry around.
+static void apply_library_deltas(Player *player){
+	// The playlist can't change under a refresh, and the refresh may or may
+	// not see these changes. A file rewritten in place doesn't change its
+	// directory's mtime, so the refresh never does. They stay queued in the
+	// watcher and go onto whatever playlist the refresh ends with.
+	if(player->library_refresh)
+		return;
+	if(!library_watch_poll(player->library_watch, &player->library_deltas))
+		return;
+	Playlist *pl = &player->playlist;
+	PlaylistChanges *changes = &player->playlist_changes;
+	i32 *selected = player->input_mode == InputDefault ? &player->playlist_selected_idx : &player->previous_selected_idx;
+	const i32 selected_id = row_id(player_sorted(player), *selected);
+	const i32 match_id = row_id(&player->matching_items, player->playlist_selected_idx);
+	// the filter reads the playlist and the search, they can't change under it.
+	const bool filtering = filter_pause(player->filter);
+	if(playlist_apply_deltas(pl, &player->library_deltas, changes)){
+		player->library_refresh = library_refresh_start(pl);
+	}
+	playlist_sorts_apply_changes(&player->sorts, pl, changes);
+	filter_index_names(player->filter);
+	*selected = follow_id(player, selected_id, *selected);
+
+	i32 count = 0;
+	i32 cursor = player->history_cursor;
+	for(i32 i = 0; i < player->history.count; ++i){
+		const i32 id = player->history.data[i];
+		if(!(pl->entries.data[id].flags & EntryRemoved)){
+			player->history.data[count++] = id;
+		} else if(i < player->history_cursor){
+			cursor -= 1;
+		}
+	}
+	player->history.count = count;
+	player->history_cursor = cursor;
+
+	if((changes->count > 0 || filtering) && player->input_mode == InputFilter){
+		update_playlist_filter(player, match_id);
+	}
+}
 
 static bool point_in_box(f32 x, f32 y, f32 left, f32 top, f32 right, f32 bottom)
 {
 	return x >= left && x < right && y >= top && y < bottom;
 }
 
+// The track set_next_track_to_play is going to pick. A random pick is made
+// once and kept, so the track that gets opened ahead of time is the one that
+// plays.
+static i32 peek_next_track(Player *player){
+	if(player->shuffle){
+		if(player->history_cursor < player->history.count)
+			return player->history.data[player->history_cursor];
+		const Playlist *pl = &player->playlist;
+		const i32 pick = player->shuffle_next;
+		if(pick < 0 || pick >= pl->entries.count || (pl->entries.data[pick].flags & EntryRemoved)){
+			// TODO: better random with some distribution guarantees? e.g.
+			// maybe ensure we don't repeat songs before at least half of the
+			// others in the playlist have played.
+			player->shuffle_next = pl->order.data[pcg32_boundedrand(&player->rng, pl->order.count)];
+		}
+		return player->shuffle_next;
+	} else {
+		const I32List *rows = player_sorted(player);
+		i32 row = 0;
+		if(player->playlist_playing_idx >= 0){
+			row = player_row_of(player, player->playlist_playing_idx);
+			if(row >= 0){
+				row += 1;
+			} else if(rows == &player->playlist.order){
+				// The track is gone. In path order we still know where it
+				// was, and that's already the next one.
+				row = playlist_row_of(&player->playlist, player->playlist_playing_idx, NULL);
+			} else {
+				row = 0;
+			}
+		}
+		return rows->data[row % rows->count];
+	}
+}
+
 static void set_next_track_to_play(Player *player){
+	const i32 next = peek_next_track(player);
 	if(player->shuffle){
-		// TODO: better random with some distribution guarantees? e.g.
-		// maybe ensure we don't repeat songs before at least half of the
-		// others in the playlist have played.
 		if(player->history_cursor >= player->history.count){
-			player->playlist_playing_idx = pcg32_boundedrand(&player->rng, player->playlist.entries.count);
-			push_i32(&player->history, player->playlist_playing_idx);
-		} else {
-			player->playlist_playing_idx = player->history.data[player->history_cursor];
+			push_i32(&player->history, next);
+			player->shuffle_next = -1;
 		}
 		player->history_cursor += 1;
-	} else {
-		player->playlist_playing_idx = (player->playlist_playing_idx + 1) % player->playlist.entries.count;
 	}
+	player->playlist_playing_idx = next;
 }
 
 
@@ -974,24 +1051,277 @@ static void set_previous_track_to_play(Player *player){
 			player->playlist_playing_idx = -1;
 		}
 	} else {
-		if(player->playlist_playing_idx > 0){
-			player->playlist_playing_idx -= 1;
+		const I32List *rows = player_sorted(player);
+		i32 row = 0;
+		if(player->playlist_playing_idx >= 0){
+			row = player_row_of(player, player->playlist_playing_idx);
+			if(row < 0 && rows == &player->playlist.order)
+				row = playlist_row_of(&player->playlist, player->playlist_playing_idx, NULL);
+		}
+		player->playlist_playing_idx = rows->data[row > 0 ? row - 1 : rows->count - 1];
+	}
+}
+
+
+static void follow_playing_track(Player *player){
+	// TODO: I'm not sure if I always want this, but most of the time I think I want this.
+	player->playlist_selected_idx = follow_id(player, player->playlist_playing_idx, player->playlist_selected_idx);
+}
+
+static f32 track_gain(Player *player, i32 id){
+	return loudness_gain(player->loudness, player->probe, &player->playlist, id, player->normalize);
+}
+
+// With auto next on, tracks start and end DEAD_AIR_KEEP_MS into the silence
+// around them, once their waveform says where it is. The start only when auto
+// next gets to them, one the user picks plays from the beginning.
+static DecoderTrim track_trim(Player *player, i32 id, bool skip_lead){
+	Waveform wave;
+	if(!player->auto_next || !waveform_get(player->waveforms, &player->playlist, id, &wave) || wave.lead >= wave.samples)
+		return (DecoderTrim){};
+	const i64 keep = (i64)wave.rate * DEAD_AIR_KEEP_MS / 1000;
+	DecoderTrim trim = {.start = skip_lead ? MAX(wave.lead - keep, (i64)0) : 0};
+	if(wave.trail > keep)
+		trim.end = wave.samples - wave.trail + keep;
+	return trim;
+}
+
+// Asks the loader for the track at playlist_playing_idx. Whatever is playing
+// keeps playing until it's open, see take_loaded_track. auto_advance is for
+// auto next going on by itself, not the user asking for a track.
+static void load_and_play(Player *player, bool auto_advance){
+	const i32 id = player->playlist_playing_idx;
+	follow_playing_track(player);
+	// The preroll skips the silence at the start, the user gets all of it.
+	if(player->loading && player->loading_id == id && (auto_advance || !player->loading_next)){
+		player->loading_next = 0;
+		return;
+	}
+	// Skipping to the next track near the end, it may be open already.
+	Track *next = atomic_load(&player->next_track);
+	if(next != NULL && next->id == id && (auto_advance || !next->skips_lead)){
+		next = atomic_exchange(&player->next_track, NULL);
+		if(next != NULL){
+			play_track(player, next);
+			return;
+		}
+	}
+	loader_open(player->loader, playlist_entry_name(player, id, true), id, track_gain(player, id), track_trim(player, id, auto_advance));
+	player->loading = 1;
+	player->loading_next = 0;
+	player->loading_id = id;
+}
+
+static void take_loaded_track(Player *player){
+	Track *track;
+	if(!player->loading || !loader_poll(player->loader, &track))
+		return;
+	player->loading = 0;
+	// the playlist may have been replaced since, the id got remapped
+	if(track != NULL)
+		track->id = player->loading_id;
+	if(player->loading_next){
+		if(track == NULL){
+			player->preroll_failed_id = player->loading_id;
 		} else {
-			player->playlist_playing_idx = player->playlist.entries.count - 1;
+			// The device would have to be opened again, there's going to be
+			// a gap.
+			const Track *current = atomic_load(&player->track);
+			const bool splice = !player->native_output || (current != NULL && same_spec(&track->spec, &current->spec));
+			atomic_store(&player->splice_next, splice);
+			atomic_store(&player->next_track, track);
 		}
+		return;
+	}
+	if(track == NULL){
+		// Nothing to play, what was playing stops.
+		SDL_PauseAudioDevice(player->audio_device_id);
+		stop_tracks(player);
+		SDL_ResumeAudioDevice(player->audio_device_id);
+		return;
+	}
+	track->report = 1;
+	play_track(player, track);
+}
+
+// Time to first audio, from pressing the key to the callback handing the
+// first samples to SDL. Only printed with -DLOAD_TIMING.
+static void report_load_time(Player *player){
+#ifdef LOAD_TIMING
+	Track *track = atomic_load(&player->track);
+	if(track == NULL || !track->report)
+		return;
+	const u64 heard = atomic_load_explicit(&track->first_audio_ns, memory_order_relaxed);
+	if(heard == 0)
+		return;
+	track->report = 0;
+	const f32 open_ms = (f32)(track->opened_ns - track->requested_ns) / 1e6f;
+	const f32 first_audio_ms = (f32)(heard - track->requested_ns) / 1e6f;
+	eprintln("first audio after ", first_audio_ms, " ms, opening took ", open_ms, " ms");
+#endif
+}
+
+static void drop_next_track(Player *player){
+	// If the callback got to it first, it's playing now, see
+	// finish_track_change.
+	loader_discard(player->loader, atomic_exchange(&player->next_track, NULL));
+	if(player->loading && player->loading_next){
+		loader_cancel(player->loader);
+		player->loading = 0;
 	}
 }
 
+// Has the track auto next is going to play opened once the current one is
+// close to the end, so the callback can go on with it without a gap.
+static void preroll_next_track(Player *player){
+	Track *track = atomic_load(&player->track);
+	if(!player->auto_next || track == NULL || player->playlist.order.count == 0){
+		drop_next_track(player);
+		return;
+	}
+	// a track somebody asked for comes first
+	if(player->loading && !player->loading_next)
+		return;
+	const PlaybackTime t = playback_clock_get(&player->clock);
+	// the callback hasn't gotten to it yet
+	if(t.id != track->id)
+		return;
+	f64 left = playback_seconds(&t, playback_remaining(&t, SDL_GetTicksNS()));
+	// the silence at the end doesn't play
+	Waveform wave;
+	const DecoderTrim trim = track_trim(player, track->id, false);
+	if(trim.end > 0 && waveform_get(player->waveforms, &player->playlist, track->id, &wave))
+		left -= (f64)(wave.samples - trim.end) / wave.rate;
+	if(t.samples > 0 && left > PREROLL_SECONDS)
+		return;
+	const i32 id = peek_next_track(player);
+	Track *next = atomic_load(&player->next_track);
+	if(next != NULL){
+		// shuffle, sort or the playlist changed since it was opened
+		if(next->id != id)
+			drop_next_track(player);
+		return;
+	}
+	if(player->loading ? player->loading_id == id : player->preroll_failed_id == id)
+		return;
+	loader_open(player->loader, playlist_entry_name(player, id, true), id, track_gain(player, id), track_trim(player, id, true));
+	player->loading = 1;
+	player->loading_next = 1;
+	player->loading_id = id;
+}
 
-static void load_and_play(Player *player){
-	Slice path = playlist_entry_name(player, player->playlist_playing_idx, true);
-	Result rc = player_load_audio(player, path);
-	if(!okp(rc)){
-		log_err(rc);
+// Up to cap tracks that are going to play after the current one, the next
+// one first.
+static i32 upcoming_tracks(Player *player, i32 *ids, i32 cap){
+	if(player->playlist.order.count == 0)
+		return 0;
+	i32 n = 0;
+	ids[n++] = peek_next_track(player);
+	if(player->shuffle){
+		// Further ahead there's only what's in the history, the random picks
+		// after the next one aren't made yet.
+		for(i32 i = player->history_cursor + 1; n < cap && i < player->history.count; ++i)
+			ids[n++] = player->history.data[i];
 	} else {
-		// TODO: I'm not sure if I always want this, but most of the time I think I want this.
-		player->playlist_selected_idx = player->playlist_playing_idx;
+		const I32List *rows = player_sorted(player);
+		const i32 row = player_row_of(player, ids[0]);
+		for(; row >= 0 && n < cap && n < rows->count; ++n)
+			ids[n] = rows->data[(row + n) % rows->count];
+	}
+	return n;
+}
+
+// Keeps the files of the next few tracks in memory, so a disk that went to
+// sleep or a slow mount doesn't hold up the next one.
+static void read_ahead_next_tracks(Player *player){
+	i32 ids[READ_AHEAD_TRACKS];
+	Slice paths[READ_AHEAD_TRACKS];
+	i32 count = 0;
+	if((player->auto_next || player->shuffle) && atomic_load(&player->track) != NULL)
+		count = upcoming_tracks(player, ids, READ_AHEAD_TRACKS);
+	for(i32 i = 0; i < count; ++i)
+		paths[i] = playlist_entry_name(player, ids[i], true);
+	read_ahead_want(player->read_ahead, paths, count);
+}
+
+// What plays now, and what plays after it. ids has room for
+// READ_AHEAD_TRACKS + 1.
+static i32 next_tracks(Player *player, i32 *ids){
+	i32 count = 0;
+	if(player->playlist_playing_idx >= 0)
+		ids[count++] = player->playlist_playing_idx;
+	if((player->auto_next || player->shuffle) && atomic_load(&player->track) != NULL)
+		count += upcoming_tracks(player, ids + count, READ_AHEAD_TRACKS);
+	return count;
+}
+
+// Has waveforms made of what plays now and next, for the progress bar and
+// for skipping the silence around them. With normalizing on, the worker
+// measures how loud they are on the way.
+static void want_waveforms(Player *player){
+	i32 ids[READ_AHEAD_TRACKS + 1];
+	const i32 count = next_tracks(player, ids);
+	waveform_want(player->waveforms, &player->playlist, ids, count, player->normalize != NormalizeOff);
+}
+
+// Has what plays now and next analyzed before the rest of the library, so
+// it's normalized by the time it's opened. What the waveform worker is
+// still to decode, it measures, the rest goes to the loudness pool. Album
+// gain needs the whole album, so in album mode their directories go along.
+static void analyze_next_tracks(Player *player){
+	if(player->normalize == NormalizeOff)
+		return;
+	i32 ids[READ_AHEAD_TRACKS + 1];
+	const i32 count = next_tracks(player, ids);
+	i32 rest[READ_AHEAD_TRACKS + 1];
+	i32 rest_count = 0;
+	for(i32 i = 0; i < count; ++i)
+		if(waveform_known(player->waveforms, &player->playlist, ids[i]))
+			rest[rest_count++] = ids[i];
+	loudness_prioritize(player->loudness, &player->playlist, rest, rest_count);
+	if(player->normalize != NormalizeAlbum)
+		return;
+	// going through the playlist once for each new set of tracks is enough
+	if(count == player->album_analyzed_count && memeq(ids, player->album_analyzed, count * sizeof(ids[0])))
+		return;
+	memcpy(player->album_analyzed, ids, count * sizeof(ids[0]));
+	player->album_analyzed_count = count;
+	const Playlist *pl = &player->playlist;
+	i32 mates[64];
+	i32 n = 0;
+	for(i32 i = 0; i < pl->order.count; ++i){
+		const i32 id = pl->order.data[i];
+		const i32 dir = pl->entries.data[id].dir;
+		bool mate = 0;
+		bool next = 0;
+		for(i32 j = 0; j < count; ++j){
+			mate = mate || (dir >= 0 && dir == pl->entries.data[ids[j]].dir);
+			next = next || id == ids[j];
+		}
+		// the ones that play next are taken care of above
+		if(!mate || next)
+			continue;
+		mates[n++] = id;
+		if(n == countof(mates)){
+			loudness_prioritize(player->loudness, pl, mates, n);
+			n = 0;
+		}
 	}
+	loudness_prioritize(player->loudness, pl, mates, n);
+}
+
+// The callback moved on to the next track by itself. Catch up with it.
+static void finish_track_change(Player *player){
+	Track *finished = atomic_exchange(&player->finished_track, NULL);
+	if(finished == NULL)
+		return;
+	loader_discard(player->loader, finished);
+	const Track *track = atomic_load(&player->track);
+	set_next_track_to_play(player);
+	// Only differs if the playlist changed in between, what's playing wins.
+	player->playlist_playing_idx = track->id;
+	player->preroll_failed_id = -1;
+	follow_playing_track(player);
 }
 
 static void handle_text_input(Player *player, const SDL_TextInputEvent *ev){
@@ -999,7 +1329,7 @@ static void handle_text_input(Player *player, const SDL_TextInputEvent *ev){
 		i32 len = strlen(ev->text);
 		insert_string(&player->filter_prompt, player->filter_prompt_cursor, ev->text, len);
 		player->filter_prompt_cursor += len;
-		update_playlist_filter(player);
+		update_playlist_filter(player, row_id(&player->matching_items, player->playlist_selected_idx));
 	}
 }
 
@@ -1013,28 +1343,30 @@ static void handle_key_event(Player *player, const SDL_KeyboardEvent *ev, bool i
 				player->paused = !player->paused;
 				if(player->paused){
 					SDL_PauseAudioDevice(player->audio_device_id);
+					hold_clock(player, 0);
 				} else {
+					hold_clock(player, 1);
 					SDL_ResumeAudioDevice(player->audio_device_id);
 				}
 			}
-			if(player->playlist.entries.count > 0){
+			if(player->playlist.order.count > 0){
 				if(ev->key == SDLK_DOWN){
-					player->playlist_selected_idx = (player->playlist_selected_idx + 1) % player->playlist.entries.count;
+					player->playlist_selected_idx = (player->playlist_selected_idx + 1) % player->playlist.order.count;
 				}
 				if(ev->key == SDLK_UP){
 					player->playlist_selected_idx = (player->playlist_selected_idx - 1);
 					if(player->playlist_selected_idx < 0){
-						player->playlist_selected_idx = player->playlist.entries.count - 1;
+						player->playlist_selected_idx = player->playlist.order.count - 1;
 					}
 				}
 				// TODO: if the entry is a directory. change directory, make new playlist
 				if(ev->key == SDLK_RETURN){
-					player->playlist_playing_idx = player->playlist_selected_idx;
+					player->playlist_playing_idx = player_sorted(player)->data[player->playlist_selected_idx];
 					if(player->shuffle){
 						push_i32(&player->history, player->playlist_playing_idx);
 						player->history_cursor += 1;
 					}
-					load_and_play(player);
+					load_and_play(player, false);
 				}
 			}
 
@@ -1045,10 +1377,32 @@ static void handle_key_event(Player *player, const SDL_KeyboardEvent *ev, bool i
 			if(ev->key == SDLK_S){
 				player->shuffle = !player->shuffle;
 			}
+			// From the next track on. One that's ready to follow may not fit
+			// anymore.
+			if(ev->key == SDLK_P){
+				player->native_output = !player->native_output;
+				loader_set_output(player->loader, &player->shared_spec, player->native_output, player->resample_quality);
+				drop_next_track(player);
+			}
+			if(ev->key == SDLK_R){
+				player->resample_quality = (player->resample_quality + 1) % ResampleQualityCount;
+				loader_set_output(player->loader, &player->shared_spec, player->native_output, player->resample_quality);
+				drop_next_track(player);
+			}
+			if(ev->key == SDLK_L){
+				player->normalize = (player->normalize + 1) % NormalizeModeCount;
+				player->album_analyzed_count = 0;
+				drop_next_track(player);
+			}
+			if(ev->key == SDLK_O){
+				const i32 id = row_id(player_sorted(player), player->playlist_selected_idx);
+				player->sort = (player->sort + 1) % SortKindCount;
+				player->playlist_selected_idx = follow_id(player, id, player->playlist_selected_idx);
+			}
 
 			if(ev->key == SDLK_G){
 				if(player->playlist_playing_idx >= 0){
-					player->playlist_selected_idx = player->playlist_playing_idx;
+					player->playlist_selected_idx = follow_id(player, player->playlist_playing_idx, player->playlist_selected_idx);
 				}
 			}
 
@@ -1056,17 +1410,17 @@ static void handle_key_event(Player *player, const SDL_KeyboardEvent *ev, bool i
 				SDL_StartTextInput(player->window);
 				player->previous_selected_idx = player->playlist_selected_idx;
 				player->input_mode = InputFilter;
-				update_playlist_filter(player);
+				update_playlist_filter(player, row_id(player_sorted(player), player->playlist_selected_idx));
 			}
 
-			if(ev->key == SDLK_N){
+			if(ev->key == SDLK_N && player->playlist.order.count > 0){
 				set_next_track_to_play(player);
-				load_and_play(player);
+				load_and_play(player, false);
 			}
-			if(ev->key == SDLK_B){
+			if(ev->key == SDLK_B && player->playlist.order.count > 0){
 				set_previous_track_to_play(player);
 				if(player->playlist_playing_idx >= 0){
-					load_and_play(player);
+					load_and_play(player, false);
 				} else {
 					player->eof = 1;
 				}
@@ -1081,28 +1435,34 @@ static void handle_key_event(Player *player, const SDL_KeyboardEvent *ev, bool i
 			if(player->filter_prompt_cursor > 0 && ev->key == SDLK_BACKSPACE){
 				player->filter_prompt_cursor -= 1;
 				delete_chars(&player->filter_prompt, player->filter_prompt_cursor, 1);
-				update_playlist_filter(player);
+				update_playlist_filter(player, row_id(&player->matching_items, player->playlist_selected_idx));
 			}
-			if(ev->key == SDLK_UP){
+			if(ev->key == SDLK_TAB){
+				player->filter_fuzzy = !player->filter_fuzzy;
+				update_playlist_filter(player, row_id(&player->matching_items, player->playlist_selected_idx));
+			}
+			if(ev->key == SDLK_UP && player->matching_items.count > 0){
+				player->filter_selection_pending = 0;
 				player->playlist_selected_idx -= 1;
 				if(player->playlist_selected_idx < 0){
 					player->playlist_selected_idx = player->matching_items.count - 1;
 				}
 			}
-			if(ev->key == SDLK_DOWN){
+			if(ev->key == SDLK_DOWN && player->matching_items.count > 0){
+				player->filter_selection_pending = 0;
 				player->playlist_selected_idx = (player->playlist_selected_idx + 1) % player->matching_items.count;
 			}
-			if(ev->key == SDLK_RETURN){
+			if(ev->key == SDLK_RETURN && player->matching_items.count > 0){
 				// TODO: should we keep the history and add this track to the list?
 				player->history.count = 0;
 				player->history_cursor = 0;
-				player->playlist_selected_idx = player->matching_items.data[player->playlist_selected_idx];
-				player->playlist_playing_idx = player->playlist_selected_idx;
+				player->playlist_playing_idx = player->matching_items.data[player->playlist_selected_idx];
+				player->playlist_selected_idx = follow_id(player, player->playlist_playing_idx, 0);
 				if(player->shuffle){
 					push_i32(&player->history, player->playlist_playing_idx);
 					player->history_cursor += 1;
 				}
-				load_and_play(player);
+				load_and_play(player, false);
 				player->input_mode = InputDefault;
 				player->filter_prompt.count = 0;
 				player->filter_prompt_cursor = 0;
@@ -1123,25 +1483,41 @@ static void seek_to_mouse_cursor(Player *player, f32 x){
 	const f32 progress_bar_x_start = 0.0f;
 	const f32 progress_bar_x_end = player->max_progress_bar_width;
 	f32 relative = (x - progress_bar_x_start) / (progress_bar_x_end - progress_bar_x_start);
-	int flags = 0;
-	if(fabsf(relative - player->last_relative_duration) > 5e-3){
-		if(relative < player->last_relative_duration){
-			flags |= AVSEEK_FLAG_BACKWARD;
-		}
-		i64 timestamp_to_seek = (f32)player->stream->duration * relative;
-		SDL_LockMutex(player->avmutex);
-		av_seek_frame(player->format_context, player->audio_stream_idx, timestamp_to_seek, flags);
-		player->last_relative_duration = relative;
-		if(player->current_frame){
-			av_frame_free(&player->current_frame);
-			player->current_frame = NULL;
-		}
-		player->current_frame_sample = 0;
-		if(player->current_packet){
-			av_packet_free(&player->current_packet);
-			player->current_packet = NULL;
-		}
-		SDL_UnlockMutex(player->avmutex);
+	Track *track = atomic_load(&player->track);
+	if(track == NULL)
+		return;
+	if(fabsf(relative - shown_progress(player)) > 5e-3){
+		if(player->seeks_asked == 0)
+			player->seeks_done_before = decoder_seeks_done(track->decoder);
+		player->seek_pending = 1;
+		player->seek_target = relative;
+		player->seek_track = track;
+		player->seeks_asked += 1;
+	}
+}
+
+// Once a frame, hands the newest seek target to the decoder.
+static void send_seek(Player *player){
+	const Track *track = atomic_load(&player->track);
+	if(player->seeks_asked > 0 && player->seek_track != track){
+		player->seek_pending = 0;
+		player->seeks_asked = 0;
+		player->seeks_sent = 0;
+	}
+	if(track == NULL)
+		return;
+	if(player->seek_pending && !decoder_seeking(track->decoder)){
+		decoder_seek(track->decoder, player->seek_target);
+		player->seek_pending = 0;
+		player->seeks_sent += 1;
+	}
+	if(!player->seeking && !player->seek_pending && player->seeks_asked > 0 && !decoder_seeking(track->decoder)){
+#ifdef SEEK_COUNTING
+		const u32 done = decoder_seeks_done(track->decoder) - player->seeks_done_before;
+		eprintln("seeking: ", player->seeks_asked, " asked, ", player->seeks_sent, " sent, ", done, " done");
+#endif
+		player->seeks_asked = 0;
+		player->seeks_sent = 0;
 	}
 }
 
@@ -1178,27 +1554,50 @@ int main(void){
 		pcg32_seed(&player.rng, (u64)ts.tv_sec, (u64)ts.tv_nsec);
 	}
 	player.playlist_playing_idx = -1;
-	player.playlist = make_playlist_from_directory(S("/home/aru/Music"));
+	playback_clock_set(&player.clock, &(PlaybackTime){.id = -1});
+	player.preroll_failed_id = -1;
+	player.shuffle_next = -1;
+	player.loading_id = -1;
+	// A saved index gets us to the first frame without touching the music
+	// directory. It gets checked for changes in the background.
+	const Slice music_root = S("/home/aru/Music");
+	if(library_index_load(music_root, &player.playlist)){
+		player.library_refresh = library_refresh_start(&player.playlist);
+	} else {
+		ScanStats scan_stats;
+		player.playlist = make_playlist_from_directory(music_root, &scan_stats);
+		print_scan_stats(&scan_stats);
+		library_index_save(&player.playlist);
+	}
+	player.filter = filter_worker_start(&player.name_search, &player.playlist);
+	player.library_deltas.names = make_charlist();
+	// Starts watching the directories we know now. Anything the refresh
+	// finds gets added when it's done.
+	player.library_watch = library_watch_start(&player.playlist);
+	player.probe = probe_pool_start();
+	player.loudness = loudness_pool_start();
+	player.normalize = NormalizeOff;
+	player.waveforms = waveform_worker_start();
+	player.read_ahead = read_ahead_start((i64)READ_AHEAD_MB * 1024 * 1024);
+	player.seeks = seek_index_cache_load();
+	pcm_init();
+	player.resample_quality = ResampleHigh;
+	player.loader = loader_start(DECODE_AHEAD_MS, player.read_ahead, player.seeks);
 	//av_log_set_callback(libavcodec_log_callback);
 	av_log_set_level(AV_LOG_QUIET);
 
 	// SDL_SetHint(SDL_HINT_SHUTDOWN_DBUS_ON_QUIT, "1");
 	SDL_Init(SDL_INIT_AUDIO);
-	player.avmutex = SDL_CreateMutex();
 	TTF_Init();
 	player.dst_audio_spec = (SDL_AudioSpec){
 		.format = SDL_AUDIO_S16,
 		.channels = 2,
 		.freq = 48000,
 	};
-	player.audio_device_id = SDL_OpenAudioDevice(
-		SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK, &player.dst_audio_spec
-	);
-	if(player.audio_device_id == 0){
+	if(!open_audio_device(&player, &player.dst_audio_spec)){
 		eprintln("failed to open audio device");
 		return 1;
 	}
-	SDL_PauseAudioDevice(player.audio_device_id);
 
 	TTF_Font *font = NULL;
 	{
@@ -1284,9 +1683,33 @@ int main(void){
 			}
 		}
 
-		if(player.eof && player.auto_next){
+		if(player.library_refresh){
+			Playlist fresh;
+			if(library_refresh_poll(&player.library_refresh, &fresh))
+				replace_playlist(&player, fresh);
+		}
+		apply_library_deltas(&player);
+		probe_pool_update(player.probe, &player.playlist);
+		loudness_pool_update(player.loudness, &player.playlist, player.normalize != NormalizeOff);
+		waveform_update(player.waveforms, player.loudness, &player.playlist);
+		if(player.input_mode == InputFilter)
+			take_filter_results(&player);
+		// a new trigram index can't go in under a query
+		if(filter_idle(player.filter))
+			name_search_poll(&player.name_search);
+
+		send_seek(&player);
+		take_loaded_track(&player);
+		finish_track_change(&player);
+		preroll_next_track(&player);
+		read_ahead_next_tracks(&player);
+		want_waveforms(&player);
+		analyze_next_tracks(&player);
+		report_load_time(&player);
+		// a track that's being opened for later can play now instead
+		if(player.eof && player.auto_next && (!player.loading || player.loading_next) && player.playlist.order.count > 0){
 			set_next_track_to_play(&player);
-			load_and_play(&player);
+			load_and_play(&player, true);
 		}
 
 		SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
@@ -1298,6 +1721,17 @@ int main(void){
 		SDL_RenderPresent(renderer);
 	}
 
+	probe_pool_stop(&player.probe, &player.playlist);
+	loudness_pool_stop(&player.loudness, &player.playlist);
+	waveform_worker_stop(&player.waveforms);
+	library_watch_stop(&player.library_watch);
+	library_refresh_cancel(&player.library_refresh);
+	if(player.playlist.dirty){
+		library_index_save(&player.playlist);
+	}
+#if defined(ALLOC_COUNTING) || defined(CPU_COUNTING)
+	print_audio_stats(&player.audio_stats);
+#endif
 	free_player(&player);
 	TTF_Quit();
 	SDL_CloseAudioDevice(player.audio_device_id);
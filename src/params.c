@@ -0,0 +1,149 @@
+#define _GNU_SOURCE
+#include "params.h"
+#include "cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// For mp3 and m4a, avformat_find_stream_info reads and decodes frames until
+// it's sure about the sample format and the channels, which takes longer
+// than everything else about opening the file. Its results are small and
+// only change when the file does, so they go in a cache file, see cache.h,
+// with the extradata in its strings.
+//
+// Files that don't get played drop out once there's more than
+// PARAM_CACHE_MAX of them, the ones played least recently first.
+
+#define PARAM_CACHE_MAX 8192
+
+typedef struct {
+	CacheKey key;
+	i64 mtime; // like MusicEntry.mtime
+	i64 size;
+	Sub extradata;
+	i32 stream;
+	i32 codec_id;
+	i32 sample_format;
+	i32 sample_rate;
+	i32 channels;
+	i32 channel_order;
+	u64 channel_mask;
+	i32 frame_size;
+	i32 block_align;
+	i32 initial_padding;
+	i32 trailing_padding;
+	i32 seek_preroll;
+	i64 bit_rate;
+	i64 start_time;    // of the stream
+	i64 duration;
+	i64 format_duration;
+} ParamRecord;
+
+static bool param_record_valid(const void *record){
+	const ParamRecord *r = record;
+	return r->stream >= 0 && r->channels >= 0;
+}
+
+static const CacheFormat param_cache_format = {
+	.name = "params.cache",
+	.magic = "mosprm",
+	.version = 2,
+	.record_size = sizeof(ParamRecord),
+	.subs = {offsetof(ParamRecord, extradata)},
+	.sub_count = 1,
+	.max = PARAM_CACHE_MAX,
+	.valid = param_record_valid,
+};
+
+struct ParamCache {
+	RecordCache cache;
+};
+
+ParamCache *param_cache_load(void){
+	ParamCache *c = calloc(1, sizeof(*c));
+	record_cache_load(&c->cache, &param_cache_format);
+	return c;
+}
+
+void param_cache_stop(ParamCache **cc){
+	ParamCache *c = *cc;
+	if(c == NULL)
+		return;
+	if(c->cache.record_count > 0)
+		record_cache_save(&c->cache, NULL, 0);
+	record_cache_free(&c->cache);
+	free(c);
+	*cc = NULL;
+}
+
+i32 param_cache_apply(ParamCache *c, const char *path, i32 len, AVFormatContext *fmt){
+	ParamRecord *r = record_cache_find(&c->cache, path, len);
+	i64 mtime, size;
+	if(r == NULL || !stat_file(path, &mtime, &size) || r->mtime != mtime || r->size != size)
+		return -1;
+	// The demuxer already read the header, what it found there has to agree.
+	if(r->stream >= (i32)fmt->nb_streams)
+		return -1;
+	AVStream *stream = fmt->streams[r->stream];
+	AVCodecParameters *par = stream->codecpar;
+	if(par->codec_type != AVMEDIA_TYPE_AUDIO || par->codec_id != (enum AVCodecID)r->codec_id)
+		return -1;
+
+	par->format = r->sample_format;
+	par->sample_rate = r->sample_rate;
+	par->frame_size = r->frame_size;
+	par->block_align = r->block_align;
+	par->initial_padding = r->initial_padding;
+	par->trailing_padding = r->trailing_padding;
+	par->seek_preroll = r->seek_preroll;
+	if(par->bit_rate == 0)
+		par->bit_rate = r->bit_rate;
+	av_channel_layout_uninit(&par->ch_layout);
+	if(r->channel_order == AV_CHANNEL_ORDER_NATIVE)
+		av_channel_layout_from_mask(&par->ch_layout, r->channel_mask);
+	else
+		av_channel_layout_default(&par->ch_layout, r->channels);
+	if(par->extradata_size == 0 && r->extradata.len > 0){
+		par->extradata = av_mallocz(r->extradata.len + AV_INPUT_BUFFER_PADDING_SIZE);
+		memcpy(par->extradata, c->cache.strings.data + r->extradata.start, r->extradata.len);
+		par->extradata_size = r->extradata.len;
+	}
+	if(stream->start_time == AV_NOPTS_VALUE)
+		stream->start_time = r->start_time;
+	if(stream->duration == AV_NOPTS_VALUE)
+		stream->duration = r->duration;
+	if(fmt->duration == AV_NOPTS_VALUE)
+		fmt->duration = r->format_duration;
+	record_cache_use(&c->cache, r);
+	return r->stream;
+}
+
+void param_cache_put(ParamCache *c, const char *path, i32 len, const AVFormatContext *fmt, i32 stream_idx){
+	ParamRecord r = {};
+	if(!stat_file(path, &r.mtime, &r.size))
+		return;
+	const AVStream *stream = fmt->streams[stream_idx];
+	const AVCodecParameters *par = stream->codecpar;
+	r.stream = stream_idx;
+	r.codec_id = par->codec_id;
+	r.sample_format = par->format;
+	r.sample_rate = par->sample_rate;
+	r.channels = par->ch_layout.nb_channels;
+	r.channel_order = par->ch_layout.order;
+	r.channel_mask = par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE ? par->ch_layout.u.mask : 0;
+	r.frame_size = par->frame_size;
+	r.block_align = par->block_align;
+	r.initial_padding = par->initial_padding;
+	r.trailing_padding = par->trailing_padding;
+	r.seek_preroll = par->seek_preroll;
+	r.bit_rate = par->bit_rate;
+	r.start_time = stream->start_time;
+	r.duration = stream->duration;
+	r.format_duration = fmt->duration;
+	// The old extradata stays in the strings until the next save.
+	r.extradata = record_cache_push(&c->cache, par->extradata, MAX(par->extradata_size, 0));
+
+	ParamRecord *record = record_cache_put(&c->cache, path, len);
+	r.key = record->key;
+	*record = r;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "library.h"
+
+#include <libavformat/avformat.h>
+
+// What avformat_find_stream_info found out about the audio stream of a file,
+// kept in a cache file. Next time the file gets played, the streams are
+// filled in from there and that whole probing step is skipped. Entries are
+// keyed by path, and only count while the file's size and mtime match.
+//
+// Not thread safe, the loader thread is the only one using it.
+typedef struct ParamCache ParamCache;
+
+ParamCache *param_cache_load(void);
+// Saves the cache and frees it.
+void param_cache_stop(ParamCache **c);
+// fmt was just opened from path. If the file is known and unchanged, fills
+// in its streams like avformat_find_stream_info would and returns the audio
+// stream. Returns -1 otherwise. path and len include the NUL.
+i32 param_cache_apply(ParamCache *c, const char *path, i32 len, AVFormatContext *fmt);
+// Remembers what avformat_find_stream_info found out about stream.
+void param_cache_put(ParamCache *c, const char *path, i32 len, const AVFormatContext *fmt, i32 stream);
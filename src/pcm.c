@@ -0,0 +1,503 @@
+#include "pcm.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PCM_X86 1
+#include <immintrin.h>
+#endif
+
+// The vector kernels only do the cases that are worth it, stereo mostly,
+// and hand back how far they got. The scalar loops do the rest: the tail
+// that doesn't fill a vector, and every layout the kernels don't know.
+//
+// SSE2 is there on every x86-64, so its kernels are the fallback. The AVX2
+// ones get compiled for AVX2 and FMA on their own, the rest of the program
+// isn't, and are only used when the CPU says it has both.
+
+typedef struct {
+	i32 (*interleave2x16)(u8 *dst, u8 *const *planes, i32 offset, i32 count);
+	i32 (*interleave2x32)(u8 *dst, u8 *const *planes, i32 offset, i32 count);
+	i32 (*mix2)(f32 *dst, u8 *const *planes, enum AVSampleFormat format, i32 in_channels, const f32 *matrix, i32 offset, i32 count);
+	i32 (*narrow)(i16 *dst, const f32 *src, i32 n, PcmDither *dither);
+} PcmKernels;
+
+// Only changed before the threads that use it start, or by the benchmark.
+static PcmIsa active = PcmScalar;
+
+static f32 sample_scale(enum AVSampleFormat format){
+	switch(av_get_packed_sample_fmt(format)){
+	case AV_SAMPLE_FMT_U8: return 1.0f / 128;
+	case AV_SAMPLE_FMT_S16: return 1.0f / 32768;
+	case AV_SAMPLE_FMT_S32: return 1.0f / 2147483648.0f;
+	case AV_SAMPLE_FMT_S64: return 1.0f / 9223372036854775808.0f;
+	default: return 1;
+	}
+}
+
+// The gains for the left and right output, with the scale of format
+// folded in.
+static void stereo_rows(f32 (*rows)[PCM_MAX_CHANNELS], enum AVSampleFormat format, i32 in_channels, const f32 *matrix){
+	const f32 scale = sample_scale(format);
+	for(i32 ch = 0; ch < in_channels; ++ch){
+		rows[0][ch] = matrix[ch] * scale;
+		rows[1][ch] = matrix[in_channels + ch] * scale;
+	}
+}
+
+static u32 xorshift(u32 *state){
+	u32 x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+//# scalar
+
+static void interleave_scalar(u8 *dst, u8 *const *planes, i32 channels, i32 sample_size, i32 offset, i32 count){
+	switch(sample_size){
+	case 1:
+		for(i32 i = 0; i < count; ++i)
+			for(i32 ch = 0; ch < channels; ++ch)
+				dst[i * channels + ch] = planes[ch][offset + i];
+		break;
+	case 2:
+		for(i32 i = 0; i < count; ++i)
+			for(i32 ch = 0; ch < channels; ++ch)
+				((u16*)dst)[i * channels + ch] = ((const u16*)planes[ch])[offset + i];
+		break;
+	case 4:
+		for(i32 i = 0; i < count; ++i)
+			for(i32 ch = 0; ch < channels; ++ch)
+				((u32*)dst)[i * channels + ch] = ((const u32*)planes[ch])[offset + i];
+		break;
+	default:
+		for(i32 i = 0; i < count; ++i)
+			for(i32 ch = 0; ch < channels; ++ch)
+				memcpy(dst + (i * channels + ch) * sample_size, planes[ch] + (offset + i) * sample_size, sample_size);
+		break;
+	}
+}
+
+static void mix_scalar(f32 *dst, i32 out_channels, u8 *const *src, enum AVSampleFormat format, i32 in_channels, const f32 *matrix, i32 offset, i32 count){
+	const bool planar = av_sample_fmt_is_planar(format);
+	const enum AVSampleFormat packed = av_get_packed_sample_fmt(format);
+	const f32 scale = sample_scale(format);
+	f32 in[PCM_MAX_CHANNELS];
+	for(i32 i = 0; i < count; ++i){
+		for(i32 ch = 0; ch < in_channels; ++ch){
+			const u8 *p = src[planar ? ch : 0];
+			const i32 at = planar ? offset + i : (offset + i) * in_channels + ch;
+			switch(packed){
+			case AV_SAMPLE_FMT_U8: in[ch] = (p[at] - 128) * scale; break;
+			case AV_SAMPLE_FMT_S16: in[ch] = ((const i16*)p)[at] * scale; break;
+			case AV_SAMPLE_FMT_S32: in[ch] = ((const i32*)p)[at] * scale; break;
+			case AV_SAMPLE_FMT_S64: in[ch] = ((const i64*)p)[at] * scale; break;
+			case AV_SAMPLE_FMT_DBL: in[ch] = (f32)((const f64*)p)[at]; break;
+			default: in[ch] = ((const f32*)p)[at]; break;
+			}
+		}
+		for(i32 out = 0; out < out_channels; ++out){
+			f32 sum = 0;
+			for(i32 ch = 0; ch < in_channels; ++ch)
+				sum += matrix[out * in_channels + ch] * in[ch];
+			dst[i * out_channels + out] = sum;
+		}
+	}
+}
+
+static void narrow_scalar(i16 *dst, const f32 *src, i32 n, PcmDither *dither){
+	for(i32 i = 0; i < n; ++i){
+		const u32 r = xorshift(&dither->state[0]);
+		const f32 noise = ((i32)(r & 0xffff) - (i32)(r >> 16)) * (1.0f / 65536);
+		f32 y = src[i] * 32767.0f + noise;
+		// NaN ends up at the bottom.
+		y = !(y >= -32768.0f) ? -32768.0f : y > 32767.0f ? 32767.0f : y;
+		// Half away from zero where the vector code rounds half to even,
+		// which is lost in the dither.
+		dst[i] = (i16)(y < 0 ? y - 0.5f : y + 0.5f);
+	}
+}
+
+#ifdef PCM_X86
+
+//# SSE2
+
+static i32 interleave2x16_sse2(u8 *dst, u8 *const *planes, i32 offset, i32 count){
+	const i16 *l = (const i16*)planes[0] + offset;
+	const i16 *r = (const i16*)planes[1] + offset;
+	__m128i *out = (__m128i*)dst;
+	i32 i = 0;
+	for(; i + 8 <= count; i += 8){
+		const __m128i a = _mm_loadu_si128((const __m128i*)(l + i));
+		const __m128i b = _mm_loadu_si128((const __m128i*)(r + i));
+		_mm_storeu_si128(out++, _mm_unpacklo_epi16(a, b));
+		_mm_storeu_si128(out++, _mm_unpackhi_epi16(a, b));
+	}
+	return i;
+}
+
+static i32 interleave2x32_sse2(u8 *dst, u8 *const *planes, i32 offset, i32 count){
+	const i32 *l = (const i32*)planes[0] + offset;
+	const i32 *r = (const i32*)planes[1] + offset;
+	__m128i *out = (__m128i*)dst;
+	i32 i = 0;
+	for(; i + 4 <= count; i += 4){
+		const __m128i a = _mm_loadu_si128((const __m128i*)(l + i));
+		const __m128i b = _mm_loadu_si128((const __m128i*)(r + i));
+		_mm_storeu_si128(out++, _mm_unpacklo_epi32(a, b));
+		_mm_storeu_si128(out++, _mm_unpackhi_epi32(a, b));
+	}
+	return i;
+}
+
+static inline __m128 load4_sse2(const u8 *plane, enum AVSampleFormat packed, i32 at){
+	switch(packed){
+	case AV_SAMPLE_FMT_S16: {
+		// SSE2 has no sign extension, put each sample in the top half and
+		// shift it down.
+		const __m128i x = _mm_loadl_epi64((const __m128i*)((const i16*)plane + at));
+		return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+	}
+	case AV_SAMPLE_FMT_S32:
+		return _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)((const i32*)plane + at)));
+	default:
+		return _mm_loadu_ps((const f32*)plane + at);
+	}
+}
+
+static i32 mix2_sse2(f32 *dst, u8 *const *planes, enum AVSampleFormat format, i32 in_channels, const f32 *matrix, i32 offset, i32 count){
+	const enum AVSampleFormat packed = av_get_packed_sample_fmt(format);
+	f32 rows[2][PCM_MAX_CHANNELS];
+	stereo_rows(rows, format, in_channels, matrix);
+	__m128 gl[PCM_MAX_CHANNELS], gr[PCM_MAX_CHANNELS];
+	for(i32 ch = 0; ch < in_channels; ++ch){
+		gl[ch] = _mm_set1_ps(rows[0][ch]);
+		gr[ch] = _mm_set1_ps(rows[1][ch]);
+	}
+	i32 i = 0;
+	for(; i + 4 <= count; i += 4){
+		__m128 l = _mm_setzero_ps();
+		__m128 r = _mm_setzero_ps();
+		for(i32 ch = 0; ch < in_channels; ++ch){
+			const __m128 x = load4_sse2(planes[ch], packed, offset + i);
+			l = _mm_add_ps(l, _mm_mul_ps(x, gl[ch]));
+			r = _mm_add_ps(r, _mm_mul_ps(x, gr[ch]));
+		}
+		_mm_storeu_ps(dst + i * 2, _mm_unpacklo_ps(l, r));
+		_mm_storeu_ps(dst + i * 2 + 4, _mm_unpackhi_ps(l, r));
+	}
+	return i;
+}
+
+// Four lanes of the scalar xorshift and noise.
+static inline __m128 tpdf_sse2(__m128i *state){
+	__m128i x = *state;
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+	*state = x;
+	const __m128i d = _mm_sub_epi32(_mm_and_si128(x, _mm_set1_epi32(0xffff)), _mm_srli_epi32(x, 16));
+	return _mm_mul_ps(_mm_cvtepi32_ps(d), _mm_set1_ps(1.0f / 65536));
+}
+
+static inline __m128i round4_sse2(const f32 *src, __m128i *state){
+	__m128 y = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src), _mm_set1_ps(32767.0f)), tpdf_sse2(state));
+	// Out of range converts to INT_MIN, clamp before. max hands back its
+	// second operand if one is NaN, so NaN ends up at the bottom, like in
+	// the scalar loop.
+	y = _mm_min_ps(_mm_max_ps(y, _mm_set1_ps(-32768.0f)), _mm_set1_ps(32767.0f));
+	return _mm_cvtps_epi32(y);
+}
+
+static i32 narrow_sse2(i16 *dst, const f32 *src, i32 n, PcmDither *dither){
+	__m128i state = _mm_loadu_si128((const __m128i*)dither->state);
+	i32 i = 0;
+	for(; i + 8 <= n; i += 8){
+		const __m128i a = round4_sse2(src + i, &state);
+		const __m128i b = round4_sse2(src + i + 4, &state);
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(a, b));
+	}
+	_mm_storeu_si128((__m128i*)dither->state, state);
+	return i;
+}
+
+//# AVX2
+
+#define AVX2 __attribute__((target("avx2,fma")))
+
+// The 256 bit unpacks work on each 128 bit half on its own, the permutes
+// put the halves back in order.
+
+AVX2 static i32 interleave2x16_avx2(u8 *dst, u8 *const *planes, i32 offset, i32 count){
+	const i16 *l = (const i16*)planes[0] + offset;
+	const i16 *r = (const i16*)planes[1] + offset;
+	__m256i *out = (__m256i*)dst;
+	i32 i = 0;
+	for(; i + 16 <= count; i += 16){
+		const __m256i a = _mm256_loadu_si256((const __m256i*)(l + i));
+		const __m256i b = _mm256_loadu_si256((const __m256i*)(r + i));
+		const __m256i lo = _mm256_unpacklo_epi16(a, b);
+		const __m256i hi = _mm256_unpackhi_epi16(a, b);
+		_mm256_storeu_si256(out++, _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256(out++, _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	return i;
+}
+
+AVX2 static i32 interleave2x32_avx2(u8 *dst, u8 *const *planes, i32 offset, i32 count){
+	const i32 *l = (const i32*)planes[0] + offset;
+	const i32 *r = (const i32*)planes[1] + offset;
+	__m256i *out = (__m256i*)dst;
+	i32 i = 0;
+	for(; i + 8 <= count; i += 8){
+		const __m256i a = _mm256_loadu_si256((const __m256i*)(l + i));
+		const __m256i b = _mm256_loadu_si256((const __m256i*)(r + i));
+		const __m256i lo = _mm256_unpacklo_epi32(a, b);
+		const __m256i hi = _mm256_unpackhi_epi32(a, b);
+		_mm256_storeu_si256(out++, _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256(out++, _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	return i;
+}
+
+AVX2 static inline __m256 load8_avx2(const u8 *plane, enum AVSampleFormat packed, i32 at){
+	switch(packed){
+	case AV_SAMPLE_FMT_S16:
+		return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)((const i16*)plane + at))));
+	case AV_SAMPLE_FMT_S32:
+		return _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)((const i32*)plane + at)));
+	default:
+		return _mm256_loadu_ps((const f32*)plane + at);
+	}
+}
+
+AVX2 static i32 mix2_avx2(f32 *dst, u8 *const *planes, enum AVSampleFormat format, i32 in_channels, const f32 *matrix, i32 offset, i32 count){
+	const enum AVSampleFormat packed = av_get_packed_sample_fmt(format);
+	f32 rows[2][PCM_MAX_CHANNELS];
+	stereo_rows(rows, format, in_channels, matrix);
+	__m256 gl[PCM_MAX_CHANNELS], gr[PCM_MAX_CHANNELS];
+	for(i32 ch = 0; ch < in_channels; ++ch){
+		gl[ch] = _mm256_set1_ps(rows[0][ch]);
+		gr[ch] = _mm256_set1_ps(rows[1][ch]);
+	}
+	i32 i = 0;
+	for(; i + 8 <= count; i += 8){
+		__m256 l = _mm256_setzero_ps();
+		__m256 r = _mm256_setzero_ps();
+		for(i32 ch = 0; ch < in_channels; ++ch){
+			const __m256 x = load8_avx2(planes[ch], packed, offset + i);
+			l = _mm256_fmadd_ps(x, gl[ch], l);
+			r = _mm256_fmadd_ps(x, gr[ch], r);
+		}
+		const __m256 lo = _mm256_unpacklo_ps(l, r);
+		const __m256 hi = _mm256_unpackhi_ps(l, r);
+		_mm256_storeu_ps(dst + i * 2, _mm256_permute2f128_ps(lo, hi, 0x20));
+		_mm256_storeu_ps(dst + i * 2 + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+	}
+	return i;
+}
+
+AVX2 static inline __m256 tpdf_avx2(__m256i *state){
+	__m256i x = *state;
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+	*state = x;
+	const __m256i d = _mm256_sub_epi32(_mm256_and_si256(x, _mm256_set1_epi32(0xffff)), _mm256_srli_epi32(x, 16));
+	return _mm256_mul_ps(_mm256_cvtepi32_ps(d), _mm256_set1_ps(1.0f / 65536));
+}
+
+AVX2 static inline __m256i round8_avx2(const f32 *src, __m256i *state){
+	__m256 y = _mm256_fmadd_ps(_mm256_loadu_ps(src), _mm256_set1_ps(32767.0f), tpdf_avx2(state));
+	y = _mm256_min_ps(_mm256_max_ps(y, _mm256_set1_ps(-32768.0f)), _mm256_set1_ps(32767.0f));
+	return _mm256_cvtps_epi32(y);
+}
+
+AVX2 static i32 narrow_avx2(i16 *dst, const f32 *src, i32 n, PcmDither *dither){
+	__m256i state = _mm256_loadu_si256((const __m256i*)dither->state);
+	i32 i = 0;
+	for(; i + 16 <= n; i += 16){
+		const __m256i a = round8_avx2(src + i, &state);
+		const __m256i b = round8_avx2(src + i + 8, &state);
+		// packs goes by halves too: a0-3 b0-3 a4-7 b4-7
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8));
+	}
+	_mm256_storeu_si256((__m256i*)dither->state, state);
+	return i;
+}
+
+#endif
+
+static const PcmKernels kernels[PcmIsaCount] = {
+	[PcmScalar] = {},
+#ifdef PCM_X86
+	[PcmSSE2] = {interleave2x16_sse2, interleave2x32_sse2, mix2_sse2, narrow_sse2},
+	[PcmAVX2] = {interleave2x16_avx2, interleave2x32_avx2, mix2_avx2, narrow_avx2},
+#endif
+};
+
+static bool has_isa(PcmIsa isa){
+#ifdef PCM_X86
+	__builtin_cpu_init();
+	switch(isa){
+	case PcmSSE2: return __builtin_cpu_supports("sse2");
+	case PcmAVX2: return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	default: return isa == PcmScalar;
+	}
+#else
+	return isa == PcmScalar;
+#endif
+}
+
+void pcm_init(void){
+	if(!pcm_use(PcmAVX2))
+		pcm_use(PcmSSE2);
+}
+
+bool pcm_use(PcmIsa isa){
+	if(!has_isa(isa))
+		return 0;
+	active = isa;
+	return 1;
+}
+
+PcmIsa pcm_isa(void){
+	return active;
+}
+
+const char *pcm_isa_name(PcmIsa isa){
+	switch(isa){
+	case PcmScalar: return "scalar";
+	case PcmSSE2: return "sse2";
+	case PcmAVX2: return "avx2";
+	default: return "?";
+	}
+}
+
+void pcm_interleave(u8 *dst, u8 *const *planes, i32 channels, i32 sample_size, i32 offset, i32 count){
+	const PcmKernels *k = &kernels[active];
+	i32 done = 0;
+	if(channels == 2 && sample_size == 2 && k->interleave2x16)
+		done = k->interleave2x16(dst, planes, offset, count);
+	else if(channels == 2 && sample_size == 4 && k->interleave2x32)
+		done = k->interleave2x32(dst, planes, offset, count);
+	interleave_scalar(dst + done * channels * sample_size, planes, channels, sample_size, offset + done, count - done);
+}
+
+void pcm_mix(f32 *dst, i32 out_channels, u8 *const *src, enum AVSampleFormat format, i32 in_channels, const f32 *matrix, i32 offset, i32 count){
+	assert(in_channels <= PCM_MAX_CHANNELS && out_channels <= PCM_MAX_CHANNELS);
+	const PcmKernels *k = &kernels[active];
+	const enum AVSampleFormat packed = av_get_packed_sample_fmt(format);
+	// the kernels only load these, the rest are rare enough
+	const bool common = packed == AV_SAMPLE_FMT_S16 || packed == AV_SAMPLE_FMT_S32 || packed == AV_SAMPLE_FMT_FLT;
+	i32 done = 0;
+	if(out_channels == 2 && av_sample_fmt_is_planar(format) && common && k->mix2)
+		done = k->mix2(dst, src, format, in_channels, matrix, offset, count);
+	mix_scalar(dst + done * out_channels, out_channels, src, format, in_channels, matrix, offset + done, count - done);
+}
+
+void pcm_dither_init(PcmDither *dither, u32 seed){
+	// xorshift never leaves 0, and neighbouring seeds make lanes that
+	// look alike for a while.
+	u32 s = seed * 2654435761u | 1;
+	for(i32 i = 0; i < 8; ++i){
+		s ^= s << 13;
+		s ^= s >> 17;
+		s ^= s << 5;
+		dither->state[i] = s;
+	}
+}
+
+void pcm_narrow(i16 *dst, const f32 *src, i32 n, PcmDither *dither){
+	const PcmKernels *k = &kernels[active];
+	const i32 done = k->narrow ? k->narrow(dst, src, n, dither) : 0;
+	narrow_scalar(dst + done, src + done, n - done, dither);
+}
+
+// Left and right gains for a channel, by where it sits.
+static void stereo_gains(enum AVChannel c, f32 *l, f32 *r){
+	const f32 h = 0.70710678f; // -3 dB
+	switch(c){
+	case AV_CHAN_FRONT_LEFT:
+	case AV_CHAN_FRONT_LEFT_OF_CENTER:
+	case AV_CHAN_WIDE_LEFT:
+	case AV_CHAN_STEREO_LEFT:
+		*l = 1; *r = 0;
+		break;
+	case AV_CHAN_FRONT_RIGHT:
+	case AV_CHAN_FRONT_RIGHT_OF_CENTER:
+	case AV_CHAN_WIDE_RIGHT:
+	case AV_CHAN_STEREO_RIGHT:
+		*l = 0; *r = 1;
+		break;
+	case AV_CHAN_FRONT_CENTER:
+	case AV_CHAN_TOP_FRONT_CENTER:
+		*l = h; *r = h;
+		break;
+	case AV_CHAN_BACK_LEFT:
+	case AV_CHAN_SIDE_LEFT:
+	case AV_CHAN_SURROUND_DIRECT_LEFT:
+	case AV_CHAN_TOP_FRONT_LEFT:
+	case AV_CHAN_TOP_BACK_LEFT:
+	case AV_CHAN_TOP_SIDE_LEFT:
+		*l = h; *r = 0;
+		break;
+	case AV_CHAN_BACK_RIGHT:
+	case AV_CHAN_SIDE_RIGHT:
+	case AV_CHAN_SURROUND_DIRECT_RIGHT:
+	case AV_CHAN_TOP_FRONT_RIGHT:
+	case AV_CHAN_TOP_BACK_RIGHT:
+	case AV_CHAN_TOP_SIDE_RIGHT:
+		*l = 0; *r = h;
+		break;
+	case AV_CHAN_LOW_FREQUENCY:
+	case AV_CHAN_LOW_FREQUENCY_2:
+		*l = 0; *r = 0;
+		break;
+	default:
+		// back centre, top centre and whatever else, into the middle
+		*l = 0.5f; *r = 0.5f;
+		break;
+	}
+}
+
+void pcm_downmix_matrix(f32 *matrix, const AVChannelLayout *layout, i32 out_channels){
+	assert(out_channels == 1 || out_channels == 2);
+	const i32 n = layout->nb_channels;
+	assert(n <= PCM_MAX_CHANNELS);
+	// Without an order, the channels are most likely in the usual one.
+	AVChannelLayout known = {};
+	if(layout->order == AV_CHANNEL_ORDER_UNSPEC)
+		av_channel_layout_default(&known, n);
+	else
+		av_channel_layout_copy(&known, layout);
+	f32 sum[2] = {};
+	for(i32 ch = 0; ch < n; ++ch){
+		f32 l, r;
+		stereo_gains(av_channel_layout_channel_from_index(&known, ch), &l, &r);
+		if(out_channels == 1){
+			matrix[ch] = (l + r) / 2;
+			sum[0] += matrix[ch];
+		} else {
+			matrix[ch] = l;
+			matrix[n + ch] = r;
+			sum[0] += l;
+			sum[1] += r;
+		}
+	}
+	av_channel_layout_uninit(&known);
+	const f32 most = MAX(sum[0], sum[1]);
+	if(most > 1){
+		for(i32 i = 0; i < n * out_channels; ++i)
+			matrix[i] /= most;
+	}
+}
+
+void pcm_identity_matrix(f32 *matrix, i32 channels){
+	for(i32 out = 0; out < channels; ++out)
+		for(i32 ch = 0; ch < channels; ++ch)
+			matrix[out * channels + ch] = out == ch;
+}
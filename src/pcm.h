@@ -0,0 +1,57 @@
+#pragma once
+
+#include "def.h"
+
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+
+// The sample shuffling the decoder does on its way into the ring:
+// interleaving planar frames, mixing channels down, and narrowing float to
+// 16 bit with dither. Each has a scalar version and SSE2 and AVX2 ones for
+// the common cases, the best one this CPU has is picked once at startup.
+
+// The most channels mixing takes in or puts out.
+#define PCM_MAX_CHANNELS 8
+
+typedef enum {
+	PcmScalar,
+	PcmSSE2,
+	PcmAVX2,
+	PcmIsaCount,
+} PcmIsa;
+
+// TPDF dither: the difference of two uniform random numbers, one step of
+// the output wide, added before rounding. One state per vector lane.
+typedef struct {
+	u32 state[8];
+} PcmDither;
+
+// Main thread, before anything else in here runs. Picks the best kernels
+// there are for this CPU. Until then, it's the scalar ones.
+void pcm_init(void);
+// Uses isa from now on, for comparing them. Returns 0 if the CPU doesn't
+// have it.
+bool pcm_use(PcmIsa isa);
+PcmIsa pcm_isa(void);
+const char *pcm_isa_name(PcmIsa isa);
+
+// Planar to interleaved, count samples of each plane from offset on.
+void pcm_interleave(u8 *dst, u8 *const *planes, i32 channels, i32 sample_size, i32 offset, i32 count);
+
+// Mixes count sample frames from offset on into interleaved float, out
+// channels of them. format is U8, S16, S32, S64, FLT or DBL, planar or
+// packed, with in_channels. matrix is out_channels rows of in_channels gains, for full
+// scale input, so 1 keeps a sample's level.
+void pcm_mix(f32 *dst, i32 out_channels, u8 *const *src, enum AVSampleFormat format, i32 in_channels, const f32 *matrix, i32 offset, i32 count);
+
+// Float to 16 bit, with dither. n is in samples, not sample frames.
+void pcm_dither_init(PcmDither *dither, u32 seed);
+void pcm_narrow(i16 *dst, const f32 *src, i32 n, PcmDither *dither);
+
+// Fills matrix for pcm_mix with the usual ITU style gains for folding
+// layout down into out_channels, 1 or 2. Centre and surrounds go in at -3
+// dB, LFE is dropped, and the whole thing is scaled down so that no output
+// can go past full scale.
+void pcm_downmix_matrix(f32 *matrix, const AVChannelLayout *layout, i32 out_channels);
+// Each of channels straight through.
+void pcm_identity_matrix(f32 *matrix, i32 channels);
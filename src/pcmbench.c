@@ -0,0 +1,308 @@
+// Times the pcm.h kernels with each instruction set this CPU has, and the
+// resampler at each quality, against SDL doing the same with an audio
+// stream, on ten seconds of noise. Also checks that the vector kernels put
+// out what the scalar ones do, and how far each resampler is off on a sine.
+//
+//   ./do.py && ./pcmbench
+//
+// The numbers are wall clock microseconds per second of 48 kHz audio, the
+// best of a few runs, on one thread, so about what the player's CPU counts
+// come to on an idle machine. There's only the debug build so far, which
+// doesn't do the scalar loops any favours.
+
+#define _GNU_SOURCE
+#include "def.h"
+#include "pcm.h"
+#include "resample.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL3/SDL_audio.h>
+#include <SDL3/SDL_error.h>
+#include <SDL3/SDL_timer.h>
+
+#define BENCH_RATE 48000
+#define BENCH_FRAMES (BENCH_RATE * 10)
+// what a codec hands out at a time, about
+#define BENCH_CHUNK 1152
+#define BENCH_RUNS 5
+
+typedef struct {
+	const char *name;
+	enum AVSampleFormat in; // planar
+	i32 in_channels;
+	enum AVSampleFormat out; // packed, S16, S32 or FLT
+	i32 out_channels;
+} BenchCase;
+
+static const BenchCase cases[] = {
+	{"interleave s16 stereo", AV_SAMPLE_FMT_S16P, 2, AV_SAMPLE_FMT_S16, 2},
+	{"interleave f32 stereo", AV_SAMPLE_FMT_FLTP, 2, AV_SAMPLE_FMT_FLT, 2},
+	{"interleave s32 stereo", AV_SAMPLE_FMT_S32P, 2, AV_SAMPLE_FMT_S32, 2},
+	{"widen s32 stereo to f32", AV_SAMPLE_FMT_S32P, 2, AV_SAMPLE_FMT_FLT, 2},
+	{"narrow f32 stereo", AV_SAMPLE_FMT_FLTP, 2, AV_SAMPLE_FMT_S16, 2},
+	{"downmix f32 5.1", AV_SAMPLE_FMT_FLTP, 6, AV_SAMPLE_FMT_FLT, 2},
+	{"downmix s16 5.1 to s16", AV_SAMPLE_FMT_S16P, 6, AV_SAMPLE_FMT_S16, 2},
+	{"downmix s32 5.1", AV_SAMPLE_FMT_S32P, 6, AV_SAMPLE_FMT_FLT, 2},
+	{"downmix s32 7.1 to s16", AV_SAMPLE_FMT_S32P, 8, AV_SAMPLE_FMT_S16, 2},
+	{"downmix f32 7.1 to s16", AV_SAMPLE_FMT_FLTP, 8, AV_SAMPLE_FMT_S16, 2},
+};
+
+typedef struct {
+	u8 *planes[PCM_MAX_CHANNELS];
+	u8 *out;
+	u8 *ref; // what the scalar kernels put out
+	f32 *mixed;
+	f32 matrix[PCM_MAX_CHANNELS * PCM_MAX_CHANNELS];
+	PcmDither dither;
+} Bench;
+
+static u32 bench_rng = 1;
+
+static u32 next_random(void){
+	bench_rng ^= bench_rng << 13;
+	bench_rng ^= bench_rng >> 17;
+	bench_rng ^= bench_rng << 5;
+	return bench_rng;
+}
+
+static SDL_AudioFormat sdl_format(enum AVSampleFormat format){
+	switch(av_get_packed_sample_fmt(format)){
+	case AV_SAMPLE_FMT_S16: return SDL_AUDIO_S16;
+	case AV_SAMPLE_FMT_S32: return SDL_AUDIO_S32;
+	default: return SDL_AUDIO_F32;
+	}
+}
+
+// Noise at about -6 dBFS.
+static void fill_planes(Bench *b, const BenchCase *c){
+	const enum AVSampleFormat packed = av_get_packed_sample_fmt(c->in);
+	for(i32 ch = 0; ch < c->in_channels; ++ch){
+		b->planes[ch] = malloc((size_t)BENCH_FRAMES * av_get_bytes_per_sample(c->in));
+		for(i32 i = 0; i < BENCH_FRAMES; ++i){
+			const i32 r = (i32)(next_random() & 0xffff) - 32768;
+			if(packed == AV_SAMPLE_FMT_S16)
+				((i16*)b->planes[ch])[i] = (i16)(r / 2);
+			else if(packed == AV_SAMPLE_FMT_S32)
+				((i32*)b->planes[ch])[i] = r * 32768 + (i32)(next_random() & 0x7fff);
+			else
+				((f32*)b->planes[ch])[i] = r / 65536.0f;
+		}
+	}
+}
+
+static bool mixes(const BenchCase *c){
+	return c->out != av_get_packed_sample_fmt(c->in) || c->out_channels != c->in_channels;
+}
+
+// The same steps as put_samples in decoder.c.
+static void convert(Bench *b, const BenchCase *c, u8 *dst){
+	const i32 out_size = av_get_bytes_per_sample(c->out);
+	const bool mix = mixes(c);
+	for(i32 at = 0; at < BENCH_FRAMES; at += BENCH_CHUNK){
+		const i32 n = MIN(BENCH_CHUNK, BENCH_FRAMES - at);
+		u8 *to = dst + (size_t)at * c->out_channels * out_size;
+		if(!mix){
+			pcm_interleave(to, b->planes, c->in_channels, out_size, at, n);
+			continue;
+		}
+		f32 *mixed = c->out == AV_SAMPLE_FMT_S16 ? b->mixed : (f32*)to;
+		pcm_mix(mixed, c->out_channels, b->planes, c->in, c->in_channels, b->matrix, at, n);
+		if(c->out == AV_SAMPLE_FMT_S16)
+			pcm_narrow((i16*)to, mixed, n * c->out_channels, &b->dither);
+	}
+}
+
+static f64 seconds_since(u64 start){
+	return (f64)(SDL_GetPerformanceCounter() - start) / (f64)SDL_GetPerformanceFrequency();
+}
+
+// Wall clock microseconds per second of audio, for BENCH_FRAMES of it.
+static f64 us_per_second(f64 best){
+	return best * 1e6 / ((f64)BENCH_FRAMES / BENCH_RATE);
+}
+
+// Off by more than the two dithers can explain.
+static bool differs(const BenchCase *c, const u8 *a, const u8 *b){
+	const i64 n = (i64)BENCH_FRAMES * c->out_channels;
+	const i32 most = mixes(c) ? 2 : 0;
+	for(i64 i = 0; i < n; ++i){
+		if(c->out == AV_SAMPLE_FMT_S16){
+			const i32 d = ((const i16*)a)[i] - ((const i16*)b)[i];
+			if(d > most || d < -most)
+				return 1;
+		} else if(c->out == AV_SAMPLE_FMT_S32){
+			if(((const i32*)a)[i] != ((const i32*)b)[i])
+				return 1;
+		} else {
+			const f32 d = ((const f32*)a)[i] - ((const f32*)b)[i];
+			if(d > 1e-5f || d < -1e-5f)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+static f64 time_sdl(Bench *b, const BenchCase *c){
+	const SDL_AudioSpec src = {sdl_format(c->in), c->in_channels, BENCH_RATE};
+	const SDL_AudioSpec dst = {sdl_format(c->out), c->out_channels, BENCH_RATE};
+	SDL_AudioStream *stream = SDL_CreateAudioStream(&src, &dst);
+	if(stream == NULL)
+		return -1;
+	const i32 out_bytes = BENCH_CHUNK * c->out_channels * av_get_bytes_per_sample(c->out);
+	const i32 in_size = av_get_bytes_per_sample(c->in);
+	f64 best = 1e9;
+	for(i32 run = 0; run < BENCH_RUNS; ++run){
+		const u64 start = SDL_GetPerformanceCounter();
+		for(i32 at = 0; at < BENCH_FRAMES; at += BENCH_CHUNK){
+			const i32 n = MIN(BENCH_CHUNK, BENCH_FRAMES - at);
+			const void *planes[PCM_MAX_CHANNELS];
+			for(i32 ch = 0; ch < c->in_channels; ++ch)
+				planes[ch] = b->planes[ch] + (size_t)at * in_size;
+			SDL_PutAudioStreamPlanarData(stream, planes, c->in_channels, n);
+			while(SDL_GetAudioStreamData(stream, b->out, out_bytes) > 0){}
+		}
+		best = MIN(best, seconds_since(start));
+	}
+	SDL_DestroyAudioStream(stream);
+	return best;
+}
+
+static bool run_case(const BenchCase *c){
+	Bench b = {};
+	fill_planes(&b, c);
+	const size_t out_bytes = (size_t)BENCH_FRAMES * c->out_channels * av_get_bytes_per_sample(c->out);
+	b.out = malloc(out_bytes);
+	b.ref = malloc(out_bytes);
+	b.mixed = malloc(BENCH_CHUNK * c->out_channels * sizeof(f32));
+	if(c->out_channels == c->in_channels){
+		pcm_identity_matrix(b.matrix, c->in_channels);
+	} else {
+		AVChannelLayout layout = {};
+		av_channel_layout_default(&layout, c->in_channels);
+		pcm_downmix_matrix(b.matrix, &layout, c->out_channels);
+		av_channel_layout_uninit(&layout);
+	}
+	pcm_dither_init(&b.dither, 1);
+
+	println(c->name);
+	bool ok = 1;
+	for(PcmIsa isa = 0; isa < PcmIsaCount; ++isa){
+		if(!pcm_use(isa))
+			continue;
+		f64 best = 1e9;
+		for(i32 run = 0; run < BENCH_RUNS; ++run){
+			const u64 start = SDL_GetPerformanceCounter();
+			convert(&b, c, b.out);
+			best = MIN(best, seconds_since(start));
+		}
+		bool same = 1;
+		if(isa == PcmScalar)
+			memcpy(b.ref, b.out, out_bytes);
+		else
+			same = !differs(c, b.ref, b.out);
+		ok = ok && same;
+		println("  ", pcm_isa_name(isa), ": ", (i64)us_per_second(best), " us", same ? "" : ", differs from scalar");
+	}
+	const f64 sdl = time_sdl(&b, c);
+	if(sdl < 0)
+		println("  sdl: failed to create stream: ", SDL_GetError());
+	else
+		println("  sdl: ", (i64)us_per_second(sdl), " us");
+
+	for(i32 ch = 0; ch < c->in_channels; ++ch)
+		free(b.planes[ch]);
+	free(b.out);
+	free(b.ref);
+	free(b.mixed);
+	return ok;
+}
+
+// Resamples BENCH_FRAMES / BENCH_RATE seconds of in into out, the way the
+// decoder does. Returns how many frames came out.
+static i32 resample(Resampler *r, const f32 *in, i32 in_frames, f32 *out){
+	resampler_reset(r);
+	i32 made = 0;
+	for(i32 at = 0; at < in_frames; at += BENCH_CHUNK){
+		const i32 n = MIN(BENCH_CHUNK, in_frames - at);
+		made += resampler_process(r, in + (i64)at * 2, n, out + (i64)made * 2);
+	}
+	return made + resampler_flush(r, out + (i64)made * 2);
+}
+
+// Worst difference to the exact sine at the new rate, in dB of full scale.
+// The first and last filter's worth is left out, that's where the silence
+// around the input comes in.
+static f64 sine_error(Resampler *r, i32 in_rate, i32 out_rate, f32 *in, f32 *out){
+	const i32 in_frames = in_rate / 10;
+	const f64 hz = 997;
+	for(i32 i = 0; i < in_frames; ++i)
+		in[i * 2] = in[i * 2 + 1] = (f32)(0.5 * sin(2 * M_PI * hz * i / in_rate));
+	const i32 made = resample(r, in, in_frames, out);
+	f64 worst = 0;
+	for(i32 i = out_rate / 100; i < made - out_rate / 100; ++i){
+		const f64 want = 0.5 * sin(2 * M_PI * hz * i / out_rate);
+		worst = MAX(worst, fabs(out[i * 2] - want));
+	}
+	return 20 * log10(MAX(worst, 1e-12));
+}
+
+static void run_resample(i32 in_rate, i32 out_rate){
+	println("resample stereo ", in_rate, " to ", out_rate);
+	const i32 in_frames = (i32)((i64)BENCH_FRAMES * in_rate / BENCH_RATE);
+	f32 *in = malloc((size_t)in_frames * 2 * sizeof(f32));
+	for(i32 i = 0; i < in_frames * 2; ++i)
+		in[i] = ((i32)(next_random() & 0xffff) - 32768) / 65536.0f;
+	const i32 want = (i32)(((i64)in_frames * out_rate + in_rate - 1) / in_rate);
+	f32 *out = malloc(((size_t)want + BENCH_CHUNK) * 2 * sizeof(f32));
+	const f64 seconds = (f64)in_frames / in_rate;
+	for(ResampleQuality q = 0; q < ResampleQualityCount; ++q){
+		Resampler *r = resampler_create(in_rate, out_rate, 2, q);
+		f64 best = 1e9;
+		i32 made = 0;
+		for(i32 run = 0; run < BENCH_RUNS; ++run){
+			const u64 start = SDL_GetPerformanceCounter();
+			made = resample(r, in, in_frames, out);
+			best = MIN(best, seconds_since(start));
+		}
+		const i32 error = (i32)sine_error(r, in_rate, out_rate, in, out);
+		println("  ", resample_quality_name(q), ": ", (i64)(best * 1e6 / seconds), " us, ", error, " dB off a sine", made == want ? "" : ", wrong length");
+		resampler_free(&r);
+	}
+	const SDL_AudioSpec src = {SDL_AUDIO_F32, 2, in_rate};
+	const SDL_AudioSpec dst = {SDL_AUDIO_F32, 2, out_rate};
+	SDL_AudioStream *stream = SDL_CreateAudioStream(&src, &dst);
+	if(stream == NULL){
+		println("  sdl: failed to create stream: ", SDL_GetError());
+	} else {
+		f64 best = 1e9;
+		for(i32 run = 0; run < BENCH_RUNS; ++run){
+			SDL_ClearAudioStream(stream);
+			const u64 start = SDL_GetPerformanceCounter();
+			for(i32 at = 0; at < in_frames; at += BENCH_CHUNK){
+				const i32 n = MIN(BENCH_CHUNK, in_frames - at);
+				SDL_PutAudioStreamData(stream, in + (i64)at * 2, n * 2 * (i32)sizeof(f32));
+				while(SDL_GetAudioStreamData(stream, out, BENCH_CHUNK * 2 * (i32)sizeof(f32)) > 0){}
+			}
+			best = MIN(best, seconds_since(start));
+		}
+		println("  sdl: ", (i64)(best * 1e6 / seconds), " us");
+		SDL_DestroyAudioStream(stream);
+	}
+	free(in);
+	free(out);
+}
+
+int main(void){
+	pcm_init();
+	const PcmIsa best = pcm_isa();
+	println("best here: ", pcm_isa_name(best));
+	bool ok = 1;
+	for(i32 i = 0; i < countof(cases); ++i)
+		ok = run_case(&cases[i]) && ok;
+	run_resample(44100, 48000);
+	run_resample(96000, 48000);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,67 @@
+#include "playclock.h"
+
+// The fields are atomics too, so a reader that races with the writer reads
+// garbage it throws away instead of having a data race. The fences keep the
+// field stores between the two seq stores, and the loads between the two
+// seq loads.
+
+void playback_clock_set(PlaybackClock *c, const PlaybackTime *t){
+	const u32 seq = atomic_load_explicit(&c->seq, memory_order_relaxed);
+	atomic_store_explicit(&c->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&c->id, t->id, memory_order_relaxed);
+	atomic_store_explicit(&c->sample, t->sample, memory_order_relaxed);
+	atomic_store_explicit(&c->samples, t->samples, memory_order_relaxed);
+	atomic_store_explicit(&c->rate, t->rate, memory_order_relaxed);
+	atomic_store_explicit(&c->at_ns, t->at_ns, memory_order_relaxed);
+	atomic_store_explicit(&c->ahead, t->ahead, memory_order_relaxed);
+	atomic_store_explicit(&c->running, t->running, memory_order_relaxed);
+	atomic_store_explicit(&c->seq, seq + 2, memory_order_release);
+}
+
+PlaybackTime playback_clock_get(const PlaybackClock *c){
+	PlaybackTime t;
+	for(;;){
+		const u32 seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+		if(seq & 1)
+			continue;
+		t.id = atomic_load_explicit(&c->id, memory_order_relaxed);
+		t.sample = atomic_load_explicit(&c->sample, memory_order_relaxed);
+		t.samples = atomic_load_explicit(&c->samples, memory_order_relaxed);
+		t.rate = atomic_load_explicit(&c->rate, memory_order_relaxed);
+		t.at_ns = atomic_load_explicit(&c->at_ns, memory_order_relaxed);
+		t.ahead = atomic_load_explicit(&c->ahead, memory_order_relaxed);
+		t.running = atomic_load_explicit(&c->running, memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);
+		if(atomic_load_explicit(&c->seq, memory_order_relaxed) == seq)
+			return t;
+	}
+}
+
+i64 playback_elapsed(const PlaybackTime *t, u64 now_ns){
+	if(!t->running || now_ns <= t->at_ns)
+		return t->sample;
+	const i64 since = (i64)((f64)(now_ns - t->at_ns) * t->rate / 1e9);
+	i64 at = t->sample + MIN(since, t->ahead);
+	if(t->samples > 0)
+		at = MIN(at, t->samples);
+	return at;
+}
+
+i64 playback_remaining(const PlaybackTime *t, u64 now_ns){
+	if(t->samples <= 0)
+		return 0;
+	const i64 left = t->samples - playback_elapsed(t, now_ns);
+	return MAX(left, (i64)0);
+}
+
+f64 playback_seconds(const PlaybackTime *t, i64 samples){
+	return t->rate > 0 ? (f64)samples / t->rate : 0;
+}
+
+f32 playback_relative(const PlaybackTime *t, u64 now_ns){
+	if(t->samples <= 0)
+		return 0;
+	const f32 relative = (f32)((f64)playback_elapsed(t, now_ns) / (f64)t->samples);
+	return MIN(relative, 1.0f);
+}
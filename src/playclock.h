@@ -0,0 +1,47 @@
+#pragma once
+
+#include "def.h"
+
+#include <stdatomic.h>
+
+// Where playback is, as the device hears it. The audio callback knows what
+// it read from the decoder, and takes off what's still queued in SDL's
+// stream and in the device's buffer. The main thread reads it without a
+// lock: it's a seqlock, the writer makes seq odd while it changes the
+// fields, and readers try again if seq was odd or changed under them.
+typedef struct {
+	i32 id;      // of the playlist entry, -1 if nothing plays
+	i64 sample;  // of the track the device plays at at_ns
+	i64 samples; // in the track, 0 if nobody knows
+	i32 rate;    // of the track
+	u64 at_ns;   // SDL_GetTicksNS
+	// Samples that were queued at at_ns. Playback goes on for that long
+	// without another callback, no further.
+	i64 ahead;
+	bool running; // 0 while the device is paused
+} PlaybackTime;
+
+typedef struct {
+	_Atomic u32 seq;
+	_Atomic i32 id;
+	_Atomic i64 sample;
+	_Atomic i64 samples;
+	_Atomic i32 rate;
+	_Atomic u64 at_ns;
+	_Atomic i64 ahead;
+	_Atomic bool running;
+} PlaybackClock;
+
+// One writer at a time: the audio callback, or the main thread while the
+// device is paused.
+void playback_clock_set(PlaybackClock *c, const PlaybackTime *t);
+PlaybackTime playback_clock_get(const PlaybackClock *c);
+
+// The sample the device plays at now_ns, going on from t at the track's rate
+// while it's running.
+i64 playback_elapsed(const PlaybackTime *t, u64 now_ns);
+// Samples from there to the end, 0 if the length isn't known.
+i64 playback_remaining(const PlaybackTime *t, u64 now_ns);
+f64 playback_seconds(const PlaybackTime *t, i64 samples);
+// How far into the track that is, 0..1.
+f32 playback_relative(const PlaybackTime *t, u64 now_ns);
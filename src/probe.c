@@ -0,0 +1,248 @@
+#include "probe.h"
+#include "jobpool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL3/SDL_cpuinfo.h>
+#include <SDL3/SDL_mutex.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+// Opening a file with libav to find out how long it is takes a few
+// milliseconds, too long to do it on the main thread for every line we draw.
+// A few workers do it in the background, the entries on screen first, see
+// jobpool.h.
+//
+// Results go into a list under the pool's mutex and the main thread moves
+// them into the table in probe_pool_update. So the UI reads the table
+// without any locking, and results are at most a frame late.
+//
+// Everything we learned is kept in a cache file, see cache.h, keyed by
+// path. mtime and size are in the info, so a file only gets probed again if
+// it changed.
+
+static_assert(ProbeNone == JobNone && ProbeQueued == JobQueued && ProbeDone == JobDone && ProbeFailed == JobFailed, "the pool looks at the state");
+
+typedef struct {
+	i32 id;
+	u32 generation;
+	TrackInfo info; // strings point into ProbeResults.names
+} ProbeResult;
+
+typedef struct {
+	ProbeResult *data;
+	i32 count;
+	i32 cap;
+	CharList names;
+} ProbeResults;
+
+typedef struct {
+	CacheKey key;
+	TrackInfo info;
+} ProbeRecord;
+
+static bool probe_record_valid(const void *record){
+	const ProbeRecord *r = record;
+	return r->info.state == ProbeDone || r->info.state == ProbeFailed;
+}
+
+static const CacheFormat probe_cache_format = {
+	.name = "probe.cache",
+	.magic = "mosprb",
+	.version = 2,
+	.record_size = sizeof(ProbeRecord),
+	.subs = {offsetof(ProbeRecord, info.codec), offsetof(ProbeRecord, info.title), offsetof(ProbeRecord, info.artist), offsetof(ProbeRecord, info.album)},
+	.sub_count = 4,
+	.valid = probe_record_valid,
+};
+
+static const JobPoolFormat probe_pool_format = {
+	.cache = &probe_cache_format,
+	.info_offset = offsetof(ProbeRecord, info),
+	.info_size = sizeof(TrackInfo),
+	.mtime = offsetof(TrackInfo, mtime),
+	.size = offsetof(TrackInfo, size),
+	.batch = 64,
+};
+
+struct ProbePool {
+	// the strings of its infos point into the strings of its cache
+	JobPool jobs;
+	// guarded by jobs.mutex
+	ProbeResults results;
+
+	// only used by the main thread
+	ProbeResults taken;
+	u32 version;
+};
+
+static Sub push_sub(CharList *l, const char *s, i32 len){
+	Sub res = {l->count, len};
+	push_string(l, s, len);
+	push_string(l, "\0", 1);
+	return res;
+}
+
+//# workers
+
+static Sub push_tag(CharList *names, const AVFormatContext *fmt, const AVStream *stream, const char *key){
+	// ogg and opus keep their tags on the stream, everything else on the container.
+	const AVDictionaryEntry *e = av_dict_get(fmt->metadata, key, NULL, 0);
+	if(e == NULL)
+		e = av_dict_get(stream->metadata, key, NULL, 0);
+	const char *value = e ? e->value : "";
+	return push_sub(names, value, strlen(value));
+}
+
+static bool probe_file(const char *path, ProbeResult *r, CharList *names){
+	AVFormatContext *fmt = NULL;
+	if(avformat_open_input(&fmt, path, NULL, NULL) < 0)
+		return 0;
+	bool ok = 0;
+	if(avformat_find_stream_info(fmt, NULL) >= 0){
+		i32 idx = av_find_best_stream(fmt, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+		if(idx >= 0){
+			const AVStream *stream = fmt->streams[idx];
+			const AVCodecParameters *par = stream->codecpar;
+			if(stream->duration != AV_NOPTS_VALUE)
+				r->info.duration = (f32)(stream->duration * av_q2d(stream->time_base));
+			else if(fmt->duration != AV_NOPTS_VALUE)
+				r->info.duration = (f32)fmt->duration / AV_TIME_BASE;
+			r->info.sample_rate = par->sample_rate;
+			r->info.channels = (u8)MIN(par->ch_layout.nb_channels, 255);
+			const char *codec = avcodec_get_name(par->codec_id);
+			r->info.codec = push_sub(names, codec, strlen(codec));
+			r->info.title = push_tag(names, fmt, stream, "title");
+			r->info.artist = push_tag(names, fmt, stream, "artist");
+			r->info.album = push_tag(names, fmt, stream, "album");
+			ok = 1;
+		}
+	}
+	avformat_close_input(&fmt);
+	return ok;
+}
+
+static int probe_worker_main(void *arg){
+	ProbePool *p = arg;
+	CharList names = make_charlist();
+	SDL_LockMutex(p->jobs.mutex);
+	PoolJob job;
+	while(job_pool_wait(&p->jobs, &job)){
+		SDL_UnlockMutex(p->jobs.mutex);
+
+		ProbeResult r = {.id = job.id, .generation = job.generation};
+		r.info.mtime = job.mtime;
+		r.info.size = job.size;
+		names.count = 0;
+		r.info.state = probe_file(job.path, &r, &names) ? ProbeDone : ProbeFailed;
+		free(job.path);
+
+		SDL_LockMutex(p->jobs.mutex);
+		ProbeResults *out = &p->results;
+		const i32 offset = out->names.count;
+		push_string(&out->names, names.data, names.count);
+		if(r.info.state == ProbeDone){
+			r.info.codec.start += offset;
+			r.info.title.start += offset;
+			r.info.artist.start += offset;
+			r.info.album.start += offset;
+		}
+		if(out->count >= out->cap){
+			out->cap = MAX(out->cap * 2, 64);
+			out->data = realloc(out->data, out->cap * sizeof(out->data[0]));
+		}
+		out->data[out->count++] = r;
+	}
+	SDL_UnlockMutex(p->jobs.mutex);
+	free(names.data);
+	return 0;
+}
+
+//# main thread
+
+ProbePool *probe_pool_start(void){
+	ProbePool *p = calloc(1, sizeof(*p));
+	p->results.names = make_charlist();
+	p->taken.names = make_charlist();
+	// Probing is mostly waiting for the disk. A few threads are plenty and
+	// leave the decoder alone.
+	const i32 n = MAX(SDL_GetNumLogicalCPUCores() / 2, 1);
+	job_pool_start(&p->jobs, &probe_pool_format, n, probe_worker_main, "probe", p);
+	return p;
+}
+
+void probe_pool_stop(ProbePool **pp, const Playlist *pl){
+	ProbePool *p = *pp;
+	if(p == NULL)
+		return;
+	job_pool_stop_workers(&p->jobs);
+	// whatever finished in the meantime is worth keeping.
+	probe_pool_update(p, pl);
+	job_pool_free(&p->jobs, pl);
+	free(p->results.data);
+	free(p->results.names.data);
+	free(p->taken.data);
+	free(p->taken.names.data);
+	free(p);
+	*pp = NULL;
+}
+
+void probe_pool_reset(ProbePool *p){
+	if(p == NULL)
+		return;
+	job_pool_reset(&p->jobs);
+}
+
+void probe_pool_update(ProbePool *p, const Playlist *pl){
+	if(p == NULL)
+		return;
+	// keep the workers busy with the rest of the library.
+	job_pool_update(&p->jobs, pl, 1);
+
+	SDL_LockMutex(p->jobs.mutex);
+	ProbeResults tmp = p->taken;
+	p->taken = p->results;
+	p->results = tmp;
+	p->results.count = 0;
+	p->results.names.count = 0;
+	SDL_UnlockMutex(p->jobs.mutex);
+
+	for(i32 i = 0; i < p->taken.count; ++i){
+		ProbeResult *r = &p->taken.data[i];
+		if(!job_pool_current(&p->jobs, r->id, r->generation))
+			continue;
+		TrackInfo info = r->info;
+		if(info.state == ProbeDone){
+			RecordCache *c = &p->jobs.cache;
+			const char *names = p->taken.names.data;
+			info.codec = record_cache_push(c, names + info.codec.start, info.codec.len);
+			info.title = record_cache_push(c, names + info.title.start, info.title.len);
+			info.artist = record_cache_push(c, names + info.artist.start, info.artist.len);
+			info.album = record_cache_push(c, names + info.album.start, info.album.len);
+		}
+		job_pool_put(&p->jobs, pl, r->id, &info, 1);
+		p->version += 1;
+	}
+}
+
+void probe_prioritize(ProbePool *p, const Playlist *pl, const i32 *ids, i32 count){
+	if(p == NULL)
+		return;
+	job_pool_prioritize(&p->jobs, pl, ids, count);
+}
+
+const TrackInfo *probe_info(const ProbePool *p, const Playlist *pl, i32 id){
+	if(p == NULL)
+		return NULL;
+	return job_pool_info(&p->jobs, pl, id);
+}
+
+u32 probe_pool_version(const ProbePool *p){
+	return p ? p->version : 0;
+}
+
+Slice probe_string(const ProbePool *p, Sub s){
+	return (Slice){p->jobs.cache.strings.data + s.start, s.len};
+}
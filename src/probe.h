@@ -0,0 +1,44 @@
+#pragma once
+
+#include "library.h"
+
+typedef enum {
+	ProbeNone,
+	ProbeQueued,
+	ProbeDone,
+	ProbeFailed,
+} ProbeState;
+
+// What we know about a file without decoding it. The strings point into the
+// pool and stay valid until probe_pool_stop.
+typedef struct {
+	u8 state;
+	u8 channels;
+	i32 sample_rate;
+	f32 duration; // seconds, 0 if unknown
+	i64 mtime;    // of the file that was probed
+	i64 size;
+	Sub codec;
+	Sub title;
+	Sub artist;
+	Sub album;
+} TrackInfo;
+
+typedef struct ProbePool ProbePool;
+
+// Starts the workers and loads the probe cache.
+ProbePool *probe_pool_start(void);
+// Saves what we know about the entries of pl and stops the workers.
+void probe_pool_stop(ProbePool **p, const Playlist *pl);
+// The playlist got replaced and all the ids changed.
+void probe_pool_reset(ProbePool *p);
+// Main thread only, once a frame. Picks up results and keeps the workers busy
+// with the rest of the library.
+void probe_pool_update(ProbePool *p, const Playlist *pl);
+// Probes these entries before anything else, e.g. the ones on screen.
+void probe_prioritize(ProbePool *p, const Playlist *pl, const i32 *ids, i32 count);
+// NULL if the entry hasn't been probed yet, or the file changed since.
+const TrackInfo *probe_info(const ProbePool *p, const Playlist *pl, i32 id);
+// Goes up whenever new results show up.
+u32 probe_pool_version(const ProbePool *p);
+Slice probe_string(const ProbePool *p, Sub s);
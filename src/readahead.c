@@ -0,0 +1,289 @@
+#define _GNU_SOURCE
+#include "readahead.h"
+#include "library.h"
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <SDL3/SDL_mutex.h>
+#include <SDL3/SDL_thread.h>
+
+// The main thread says which files come next, the worker reads them one at
+// a time, in that order, into buffers of their own. The loader gets those
+// through fileio.c, as long as the file didn't change since.
+//
+// Before reading a file the worker tells the kernel to read all of it ahead,
+// so even a file that doesn't fit in the cap won't have to wait for the disk
+// when it's opened, unless the page cache drops it again.
+//
+// There's only ever a handful of files, so they're in an array and
+// everything is a loop over it.
+
+// read at a time, between checks for stop
+#define READ_AHEAD_CHUNK (1024 * 1024)
+
+struct ReadAheadFile {
+	char *path;
+	u8 *data; // NULL if the file couldn't be read or doesn't fit
+	i64 size;
+	i64 mtime;
+	u64 used; // clock of the last get, the smallest goes first
+	i32 refs;
+};
+
+struct ReadAhead {
+	SDL_Thread *thread;
+	SDL_Mutex *mutex;
+	SDL_Condition *wake;
+	// Only set under the mutex, the worker looks at it without while it
+	// reads.
+	_Atomic bool stop;
+	i64 cap;
+
+	// guarded by mutex
+	CharList wanted; // the paths, one after the other with their NUL
+	i32 wanted_count;
+	ReadAheadFile **files;
+	i32 file_count;
+	i32 file_cap;
+	i64 total; // bytes in data, or about to be
+	u64 clock;
+};
+
+// Without a trailing NUL.
+static i32 path_len(Slice path){
+	return path.len > 0 && path.str[path.len - 1] == 0 ? path.len - 1 : path.len;
+}
+
+static bool is_wanted(const ReadAhead *ra, const char *path){
+	const char *p = ra->wanted.data;
+	for(i32 i = 0; i < ra->wanted_count; ++i){
+		if(strcmp(p, path) == 0)
+			return 1;
+		p += strlen(p) + 1;
+	}
+	return 0;
+}
+
+static i32 find_file(const ReadAhead *ra, const char *path){
+	for(i32 i = 0; i < ra->file_count; ++i){
+		if(strcmp(ra->files[i]->path, path) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static void drop_file(ReadAhead *ra, i32 i){
+	ReadAheadFile *f = ra->files[i];
+	if(f->data)
+		ra->total -= f->size;
+	free(f->data);
+	free(f->path);
+	free(f);
+	ra->files[i] = ra->files[--ra->file_count];
+}
+
+// Makes room for size more bytes, dropping the files that were used least
+// recently. Never the wanted ones or ones somebody's reading.
+static bool make_room(ReadAhead *ra, i64 size){
+	if(size > ra->cap)
+		return 0;
+	while(ra->total + size > ra->cap){
+		i32 victim = -1;
+		for(i32 i = 0; i < ra->file_count; ++i){
+			const ReadAheadFile *f = ra->files[i];
+			if(f->data == NULL || f->refs > 0 || is_wanted(ra, f->path))
+				continue;
+			if(victim < 0 || f->used < ra->files[victim]->used)
+				victim = i;
+		}
+		if(victim < 0)
+			return 0;
+		drop_file(ra, victim);
+	}
+	return 1;
+}
+
+//# worker
+
+// Fills in f, reading the file if there's room for it.
+static void read_file(ReadAhead *ra, ReadAheadFile *f){
+	const int fd = open(f->path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		return;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)){
+		close(fd);
+		return;
+	}
+	f->size = st.st_size;
+	f->mtime = file_mtime_us(&st);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+	SDL_LockMutex(ra->mutex);
+	const bool fits = make_room(ra, f->size);
+	if(fits)
+		ra->total += f->size;
+	SDL_UnlockMutex(ra->mutex);
+	if(!fits){
+		close(fd);
+		return;
+	}
+	u8 *data = malloc(MAX(f->size, 1));
+	i64 done = 0;
+	while(done < f->size && !atomic_load_explicit(&ra->stop, memory_order_relaxed)){
+		const i64 want = MIN(f->size - done, READ_AHEAD_CHUNK);
+		const ssize_t got = read(fd, data + done, want);
+		if(got <= 0)
+			break;
+		done += got;
+	}
+	close(fd);
+	if(done == f->size){
+		f->data = data;
+		return;
+	}
+	free(data);
+	SDL_LockMutex(ra->mutex);
+	ra->total -= f->size;
+	SDL_UnlockMutex(ra->mutex);
+}
+
+// The first wanted path that hasn't been looked at yet.
+static const char *next_wanted(const ReadAhead *ra){
+	const char *p = ra->wanted.data;
+	for(i32 i = 0; i < ra->wanted_count; ++i){
+		if(find_file(ra, p) < 0)
+			return p;
+		p += strlen(p) + 1;
+	}
+	return NULL;
+}
+
+static int read_ahead_main(void *arg){
+	ReadAhead *ra = arg;
+	SDL_LockMutex(ra->mutex);
+	while(!ra->stop){
+		const char *path = next_wanted(ra);
+		if(path == NULL){
+			SDL_WaitCondition(ra->wake, ra->mutex);
+			continue;
+		}
+		ReadAheadFile *f = calloc(1, sizeof(*f));
+		f->path = strdup(path);
+		SDL_UnlockMutex(ra->mutex);
+
+		read_file(ra, f);
+
+		SDL_LockMutex(ra->mutex);
+		// Even if it's not wanted anymore, it may be again soon. Files that
+		// didn't work out stay as well, so they aren't tried over and over.
+		f->used = ++ra->clock;
+		if(ra->file_count == ra->file_cap){
+			ra->file_cap = MAX(ra->file_cap * 2, 16);
+			ra->files = realloc(ra->files, ra->file_cap * sizeof(ra->files[0]));
+		}
+		ra->files[ra->file_count++] = f;
+	}
+	SDL_UnlockMutex(ra->mutex);
+	return 0;
+}
+
+//# main thread
+
+ReadAhead *read_ahead_start(i64 cap_bytes){
+	ReadAhead *ra = calloc(1, sizeof(*ra));
+	ra->cap = cap_bytes;
+	ra->mutex = SDL_CreateMutex();
+	ra->wake = SDL_CreateCondition();
+	ra->wanted = make_charlist();
+	ra->thread = SDL_CreateThread(read_ahead_main, "read ahead", ra);
+	return ra;
+}
+
+void read_ahead_stop(ReadAhead **rra){
+	ReadAhead *ra = *rra;
+	if(ra == NULL)
+		return;
+	SDL_LockMutex(ra->mutex);
+	atomic_store_explicit(&ra->stop, 1, memory_order_relaxed);
+	SDL_SignalCondition(ra->wake);
+	SDL_UnlockMutex(ra->mutex);
+	SDL_WaitThread(ra->thread, NULL);
+	SDL_DestroyCondition(ra->wake);
+	SDL_DestroyMutex(ra->mutex);
+	while(ra->file_count > 0){
+		assert(ra->files[0]->refs == 0);
+		drop_file(ra, 0);
+	}
+	free(ra->files);
+	free(ra->wanted.data);
+	free(ra);
+	*rra = NULL;
+}
+
+void read_ahead_want(ReadAhead *ra, const Slice *paths, i32 count){
+	SDL_LockMutex(ra->mutex);
+	bool same = count == ra->wanted_count;
+	const char *p = ra->wanted.data;
+	for(i32 i = 0; same && i < count; ++i){
+		const i32 len = path_len(paths[i]);
+		same = (i32)strlen(p) == len && memeq(p, paths[i].str, len);
+		p += strlen(p) + 1;
+	}
+	if(same){
+		SDL_UnlockMutex(ra->mutex);
+		return;
+	}
+	ra->wanted.count = 0;
+	for(i32 i = 0; i < count; ++i){
+		push_string(&ra->wanted, paths[i].str, path_len(paths[i]));
+		push_string(&ra->wanted, "", 1);
+	}
+	ra->wanted_count = count;
+	// give the ones that didn't work out another chance next time
+	for(i32 i = ra->file_count - 1; i >= 0; --i){
+		const ReadAheadFile *f = ra->files[i];
+		if(f->data == NULL && !is_wanted(ra, f->path))
+			drop_file(ra, i);
+	}
+	SDL_SignalCondition(ra->wake);
+	SDL_UnlockMutex(ra->mutex);
+}
+
+//# any thread
+
+ReadAheadFile *read_ahead_get(ReadAhead *ra, const char *path, i64 size, i64 mtime, const u8 **data){
+	SDL_LockMutex(ra->mutex);
+	const i32 i = find_file(ra, path);
+	ReadAheadFile *f = i >= 0 ? ra->files[i] : NULL;
+	if(f != NULL && f->data != NULL && (f->size != size || f->mtime != mtime)){
+		// The file changed since, read it again if it's still wanted.
+		if(f->refs == 0){
+			drop_file(ra, i);
+			SDL_SignalCondition(ra->wake);
+		}
+		f = NULL;
+	}
+	if(f != NULL && f->data != NULL){
+		f->refs += 1;
+		f->used = ++ra->clock;
+		*data = f->data;
+	} else {
+		f = NULL;
+	}
+	SDL_UnlockMutex(ra->mutex);
+	return f;
+}
+
+void read_ahead_release(ReadAhead *ra, ReadAheadFile *f){
+	if(f == NULL)
+		return;
+	SDL_LockMutex(ra->mutex);
+	f->refs -= 1;
+	SDL_UnlockMutex(ra->mutex);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "def.h"
+
+// Reads the tracks that are going to play next into memory ahead of time,
+// so a disk that has to spin up or a slow network mount doesn't hold up the
+// next track. What's in memory is capped, the files used least recently go
+// first. Files that don't fit only get the kernel to read them ahead.
+typedef struct ReadAhead ReadAhead;
+// A file in memory, kept there until it's released.
+typedef struct ReadAheadFile ReadAheadFile;
+
+ReadAhead *read_ahead_start(i64 cap_bytes);
+// Everything that was got has to be released before.
+void read_ahead_stop(ReadAhead **ra);
+// Main thread. The files to have in memory, the one needed first first.
+// Replaces the list from last time, cheap if nothing changed.
+void read_ahead_want(ReadAhead *ra, const Slice *paths, i32 count);
+// Any thread. NULL unless path is in memory, read while the file had this
+// size and mtime (microseconds). *data stays valid until the release.
+ReadAheadFile *read_ahead_get(ReadAhead *ra, const char *path, i64 size, i64 mtime, const u8 **data);
+void read_ahead_release(ReadAhead *ra, ReadAheadFile *f);
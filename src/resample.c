@@ -0,0 +1,340 @@
+#define _GNU_SOURCE
+#include "resample.h"
+#include "pcm.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RESAMPLE_X86 1
+#include <immintrin.h>
+#endif
+
+#include <SDL3/SDL_atomic.h>
+
+// With the rates reduced to up/down, output k sits at input time k*down/up.
+// Its integer part q says which input samples the filter covers, q-half+1
+// to q+half, its remainder p out of up which of the phases to use. Pairs of
+// rates with an up bigger than RESAMPLE_MAX_PHASES get the closest of that
+// many phases, which is still far below what 16 bit can show. Rounding up
+// from the last of them lands on a whole sample later, so there's a row for
+// that too, the window leaves its first tap at 0.
+//
+// The input is kept per channel, from the first sample an output still
+// needs, so the dot products run over plain arrays, 8 taps at a time with
+// FMA if the CPU has it. The rest of the build doesn't assume it does, the
+// FMA one is compiled for it on its own and picked when a resampler is
+// made.
+//
+// After a reset the resampler makes up half a filter of silence before the
+// input, so output 0 lines up with input 0 and nothing gets delayed.
+
+#define RESAMPLE_MAX_PHASES 1024
+// filters get wider for going down in rate, up to this
+#define RESAMPLE_MAX_TAPS 256
+// distinct rate pairs and qualities whose tables are kept
+#define RESAMPLE_TABLES_MAX 16
+
+typedef struct {
+	const char *name;
+	i32 taps;
+	f64 beta;   // of the Kaiser window
+	f64 cutoff; // of the input's Nyquist, in the middle of the transition
+} ResamplePreset;
+
+static const ResamplePreset presets[ResampleQualityCount] = {
+	[ResampleFast] = {"fast", 2, 0, 1},
+	[ResampleMedium] = {"medium", 32, 7, 0.865},
+	[ResampleHigh] = {"high", 128, 9, 0.955},
+};
+
+typedef struct {
+	u32 up;
+	u32 down;
+	ResampleQuality quality;
+	i32 taps;
+	i32 half;
+	u32 phases;
+	f32 *coefs; // phases + 1 rows of taps
+} ResampleTable;
+
+// Kept until the program ends, tables don't change once they're made.
+static ResampleTable *tables[RESAMPLE_TABLES_MAX];
+static i32 table_count;
+static SDL_SpinLock tables_lock;
+
+struct Resampler {
+	const ResampleTable *table;
+	bool own_table; // didn't fit in tables
+	i32 channels;
+	f32 *hist[PCM_MAX_CHANNELS];
+	i32 have;
+	i32 hist_cap;
+	i64 first; // the input sample at hist[ch][0]
+	i64 q;     // of the next output
+	u32 p;
+	i64 fed;   // input frames since the reset
+	i64 made;  // output frames since the reset
+	f32 (*dot)(const f32 *x, const f32 *c, i32 taps);
+};
+
+static u32 gcd(u32 a, u32 b){
+	while(b){
+		const u32 t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static f64 bessel_i0(f64 x){
+	f64 sum = 1;
+	f64 term = 1;
+	for(i32 k = 1; k < 64; ++k){
+		const f64 h = x / (2 * k);
+		term *= h * h;
+		sum += term;
+		if(term < sum * 1e-12)
+			break;
+	}
+	return sum;
+}
+
+static ResampleTable *make_table(u32 up, u32 down, ResampleQuality quality){
+	const ResamplePreset *preset = &presets[quality];
+	ResampleTable *t = calloc(1, sizeof(*t));
+	t->up = up;
+	t->down = down;
+	t->quality = quality;
+	t->phases = MIN(up, (u32)RESAMPLE_MAX_PHASES);
+	// Going down, the cutoff has to come down to the new Nyquist, and the
+	// filter gets as much wider to keep the same transition.
+	const f64 scale = up < down ? (f64)up / down : 1.0;
+	if(quality == ResampleFast){
+		t->taps = 2;
+	} else {
+		const i32 taps = (i32)ceil(preset->taps / scale);
+		t->taps = MIN((taps + 7) & ~7, RESAMPLE_MAX_TAPS);
+	}
+	t->half = t->taps / 2;
+	t->coefs = aligned_alloc(32, ((size_t)(t->phases + 1) * t->taps * sizeof(f32) + 31) & ~(size_t)31);
+	const f64 cutoff = preset->cutoff * scale;
+	const f64 i0_beta = bessel_i0(preset->beta);
+	for(u32 p = 0; p <= t->phases; ++p){
+		const f64 frac = (f64)p / t->phases;
+		f32 *row = t->coefs + (size_t)p * t->taps;
+		f64 sum = 0;
+		for(i32 k = 0; k < t->taps; ++k){
+			// from the output's time to this tap's sample, in input samples
+			const f64 d = k - (t->half - 1) - frac;
+			f64 c;
+			if(quality == ResampleFast){
+				c = MAX(1 - fabs(d), 0.0);
+			} else {
+				const f64 x = d / t->half;
+				const f64 w = fabs(x) >= 1 ? 0 : bessel_i0(preset->beta * sqrt(1 - x * x)) / i0_beta;
+				const f64 a = M_PI * cutoff * d;
+				c = cutoff * (d == 0 ? 1 : sin(a) / a) * w;
+			}
+			row[k] = (f32)c;
+			sum += c;
+		}
+		// exactly the same level for every phase
+		for(i32 k = 0; k < t->taps; ++k)
+			row[k] = (f32)(row[k] / sum);
+	}
+	return t;
+}
+
+static void free_table(ResampleTable *t){
+	free(t->coefs);
+	free(t);
+}
+
+// Finds or makes the table. Returns 0 in *cached if it's the caller's to
+// free.
+static ResampleTable *get_table(u32 up, u32 down, ResampleQuality quality, bool *cached){
+	SDL_LockSpinlock(&tables_lock);
+	for(i32 i = 0; i < table_count; ++i){
+		ResampleTable *t = tables[i];
+		if(t->up == up && t->down == down && t->quality == quality){
+			SDL_UnlockSpinlock(&tables_lock);
+			*cached = 1;
+			return t;
+		}
+	}
+	SDL_UnlockSpinlock(&tables_lock);
+	// Made without the lock, it takes a while. Somebody else may make the
+	// same one meanwhile, then theirs is used.
+	ResampleTable *t = make_table(up, down, quality);
+	SDL_LockSpinlock(&tables_lock);
+	for(i32 i = 0; i < table_count; ++i){
+		ResampleTable *other = tables[i];
+		if(other->up == up && other->down == down && other->quality == quality){
+			SDL_UnlockSpinlock(&tables_lock);
+			free_table(t);
+			*cached = 1;
+			return other;
+		}
+	}
+	*cached = table_count < RESAMPLE_TABLES_MAX;
+	if(*cached)
+		tables[table_count++] = t;
+	SDL_UnlockSpinlock(&tables_lock);
+	return t;
+}
+
+static f32 dot(const f32 *x, const f32 *c, i32 taps){
+	f32 sum = 0;
+	for(i32 k = 0; k < taps; ++k)
+		sum += x[k] * c[k];
+	return sum;
+}
+
+#ifdef RESAMPLE_X86
+// taps is a multiple of 8
+__attribute__((target("avx,fma"))) static f32 dot_fma(const f32 *x, const f32 *c, i32 taps){
+	__m256 acc = _mm256_setzero_ps();
+	for(i32 k = 0; k < taps; k += 8)
+		acc = _mm256_fmadd_ps(_mm256_loadu_ps(x + k), _mm256_load_ps(c + k), acc);
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_movehdup_ps(s));
+	return _mm_cvtss_f32(s);
+}
+
+static bool has_fma(void){
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx") && __builtin_cpu_supports("fma");
+}
+#endif
+
+const char *resample_quality_name(ResampleQuality quality){
+	return quality < ResampleQualityCount ? presets[quality].name : "?";
+}
+
+Resampler *resampler_create(i32 in_rate, i32 out_rate, i32 channels, ResampleQuality quality){
+	assert(in_rate > 0 && out_rate > 0 && channels <= PCM_MAX_CHANNELS);
+	const u32 g = gcd((u32)in_rate, (u32)out_rate);
+	Resampler *r = calloc(1, sizeof(*r));
+	bool cached;
+	r->table = get_table((u32)out_rate / g, (u32)in_rate / g, quality, &cached);
+	r->own_table = !cached;
+	r->channels = channels;
+	r->dot = dot;
+#ifdef RESAMPLE_X86
+	if(r->table->taps % 8 == 0 && has_fma())
+		r->dot = dot_fma;
+#endif
+	resampler_reset(r);
+	return r;
+}
+
+void resampler_free(Resampler **rr){
+	Resampler *r = *rr;
+	if(r == NULL)
+		return;
+	if(r->own_table)
+		free_table((ResampleTable*)r->table);
+	for(i32 ch = 0; ch < r->channels; ++ch)
+		free(r->hist[ch]);
+	free(r);
+	*rr = NULL;
+}
+
+static void reserve_hist(Resampler *r, i32 frames){
+	if(frames <= r->hist_cap)
+		return;
+	r->hist_cap = MAX(frames, r->hist_cap * 2);
+	for(i32 ch = 0; ch < r->channels; ++ch)
+		r->hist[ch] = realloc(r->hist[ch], r->hist_cap * sizeof(f32));
+}
+
+void resampler_reset(Resampler *r){
+	const i32 pad = r->table->half - 1;
+	reserve_hist(r, MAX(pad, 1));
+	for(i32 ch = 0; ch < r->channels; ++ch)
+		memset(r->hist[ch], 0, pad * sizeof(f32));
+	r->have = pad;
+	r->first = -pad;
+	r->q = 0;
+	r->p = 0;
+	r->fed = 0;
+	r->made = 0;
+}
+
+i32 resampler_out_max(const Resampler *r, i32 in_frames){
+	return (i32)((i64)in_frames * r->table->up / r->table->down) + 2;
+}
+
+i32 resampler_in_max(const Resampler *r, i32 out_frames){
+	return (i32)MAX((i64)(out_frames - 2) * r->table->down / r->table->up, 0);
+}
+
+static void append(Resampler *r, const f32 *in, i32 frames){
+	reserve_hist(r, r->have + frames);
+	const i32 channels = r->channels;
+	for(i32 ch = 0; ch < channels; ++ch){
+		f32 *h = r->hist[ch] + r->have;
+		if(in == NULL){
+			memset(h, 0, frames * sizeof(f32));
+			continue;
+		}
+		for(i32 i = 0; i < frames; ++i)
+			h[i] = in[i * channels + ch];
+	}
+	r->have += frames;
+}
+
+// Makes up to limit outputs out of what's there, and drops the input no
+// output needs anymore.
+static i32 produce(Resampler *r, f32 *out, i64 limit){
+	const ResampleTable *t = r->table;
+	const i32 channels = r->channels;
+	const u32 step = t->down / t->up;
+	const u32 rest = t->down % t->up;
+	i32 made = 0;
+	while(made < limit && r->q + t->half - r->first < r->have){
+		const i32 start = (i32)(r->q - t->half + 1 - r->first);
+		const u32 phase = t->phases == t->up ? r->p : (u32)(((u64)r->p * t->phases + t->up / 2) / t->up);
+		const f32 *c = t->coefs + (size_t)phase * t->taps;
+		for(i32 ch = 0; ch < channels; ++ch)
+			out[made * channels + ch] = r->dot(r->hist[ch] + start, c, t->taps);
+		made += 1;
+		r->q += step;
+		r->p += rest;
+		if(r->p >= t->up){
+			r->p -= t->up;
+			r->q += 1;
+		}
+	}
+	const i64 drop = MIN(r->q - t->half + 1 - r->first, (i64)r->have);
+	if(drop > 0){
+		for(i32 ch = 0; ch < channels; ++ch)
+			memmove(r->hist[ch], r->hist[ch] + drop, (r->have - drop) * sizeof(f32));
+		r->have -= (i32)drop;
+		r->first += drop;
+	}
+	r->made += made;
+	return made;
+}
+
+i32 resampler_process(Resampler *r, const f32 *in, i32 in_frames, f32 *out){
+	append(r, in, in_frames);
+	r->fed += in_frames;
+	return produce(r, out, INT32_MAX);
+}
+
+i32 resampler_tail(const Resampler *r){
+	const u32 up = r->table->up;
+	const u32 down = r->table->down;
+	const i64 total = (r->fed * up + down - 1) / down;
+	return (i32)MAX(total - r->made, 0);
+}
+
+i32 resampler_flush(Resampler *r, f32 *out){
+	const i32 tail = resampler_tail(r);
+	append(r, NULL, r->table->half);
+	return produce(r, out, tail);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "def.h"
+
+// Changes the sample rate of interleaved float audio, with a windowed sinc
+// filter split into one phase per output position between two input
+// samples. The phases of a rate pair and quality are worked out once and
+// shared by every resampler that needs them.
+typedef struct Resampler Resampler;
+
+typedef enum {
+	ResampleFast,   // linear, between the two samples around
+	ResampleMedium, // 32 taps, about 70 dB down past 17 kHz at 44.1
+	ResampleHigh,   // 128 taps, about 90 dB down past 20 kHz at 44.1
+	ResampleQualityCount,
+} ResampleQuality;
+
+const char *resample_quality_name(ResampleQuality quality);
+
+// Only for one thread at a time, but any one. channels up to
+// PCM_MAX_CHANNELS.
+Resampler *resampler_create(i32 in_rate, i32 out_rate, i32 channels, ResampleQuality quality);
+void resampler_free(Resampler **r);
+// Forgets the input so far, for starting somewhere else.
+void resampler_reset(Resampler *r);
+
+// The most output in_frames more input can make.
+i32 resampler_out_max(const Resampler *r, i32 in_frames);
+// The most input whose output fits in out_frames.
+i32 resampler_in_max(const Resampler *r, i32 out_frames);
+// Takes in_frames, writes the output they make to out and returns how many
+// frames that is. The last half a filter of input only makes output once
+// more comes after it, or with the flush.
+i32 resampler_process(Resampler *r, const f32 *in, i32 in_frames, f32 *out);
+// Once the input is over: how many frames there are still to come, and
+// writing them out. Together, the output is the input's length at the new
+// rate, rounded up.
+i32 resampler_tail(const Resampler *r);
+i32 resampler_flush(Resampler *r, f32 *out);
@@ -0,0 +1,370 @@
+#include "search.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL3/SDL_cpuinfo.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SEARCH_X86 1
+#endif
+
+// Below this, scanning all names is quick enough that the trigram index
+// isn't worth the memory. INT32_MAX turns it off.
+#define SEARCH_TRIGRAM_MIN_NAMES 100000
+
+// The filter looks for the query in the names of all entries on every
+// keystroke. Instead of folding case a byte at a time, there's a lowercase
+// copy of all the names, so matching is just comparing bytes, and all names
+// are searched in one go by running over that copy front to back, 64 bytes
+// at a time. Each hit is then mapped back to the entry it's in.
+//
+// Only ASCII gets folded, same as the filter always did.
+//
+// Making that copy costs as much as the names are long, so it's made on the
+// filter worker, a chunk of entries at a time in between queries. Until an
+// entry is in there, its name gets folded as it's compared.
+
+static void lower_ascii(char *s, i32 n){
+	for(i32 i = 0; i < n; ++i)
+		s[i] = lower_char(s[i]);
+}
+
+// First occurrence of needle in hay, or NULL. m is at least 1.
+static const char *find(const char *hay, i64 n, const char *needle, i32 m){
+	if(n < m)
+		return NULL;
+	const char *p = hay;
+	const char *end = hay + n - m + 1;
+	while(p < end){
+		p = memchr(p, needle[0], end - p);
+		if(p == NULL)
+			return NULL;
+		if(memeq(p + 1, needle + 1, m - 1))
+			return p;
+		p += 1;
+	}
+	return NULL;
+}
+
+//# kernels
+
+// Bit i is set if a match of the needle could start at p[i], because p[i] is
+// its first byte and p[i+m-1] its last. That rules out almost every position,
+// even for needles that start with a common letter, and for needles of one or
+// two bytes it's the answer already. Reads p[0..64+m-1).
+typedef u64 (*CandidatesFn)(const char *p, i32 m, char first, char last);
+
+__attribute__((always_inline))
+static inline u64 candidates_scalar(const char *p, i32 m, char first, char last){
+	u64 mask = 0;
+	for(i32 i = 0; i < 64; ++i)
+		mask |= (u64)(p[i] == first && p[i+m-1] == last) << i;
+	return mask;
+}
+
+#ifdef SEARCH_X86
+__attribute__((target("avx2"), always_inline))
+static inline u64 candidates_avx2(const char *p, i32 m, char first, char last){
+	const __m256i f = _mm256_set1_epi8(first);
+	const __m256i l = _mm256_set1_epi8(last);
+	u64 mask = 0;
+	for(i32 i = 0; i < 64; i += 32){
+		const __m256i a = _mm256_loadu_si256((const __m256i*)(p + i));
+		const __m256i b = _mm256_loadu_si256((const __m256i*)(p + i + m - 1));
+		const u32 bits = (u32)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, f), _mm256_cmpeq_epi8(b, l)));
+		mask |= (u64)bits << i;
+	}
+	return mask;
+}
+
+// Only needs SSE2, but anything old enough to not have SSE4.2 doesn't need
+// to be fast. pcmpestri can do substring search by itself, but a lot slower.
+__attribute__((target("sse4.2"), always_inline))
+static inline u64 candidates_sse42(const char *p, i32 m, char first, char last){
+	const __m128i f = _mm_set1_epi8(first);
+	const __m128i l = _mm_set1_epi8(last);
+	u64 mask = 0;
+	for(i32 i = 0; i < 64; i += 16){
+		const __m128i a = _mm_loadu_si128((const __m128i*)(p + i));
+		const __m128i b = _mm_loadu_si128((const __m128i*)(p + i + m - 1));
+		const u32 bits = (u32)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, f), _mm_cmpeq_epi8(b, l)));
+		mask |= (u64)bits << i;
+	}
+	return mask;
+}
+#endif
+
+// Marks the entries whose names contain the query. Inlined into a copy for
+// each kernel, so that the kernel gets inlined into the loop.
+__attribute__((always_inline))
+static inline void scan_names(NameSearch *s, CandidatesFn candidates){
+	const char *blob = s->lower.data;
+	const i64 n = s->lower.count;
+	const char *q = s->query.data;
+	const i32 m = s->query.count;
+	// The query has no NUL in it, so a match never runs into the next name.
+	// Once a name matched, the rest of it doesn't matter.
+	i64 skip = 0;
+	for(i32 b = 0; b < s->block_count; ++b){
+		const i64 base = (i64)b * 64;
+		u64 mask;
+		if(base + 64 + m - 1 <= n){
+			mask = candidates(blob + base, m, q[0], q[m-1]);
+			// the second byte too, most candidates fail that
+			if(m > 2 && mask)
+				mask &= candidates(blob + base + 1, m - 1, q[1], q[m-1]);
+		} else {
+			// the kernels would read past the end
+			mask = 0;
+			for(i64 i = base; i + m <= n && i < base + 64; ++i)
+				mask |= (u64)(blob[i] == q[0] && blob[i+m-1] == q[m-1] && (m < 2 || blob[i+1] == q[1])) << (i - base);
+		}
+		if(skip > base)
+			mask &= skip - base >= 64 ? 0 : ~0ull << (skip - base);
+		const u64 starts = s->starts[b];
+		while(mask){
+			const i32 bit = __builtin_ctzll(mask);
+			if(m > 3 && !memeq(blob + base + bit + 2, q + 2, m - 3)){
+				mask &= mask - 1;
+				continue;
+			}
+			// bits up to and including this one
+			const u64 upto = bit == 63 ? ~0ull : (2ull << bit) - 1;
+			const i32 span = s->starts_before[b] + __builtin_popcountll(starts & upto) - 1;
+			const NameSpan *sp = &s->spans[span];
+			if(sp->id >= 0)
+				s->stamps[sp->id] = s->stamp;
+			skip = sp->end + 1;
+			mask &= skip - base >= 64 ? 0 : ~0ull << (skip - base);
+		}
+	}
+}
+
+static void scan_scalar(NameSearch *s){
+	scan_names(s, candidates_scalar);
+}
+
+#ifdef SEARCH_X86
+__attribute__((target("avx2")))
+static void scan_avx2(NameSearch *s){
+	scan_names(s, candidates_avx2);
+}
+
+__attribute__((target("sse4.2")))
+static void scan_sse42(NameSearch *s){
+	scan_names(s, candidates_sse42);
+}
+#endif
+
+static void (*scan_impl)(NameSearch *s);
+
+static void pick_scan(void){
+#ifdef SEARCH_X86
+	if(SDL_HasAVX2()){
+		scan_impl = scan_avx2;
+		return;
+	}
+	if(SDL_HasSSE42()){
+		scan_impl = scan_sse42;
+		return;
+	}
+#endif
+	scan_impl = scan_scalar;
+}
+
+//# names
+
+static void grow_blocks(NameSearch *s, i32 count){
+	if(count > s->block_cap){
+		s->block_cap = MAX(count, s->block_cap * 2);
+		s->starts = realloc(s->starts, s->block_cap * sizeof(s->starts[0]));
+		s->starts_before = realloc(s->starts_before, s->block_cap * sizeof(s->starts_before[0]));
+	}
+	for(i32 b = s->block_count; b < count; ++b){
+		s->starts[b] = 0;
+		s->starts_before[b] = s->span_count;
+	}
+	s->block_count = MAX(s->block_count, count);
+}
+
+bool name_search_update(NameSearch *s, const Playlist *pl, i32 max_entries){
+	if(s->lower.data == NULL){
+		s->lower = make_charlist();
+		s->query = make_charlist();
+	}
+	if(s->entry_count < pl->entries.count){
+		s->span_of = realloc(s->span_of, pl->entries.count * sizeof(s->span_of[0]));
+		s->stamps = realloc(s->stamps, pl->entries.count * sizeof(s->stamps[0]));
+		for(i32 id = s->entry_count; id < pl->entries.count; ++id){
+			s->span_of[id] = -1;
+			s->stamps[id] = 0;
+		}
+		s->entry_count = pl->entries.count;
+	}
+	if(s->update_names == 0){
+		if(pl->names.count <= s->names_seen)
+			return 1;
+		s->update_id = 0;
+		s->update_names = pl->names.count;
+	}
+	// New entries and renamed ones have their path in the part of the blob
+	// we haven't seen yet. Going by id keeps the names in library order,
+	// since a scan hands out the ids by path. The playlist may have changed
+	// since the pass started, then whatever came in since is left for the
+	// next one.
+	const i32 id_end = (i32)MIN((i64)s->update_id + max_entries, pl->entries.count);
+	for(i32 id = s->update_id; id < id_end; ++id){
+		const MusicEntry *e = &pl->entries.data[id];
+		if(e->path.start < s->names_seen)
+			continue;
+		const i32 start = s->lower.count;
+		const i32 len = e->path.len - e->name_offset - 1;
+		push_string(&s->lower, pl->names.data + e->path.start + e->name_offset, len + 1);
+		lower_ascii(s->lower.data + start, len);
+		grow_blocks(s, start / 64 + 1);
+		s->starts[start / 64] |= 1ull << (start % 64);
+		if(s->span_count == s->span_cap){
+			s->span_cap = MAX(s->span_cap * 2, 1024);
+			s->spans = realloc(s->spans, s->span_cap * sizeof(s->spans[0]));
+		}
+		// a rename leaves the old name behind
+		if(s->span_of[id] >= 0)
+			s->spans[s->span_of[id]].id = -1;
+		s->span_of[id] = s->span_count;
+		s->spans[s->span_count++] = (NameSpan){start, start + len, id};
+	}
+	s->update_id = id_end;
+	if(id_end < pl->entries.count)
+		return 0;
+	grow_blocks(s, (s->lower.count + 63) / 64);
+	s->names_seen = s->update_names;
+	s->update_names = 0;
+
+	if(s->trigram_build == NULL && s->span_count >= SEARCH_TRIGRAM_MIN_NAMES){
+		const i32 indexed = s->trigrams ? trigram_index_span_count(s->trigrams) : 0;
+		if(s->trigrams == NULL || s->span_count - indexed > indexed / 8)
+			s->trigram_build = trigram_build_start(s->lower.data, s->lower.count);
+	}
+	return pl->names.count <= s->names_seen;
+}
+
+bool name_search_complete(const NameSearch *s, const Playlist *pl){
+	return s->update_names == 0 && pl->names.count <= s->names_seen;
+}
+
+const char *name_search_lower(const NameSearch *s, i32 id){
+	if(id >= s->entry_count || s->span_of[id] < 0)
+		return NULL;
+	return s->lower.data + s->spans[s->span_of[id]].start;
+}
+
+void name_search_poll(NameSearch *s){
+	TrigramIndex *t = trigram_build_poll(&s->trigram_build);
+	if(t == NULL)
+		return;
+	free_trigram_index(&s->trigrams);
+	s->trigrams = t;
+	print_trigram_stats(t);
+}
+
+void name_search_reset(NameSearch *s){
+	trigram_build_cancel(&s->trigram_build);
+	free_trigram_index(&s->trigrams);
+	s->lower.count = 0;
+	s->span_count = 0;
+	s->entry_count = 0;
+	s->block_count = 0;
+	s->names_seen = 0;
+	s->update_id = 0;
+	s->update_names = 0;
+}
+
+void free_name_search(NameSearch *s){
+	trigram_build_cancel(&s->trigram_build);
+	free_trigram_index(&s->trigrams);
+	free(s->candidates.data);
+	free(s->lower.data);
+	free(s->query.data);
+	free(s->spans);
+	free(s->span_of);
+	free(s->starts);
+	free(s->starts_before);
+	free(s->stamps);
+	*s = (NameSearch){};
+}
+
+void name_search_set_query(NameSearch *s, const char *query, i32 len){
+	if(scan_impl == NULL)
+		pick_scan();
+	if(s->query.data == NULL)
+		s->query = make_charlist();
+	s->query.count = 0;
+	push_string(&s->query, query, len);
+	lower_ascii(s->query.data, len);
+}
+
+static bool span_matches(const NameSearch *s, const NameSpan *sp){
+	return find(s->lower.data + sp->start, sp->end - sp->start, s->query.data, s->query.count) != NULL;
+}
+
+// Returns 0 if the index doesn't narrow it down enough to be worth it.
+static bool search_trigrams(NameSearch *s){
+	if(s->candidates.data == NULL)
+		s->candidates = make_i32list();
+	if(!trigram_candidates(s->trigrams, s->query.data, s->query.count, s->span_count / 16, &s->candidates))
+		return 0;
+	for(i32 i = 0; i < s->candidates.count; ++i){
+		const NameSpan *sp = &s->spans[s->candidates.data[i]];
+		if(sp->id >= 0 && span_matches(s, sp))
+			s->stamps[sp->id] = s->stamp;
+	}
+	for(i32 i = trigram_index_span_count(s->trigrams); i < s->span_count; ++i){
+		const NameSpan *sp = &s->spans[i];
+		if(sp->id >= 0 && span_matches(s, sp))
+			s->stamps[sp->id] = s->stamp;
+	}
+	return 1;
+}
+
+void name_search_all(NameSearch *s){
+	s->stamp += 1;
+	if(s->stamp == 0){
+		memset(s->stamps, 0, s->entry_count * sizeof(s->stamps[0]));
+		s->stamp = 1;
+	}
+	if(s->query.count == 0){
+		for(i32 id = 0; id < s->entry_count; ++id)
+			s->stamps[id] = s->stamp;
+		return;
+	}
+	if(s->trigrams && s->query.count >= 3 && search_trigrams(s))
+		return;
+	scan_impl(s);
+}
+
+bool name_search_found(const NameSearch *s, i32 id){
+	return s->stamps[id] == s->stamp;
+}
+
+bool name_search_matches(const NameSearch *s, const Playlist *pl, i32 id){
+	if(s->query.count == 0)
+		return 1;
+	if(name_search_lower(s, id))
+		return span_matches(s, &s->spans[s->span_of[id]]);
+	// not in the lowercase copy yet
+	const MusicEntry *e = &pl->entries.data[id];
+	const char *name = pl->names.data + e->path.start + e->name_offset;
+	const i32 n = e->path.len - e->name_offset - 1;
+	const char *q = s->query.data;
+	const i32 m = s->query.count;
+	for(i32 i = 0; i + m <= n; ++i){
+		i32 k = 0;
+		while(k < m && lower_char(name[i + k]) == q[k])
+			++k;
+		if(k == m)
+			return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "library.h"
+#include "trigram.h"
+
+// Where the name of an entry is in NameSearch.lower.
+typedef struct {
+	i32 start;
+	i32 end;
+	i32 id;
+} NameSpan;
+
+// Case-insensitive substring search over the names of a playlist.
+typedef struct {
+	// The names of the entries with ASCII lowercased, each followed by a
+	// NUL. Without the library root and the directories, that's the only
+	// part of pl->names the filter looks at.
+	CharList lower;
+	// in the same order as the names in lower. Renamed entries leave their
+	// old name behind, with an id of -1.
+	NameSpan *spans;
+	i32 span_count;
+	i32 span_cap;
+	// by entry id, the index of its current span
+	i32 *span_of;
+	i32 entry_count;
+	// A bit for every byte of lower that starts a name, and for every 64
+	// bytes, how many names start before them. That maps a hit to its span
+	// with a popcount.
+	u64 *starts;
+	i32 *starts_before;
+	i32 block_count;
+	i32 block_cap;
+	// how much of pl->names we've seen. Names are only ever appended, so
+	// this only has to catch up with the end.
+	i32 names_seen;
+	// A pass that's halfway done: the next id to look at, and what
+	// names_seen becomes once it's through. 0 if there's none.
+	i32 update_id;
+	i32 update_names;
+	// Built in the background for big libraries. Names after the ones it
+	// knows about get checked one by one, until there's enough of them to
+	// build it again.
+	TrigramIndex *trigrams;
+	TrigramBuild *trigram_build;
+	I32List candidates;
+	// the current query, lowercased
+	CharList query;
+	// entries that name_search_all found have stamps[id] == stamp
+	u32 *stamps;
+	u32 stamp;
+} NameSearch;
+
+static inline char lower_char(char c){
+	return (char)((u8)c + ((u8)(c - 'A') < 26 ? 32 : 0));
+}
+
+// Catches up with whatever got added to pl since the last update, looking
+// at no more than max_entries entries at a time. Returns 1 once it's caught
+// up.
+bool name_search_update(NameSearch *s, const Playlist *pl, i32 max_entries);
+// Every name of pl is in the lowercase copy, name_search_all can be used.
+bool name_search_complete(const NameSearch *s, const Playlist *pl);
+// The lowercase name of entry id, NULL if it isn't in the copy yet.
+const char *name_search_lower(const NameSearch *s, i32 id);
+// Main thread, once a frame. Picks up a trigram index that's done.
+void name_search_poll(NameSearch *s);
+// The playlist got replaced and all the ids and offsets changed.
+void name_search_reset(NameSearch *s);
+void free_name_search(NameSearch *s);
+
+void name_search_set_query(NameSearch *s, const char *query, i32 len);
+// Finds every entry that contains the query, in one pass over all names, or
+// with the trigram index if that narrows it down enough.
+void name_search_all(NameSearch *s);
+// If the last name_search_all found id.
+bool name_search_found(const NameSearch *s, i32 id);
+// Looks at the name of a single entry.
+bool name_search_matches(const NameSearch *s, const Playlist *pl, i32 id);
@@ -0,0 +1,152 @@
+#define _GNU_SOURCE
+#include "seekindex.h"
+#include "cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL3/SDL_mutex.h>
+
+// A cache file like the one in params.c, see cache.h, with the points in
+// its strings. Decoders get a copy of the points of their file, add to it
+// while they play, and hand it back when they stop. Only that and opening
+// take the mutex, so it doesn't matter that the decoders run on threads of
+// their own.
+//
+// A point every SEEK_INDEX_SECONDS seconds is about 2 KiB for ten minutes
+// of audio. Files that aren't played drop out once there's more than
+// SEEK_INDEX_MAX of them, the ones played least recently first.
+
+#define SEEK_INDEX_MAX 2048
+
+typedef struct {
+	CacheKey key;
+	i64 mtime; // like MusicEntry.mtime
+	i64 size;
+	Sub points; // bytes, SeekPoints one after the other
+} SeekIndexRecord;
+
+static bool seek_record_valid(const void *record){
+	const SeekIndexRecord *r = record;
+	return r->points.len % sizeof(SeekPoint) == 0;
+}
+
+static const CacheFormat seek_index_format = {
+	.name = "seeks.cache",
+	.magic = "mosseek",
+	.version = 2,
+	.record_size = sizeof(SeekIndexRecord),
+	.subs = {offsetof(SeekIndexRecord, points)},
+	.sub_count = 1,
+	.max = SEEK_INDEX_MAX,
+	.valid = seek_record_valid,
+};
+
+struct SeekIndexCache {
+	SDL_Mutex *mutex;
+	RecordCache cache; // guarded by mutex
+};
+
+struct SeekIndex {
+	SeekIndexCache *cache;
+	CharList path;
+	i64 mtime;
+	i64 size;
+	SeekPoint *points;
+	i32 count;
+	i32 cap;
+	i32 known; // how many came from the cache
+};
+
+SeekIndexCache *seek_index_cache_load(void){
+	SeekIndexCache *c = calloc(1, sizeof(*c));
+	c->mutex = SDL_CreateMutex();
+	record_cache_load(&c->cache, &seek_index_format);
+	return c;
+}
+
+void seek_index_cache_stop(SeekIndexCache **cc){
+	SeekIndexCache *c = *cc;
+	if(c == NULL)
+		return;
+	if(c->cache.record_count > 0)
+		record_cache_save(&c->cache, NULL, 0);
+	SDL_DestroyMutex(c->mutex);
+	record_cache_free(&c->cache);
+	free(c);
+	*cc = NULL;
+}
+
+SeekIndex *seek_index_open(SeekIndexCache *c, const char *path, i32 len){
+	i64 mtime, size;
+	if(!stat_file(path, &mtime, &size))
+		return NULL;
+	SeekIndex *s = calloc(1, sizeof(*s));
+	s->cache = c;
+	s->path = make_charlist();
+	push_string(&s->path, path, len);
+	s->mtime = mtime;
+	s->size = size;
+	SDL_LockMutex(c->mutex);
+	SeekIndexRecord *r = record_cache_find(&c->cache, path, len);
+	if(r != NULL && r->mtime == mtime && r->size == size && r->points.len > 0){
+		s->count = r->points.len / (i32)sizeof(SeekPoint);
+		s->cap = s->count;
+		s->points = malloc(s->cap * sizeof(SeekPoint));
+		memcpy(s->points, c->cache.strings.data + r->points.start, r->points.len);
+		s->known = s->count;
+		record_cache_use(&c->cache, r);
+	}
+	SDL_UnlockMutex(c->mutex);
+	return s;
+}
+
+void seek_index_close(SeekIndex **ss){
+	SeekIndex *s = *ss;
+	if(s == NULL)
+		return;
+	SeekIndexCache *c = s->cache;
+	if(s->count > s->known){
+		SDL_LockMutex(c->mutex);
+		// The old points stay in the strings until the next save.
+		const Sub points = record_cache_push(&c->cache, s->points, s->count * (i32)sizeof(SeekPoint));
+		SeekIndexRecord *r = record_cache_put(&c->cache, s->path.data, s->path.count);
+		r->mtime = s->mtime;
+		r->size = s->size;
+		r->points = points;
+		SDL_UnlockMutex(c->mutex);
+	}
+	free(s->path.data);
+	free(s->points);
+	free(s);
+	*ss = NULL;
+}
+
+void seek_index_add(SeekIndex *s, i64 sample, i64 pos){
+	assert(s->count == 0 || sample > s->points[s->count - 1].sample);
+	if(s->count == s->cap){
+		s->cap = MAX(s->cap * 2, 64);
+		s->points = realloc(s->points, s->cap * sizeof(SeekPoint));
+	}
+	s->points[s->count++] = (SeekPoint){sample, pos};
+}
+
+bool seek_index_find(const SeekIndex *s, i64 sample, SeekPoint *p){
+	i32 lo = 0;
+	i32 hi = s->count;
+	while(lo < hi){
+		const i32 mid = lo + (hi - lo) / 2;
+		if(s->points[mid].sample <= sample)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if(lo == 0)
+		return 0;
+	*p = s->points[lo - 1];
+	return 1;
+}
+
+i64 seek_index_last(const SeekIndex *s){
+	return s->count > 0 ? s->points[s->count - 1].sample : -1;
+}
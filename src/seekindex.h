@@ -0,0 +1,38 @@
+#pragma once
+
+#include "library.h"
+
+// Where in the file the samples are, every few seconds, for files the
+// demuxer can only seek in by guessing (mp3 without a TOC, raw aac and the
+// like). The decoder writes it down the first time a file plays from the
+// start, and it's kept in a cache file for the next time. Entries are keyed
+// by path and only count while the file's size and mtime match.
+typedef struct SeekIndexCache SeekIndexCache;
+// The index of one file, for one decoder.
+typedef struct SeekIndex SeekIndex;
+
+// how far apart the points are
+#define SEEK_INDEX_SECONDS 5
+
+typedef struct {
+	i64 sample; // the first one the packet at pos decodes to
+	i64 pos;    // byte offset in the file
+} SeekPoint;
+
+SeekIndexCache *seek_index_cache_load(void);
+// Saves the cache and frees it. Every index has to be closed before.
+void seek_index_cache_stop(SeekIndexCache **c);
+
+// Any thread. What's known about path, which may be nothing yet. NULL if the
+// file isn't there. len includes the NUL.
+SeekIndex *seek_index_open(SeekIndexCache *c, const char *path, i32 len);
+// Any thread, puts what was added back into the cache.
+void seek_index_close(SeekIndex **s);
+
+// The rest only from the thread that has the index.
+// sample has to be past the last point.
+void seek_index_add(SeekIndex *s, i64 sample, i64 pos);
+// The last point at or before sample. Returns 0 if there's none.
+bool seek_index_find(const SeekIndex *s, i64 sample, SeekPoint *p);
+// Sample of the last point, -1 if there's none.
+i64 seek_index_last(const SeekIndex *s);
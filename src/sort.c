@@ -0,0 +1,366 @@
+#include "sort.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL3/SDL_timer.h>
+
+// Radix sorts instead of comparison sorts. Comparing two paths means two
+// random reads into the names blob and a memcmp over a prefix that is the
+// same for most of the library, n log n times. The radix sorts touch each
+// key once per byte that actually tells entries apart.
+//
+// Every order breaks ties by path: the sorts are stable and start out from
+// pl->order, which is by path already.
+
+const Slice sort_kind_names[SortKindCount] = {
+#define X(A) S(#A),
+	sort_kinds_def
+#undef X
+};
+
+//# strings
+
+typedef struct {
+	const char *blob;
+	const u8 *keys;
+	size_t stride;
+} StringKeys;
+
+static const Sub *string_key(const StringKeys *k, i32 id){
+	return (const Sub*)(k->keys + k->stride * (size_t)id);
+}
+
+// 0 past the end. Keys end with a NUL anyway, so that's also where they end.
+static u8 string_key_byte(const StringKeys *k, i32 id, i32 depth){
+	const Sub *s = string_key(k, id);
+	return depth < s->len ? (u8)k->blob[s->start + depth] : 0;
+}
+
+static i32 compare_string_keys(const StringKeys *k, i32 a, i32 b, i32 depth){
+	const Sub *sa = string_key(k, a);
+	const Sub *sb = string_key(k, b);
+	i32 la = sa->len - depth;
+	i32 lb = sb->len - depth;
+	i32 d = memcmp(k->blob + sa->start + depth, k->blob + sb->start + depth, MIN(la, lb));
+	if(d != 0)
+		return d;
+	return la < lb ? -1 : (la > lb ? 1 : 0);
+}
+
+static void msd_sort(const StringKeys *k, i32 *ids, i32 *tmp, u8 *bytes, i32 n, i32 depth){
+	while(1){
+		if(n <= 32){
+			// insertion sort. only moves past strictly greater keys, so it's stable.
+			for(i32 i = 1; i < n; ++i){
+				i32 id = ids[i];
+				i32 j = i;
+				while(j > 0 && compare_string_keys(k, ids[j-1], id, depth) > 0){
+					ids[j] = ids[j-1];
+					--j;
+				}
+				ids[j] = id;
+			}
+			return;
+		}
+		i32 count[256] = {};
+		for(i32 i = 0; i < n; ++i){
+			bytes[i] = string_key_byte(k, ids[i], depth);
+			count[bytes[i]] += 1;
+		}
+		if(count[bytes[0]] == n){
+			// same byte everywhere, nothing to split. don't recurse for every
+			// byte of a long common prefix.
+			if(bytes[0] == 0)
+				return;
+			depth += 1;
+			continue;
+		}
+		i32 start[256];
+		i32 sum = 0;
+		for(i32 b = 0; b < 256; ++b){
+			start[b] = sum;
+			sum += count[b];
+		}
+		i32 at[256];
+		memcpy(at, start, sizeof(at));
+		for(i32 i = 0; i < n; ++i)
+			tmp[at[bytes[i]]++] = ids[i];
+		memcpy(ids, tmp, n * sizeof(ids[0]));
+		// bucket 0 holds keys that ended, they're all equal.
+		for(i32 b = 1; b < 256; ++b){
+			if(count[b] > 1)
+				msd_sort(k, ids + start[b], tmp + start[b], bytes + start[b], count[b], depth + 1);
+		}
+		return;
+	}
+}
+
+void radix_sort_strings(const char *blob, const void *keys, size_t stride, i32 *ids, i32 count, i32 depth){
+	if(count <= 1)
+		return;
+	const StringKeys k = {blob, keys, stride};
+	i32 *tmp = malloc(count * sizeof(tmp[0]));
+	u8 *bytes = malloc(count);
+	msd_sort(&k, ids, tmp, bytes, count, depth);
+	free(bytes);
+	free(tmp);
+}
+
+//# integers
+
+typedef struct {
+	u64 key;
+	i32 id;
+} KeyedId;
+
+// LSD radix sort, a byte at a time. Bytes that are the same in every key,
+// like the top bytes of a timestamp, are skipped.
+static void radix_sort_keyed(KeyedId *a, i32 n){
+	KeyedId *tmp = malloc(MAX(n, 1) * sizeof(tmp[0]));
+	i32 (*count)[256] = calloc(8, sizeof(*count));
+	for(i32 i = 0; i < n; ++i){
+		for(i32 b = 0; b < 8; ++b)
+			count[b][(a[i].key >> (b * 8)) & 255] += 1;
+	}
+	KeyedId *src = a;
+	KeyedId *dst = tmp;
+	for(i32 b = 0; b < 8 && n > 0; ++b){
+		const i32 shift = b * 8;
+		if(count[b][(src[0].key >> shift) & 255] == n)
+			continue;
+		i32 at[256];
+		i32 sum = 0;
+		for(i32 j = 0; j < 256; ++j){
+			at[j] = sum;
+			sum += count[b][j];
+		}
+		for(i32 i = 0; i < n; ++i)
+			dst[at[(src[i].key >> shift) & 255]++] = src[i];
+		KeyedId *t = src;
+		src = dst;
+		dst = t;
+	}
+	if(src != a)
+		memcpy(a, src, n * sizeof(a[0]));
+	free(count);
+	free(tmp);
+}
+
+static u64 sort_key(const Playlist *pl, const ProbePool *probe, SortKind kind, i32 id){
+	switch(kind){
+	case Sort_mtime:
+		// newest first
+		return ~((u64)pl->entries.data[id].mtime ^ (1ull << 63));
+	case Sort_duration: {
+		// the bits of a positive float sort like the float. unknown goes last.
+		const TrackInfo *info = probe_info(probe, pl, id);
+		if(info == NULL || info->state != ProbeDone || !(info->duration >= 0.0f))
+			return ~0ull;
+		u32 bits;
+		memcpy(&bits, &info->duration, sizeof(bits));
+		return bits;
+	}
+	default:
+		return 0;
+	}
+}
+
+//# natural order
+
+// A key that sorts "Track 2" before "Track 10" with a plain byte compare.
+// Every run of digits becomes '0', the number of digits without leading
+// zeros plus one, and those digits. Letters are folded to lower case.
+static void push_natural_key(CharList *out, const char *s, i32 len){
+	for(i32 i = 0; i < len;){
+		char c = s[i];
+		if(c >= '0' && c <= '9'){
+			i32 end = i;
+			while(end < len && s[end] >= '0' && s[end] <= '9')
+				++end;
+			while(i < end - 1 && s[i] == '0')
+				++i;
+			if(s[i] == '0')
+				++i;
+			i32 digits = MIN(end - i, 254);
+			char head[2] = {'0', (char)(digits + 1)};
+			push_string(out, head, 2);
+			push_string(out, s + i, digits);
+			i = end;
+			continue;
+		}
+		if(c >= 'A' && c <= 'Z')
+			c |= 32;
+		push_string(out, &c, 1);
+		++i;
+	}
+	push_string(out, "\0", 1);
+}
+
+static void update_natural_key(PlaylistSorts *s, const Playlist *pl, i32 id){
+	if(s->natural_names.data == NULL)
+		s->natural_names = make_charlist();
+	if(id >= s->natural_cap){
+		s->natural_cap = MAX(id + 1 + id / 8, 1024);
+		s->natural_keys = realloc(s->natural_keys, s->natural_cap * sizeof(s->natural_keys[0]));
+	}
+	for(; s->natural_count <= id; ++s->natural_count)
+		s->natural_keys[s->natural_count] = (Sub){};
+	const MusicEntry *e = &pl->entries.data[id];
+	const i32 start = s->natural_names.count;
+	// the NUL is added by push_natural_key
+	push_natural_key(&s->natural_names, pl->names.data + e->path.start + e->name_offset, e->path.len - 1 - e->name_offset);
+	s->natural_keys[id] = (Sub){start, s->natural_names.count - start};
+}
+
+//# building and keeping up
+
+static void copy_order(I32List *dst, const Playlist *pl){
+	dst->count = 0;
+	for(i32 i = 0; i < pl->order.count; ++i)
+		push_i32(dst, pl->order.data[i]);
+}
+
+// Rows of perm[kind] from row on, after they moved. ids from the playlist
+// that aren't there yet get -1.
+static void index_rows(PlaylistSorts *s, const Playlist *pl, SortKind kind, i32 row){
+	const I32List *perm = &s->perm[kind];
+	I32List *rows = &s->rows[kind];
+	if(rows->data == NULL)
+		*rows = make_i32list();
+	while(rows->count < pl->entries.count)
+		push_i32(rows, -1);
+	for(i32 i = row; i < perm->count; ++i)
+		rows->data[perm->data[i]] = i;
+}
+
+static void build_sorted(PlaylistSorts *s, const Playlist *pl, const ProbePool *probe, SortKind kind){
+	I32List *perm = &s->perm[kind];
+	if(perm->data == NULL)
+		*perm = make_i32list();
+	copy_order(perm, pl);
+	if(kind == Sort_natural){
+		for(i32 id = s->natural_count; id < pl->entries.count; ++id)
+			update_natural_key(s, pl, id);
+		radix_sort_strings(s->natural_names.data, s->natural_keys, sizeof(Sub), perm->data, perm->count, 0);
+	} else {
+		KeyedId *keyed = malloc(MAX(perm->count, 1) * sizeof(keyed[0]));
+		for(i32 i = 0; i < perm->count; ++i)
+			keyed[i] = (KeyedId){sort_key(pl, probe, kind, perm->data[i]), perm->data[i]};
+		radix_sort_keyed(keyed, perm->count);
+		for(i32 i = 0; i < perm->count; ++i)
+			perm->data[i] = keyed[i].id;
+		free(keyed);
+	}
+	s->rows[kind].count = 0;
+	index_rows(s, pl, kind, 0);
+	s->built[kind] = 1;
+	s->version += 1;
+}
+
+const I32List *playlist_sorted(PlaylistSorts *s, const Playlist *pl, const ProbePool *probe, SortKind kind){
+	if(kind == Sort_path)
+		return &pl->order;
+	if(kind == Sort_duration){
+		// durations keep coming in from the probe workers. don't shuffle the
+		// list around more than once a second.
+		const u32 version = probe_pool_version(probe);
+		const u64 now = SDL_GetTicksNS();
+		if(s->built[kind] && version != s->duration_version && now - s->duration_built_ns > 1000000000ull)
+			s->built[kind] = 0;
+		if(!s->built[kind]){
+			s->duration_version = version;
+			s->duration_built_ns = now;
+		}
+	}
+	if(!s->built[kind])
+		build_sorted(s, pl, probe, kind);
+	return &s->perm[kind];
+}
+
+static i32 compare_entries(const PlaylistSorts *s, const Playlist *pl, SortKind kind, i32 a, i32 b){
+	const MusicEntry *ea = &pl->entries.data[a];
+	const MusicEntry *eb = &pl->entries.data[b];
+	i32 d = 0;
+	if(kind == Sort_natural){
+		const StringKeys k = {s->natural_names.data, (const u8*)s->natural_keys, sizeof(Sub)};
+		d = compare_string_keys(&k, a, b, 0);
+	} else if(kind == Sort_mtime){
+		d = ea->mtime > eb->mtime ? -1 : (ea->mtime < eb->mtime ? 1 : 0);
+	}
+	if(d == 0)
+		d = compare_sub((void*)&pl->names, &ea->path, &eb->path);
+	return d;
+}
+
+void playlist_sorts_apply_changes(PlaylistSorts *s, const Playlist *pl, const PlaylistChanges *changes){
+	if(changes->count == 0)
+		return;
+	s->version += 1;
+	// a duration of a new entry isn't known yet anyway.
+	s->built[Sort_duration] = 0;
+	for(i32 kind = Sort_natural; kind < SortKindCount; ++kind){
+		if(!s->built[kind] || kind == Sort_duration)
+			continue;
+		I32List *perm = &s->perm[kind];
+		for(i32 i = 0; i < changes->count; ++i){
+			const PlaylistChange *c = &changes->data[i];
+			if(c->kind == ChangeRemove){
+				i32 row = sorted_row_of(s, pl, kind, c->id);
+				if(row >= 0){
+					memmove(perm->data + row, perm->data + row + 1, (perm->count - row - 1) * sizeof(perm->data[0]));
+					perm->count -= 1;
+					s->rows[kind].data[c->id] = -1;
+					index_rows(s, pl, kind, row);
+				}
+				continue;
+			}
+			// inserts are new entries or renamed ones, the key might have changed.
+			if(kind == Sort_natural)
+				update_natural_key(s, pl, c->id);
+			i32 lo = 0;
+			i32 hi = perm->count;
+			while(lo < hi){
+				i32 mid = lo + (hi - lo) / 2;
+				if(compare_entries(s, pl, kind, perm->data[mid], c->id) <= 0)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			push_i32(perm, 0);
+			memmove(perm->data + lo + 1, perm->data + lo, (perm->count - 1 - lo) * sizeof(perm->data[0]));
+			perm->data[lo] = c->id;
+			index_rows(s, pl, kind, lo);
+		}
+	}
+}
+
+i32 sorted_row_of(const PlaylistSorts *s, const Playlist *pl, SortKind kind, i32 id){
+	if(kind == Sort_path){
+		bool exact;
+		i32 row = playlist_row_of(pl, id, &exact);
+		return exact ? row : -1;
+	}
+	const I32List *rows = &s->rows[kind];
+	return id >= 0 && id < rows->count ? rows->data[id] : -1;
+}
+
+void playlist_sorts_reset(PlaylistSorts *s){
+	for(i32 i = 0; i < SortKindCount; ++i){
+		s->built[i] = 0;
+		s->rows[i].count = 0;
+	}
+	s->natural_names.count = 0;
+	s->natural_count = 0;
+	s->version += 1;
+}
+
+void free_playlist_sorts(PlaylistSorts *s){
+	for(i32 i = 0; i < SortKindCount; ++i){
+		free(s->perm[i].data);
+		free(s->rows[i].data);
+	}
+	free(s->natural_names.data);
+	free(s->natural_keys);
+	zerostruct(s);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "library.h"
+#include "probe.h"
+
+#define sort_kinds_def\
+	X(path)\
+	X(natural)\
+	X(mtime)\
+	X(duration)\
+
+typedef enum SortKind {
+#define X(A) Sort_##A,
+	sort_kinds_def
+#undef X
+	SortKindCount,
+} SortKind;
+
+extern const Slice sort_kind_names[SortKindCount];
+
+// Other orders of the entries in a playlist, next to pl->order, which is
+// always by path.  Each one is built the first time it's asked for and then
+// kept up to date, so switching between them costs nothing.
+typedef struct {
+	I32List perm[SortKindCount]; // perm[Sort_path] is unused
+	// The other way around: the row of every entry id in perm, -1 if it
+	// isn't in there. Kept up to date with perm.
+	I32List rows[SortKindCount];
+	bool built[SortKindCount];
+	// natural sort keys by entry id, see natural_key
+	CharList natural_names;
+	Sub *natural_keys;
+	i32 natural_count;
+	i32 natural_cap;
+	u32 duration_version;
+	u64 duration_built_ns;
+	// goes up whenever any of the orders changes
+	u32 version;
+} PlaylistSorts;
+
+// Stable MSD radix sort of ids by the strings at keys[id], which are Subs
+// into blob, stride bytes apart. Every key starts with the same depth bytes.
+void radix_sort_strings(const char *blob, const void *keys, size_t stride, i32 *ids, i32 count, i32 depth);
+
+const I32List *playlist_sorted(PlaylistSorts *s, const Playlist *pl, const ProbePool *probe, SortKind kind);
+// Follows pl->order after playlist_apply_deltas.
+void playlist_sorts_apply_changes(PlaylistSorts *s, const Playlist *pl, const PlaylistChanges *changes);
+// Row of id in the order playlist_sorted last returned for kind, -1 if it
+// isn't in there.
+i32 sorted_row_of(const PlaylistSorts *s, const Playlist *pl, SortKind kind, i32 id);
+// The playlist got replaced and all the ids changed.
+void playlist_sorts_reset(PlaylistSorts *s);
+void free_playlist_sorts(PlaylistSorts *s);
@@ -0,0 +1,419 @@
+#include "trigram.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL3/SDL_cpuinfo.h>
+#include <SDL3/SDL_thread.h>
+#include <SDL3/SDL_timer.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TRIGRAM_X86 1
+#endif
+
+// Even a fast scan has to read every name on every keystroke. With an
+// index of which names have which trigrams in them, a query of three or more
+// bytes only has to look at the names that have all of its trigrams, and
+// those still get checked for the whole query.
+//
+// The names of a trigram are a sorted list of span indices. They're stored
+// as deltas in LEB128, in blocks of TRIGRAM_BLOCK with the first span of each
+// block stored as is, so intersecting a long list with a few candidates only
+// decodes the blocks the candidates could be in.
+
+#define TRIGRAM_BLOCK 64
+
+typedef struct {
+	u32 key;     // the three bytes, 0 if the slot is empty
+	i32 count;
+	i32 block;   // the first of its blocks
+	i32 last;    // only while building: the last span added
+	u32 cursor;  // only while building: where its next delta goes
+} TrigramList;
+
+typedef struct {
+	i32 first;   // the first span in the block
+	u32 offset;  // where the deltas to the rest of them start
+} TrigramBlock;
+
+struct TrigramIndex {
+	TrigramList *lists; // open addressing by key
+	u32 list_cap;
+	i32 list_count;
+	TrigramBlock *blocks;
+	i32 block_count;
+	u8 *bytes;
+	u32 byte_count;
+	i32 span_count;
+	i64 posting_count;
+	u64 build_ns;
+};
+
+static u32 list_slot(u32 key, u32 cap){
+	u32 h = key * 0x9E3779B1u;
+	return (h ^ (h >> 15)) & (cap - 1);
+}
+
+static TrigramList *find_list(const TrigramIndex *t, u32 key){
+	for(u32 i = list_slot(key, t->list_cap);; i = (i + 1) & (t->list_cap - 1)){
+		TrigramList *l = &t->lists[i];
+		if(l->key == key)
+			return l;
+		if(l->key == 0)
+			return NULL;
+	}
+}
+
+static TrigramList *add_list(TrigramIndex *t, u32 key){
+	if((u32)(t->list_count + 1) * 2 > t->list_cap){
+		TrigramList *old = t->lists;
+		const u32 old_cap = t->list_cap;
+		t->list_cap = MAX(old_cap * 2, 4096u);
+		t->lists = calloc(t->list_cap, sizeof(t->lists[0]));
+		for(u32 i = 0; i < old_cap; ++i){
+			if(old[i].key == 0)
+				continue;
+			u32 j = list_slot(old[i].key, t->list_cap);
+			while(t->lists[j].key != 0)
+				j = (j + 1) & (t->list_cap - 1);
+			t->lists[j] = old[i];
+		}
+		free(old);
+	}
+	u32 i = list_slot(key, t->list_cap);
+	while(t->lists[i].key != 0 && t->lists[i].key != key)
+		i = (i + 1) & (t->list_cap - 1);
+	TrigramList *l = &t->lists[i];
+	if(l->key == 0){
+		*l = (TrigramList){.key = key, .last = -1};
+		t->list_count += 1;
+	}
+	return l;
+}
+
+static i32 varint_size(u32 x){
+	i32 n = 1;
+	while(x >= 128){
+		x >>= 7;
+		n += 1;
+	}
+	return n;
+}
+
+static u32 put_varint(u8 *out, u32 at, u32 x){
+	while(x >= 128){
+		out[at++] = (u8)(x | 128);
+		x >>= 7;
+	}
+	out[at++] = (u8)x;
+	return at;
+}
+
+//# building
+
+// Two passes over the names: the first one counts how big every list is, so
+// the second one can write them all straight into one allocation.
+static bool build_index(TrigramIndex *t, const u8 *names, i32 len, _Atomic bool *cancel){
+	i32 span = 0;
+	for(i32 i = 0; i < len; ++i){
+		if((i & 0xfffff) == 0 && atomic_load_explicit(cancel, memory_order_relaxed))
+			return 0;
+		if(names[i] == 0){
+			span += 1;
+			continue;
+		}
+		if(i + 2 >= len || names[i+1] == 0 || names[i+2] == 0)
+			continue;
+		TrigramList *l = add_list(t, (u32)names[i] << 16 | (u32)names[i+1] << 8 | names[i+2]);
+		if(l->last == span)
+			continue;
+		if(l->count % TRIGRAM_BLOCK != 0)
+			l->cursor += varint_size(span - l->last);
+		l->count += 1;
+		l->last = span;
+	}
+	t->span_count = span;
+
+	for(u32 i = 0; i < t->list_cap; ++i){
+		TrigramList *l = &t->lists[i];
+		if(l->key == 0)
+			continue;
+		const u32 size = l->cursor;
+		l->block = t->block_count;
+		t->block_count += (l->count + TRIGRAM_BLOCK - 1) / TRIGRAM_BLOCK;
+		l->cursor = t->byte_count;
+		t->byte_count += size;
+		t->posting_count += l->count;
+		l->count = 0;
+		l->last = -1;
+	}
+	t->blocks = malloc(MAX(t->block_count, 1) * sizeof(t->blocks[0]));
+	t->bytes = malloc(MAX(t->byte_count, 1u));
+
+	span = 0;
+	for(i32 i = 0; i < len; ++i){
+		if((i & 0xfffff) == 0 && atomic_load_explicit(cancel, memory_order_relaxed))
+			return 0;
+		if(names[i] == 0){
+			span += 1;
+			continue;
+		}
+		if(i + 2 >= len || names[i+1] == 0 || names[i+2] == 0)
+			continue;
+		TrigramList *l = find_list(t, (u32)names[i] << 16 | (u32)names[i+1] << 8 | names[i+2]);
+		if(l->last == span)
+			continue;
+		if(l->count % TRIGRAM_BLOCK == 0)
+			t->blocks[l->block + l->count / TRIGRAM_BLOCK] = (TrigramBlock){span, l->cursor};
+		else
+			l->cursor = put_varint(t->bytes, l->cursor, span - l->last);
+		l->count += 1;
+		l->last = span;
+	}
+	return 1;
+}
+
+struct TrigramBuild {
+	SDL_Thread *thread;
+	u8 *names;
+	i32 len;
+	TrigramIndex *result;
+	_Atomic bool done;
+	_Atomic bool cancel;
+};
+
+static int trigram_build_main(void *arg){
+	TrigramBuild *b = arg;
+	const u64 start = SDL_GetTicksNS();
+	b->result = calloc(1, sizeof(*b->result));
+	if(build_index(b->result, b->names, b->len, &b->cancel)){
+		b->result->build_ns = SDL_GetTicksNS() - start;
+	} else {
+		free_trigram_index(&b->result);
+	}
+	free(b->names);
+	b->names = NULL;
+	atomic_store_explicit(&b->done, 1, memory_order_release);
+	return 0;
+}
+
+TrigramBuild *trigram_build_start(const char *names, i32 len){
+	TrigramBuild *b = calloc(1, sizeof(*b));
+	b->names = malloc(MAX(len, 1));
+	memcpy(b->names, names, len);
+	b->len = len;
+	b->thread = SDL_CreateThread(trigram_build_main, "trigram index", b);
+	if(b->thread == NULL){
+		free(b->names);
+		free(b);
+		return NULL;
+	}
+	return b;
+}
+
+TrigramIndex *trigram_build_poll(TrigramBuild **pb){
+	TrigramBuild *b = *pb;
+	if(b == NULL || !atomic_load_explicit(&b->done, memory_order_acquire))
+		return NULL;
+	SDL_WaitThread(b->thread, NULL);
+	TrigramIndex *t = b->result;
+	free(b);
+	*pb = NULL;
+	return t;
+}
+
+void trigram_build_cancel(TrigramBuild **pb){
+	TrigramBuild *b = *pb;
+	if(b == NULL)
+		return;
+	atomic_store_explicit(&b->cancel, 1, memory_order_relaxed);
+	SDL_WaitThread(b->thread, NULL);
+	free_trigram_index(&b->result);
+	free(b);
+	*pb = NULL;
+}
+
+void free_trigram_index(TrigramIndex **pt){
+	TrigramIndex *t = *pt;
+	if(t == NULL)
+		return;
+	free(t->lists);
+	free(t->blocks);
+	free(t->bytes);
+	free(t);
+	*pt = NULL;
+}
+
+i32 trigram_index_span_count(const TrigramIndex *t){
+	return t->span_count;
+}
+
+void print_trigram_stats(const TrigramIndex *t){
+	const u64 bytes = (u64)t->list_cap * sizeof(t->lists[0]) + (u64)t->block_count * sizeof(t->blocks[0]) + t->byte_count;
+	eprintln("trigram index of ", t->span_count, " names: ", t->list_count, " trigrams, ", (u64)t->posting_count, " postings, ", bytes / 1024, " KB, built in ", t->build_ns / 1000000, " ms");
+}
+
+//# intersecting
+
+// Keeps the elements of a that are in b. a is short, b is a decoded block,
+// padded with INT32_MAX to 8 past nb. out may be a.
+typedef i32 (*IntersectFn)(const i32 *a, i32 na, const i32 *b, i32 nb, i32 *out);
+
+static i32 intersect_scalar(const i32 *a, i32 na, const i32 *b, i32 nb, i32 *out){
+	i32 i = 0;
+	i32 j = 0;
+	i32 n = 0;
+	while(i < na && j < nb){
+		if(a[i] < b[j]){
+			i += 1;
+		} else if(a[i] > b[j]){
+			j += 1;
+		} else {
+			out[n++] = a[i];
+			i += 1;
+			j += 1;
+		}
+	}
+	return n;
+}
+
+#ifdef TRIGRAM_X86
+// Skips through b eight at a time, then compares a whole group at once.
+// Which way a comparison goes is hard to predict, so this mostly saves
+// branch misses.
+__attribute__((target("avx2")))
+static i32 intersect_avx2(const i32 *a, i32 na, const i32 *b, i32 nb, i32 *out){
+	i32 j = 0;
+	i32 n = 0;
+	for(i32 i = 0; i < na; ++i){
+		const i32 x = a[i];
+		while(j + 8 <= nb && b[j+7] < x)
+			j += 8;
+		if(j >= nb)
+			break;
+		const __m256i eq = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(b + j)), _mm256_set1_epi32(x));
+		out[n] = x;
+		n += _mm256_movemask_epi8(eq) != 0;
+	}
+	return n;
+}
+
+__attribute__((target("sse4.2")))
+static i32 intersect_sse42(const i32 *a, i32 na, const i32 *b, i32 nb, i32 *out){
+	i32 j = 0;
+	i32 n = 0;
+	for(i32 i = 0; i < na; ++i){
+		const i32 x = a[i];
+		while(j + 4 <= nb && b[j+3] < x)
+			j += 4;
+		if(j >= nb)
+			break;
+		const __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(b + j)), _mm_set1_epi32(x));
+		out[n] = x;
+		n += _mm_movemask_epi8(eq) != 0;
+	}
+	return n;
+}
+#endif
+
+static IntersectFn intersect_impl;
+
+static IntersectFn pick_intersect(void){
+#ifdef TRIGRAM_X86
+	if(SDL_HasAVX2())
+		return intersect_avx2;
+	if(SDL_HasSSE42())
+		return intersect_sse42;
+#endif
+	return intersect_scalar;
+}
+
+static i32 decode_block(const TrigramIndex *t, const TrigramList *l, i32 j, i32 *out){
+	const TrigramBlock *b = &t->blocks[l->block + j];
+	const i32 n = MIN(TRIGRAM_BLOCK, l->count - j * TRIGRAM_BLOCK);
+	const u8 *p = t->bytes + b->offset;
+	i32 span = b->first;
+	out[0] = span;
+	for(i32 i = 1; i < n; ++i){
+		u32 d = 0;
+		i32 shift = 0;
+		do {
+			d |= (u32)(*p & 127) << shift;
+			shift += 7;
+		} while(*p++ & 128);
+		span += (i32)d;
+		out[i] = span;
+	}
+	for(i32 i = n; i < n + 8; ++i)
+		out[i] = INT32_MAX;
+	return n;
+}
+
+// Keeps the candidates that are in l.
+static void intersect_list(const TrigramIndex *t, const TrigramList *l, I32List *candidates){
+	i32 buf[TRIGRAM_BLOCK + 8];
+	i32 *c = candidates->data;
+	const i32 n = candidates->count;
+	const i32 blocks = (l->count + TRIGRAM_BLOCK - 1) / TRIGRAM_BLOCK;
+	i32 i = 0;
+	i32 kept = 0;
+	for(i32 j = 0; j < blocks && i < n; ++j){
+		const i32 end = j + 1 < blocks ? t->blocks[l->block + j + 1].first : INT32_MAX;
+		i32 k = i;
+		while(k < n && c[k] < end)
+			k += 1;
+		if(k > i){
+			const i32 count = decode_block(t, l, j, buf);
+			kept += intersect_impl(c + i, k - i, buf, count, c + kept);
+		}
+		i = k;
+	}
+	candidates->count = kept;
+}
+
+bool trigram_candidates(const TrigramIndex *t, const char *query, i32 len, i32 max, I32List *out){
+	if(intersect_impl == NULL)
+		intersect_impl = pick_intersect();
+	out->count = 0;
+	// More than enough to narrow it down, the rest gets checked anyway.
+	const TrigramList *lists[32];
+	i32 count = 0;
+	for(i32 i = 0; i + 2 < len && count < countof(lists); ++i){
+		const u8 *q = (const u8*)query + i;
+		const TrigramList *l = find_list(t, (u32)q[0] << 16 | (u32)q[1] << 8 | q[2]);
+		if(l == NULL)
+			return 1;
+		bool seen = 0;
+		for(i32 j = 0; j < count; ++j)
+			seen |= lists[j] == l;
+		if(!seen)
+			lists[count++] = l;
+	}
+	// shortest first, every intersection after that only gets smaller
+	for(i32 i = 1; i < count; ++i){
+		for(i32 j = i; j > 0 && lists[j]->count < lists[j-1]->count; --j){
+			const TrigramList *tmp = lists[j];
+			lists[j] = lists[j-1];
+			lists[j-1] = tmp;
+		}
+	}
+	if(lists[0]->count > max)
+		return 0;
+	i32 buf[TRIGRAM_BLOCK + 8];
+	const i32 blocks = (lists[0]->count + TRIGRAM_BLOCK - 1) / TRIGRAM_BLOCK;
+	for(i32 j = 0; j < blocks; ++j){
+		const i32 n = decode_block(t, lists[0], j, buf);
+		for(i32 i = 0; i < n; ++i)
+			push_i32(out, buf[i]);
+	}
+	for(i32 i = 1; i < count && out->count > 0; ++i){
+		// Once a list is a lot longer than the candidates, decoding the
+		// parts of it they could be in costs more than checking them.
+		if(lists[i]->count > 16 * out->count)
+			break;
+		intersect_list(t, lists[i], out);
+	}
+	return 1;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "library.h"
+
+// For every three bytes that show up in the names of a NameSearch, the
+// names they show up in, by span index. Names are in order and NUL
+// separated, so the n-th name in the blob is span n.
+typedef struct TrigramIndex TrigramIndex;
+typedef struct TrigramBuild TrigramBuild;
+
+// Copies the names and builds an index of them on a background thread.
+TrigramBuild *trigram_build_start(const char *names, i32 len);
+// The index, once it's done, NULL until then.
+TrigramIndex *trigram_build_poll(TrigramBuild **b);
+void trigram_build_cancel(TrigramBuild **b);
+
+// How many spans the index knows about. The ones after that have to be
+// looked at some other way.
+i32 trigram_index_span_count(const TrigramIndex *t);
+// Spans whose names might have all the trigrams of query in them, in order.
+// The query is lowercase and at least three bytes long. Returns 0 if there
+// would be more than max of them, when looking at all names is quicker.
+bool trigram_candidates(const TrigramIndex *t, const char *query, i32 len, i32 max, I32List *out);
+void print_trigram_stats(const TrigramIndex *t);
+void free_trigram_index(TrigramIndex **t);
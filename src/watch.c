@@ -0,0 +1,488 @@
+#define _GNU_SOURCE
+#include "library.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <SDL3/SDL_mutex.h>
+#include <SDL3/SDL_thread.h>
+#include <SDL3/SDL_timer.h>
+
+// Turns inotify events on the library directories into LibraryDeltas. The
+// thread never touches the playlist, it only knows the paths of the
+// directories it watches.  The main thread picks up the deltas with
+// library_watch_poll and applies them with playlist_apply_deltas.
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR)
+// How long a IN_MOVED_FROM waits for its IN_MOVED_TO before it counts as
+// moved out of the library. The two are queued together, but can end up in
+// different reads.
+#define MOVE_WAIT_MS 50
+
+struct LibraryWatch {
+	SDL_Thread *thread;
+	int fd;
+	_Atomic bool stop;
+
+	SDL_Mutex *mutex;
+	// guarded by mutex
+	LibraryDeltas pending;
+	CharList dirs_to_add; // NUL-terminated paths, back to back
+
+	// only used by the watcher thread
+	LibraryDeltas batch;
+	CharList wd_names;
+	Sub *wd_paths; // indexed by watch descriptor. len 0 if unused
+	i32 wd_cap;
+	// The watch descriptors by path, so a refresh handing us every directory
+	// again doesn't cost a syscall and a copy of the path each. -1 is empty,
+	// -2 was taken by a watch that's gone.
+	i32 *wd_slots;
+	i32 wd_slot_cap;
+	i32 wd_slots_taken; // including the -2s
+	CharList fullpath;
+	bool warned_limit;
+	// A rename is a IN_MOVED_FROM followed by a IN_MOVED_TO with the same
+	// cookie. The first half waits here for the second.
+	CharList moved_from;
+	u32 moved_cookie;
+	bool moved_is_dir;
+	bool have_moved;
+	u64 moved_ns;
+};
+
+static void push_delta(LibraryDeltas *d, const LibraryDelta *delta){
+	if(d->count >= d->cap){
+		d->cap = MAX(d->cap * 2, 64);
+		d->data = realloc(d->data, d->cap * sizeof(d->data[0]));
+	}
+	d->data[d->count++] = *delta;
+}
+
+static Sub push_delta_path(LibraryDeltas *d, const char *path, i32 len){
+	Sub s = {d->names.count, len};
+	push_string(&d->names, path, len);
+	return s;
+}
+
+static i32 *wd_slot(LibraryWatch *w, const char *path, i32 len){
+	const u32 mask = (u32)w->wd_slot_cap - 1;
+	i32 *free_slot = NULL;
+	for(u32 i = hash_path(path, len) & mask;; i = (i + 1) & mask){
+		i32 *slot = &w->wd_slots[i];
+		if(*slot == -1)
+			return free_slot ? free_slot : slot;
+		if(*slot == -2){
+			if(free_slot == NULL)
+				free_slot = slot;
+			continue;
+		}
+		const Sub k = w->wd_paths[*slot];
+		if(k.len == len && memeq(w->wd_names.data + k.start, path, len))
+			return slot;
+	}
+}
+
+static void wd_slots_grow(LibraryWatch *w){
+	const i32 cap = MAX(w->wd_slot_cap * 2, 1024);
+	free(w->wd_slots);
+	w->wd_slots = malloc(cap * sizeof(w->wd_slots[0]));
+	for(i32 i = 0; i < cap; ++i)
+		w->wd_slots[i] = -1;
+	w->wd_slot_cap = cap;
+	w->wd_slots_taken = 0;
+	for(i32 wd = 0; wd < w->wd_cap; ++wd){
+		const Sub k = w->wd_paths[wd];
+		if(k.len == 0)
+			continue;
+		*wd_slot(w, w->wd_names.data + k.start, k.len) = wd;
+		w->wd_slots_taken += 1;
+	}
+}
+
+// The watch is gone, or has another path now.
+static void forget_wd(LibraryWatch *w, i32 wd){
+	const Sub k = w->wd_paths[wd];
+	if(k.len == 0)
+		return;
+	i32 *slot = wd_slot(w, w->wd_names.data + k.start, k.len);
+	if(*slot == wd)
+		*slot = -2;
+	w->wd_paths[wd] = (Sub){};
+}
+
+static void watch_add(LibraryWatch *w, const char *path, i32 len){
+	if((w->wd_slots_taken + 1) * 2 > w->wd_slot_cap)
+		wd_slots_grow(w);
+	if(*wd_slot(w, path, len) >= 0)
+		return;
+	int wd = inotify_add_watch(w->fd, path, WATCH_MASK);
+	if(wd < 0){
+		if(errno == ENOSPC && !w->warned_limit){
+			eprintln("inotify watch limit reached, raise fs.inotify.max_user_watches to see all library changes");
+			w->warned_limit = 1;
+		}
+		return;
+	}
+	if(wd >= w->wd_cap){
+		i32 cap = MAX(w->wd_cap * 2, 1024);
+		while(wd >= cap)
+			cap *= 2;
+		w->wd_paths = realloc(w->wd_paths, cap * sizeof(w->wd_paths[0]));
+		memset(w->wd_paths + w->wd_cap, 0, (cap - w->wd_cap) * sizeof(w->wd_paths[0]));
+		w->wd_cap = cap;
+	}
+	// Adding a watch for a directory we already watch gives back the same wd.
+	// It might have been moved, so always take the new path.
+	forget_wd(w, wd);
+	w->wd_paths[wd] = (Sub){w->wd_names.count, len};
+	push_string(&w->wd_names, path, len);
+	i32 *slot = wd_slot(w, path, len);
+	w->wd_slots_taken += *slot == -1;
+	*slot = wd;
+}
+
+// path is NUL-terminated, st is what stat says about it.
+static void emit_added_file(LibraryWatch *w, const CharList *path, i32 ext, const struct stat *st){
+	LibraryDelta d = {
+		.kind = DeltaAddFile,
+		.path = push_delta_path(&w->batch, path->data, path->count),
+		.ext = ext,
+		.mtime = file_mtime_us(st),
+		.size = st->st_size,
+	};
+	push_delta(&w->batch, &d);
+}
+
+// fullpath holds a NUL-terminated file path.
+static void emit_file(LibraryWatch *w, LibraryDeltaKind kind, const CharList *fullpath, Sub *new_path){
+	LibraryDelta d = {.kind = kind};
+	if(kind != DeltaRemoveFile){
+		const CharList *target = fullpath;
+		CharList tmp;
+		if(new_path){
+			tmp = (CharList){w->batch.names.data + new_path->start, new_path->len, new_path->len};
+			target = &tmp;
+		}
+		i32 ext = path_extension_id(target);
+		struct stat st;
+		if(ext < 0 || stat(target->data, &st) != 0 || !S_ISREG(st.st_mode)){
+			// renamed to something that isn't music anymore
+			if(kind == DeltaRename)
+				emit_file(w, DeltaRemoveFile, fullpath, NULL);
+			return;
+		}
+		d.ext = ext;
+		d.mtime = file_mtime_us(&st);
+		d.size = st.st_size;
+	} else if(path_extension_id(fullpath) < 0){
+		return;
+	}
+	d.path = push_delta_path(&w->batch, fullpath->data, fullpath->count);
+	if(new_path)
+		d.new_path = *new_path;
+	push_delta(&w->batch, &d);
+}
+
+// Watches a directory that just showed up and reports everything in it.
+// Follows symlinks, like the scanner does, and like it walks each directory
+// only once.
+static void walk_new_dir(LibraryWatch *w, const char *path, i32 len, InodeSet *visited, i32 depth){
+	// len excludes the NUL, path ends in '/'.
+	if(depth > 64)
+		return;
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd < 0)
+		return;
+	struct stat st;
+	DIR *dirp = fstat(fd, &st) == 0 && inode_set_insert(visited, (u64)st.st_dev, (u64)st.st_ino) ? fdopendir(fd) : NULL;
+	if(dirp == NULL){
+		close(fd);
+		return;
+	}
+	watch_add(w, path, len + 1);
+	LibraryDelta d = {
+		.kind = DeltaAddDir,
+		.path = push_delta_path(&w->batch, path, len + 1),
+		.mtime = file_mtime_us(&st),
+		.dev = (u64)st.st_dev,
+		.ino = (u64)st.st_ino,
+	};
+	push_delta(&w->batch, &d);
+	CharList sub = make_charlist();
+	while(1){
+		struct dirent *de = readdir(dirp);
+		if(de == NULL)
+			break;
+		const char *name = de->d_name;
+		if(name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+			continue;
+		const u8 type = de->d_type;
+		if(type != DT_DIR && type != DT_REG && type != DT_LNK && type != DT_UNKNOWN)
+			continue;
+		sub.count = 0;
+		push_string(&sub, path, len);
+		push_string(&sub, name, strlen(name));
+		push_string(&sub, "\0", 1);
+		const i32 ext = path_extension_id(&sub);
+		// a regular file has to be music to be worth a stat
+		if(type == DT_REG && ext < 0)
+			continue;
+		bool is_dir = type == DT_DIR;
+		if(!is_dir){
+			// Without a d_type, or for a symlink, only stat tells what it
+			// is. Follows symlinks.
+			if(fstatat(dirfd(dirp), name, &st, 0) != 0)
+				continue;
+			is_dir = S_ISDIR(st.st_mode);
+			if(!is_dir){
+				if(S_ISREG(st.st_mode) && ext >= 0)
+					emit_added_file(w, &sub, ext, &st);
+				continue;
+			}
+		}
+		sub.data[sub.count - 1] = '/';
+		push_string(&sub, "\0", 1);
+		walk_new_dir(w, sub.data, sub.count - 1, visited, depth + 1);
+	}
+	free(sub.data);
+	closedir(dirp);
+}
+
+// dirpath is NUL-terminated and ends in '/'.
+static void walk_new_tree(LibraryWatch *w, const CharList *dirpath){
+	InodeSet visited = {};
+	walk_new_dir(w, dirpath->data, dirpath->count - 1, &visited, 0);
+	free(visited.keys);
+}
+
+static bool event_path(LibraryWatch *w, const struct inotify_event *ev, bool is_dir){
+	if(ev->wd < 0 || ev->wd >= w->wd_cap || w->wd_paths[ev->wd].len == 0)
+		return 0;
+	const Sub dir = w->wd_paths[ev->wd];
+	w->fullpath.count = 0;
+	// dir is NUL-terminated, leave that off.
+	push_string(&w->fullpath, w->wd_names.data + dir.start, dir.len - 1);
+	push_string(&w->fullpath, ev->name, strlen(ev->name));
+	push_string(&w->fullpath, is_dir ? "/\0" : "\0", is_dir ? 2 : 1);
+	return 1;
+}
+
+static void emit_remove_dir(LibraryWatch *w, const CharList *dirpath){
+	LibraryDelta d = {.kind = DeltaRemoveDir};
+	d.path = push_delta_path(&w->batch, dirpath->data, dirpath->count);
+	push_delta(&w->batch, &d);
+}
+
+// The IN_MOVED_FROM that's waiting never got its IN_MOVED_TO, it was moved
+// out of the library.
+static void flush_move(LibraryWatch *w){
+	if(!w->have_moved)
+		return;
+	if(w->moved_is_dir)
+		emit_remove_dir(w, &w->moved_from);
+	else
+		emit_file(w, DeltaRemoveFile, &w->moved_from, NULL);
+	w->have_moved = 0;
+}
+
+static void handle_events(LibraryWatch *w, const u8 *buf, ssize_t n){
+	CharList *moved_from = &w->moved_from;
+	for(const u8 *p = buf; p < buf + n;){
+		const struct inotify_event *ev = (const struct inotify_event*)p;
+		p += sizeof(struct inotify_event) + ev->len;
+		if(ev->mask & IN_Q_OVERFLOW){
+			LibraryDelta d = {.kind = DeltaOverflow};
+			push_delta(&w->batch, &d);
+			continue;
+		}
+		if(ev->mask & IN_IGNORED){
+			if(ev->wd >= 0 && ev->wd < w->wd_cap)
+				forget_wd(w, ev->wd);
+			continue;
+		}
+		if(ev->len == 0)
+			continue;
+		const bool is_dir = (ev->mask & IN_ISDIR) != 0;
+		if(!event_path(w, ev, is_dir))
+			continue;
+		if(w->have_moved && !((ev->mask & IN_MOVED_TO) && ev->cookie == w->moved_cookie))
+			flush_move(w);
+		if(ev->mask & IN_MOVED_FROM){
+			moved_from->count = 0;
+			push_string(moved_from, w->fullpath.data, w->fullpath.count);
+			w->moved_cookie = ev->cookie;
+			w->moved_is_dir = is_dir;
+			w->have_moved = 1;
+			w->moved_ns = SDL_GetTicksNS();
+		} else if(ev->mask & IN_MOVED_TO){
+			if(w->have_moved && !is_dir && !w->moved_is_dir){
+				Sub to = push_delta_path(&w->batch, w->fullpath.data, w->fullpath.count);
+				emit_file(w, DeltaRename, moved_from, &to);
+			} else if(is_dir){
+				if(w->have_moved)
+					emit_remove_dir(w, moved_from);
+				walk_new_tree(w, &w->fullpath);
+			} else {
+				emit_file(w, DeltaAddFile, &w->fullpath, NULL);
+			}
+			w->have_moved = 0;
+		} else if(ev->mask & IN_CREATE){
+			if(is_dir)
+				walk_new_tree(w, &w->fullpath);
+			else
+				emit_file(w, DeltaAddFile, &w->fullpath, NULL);
+		} else if(ev->mask & IN_CLOSE_WRITE){
+			emit_file(w, DeltaAddFile, &w->fullpath, NULL);
+		} else if(ev->mask & IN_DELETE){
+			if(is_dir)
+				emit_remove_dir(w, &w->fullpath);
+			else
+				emit_file(w, DeltaRemoveFile, &w->fullpath, NULL);
+		}
+	}
+}
+
+static void publish_batch(LibraryWatch *w){
+	if(w->batch.count == 0)
+		return;
+	SDL_LockMutex(w->mutex);
+	LibraryDeltas *dst = &w->pending;
+	const i32 offset = dst->names.count;
+	push_string(&dst->names, w->batch.names.data, w->batch.names.count);
+	for(i32 i = 0; i < w->batch.count; ++i){
+		LibraryDelta d = w->batch.data[i];
+		d.path.start += offset;
+		d.new_path.start += offset;
+		push_delta(dst, &d);
+	}
+	SDL_UnlockMutex(w->mutex);
+	w->batch.count = 0;
+	w->batch.names.count = 0;
+}
+
+static int library_watch_main(void *arg){
+	LibraryWatch *w = arg;
+	CharList dirs = make_charlist();
+	_Alignas(struct inotify_event) u8 buf[16 * 1024];
+	while(!atomic_load_explicit(&w->stop, memory_order_relaxed)){
+		SDL_LockMutex(w->mutex);
+		CharList tmp = dirs;
+		dirs = w->dirs_to_add;
+		w->dirs_to_add = tmp;
+		w->dirs_to_add.count = 0;
+		SDL_UnlockMutex(w->mutex);
+		for(i32 i = 0; i < dirs.count;){
+			i32 len = strlen(dirs.data + i);
+			watch_add(w, dirs.data + i, len + 1);
+			i += len + 1;
+		}
+		dirs.count = 0;
+
+		// Wake up in time to give up on a move that's waiting.
+		i32 timeout_ms = 200;
+		if(w->have_moved){
+			const u64 waited_ms = (SDL_GetTicksNS() - w->moved_ns) / 1000000;
+			timeout_ms = waited_ms < MOVE_WAIT_MS ? (i32)(MOVE_WAIT_MS - waited_ms) : 0;
+		}
+		struct pollfd pfd = {.fd = w->fd, .events = POLLIN};
+		if(poll(&pfd, 1, timeout_ms) > 0){
+			while(1){
+				ssize_t n = read(w->fd, buf, sizeof(buf));
+				if(n <= 0)
+					break;
+				handle_events(w, buf, n);
+			}
+		}
+		if(w->have_moved && SDL_GetTicksNS() - w->moved_ns >= (u64)MOVE_WAIT_MS * 1000000)
+			flush_move(w);
+		publish_batch(w);
+	}
+	free(dirs.data);
+	return 0;
+}
+
+static void init_deltas(LibraryDeltas *d){
+	zerostruct(d);
+	d->names = make_charlist();
+}
+
+LibraryWatch *library_watch_start(const Playlist *pl){
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(fd < 0)
+		return NULL;
+	LibraryWatch *w = calloc(1, sizeof(*w));
+	w->fd = fd;
+	w->mutex = SDL_CreateMutex();
+	init_deltas(&w->pending);
+	init_deltas(&w->batch);
+	w->dirs_to_add = make_charlist();
+	w->wd_names = make_charlist();
+	w->fullpath = make_charlist();
+	w->moved_from = make_charlist();
+	library_watch_add_dirs(w, pl);
+	w->thread = SDL_CreateThread(library_watch_main, "library watch", w);
+	if(w->thread == NULL){
+		library_watch_stop(&w);
+		return NULL;
+	}
+	return w;
+}
+
+void library_watch_add_dirs(LibraryWatch *w, const Playlist *pl){
+	if(w == NULL)
+		return;
+	SDL_LockMutex(w->mutex);
+	for(i32 i = 0; i < pl->dirs.count; ++i){
+		const Sub p = pl->dirs.data[i].path;
+		push_string(&w->dirs_to_add, pl->names.data + p.start, p.len);
+	}
+	SDL_UnlockMutex(w->mutex);
+}
+
+bool library_watch_poll(LibraryWatch *w, LibraryDeltas *out){
+	out->count = 0;
+	out->names.count = 0;
+	if(w == NULL)
+		return 0;
+	SDL_LockMutex(w->mutex);
+	bool any = w->pending.count > 0;
+	if(any){
+		LibraryDeltas tmp = *out;
+		*out = w->pending;
+		w->pending = tmp;
+	}
+	SDL_UnlockMutex(w->mutex);
+	return any;
+}
+
+void library_watch_stop(LibraryWatch **pw){
+	LibraryWatch *w = *pw;
+	if(w == NULL)
+		return;
+	atomic_store_explicit(&w->stop, 1, memory_order_relaxed);
+	if(w->thread)
+		SDL_WaitThread(w->thread, NULL);
+	close(w->fd);
+	SDL_DestroyMutex(w->mutex);
+	free(w->pending.data);
+	free(w->pending.names.data);
+	free(w->batch.data);
+	free(w->batch.names.data);
+	free(w->dirs_to_add.data);
+	free(w->wd_names.data);
+	free(w->wd_paths);
+	free(w->wd_slots);
+	free(w->fullpath.data);
+	free(w->moved_from.data);
+	free(w);
+	*pw = NULL;
+}
@@ -0,0 +1,451 @@
+#define _GNU_SOURCE
+#include "waveform.h"
+#include "cache.h"
+#include "floatfile.h"
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL3/SDL_mutex.h>
+#include <SDL3/SDL_thread.h>
+
+// The worker decodes the tracks the main thread wants, the one that's
+// playing and the next few, as fast as libav goes, and keeps the lowest and
+// highest sample of every stretch. How long a track is only shows at its
+// end, the container's duration is a guess. So stretches start out at about
+// that guess over WAVEFORM_BUCKETS, and whenever there are twice as many as
+// that, they get merged two by two into stretches twice as long. At the end
+// there's one more merge if there are still too many, which leaves the
+// finest level with half to all of WAVEFORM_BUCKETS peaks. Peaks are 8 bit
+// and rounded outwards, that's more than a pixel can show.
+//
+// Silence is everything under -60 dBFS. Where the first and the last sample
+// above that are is noted while going over the samples anyway.
+//
+// The tracks that play next are the ones the loudness pool wants first, so
+// with normalizing on the worker measures them on the same samples, and
+// they're decoded once instead of twice.
+//
+// The cache is a RecordCache, see cache.h, like the seek index: the ones
+// not used for the longest drop out once there are more than WAVEFORM_MAX.
+// Only the main thread touches it. The worker hands results over under the
+// mutex, like the probe pool.
+
+#define WAVEFORM_MAX 1024
+#define SILENCE_LEVEL 0.001f
+// stretches for a first guess when nobody knows how long the track is
+#define WAVEFORM_DEFAULT_STRETCH 1024
+
+typedef struct {
+	CacheKey key;
+	i64 mtime; // like MusicEntry.mtime
+	i64 size;
+	i64 samples;
+	i64 lead;
+	i64 trail;
+	i32 rate;
+	i32 count; // peaks in the finest level, 0 if the file couldn't be decoded
+	Sub peaks; // bytes, all levels
+} WaveformRecord;
+
+typedef struct {
+	char *path; // with the NUL
+	i32 len;
+	i64 mtime;
+	i64 size;
+	i32 id;       // of the entry it was wanted for
+	bool measure; // its loudness too
+} WaveformJob;
+
+typedef struct {
+	WaveformJob job;
+	Waveform w;
+	WavePeak *peaks; // what w points at
+	i32 peak_count;
+	Loudness loudness; // LoudnessNone if it wasn't measured
+} WaveformResult;
+
+// One track on its way through the worker.
+typedef struct {
+	f32 lo[2 * WAVEFORM_BUCKETS];
+	f32 hi[2 * WAVEFORM_BUCKETS];
+	i32 count;
+	i64 stretch; // samples in a bucket
+	i64 filled;  // in the last one
+	i64 samples;
+	i64 first_loud; // -1 until there's sound
+	i64 last_loud;
+} WaveformBuilder;
+
+struct WaveformWorker {
+	SDL_Thread *thread;
+	SDL_Mutex *mutex;
+	SDL_Condition *wake;
+	// Set under the mutex, the worker also looks at it while it decodes.
+	_Atomic bool stop;
+	// guarded by mutex
+	WaveformJob *jobs;
+	i32 job_head;
+	i32 job_count;
+	i32 job_cap;
+	char *current; // path of the job that's being done, NULL if none
+	WaveformResult *results;
+	i32 result_count;
+	i32 result_cap;
+
+	// only used by the main thread
+	RecordCache cache;
+};
+
+// Peaks in the levels of a waveform whose finest one has count.
+static i32 total_peaks(i32 count){
+	i32 total = count;
+	while(count > 1){
+		count = (count + 1) / 2;
+		total += count;
+	}
+	return total;
+}
+
+static bool waveform_record_valid(const void *record){
+	const WaveformRecord *r = record;
+	return r->count >= 0 && r->count <= WAVEFORM_BUCKETS
+		&& r->peaks.len == (r->count > 0 ? total_peaks(r->count) * (i32)sizeof(WavePeak) : 0);
+}
+
+static const CacheFormat waveform_cache_format = {
+	.name = "waveforms.cache",
+	.magic = "moswave",
+	.version = 2,
+	.record_size = sizeof(WaveformRecord),
+	.subs = {offsetof(WaveformRecord, peaks)},
+	.sub_count = 1,
+	.max = WAVEFORM_MAX,
+	.valid = waveform_record_valid,
+};
+
+//# worker
+
+static void merge_buckets(WaveformBuilder *b){
+	const i32 count = (b->count + 1) / 2;
+	for(i32 i = 0; i < count; ++i){
+		const i32 j = MIN(2 * i + 1, b->count - 1);
+		b->lo[i] = fminf(b->lo[2 * i], b->lo[j]);
+		b->hi[i] = fmaxf(b->hi[2 * i], b->hi[j]);
+	}
+	b->filled += b->count % 2 == 0 ? b->stretch : 0;
+	b->count = count;
+	b->stretch *= 2;
+}
+
+static void next_bucket(WaveformBuilder *b){
+	if(b->count == 2 * WAVEFORM_BUCKETS)
+		merge_buckets(b);
+	b->lo[b->count] = INFINITY;
+	b->hi[b->count] = -INFINITY;
+	b->count += 1;
+	b->filled = 0;
+}
+
+static void take_frame(WaveformBuilder *b, const f32 *x, i32 n, i32 channels){
+	i32 i = 0;
+	while(i < n){
+		if(b->filled == b->stretch)
+			next_bucket(b);
+		const i32 run = (i32)MIN((i64)(n - i), b->stretch - b->filled);
+		const f32 *s = x + i * channels;
+		f32 lo = INFINITY;
+		f32 hi = -INFINITY;
+		for(i32 k = 0; k < run * channels; ++k){
+			lo = fminf(lo, s[k]);
+			hi = fmaxf(hi, s[k]);
+		}
+		if(hi > SILENCE_LEVEL || lo < -SILENCE_LEVEL){
+			i32 first = 0;
+			while(fabsf(s[first]) <= SILENCE_LEVEL)
+				first += 1;
+			i32 last = run * channels - 1;
+			while(fabsf(s[last]) <= SILENCE_LEVEL)
+				last -= 1;
+			if(b->first_loud < 0)
+				b->first_loud = b->samples + first / channels;
+			b->last_loud = b->samples + last / channels;
+		}
+		b->lo[b->count - 1] = fminf(b->lo[b->count - 1], lo);
+		b->hi[b->count - 1] = fmaxf(b->hi[b->count - 1], hi);
+		b->filled += run;
+		b->samples += run;
+		i += run;
+	}
+}
+
+static i8 quantize(f32 x, bool up){
+	const f32 q = up ? ceilf(x * 127) : floorf(x * 127);
+	return (i8)fmaxf(fminf(q, 127.0f), -127.0f);
+}
+
+// Puts the levels of what b has in r.
+static void finish(WaveformBuilder *b, i32 rate, WaveformResult *r){
+	if(b->count > WAVEFORM_BUCKETS)
+		merge_buckets(b);
+	r->peak_count = total_peaks(b->count);
+	r->peaks = malloc(MAX(r->peak_count, 1) * sizeof(WavePeak));
+	WavePeak *level = r->peaks;
+	for(i32 i = 0; i < b->count; ++i)
+		level[i] = (WavePeak){quantize(b->lo[i], 0), quantize(b->hi[i], 1)};
+	i32 count = b->count;
+	while(count > 1){
+		WavePeak *next = level + count;
+		const i32 next_count = (count + 1) / 2;
+		for(i32 i = 0; i < next_count; ++i){
+			const i32 j = MIN(2 * i + 1, count - 1);
+			next[i].min = MIN(level[2 * i].min, level[j].min);
+			next[i].max = MAX(level[2 * i].max, level[j].max);
+		}
+		level = next;
+		count = next_count;
+	}
+	r->w = (Waveform){
+		.samples = b->samples,
+		.rate = rate,
+		.lead = b->first_loud < 0 ? b->samples : b->first_loud,
+		.trail = b->first_loud < 0 ? 0 : b->samples - 1 - b->last_loud,
+		.peaks = r->peaks,
+		.count = b->count,
+	};
+}
+
+// Decodes the file of r->job into r's waveform, and its loudness if the job
+// asks for that. r->w stays zero if the file couldn't be decoded.
+static void make_waveform(WaveformWorker *w, WaveformBuilder *b, FloatFile *f, LoudnessMeter *m, WaveformResult *r){
+	const bool measure = r->job.measure;
+	if(measure)
+		r->loudness = (Loudness){.state = LoudnessFailed, .mtime = r->job.mtime, .size = r->job.size};
+	if(!float_file_open(f, r->job.path))
+		return;
+	b->stretch = f->guess > 0 ? MAX((i64)ceil(f->guess / WAVEFORM_BUCKETS), (i64)1) : WAVEFORM_DEFAULT_STRETCH;
+	b->filled = b->stretch;
+	b->count = 0;
+	b->samples = 0;
+	b->first_loud = -1;
+	b->last_loud = -1;
+	if(measure)
+		loudness_meter_start(m, f);
+	i32 n;
+	do {
+		n = float_file_next(f);
+		if(n <= 0)
+			break;
+		take_frame(b, f->samples, n, f->channels);
+		if(measure)
+			loudness_meter_take(m, f->samples, n);
+	} while(!atomic_load_explicit(&w->stop, memory_order_relaxed));
+	float_file_close(f);
+	if(n != 0)
+		return;
+	if(b->samples > 0)
+		finish(b, f->rate, r);
+	if(measure){
+		loudness_meter_finish(m, &r->loudness);
+		r->loudness.state = LoudnessDone;
+	}
+}
+
+static int waveform_worker_main(void *arg){
+	WaveformWorker *w = arg;
+	SDL_SetCurrentThreadPriority(SDL_THREAD_PRIORITY_LOW);
+	WaveformBuilder *b = calloc(1, sizeof(*b));
+	LoudnessMeter *m = loudness_meter_create();
+	FloatFile f = {};
+	SDL_LockMutex(w->mutex);
+	while(!w->stop){
+		if(w->job_head == w->job_count){
+			SDL_WaitCondition(w->wake, w->mutex);
+			continue;
+		}
+		WaveformResult r = {.job = w->jobs[w->job_head++]};
+		w->current = r.job.path;
+		SDL_UnlockMutex(w->mutex);
+
+		// failures are kept too, so they aren't tried again
+		make_waveform(w, b, &f, m, &r);
+
+		SDL_LockMutex(w->mutex);
+		w->current = NULL;
+		if(w->stop){
+			free(r.job.path);
+			free(r.peaks);
+			break;
+		}
+		if(w->result_count >= w->result_cap){
+			w->result_cap = MAX(w->result_cap * 2, 8);
+			w->results = realloc(w->results, w->result_cap * sizeof(w->results[0]));
+		}
+		w->results[w->result_count++] = r;
+	}
+	SDL_UnlockMutex(w->mutex);
+	float_file_free(&f);
+	loudness_meter_free(&m);
+	free(b);
+	return 0;
+}
+
+//# cache
+
+static void cache_put(WaveformWorker *w, const WaveformResult *r){
+	// The old peaks stay in the strings until the next save.
+	const Sub peaks = record_cache_push(&w->cache, r->peaks, r->w.count > 0 ? r->peak_count * (i32)sizeof(WavePeak) : 0);
+	WaveformRecord *rec = record_cache_put(&w->cache, r->job.path, r->job.len);
+	rec->mtime = r->job.mtime;
+	rec->size = r->job.size;
+	rec->samples = r->w.samples;
+	rec->lead = r->w.lead;
+	rec->trail = r->w.trail;
+	rec->rate = r->w.rate;
+	rec->count = r->w.count;
+	rec->peaks = peaks;
+}
+
+//# main thread
+
+WaveformWorker *waveform_worker_start(void){
+	WaveformWorker *w = calloc(1, sizeof(*w));
+	w->mutex = SDL_CreateMutex();
+	w->wake = SDL_CreateCondition();
+	record_cache_load(&w->cache, &waveform_cache_format);
+	w->thread = SDL_CreateThread(waveform_worker_main, "waveform", w);
+	return w;
+}
+
+static void clear_jobs(WaveformWorker *w){
+	for(i32 i = w->job_head; i < w->job_count; ++i)
+		free(w->jobs[i].path);
+	w->job_head = 0;
+	w->job_count = 0;
+}
+
+void waveform_worker_stop(WaveformWorker **ww){
+	WaveformWorker *w = *ww;
+	if(w == NULL)
+		return;
+	SDL_LockMutex(w->mutex);
+	w->stop = 1;
+	SDL_SignalCondition(w->wake);
+	SDL_UnlockMutex(w->mutex);
+	SDL_WaitThread(w->thread, NULL);
+	// What it measured for the loudness pool is lost, a track at most.
+	waveform_update(w, NULL, NULL);
+	if(w->cache.record_count > 0)
+		record_cache_save(&w->cache, NULL, 0);
+	clear_jobs(w);
+	free(w->jobs);
+	free(w->results);
+	SDL_DestroyCondition(w->wake);
+	SDL_DestroyMutex(w->mutex);
+	record_cache_free(&w->cache);
+	free(w);
+	*ww = NULL;
+}
+
+void waveform_update(WaveformWorker *w, LoudnessPool *loudness, const Playlist *pl){
+	SDL_LockMutex(w->mutex);
+	for(i32 i = 0; i < w->result_count; ++i){
+		WaveformResult *r = &w->results[i];
+		cache_put(w, r);
+		// The ids may have changed since the job was made.
+		const WaveformJob *job = &r->job;
+		if(loudness && r->loudness.state != LoudnessNone && job->id < pl->entries.count){
+			const Sub path = pl->entries.data[job->id].path;
+			if(path.len == job->len && memeq(pl->names.data + path.start, job->path, job->len))
+				loudness_pool_put(loudness, pl, job->id, &r->loudness);
+		}
+		free(r->job.path);
+		free(r->peaks);
+	}
+	w->result_count = 0;
+	SDL_UnlockMutex(w->mutex);
+}
+
+static bool is_current(const WaveformRecord *r, const MusicEntry *e){
+	return r->mtime == e->mtime && r->size == e->size;
+}
+
+void waveform_want(WaveformWorker *w, const Playlist *pl, const i32 *ids, i32 count, bool measure){
+	i32 todo[8];
+	i32 n = 0;
+	SDL_LockMutex(w->mutex);
+	for(i32 i = 0; i < count && n < countof(todo); ++i){
+		const MusicEntry *e = &pl->entries.data[ids[i]];
+		if(e->flags & EntryRemoved)
+			continue;
+		const char *path = pl->names.data + e->path.start;
+		const WaveformRecord *r = record_cache_find(&w->cache, path, e->path.len);
+		if(r != NULL && is_current(r, e))
+			continue;
+		if(w->current != NULL && strcmp(w->current, path) == 0)
+			continue;
+		todo[n++] = ids[i];
+	}
+	// the same as last time, minus what's been taken
+	bool same = w->job_count - w->job_head == n;
+	for(i32 i = 0; same && i < n; ++i){
+		const Sub p = pl->entries.data[todo[i]].path;
+		const WaveformJob *job = &w->jobs[w->job_head + i];
+		same = job->len == p.len && memeq(job->path, pl->names.data + p.start, p.len) && job->measure == measure;
+	}
+	if(!same){
+		clear_jobs(w);
+		if(n > w->job_cap){
+			w->job_cap = MAX(n, 8);
+			w->jobs = realloc(w->jobs, w->job_cap * sizeof(w->jobs[0]));
+		}
+		for(i32 i = 0; i < n; ++i){
+			const MusicEntry *e = &pl->entries.data[todo[i]];
+			WaveformJob *job = &w->jobs[w->job_count++];
+			*job = (WaveformJob){malloc(e->path.len), e->path.len, e->mtime, e->size, todo[i], measure};
+			memcpy(job->path, pl->names.data + e->path.start, e->path.len);
+		}
+		SDL_SignalCondition(w->wake);
+	}
+	SDL_UnlockMutex(w->mutex);
+}
+
+bool waveform_known(WaveformWorker *w, const Playlist *pl, i32 id){
+	if(id < 0 || id >= pl->entries.count)
+		return 0;
+	const MusicEntry *e = &pl->entries.data[id];
+	const WaveformRecord *r = record_cache_find(&w->cache, pl->names.data + e->path.start, e->path.len);
+	return r != NULL && is_current(r, e);
+}
+
+bool waveform_get(WaveformWorker *w, const Playlist *pl, i32 id, Waveform *out){
+	if(id < 0 || id >= pl->entries.count)
+		return 0;
+	const MusicEntry *e = &pl->entries.data[id];
+	WaveformRecord *r = record_cache_find(&w->cache, pl->names.data + e->path.start, e->path.len);
+	if(r == NULL || !is_current(r, e) || r->count == 0)
+		return 0;
+	record_cache_use(&w->cache, r);
+	*out = (Waveform){
+		.samples = r->samples,
+		.rate = r->rate,
+		.lead = r->lead,
+		.trail = r->trail,
+		.peaks = (const WavePeak*)(w->cache.strings.data + r->peaks.start),
+		.count = r->count,
+	};
+	return 1;
+}
+
+const WavePeak *waveform_level(const Waveform *w, i32 want, i32 *count){
+	const WavePeak *level = w->peaks;
+	i32 n = w->count;
+	while(n > 1 && (n + 1) / 2 >= want){
+		level += n;
+		n = (n + 1) / 2;
+	}
+	*count = n;
+	return level;
+}
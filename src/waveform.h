@@ -0,0 +1,51 @@
+#pragma once
+
+#include "library.h"
+#include "loudness.h"
+
+// A picture of a track for the progress bar: the lowest and highest sample
+// of every stretch of it, at a few resolutions, and how much silence there
+// is at either end. A worker decodes the tracks that are wanted once, and
+// the results are kept in a cache file, keyed by path, size and mtime.
+typedef struct WaveformWorker WaveformWorker;
+
+// the most peaks the finest level has
+#define WAVEFORM_BUCKETS 2048
+
+typedef struct {
+	i8 min; // -127..127 is full scale
+	i8 max;
+} WavePeak;
+
+typedef struct {
+	i64 samples; // of the track, at its own rate
+	i32 rate;
+	i64 lead;    // samples of silence before the first sound, all of them if there's none
+	i64 trail;   // and after the last one
+	// Every level one after the other, the finest first, each with half as
+	// many peaks as the one before, down to one.
+	const WavePeak *peaks;
+	i32 count; // peaks in the finest level
+} Waveform;
+
+WaveformWorker *waveform_worker_start(void);
+// Saves the cache and stops the worker.
+void waveform_worker_stop(WaveformWorker **w);
+
+// The rest is for the main thread only.
+// Picks up what the worker finished, once a frame, and hands what it
+// measured to loudness, if that's not NULL.
+void waveform_update(WaveformWorker *w, LoudnessPool *loudness, const Playlist *pl);
+// The entries of pl to have waveforms of, the one needed first first.
+// Replaces the list from last time, cheap if nothing changed. With measure,
+// the worker measures their loudness too, for waveform_update to hand in.
+void waveform_want(WaveformWorker *w, const Playlist *pl, const i32 *ids, i32 count, bool measure);
+// Whether the worker is done with the entry, whether or not it got a
+// waveform out of it. Until then, a wanted entry is still to be decoded.
+bool waveform_known(WaveformWorker *w, const Playlist *pl, i32 id);
+// Returns 0 if there's no waveform of the entry yet. *out points into the
+// cache until the next waveform_update.
+bool waveform_get(WaveformWorker *w, const Playlist *pl, i32 id, Waveform *out);
+// The coarsest level that has at least want peaks, or the finest one if
+// none has. *count is how many peaks it has.
+const WavePeak *waveform_level(const Waveform *w, i32 want, i32 *count);